@@ -0,0 +1,258 @@
+/*################################################################
+Pandrift
+Copyright (c) 2013 Warren Moore
+
+This software may be redistributed under the terms of the MIT License.
+See the file LICENSE for details.
+################################################################*/
+
+#include "pandrift_stereo_parameters.hh"
+#include "pandrift_distortion_table.hh"
+#include "pandrift_lens_footprint.hh"
+#include "pandrift_temporal_upscaler.hh"
+#include "pandrift_compositor_layer.hh"
+#include "trueClock.h"
+#include "pvector.h"
+#include <iostream>
+#include <stdlib.h>
+#include <math.h>
+
+using namespace std;
+using namespace pandrift;
+
+namespace
+{
+
+const int cDefaultIterations = 10000;
+// The lookup bake is a whole panel; fewer passes time it well enough
+const int cLookupIterationDivisor = 1000;
+const int cLookupWidth = 1280;
+const int cLookupHeight = 800;
+const int cDistortionTableSize = 256;
+const float cTolerance = 1e-4;
+// An eye-sized patch of a pattern with detail the source alone can't resolve
+const int cUpscaleWidth = 128;
+const int cUpscaleHeight = 80;
+const float cUpscaleRenderScale = 0.7;
+const float cUpscalePatternCycles = 30;
+const int cUpscaleFrames = 64;
+const float cUpscaleBlend = 0.1;
+// The upscale must be at least this much closer to native than one frame is
+const float cUpscaleMaxErrorRatio = 0.5;
+
+// What RiftManager reads from a DK1 through LibOVR 0.2.4, with its
+// distortion fit point of (-0.75, 0) and the default IPD
+void get_dk1_parameters(StereoParameters &params)
+{
+  params.version = 1;
+  params.display_width_pixels = 1280;
+  params.display_height_pixels = 800;
+  params.display_width_metres = 0.14976;
+  params.display_height_metres = 0.0936;
+  params.lens_separation = 0.0635;
+  params.eye_screen_distance = 0.041;
+  params.y_fov_radians = 1.98205204;
+  params.interpupillary_distance = 0.0655;
+  params.projection_centre_offset = 0.15197650;
+  params.distortion_scale = 1.33783535;
+  params.distortion_centre_offset = 0.15197650;
+  params.distortion_coefficients = LVector4f(1.0, 0.22, 0.24, 0.0);
+  params.chromatic_aberration_coefficients = LVector4f(0.996, -0.004, 1.014, 0.0);
+  params.device_key = 0;
+}
+
+int failures = 0;
+
+void check(const char *name, float value, float expected)
+{
+  const bool cPass = fabs(value - expected) <= cTolerance;
+  if (!cPass)
+    ++failures;
+
+  cout << (cPass ? "pass " : "FAIL ") << name << " " << value << " (expected " << expected << ")" << endl;
+}
+
+void check_parameters(const StereoParameters &params)
+{
+  // Projection, shifted to each lens centre
+  check("projection centre offset left", params.projection[cEyeLeft][1][0], 0.15197650);
+  check("projection centre offset right", params.projection[cEyeRight][1][0], -0.15197650);
+  check("eye offset left", params.eye_offset[cEyeLeft], -0.03275);
+  check("eye offset right", params.eye_offset[cEyeRight], 0.03275);
+
+  // HUD
+  check("hud film width scale", params.hud_film_width_scale, 2.66644216);
+  check("hud film height scale", params.hud_film_height_scale, 3.33305264);
+  check("hud film offset left", params.hud_film_offset[cEyeLeft], -0.24729368);
+  check("hud film offset right", params.hud_film_offset[cEyeRight], 0.24729368);
+
+  // Side-by-side warp
+  check("warp scale in u", params.warp.scale_in[0], 4.0);
+  check("warp scale in v", params.warp.scale_in[1], 2.5);
+  check("warp scale u", params.warp.scale[0], 0.18686904);
+  check("warp scale v", params.warp.scale[1], 0.29899046);
+  check("warp screen centre left", params.warp.screen_centre[cEyeLeft][0], 0.25);
+  check("warp screen centre right", params.warp.screen_centre[cEyeRight][0], 0.75);
+  check("warp lens centre left", params.warp.lens_centre[cEyeLeft][0], 0.28799412);
+  check("warp lens centre right", params.warp.lens_centre[cEyeRight][0], 0.71200588);
+
+  // Per-eye warp
+  check("eye warp scale in u", params.eye_warp.scale_in[0], 2.0);
+  check("eye warp scale u", params.eye_warp.scale[0], 0.37373808);
+  check("eye warp lens centre left", params.eye_warp.lens_centre[cEyeLeft][0], 0.57598823);
+  check("eye warp lens centre right", params.eye_warp.lens_centre[cEyeRight][0], 0.42401177);
+}
+
+// Fill an RGB image with the pattern, drawn offset by jitter pixels
+void draw_pattern(int width, int height, const LVecBase2f &jitter, pvector<float> &image)
+{
+  image.resize(size_t(width) * size_t(height) * 3);
+  for (int y = 0; y < height; ++y)
+  {
+    for (int x = 0; x < width; ++x)
+    {
+      const float cU = (float(x) + 0.5 - jitter[0]) / float(width);
+      const float cV = (float(y) + 0.5 - jitter[1]) / float(height);
+      const float cWave = sin(2.0 * M_PI * cUpscalePatternCycles * cU) *
+                          cos(2.0 * M_PI * cUpscalePatternCycles * 0.6 * cV);
+
+      float *texel_ptr = &image[(size_t(y) * size_t(width) + size_t(x)) * 3];
+      texel_ptr[0] = 0.5 + 0.2 * cWave;
+      texel_ptr[1] = 0.5 - 0.2 * cWave;
+      texel_ptr[2] = 0.5;
+    }
+  }
+}
+
+// Resolve frames drawn at the source size into a history at the upscale size
+void accumulate_pattern(int source_width, int source_height, int frames, pvector<float> &history)
+{
+  history.resize(size_t(cUpscaleWidth) * size_t(cUpscaleHeight) * 3);
+
+  pvector<float> source;
+  for (int frame = 0; frame < frames; ++frame)
+  {
+    const LVecBase2f cJitter = frames > 1 ? TemporalUpscaler::get_jitter_offset(frame) : LVecBase2f(0, 0);
+    draw_pattern(source_width, source_height, cJitter, source);
+    TemporalUpscaler::accumulate_reference(&source[0],
+                                           source_width,
+                                           source_height,
+                                           cJitter,
+                                           cUpscaleBlend,
+                                           frame == 0,
+                                           &history[0],
+                                           cUpscaleWidth,
+                                           cUpscaleHeight);
+  }
+}
+
+float rms_difference(const pvector<float> &image, const pvector<float> &reference)
+{
+  double sum = 0;
+  for (size_t index = 0; index < image.size(); ++index)
+    sum += (image[index] - reference[index]) * (image[index] - reference[index]);
+
+  return sqrt(sum / double(image.size()));
+}
+
+// Compare the upscale against the same resolve at native resolution, and
+// against a single frame at the source size
+void check_upscale()
+{
+  const int cSourceWidth = int(float(cUpscaleWidth) * cUpscaleRenderScale + 0.5);
+  const int cSourceHeight = int(float(cUpscaleHeight) * cUpscaleRenderScale + 0.5);
+
+  pvector<float> native, upscaled, single;
+  accumulate_pattern(cUpscaleWidth, cUpscaleHeight, cUpscaleFrames, native);
+  accumulate_pattern(cSourceWidth, cSourceHeight, cUpscaleFrames, upscaled);
+  accumulate_pattern(cSourceWidth, cSourceHeight, 1, single);
+
+  const float cUpscaledError = rms_difference(upscaled, native);
+  const float cSingleError = rms_difference(single, native);
+  const bool cPass = cUpscaledError <= cSingleError * cUpscaleMaxErrorRatio;
+  if (!cPass)
+    ++failures;
+
+  cout << (cPass ? "pass " : "FAIL ") << "upscale rms error against native " << cUpscaledError
+       << " (single frame " << cSingleError << ")" << endl;
+}
+
+// Translucent black HUD pixels over a white scene: a lone half-alpha draw
+// must darken it by half, not by its alpha squared
+void check_layer_alpha()
+{
+  const LColor cScene(1.0, 1.0, 1.0, 1.0);
+  const LColor cDraws[2] = {LColor(0.0, 0.0, 0.0, 0.5), LColor(0.0, 0.0, 0.0, 0.5)};
+
+  check("layer half alpha over white", CompositorLayer::composite_reference(cScene, cDraws, 1)[0], 0.5);
+  check("layer two half alphas over white", CompositorLayer::composite_reference(cScene, cDraws, 2)[0], 0.25);
+}
+
+void report(const char *name, double seconds, int iterations)
+{
+  cout << "time " << name << " " << (seconds / double(iterations)) * 1000000.0 << "us" << endl;
+}
+
+}
+
+// Check the stereo math against DK1 reference values, then time each part of it
+int main(int argc, char *argv[])
+{
+  int iterations = cDefaultIterations;
+  if (argc > 1)
+    iterations = max(1, atoi(argv[1]));
+
+  StereoParameters params;
+  get_dk1_parameters(params);
+  calculate_derived_parameters(params);
+  check_parameters(params);
+  check_upscale();
+  check_layer_alpha();
+
+  TrueClock *clock_ptr = TrueClock::get_global_ptr();
+
+  // Projection, HUD and warp parameters, as on every display (re)creation
+  double start = clock_ptr->get_short_time();
+  for (int iteration = 0; iteration < iterations; ++iteration)
+  {
+    StereoParameters derived_params;
+    get_dk1_parameters(derived_params);
+    calculate_derived_parameters(derived_params);
+  }
+  report("calculate_derived_parameters", clock_ptr->get_short_time() - start, iterations);
+
+  // A fresh table each time, as update() skips parameters it already has
+  start = clock_ptr->get_short_time();
+  for (int iteration = 0; iteration < iterations; ++iteration)
+  {
+    DistortionTable table(cDistortionTableSize);
+    table.update(params.warp);
+  }
+  report("DistortionTable::update", clock_ptr->get_short_time() - start, iterations);
+
+  DistortionTable table(cDistortionTableSize);
+  table.update(params.warp);
+
+  start = clock_ptr->get_short_time();
+  for (int iteration = 0; iteration < iterations; ++iteration)
+  {
+    LensFootprint footprint;
+    calculate_lens_footprint(table, iteration & 1, footprint);
+  }
+  report("calculate_lens_footprint", clock_ptr->get_short_time() - start, iterations);
+
+  const int cLookupIterations = max(1, iterations / cLookupIterationDivisor);
+  pvector<float> lookup(size_t(cLookupWidth) * size_t(cLookupHeight) * 4);
+  start = clock_ptr->get_short_time();
+  for (int iteration = 0; iteration < cLookupIterations; ++iteration)
+    table.bake_lookup(cLookupWidth, cLookupHeight, &lookup[0]);
+  report("DistortionTable::bake_lookup", clock_ptr->get_short_time() - start, cLookupIterations);
+
+  if (failures > 0)
+  {
+    cerr << failures << " calibration values out of tolerance" << endl;
+    return 1;
+  }
+
+  return 0;
+}
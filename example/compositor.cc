@@ -0,0 +1,227 @@
+/*################################################################
+Pandrift
+Copyright (c) 2013 Warren Moore
+
+This software may be redistributed under the terms of the MIT License.
+See the file LICENSE for details.
+################################################################*/
+
+#include "pandaFramework.h"
+#include "pandaSystem.h"
+#include "load_prc_file.h"
+#include "texture.h"
+#include "pandrift_rift_manager.hh"
+#include "pandrift_display_manager.hh"
+#include "pandrift_shared_frame_ring.hh"
+#include "boost/shared_ptr.hpp"
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <sys/resource.h>
+
+using namespace pandrift;
+
+namespace
+{
+
+const char *cDefaultRingName = "/pandrift";
+const double cDefaultWaitSeconds = 10.0;
+const double cOpenRetrySeconds = 0.1;
+// A publisher silent this long is taken to have gone, and the ring reopened
+const double cStallSeconds = 1.0;
+// Ahead of the application, where the user allows it
+const int cCompositorNice = -10;
+
+struct Latencies
+{
+  pvector<float> seconds;
+
+  void report(const char *name)
+  {
+    if (seconds.empty())
+      return;
+
+    sort(seconds.begin(), seconds.end());
+    double total = 0;
+    for (size_t latency = 0; latency < seconds.size(); ++latency)
+      total += seconds[latency];
+
+    cerr << name << " mean/median/p95/max: " << (total / seconds.size()) * 1000.0
+         << "/" << seconds[seconds.size() / 2] * 1000.0
+         << "/" << seconds[(seconds.size() * 95) / 100] * 1000.0
+         << "/" << seconds.back() * 1000.0 << "ms" << endl;
+  }
+};
+
+bool open_ring(SharedFrameRing &ring, const string &name, double wait_seconds)
+{
+  // The application may not have started publishing yet
+  const double cStart = SharedFrameRing::get_time();
+  while (!ring.open(name))
+  {
+    if (SharedFrameRing::get_time() - cStart >= wait_seconds)
+      return false;
+
+    Thread::sleep(cOpenRetrySeconds);
+  }
+
+  return true;
+}
+
+}
+
+// Warp and present the eye buffers another process publishes, so that
+// process stalling or exiting never freezes the headset
+int main(int argc, char *argv[])
+{
+  string ring_name = cDefaultRingName;
+  double wait_seconds = cDefaultWaitSeconds;
+  bool offscreen = false;
+  bool lookup = false;
+  bool scanout = false;
+  int exit_frames = 0;
+  for (int arg = 1; arg < argc; ++arg)
+  {
+    const string cArg = argv[arg];
+    if ("-ring" == cArg && arg + 1 < argc)
+      ring_name = argv[++arg];
+    else if ("-wait" == cArg && arg + 1 < argc)
+      wait_seconds = atof(argv[++arg]);
+    else if ("-offscreen" == cArg)
+      offscreen = true;
+    else if ("-lookup" == cArg)
+      lookup = true;
+    else if ("-scanout" == cArg)
+      scanout = true;
+    else if ("-frames" == cArg && arg + 1 < argc)
+      exit_frames = atoi(argv[++arg]);
+    else
+    {
+      cerr << "Usage: compositor [-ring name] [-wait seconds] [-offscreen] [-lookup] [-scanout] [-frames frames]" << endl;
+      return 1;
+    }
+  }
+
+  if (setpriority(PRIO_PROCESS, 0, cCompositorNice) != 0)
+    cerr << "Unable to raise the compositor's priority; running at the default" << endl;
+
+  boost::shared_ptr<SharedFrameRing> ring_ptr(new SharedFrameRing());
+  if (!open_ring(*ring_ptr, ring_name, wait_seconds))
+  {
+    cerr << "No frames published to " << ring_name << endl;
+    return 1;
+  }
+
+  boost::shared_ptr<RiftManager> rift_manager_ptr(new RiftManager());
+
+  PandaFramework framework;
+  framework.open_framework(argc, argv);
+  framework.set_window_title("Pandrift Compositor");
+
+  load_prc_file_data("", "sync-video 1");
+  if (offscreen)
+    load_prc_file_data("", "window-type offscreen");
+
+  WindowProperties window_properties;
+  framework.get_default_window_props(window_properties);
+  window_properties.set_size(rift_manager_ptr->get_display_width_pixels(),
+                             rift_manager_ptr->get_display_height_pixels());
+  window_properties.set_fixed_size(true);
+
+  PT(WindowFramework) window_ptr = framework.open_window(window_properties, 0);
+  if (!window_ptr)
+    return 1;
+
+  // Published frames are copied into the texture's RAM image once whole
+  PT(Texture) eye_texture_ptr = new Texture("compositor eye buffer");
+  eye_texture_ptr->setup_2d_texture(ring_ptr->get_width(), ring_ptr->get_height(), Texture::T_unsigned_byte, Texture::F_rgba8);
+  eye_texture_ptr->set_magfilter(Texture::FT_linear);
+  eye_texture_ptr->set_minfilter(Texture::FT_linear);
+  eye_texture_ptr->set_wrap_u(Texture::WM_clamp);
+  eye_texture_ptr->set_wrap_v(Texture::WM_clamp);
+  eye_texture_ptr->make_ram_image();
+
+  DisplayManager display_manager(window_ptr);
+  display_manager.set_rift_manager(rift_manager_ptr);
+  display_manager.set_eye_source(eye_texture_ptr);
+  if (lookup)
+    display_manager.set_warp_mode(DisplayManager::cLookupTexture);
+  display_manager.set_scanout_compensation(scanout);
+  display_manager.set_distortion_cache_directory(".");
+  if (!display_manager.create_display())
+    return 1;
+
+  // Frames are read here first, so a torn copy never reaches the texture
+  pvector<unsigned char> staging(ring_ptr->get_frame_bytes());
+
+  Latencies handoff, drawn_to_pickup;
+  int frames = 0, new_frames = 0, skipped_frames = 0, torn_frames = 0, reopens = 0;
+  PN_uint32 last_sequence = 0;
+  double last_frame_time = SharedFrameRing::get_time();
+  Thread *thread_ptr = Thread::get_current_thread();
+  while (!framework.get_exit_flag() && (exit_frames <= 0 || frames < exit_frames))
+  {
+    const PN_uint32 cSequence = ring_ptr->get_latest_sequence();
+    if (cSequence != last_sequence)
+    {
+      SharedFrameRing::Frame frame;
+      if (ring_ptr->read_latest(&staging[0], frame))
+      {
+        PTA_uchar image = eye_texture_ptr->modify_ram_image();
+        memcpy(image.p(), &staging[0], staging.size());
+
+        const double cPickupTime = SharedFrameRing::get_time();
+        handoff.seconds.push_back(cPickupTime - frame.publish_time);
+        drawn_to_pickup.seconds.push_back(cPickupTime - frame.drawn_time);
+
+        if (last_sequence != 0 && frame.sequence > last_sequence + 1)
+          skipped_frames += frame.sequence - last_sequence - 1;
+
+        last_sequence = frame.sequence;
+        last_frame_time = cPickupTime;
+        ++new_frames;
+      }
+      else
+      {
+        // Overwritten as we copied; this refresh repeats the last whole
+        // frame, and the next picks up the newest
+        ++torn_frames;
+      }
+    }
+    else if (SharedFrameRing::get_time() - last_frame_time > cStallSeconds)
+    {
+      // Keep presenting the last frame, and pick up a restarted publisher,
+      // whose new ring has moved on from the one we hold. The old ring is
+      // only let go once the new one is open.
+      boost::shared_ptr<SharedFrameRing> fresh_ring_ptr(new SharedFrameRing());
+      if (fresh_ring_ptr->open(ring_name) &&
+          fresh_ring_ptr->get_width() == ring_ptr->get_width() &&
+          fresh_ring_ptr->get_height() == ring_ptr->get_height() &&
+          fresh_ring_ptr->get_latest_sequence() != ring_ptr->get_latest_sequence())
+      {
+        ring_ptr = fresh_ring_ptr;
+        last_sequence = 0;
+        ++reopens;
+      }
+
+      last_frame_time = SharedFrameRing::get_time();
+    }
+
+    framework.do_frame(thread_ptr);
+    ++frames;
+  }
+
+  cerr << "Compositor frames: " << frames
+       << ", new: " << new_frames
+       << ", repeated: " << frames - new_frames
+       << ", skipped: " << skipped_frames
+       << ", torn: " << torn_frames
+       << ", reopened: " << reopens << endl;
+  handoff.report("Publish to pickup");
+  drawn_to_pickup.report("Draw to pickup");
+
+  display_manager.shutdown();
+  framework.close_framework();
+
+  return 0;
+}
@@ -12,10 +12,67 @@ See the file LICENSE for details.
 #include "world.hh"
 #include "pandrift_rift_manager.hh"
 #include "pandrift_display_manager.hh"
+#include "pandrift_frame_scheduler.hh"
+#include "pandrift_task_chains.hh"
+#include "pandrift_latency_monitor.hh"
+#include "pandrift_allocation_audit.hh"
+#include "clockObject.h"
+#include "shaderAttrib.h"
+#include "renderState.h"
 #include "boost/shared_ptr.hpp"
+#include <stdlib.h>
 
 using namespace pandrift;
 
+// After the scene loads, frames left to settle before the audit counts
+const int cAuditWarmupFrames = 120;
+// After igLoop, so each audited frame includes its draw
+const int cAuditTaskSort = 55;
+// The app's own tasks on the default chain, after the frame scheduler's
+// sleep and up to the camera update, leaving out the warp and igLoop
+const int cAppTaskFirstSort = -999;
+const char *cSceneVertexShader = "pandrift-scene-v.glsl";
+const char *cSceneFragmentShader = "pandrift-scene-f.glsl";
+
+struct ExitAfterFrames
+{
+  PandaFramework *framework_ptr;
+  int frames;
+};
+
+struct AuditWarmup
+{
+  World *world_ptr;
+  int frames;
+};
+
+AsyncTask::DoneStatus exit_task(GenericAsyncTask *task_ptr, void *data)
+{
+  ExitAfterFrames *exit_ptr = reinterpret_cast<ExitAfterFrames*>(data);
+  assert(exit_ptr);
+
+  if (ClockObject::get_global_clock()->get_frame_count() < exit_ptr->frames)
+    return AsyncTask::DS_cont;
+
+  exit_ptr->framework_ptr->set_exit_flag();
+
+  return AsyncTask::DS_done;
+}
+
+AsyncTask::DoneStatus allocation_audit_task(GenericAsyncTask *task_ptr, void *data)
+{
+  AuditWarmup *warmup_ptr = reinterpret_cast<AuditWarmup*>(data);
+  assert(warmup_ptr);
+
+  AllocationAudit::end_frame();
+
+  // Only steady-state frames count
+  if (warmup_ptr->world_ptr->is_loading() || warmup_ptr->frames-- > 0)
+    AllocationAudit::reset();
+
+  return AsyncTask::DS_cont;
+}
+
 void key_escape_handler(const Event *event, void *data)
 {
   PandaFramework *framework = reinterpret_cast<PandaFramework*>(data);
@@ -60,11 +117,139 @@ void key_rift_handler(const Event *event, void *data)
   cerr << "Display enabled? " << (display_manager->is_enabled() ? "Y" : "N") << endl;
 }
 
+void key_capture_handler(const Event *event, void *data)
+{
+  DisplayManager *display_manager = reinterpret_cast<DisplayManager*>(data);
+  assert(display_manager);
+
+  if (display_manager->is_capturing())
+  {
+    display_manager->stop_capture();
+
+    cerr << "Capture dropped frames: " << display_manager->get_capture_dropped_frames() << endl;
+  }
+  else
+  {
+    display_manager->start_capture("pandrift-capture.y4m");
+  }
+
+  cerr << "Capturing? " << (display_manager->is_capturing() ? "Y" : "N") << endl;
+}
+
+void toggle_display_state(DisplayManager *display_manager, DisplayManager::DisplayState state)
+{
+  if (display_manager->get_display_state() == state)
+    display_manager->set_display_state(DisplayManager::cStateActive);
+  else
+    display_manager->set_display_state(state);
+
+  cerr << "Display state: " << display_manager->get_display_state() << endl;
+}
+
+void key_pause_handler(const Event *event, void *data)
+{
+  DisplayManager *display_manager = reinterpret_cast<DisplayManager*>(data);
+  assert(display_manager);
+
+  toggle_display_state(display_manager, DisplayManager::cStatePaused);
+}
+
+// The DK1 can't tell when it's taken off, so stand in for its proximity sensor
+void key_idle_handler(const Event *event, void *data)
+{
+  DisplayManager *display_manager = reinterpret_cast<DisplayManager*>(data);
+  assert(display_manager);
+
+  toggle_display_state(display_manager, DisplayManager::cStateHeadsetIdle);
+}
+
+struct MinimizeWatch
+{
+  WindowFramework *window_ptr;
+  DisplayManager *display_manager_ptr;
+};
+
+void window_event_handler(const Event *event, void *data)
+{
+  MinimizeWatch *watch_ptr = reinterpret_cast<MinimizeWatch*>(data);
+  assert(watch_ptr);
+
+  PT(GraphicsWindow) graphics_window_ptr = watch_ptr->window_ptr->get_graphics_window();
+  if (!graphics_window_ptr)
+    return;
+
+  DisplayManager *display_manager = watch_ptr->display_manager_ptr;
+  const bool cMinimized = graphics_window_ptr->get_properties().get_minimized();
+  if (cMinimized && DisplayManager::cStateMinimized != display_manager->get_display_state())
+    display_manager->set_display_state(DisplayManager::cStateMinimized);
+  else if (!cMinimized && DisplayManager::cStateMinimized == display_manager->get_display_state())
+    display_manager->set_display_state(DisplayManager::cStateActive);
+}
+
 int main(int argc, char *argv[])
 {
+  // Options for unattended latency runs
+  bool measure_latency = false;
+  bool audit_allocations = false;
+  bool offscreen = false;
+  bool reprojection = false;
+  bool lookup = false;
+  float upscale_render_scale = 1.0;
+  bool eccentricity_lod = false;
+  bool guard_band = false;
+  float far_field_distance = 0;
+  bool scanout = false;
+  string publish_ring_name;
+  string replay_file_name;
+  int exit_frames = 0;
+  for (int arg = 1; arg < argc; ++arg)
+  {
+    const string cArg = argv[arg];
+    if ("-latency" == cArg)
+      measure_latency = true;
+    else if ("-audit-allocations" == cArg)
+      audit_allocations = true;
+    else if ("-offscreen" == cArg)
+      offscreen = true;
+    else if ("-reproject" == cArg)
+      reprojection = true;
+    else if ("-lookup" == cArg)
+      lookup = true;
+    else if ("-upscale" == cArg && arg + 1 < argc)
+      upscale_render_scale = atof(argv[++arg]);
+    else if ("-eccentricity-lod" == cArg)
+      eccentricity_lod = true;
+    else if ("-guard-band" == cArg)
+      guard_band = true;
+    else if ("-far-field" == cArg && arg + 1 < argc)
+      far_field_distance = atof(argv[++arg]);
+    else if ("-scanout" == cArg)
+      scanout = true;
+    else if ("-publish" == cArg && arg + 1 < argc)
+      publish_ring_name = argv[++arg];
+    else if ("-replay" == cArg && arg + 1 < argc)
+      replay_file_name = argv[++arg];
+    else if ("-frames" == cArg && arg + 1 < argc)
+      exit_frames = atoi(argv[++arg]);
+  }
+
+  if (audit_allocations && !AllocationAudit::is_compiled())
+  {
+    cerr << "Build with PANDRIFT_ALLOCATION_AUDIT to audit allocations" << endl;
+    return 1;
+  }
+
   // Create the rift manager
   boost::shared_ptr<RiftManager> rift_manager_ptr(new RiftManager());
 
+  // Without a device, drive the sensor from a recording
+  if (!replay_file_name.empty())
+  {
+    pvector<ImuSample> samples;
+    if (!load_imu_samples(replay_file_name, samples) || !rift_manager_ptr->start_imu_replay(samples))
+      cerr << "Unable to replay " << replay_file_name << endl;
+  }
+
   // Start the Panda framework
   PandaFramework framework;
   framework.open_framework(argc, argv);
@@ -75,6 +260,13 @@ int main(int argc, char *argv[])
   load_prc_file_data("", "red-blue-stereo 0");
   load_prc_file_data("", "side-by-side-stereo 0");
 
+  // The frame scheduler needs the flip to return on vsync
+  load_prc_file_data("", "sync-video 1");
+  load_prc_file_data("", "auto-flip 1");
+
+  if (offscreen)
+    load_prc_file_data("", "window-type offscreen");
+
   // Open window
   WindowProperties window_properties;
   framework.get_default_window_props(window_properties);
@@ -93,24 +285,166 @@ int main(int argc, char *argv[])
   NodePath display_camera_group = display_manager.get_camera_root();
   display_camera_group.reparent_to(window_ptr->get_camera_group());
   display_manager.set_rift_manager(rift_manager_ptr);
+  display_manager.set_reprojection(reprojection);
+  if (lookup)
+    display_manager.set_warp_mode(DisplayManager::cLookupTexture);
+  display_manager.set_upscale_render_scale(upscale_render_scale);
+  display_manager.set_eccentricity_lod(eccentricity_lod);
+  display_manager.set_guard_band_culling(guard_band);
+  display_manager.set_far_field_distance(far_field_distance);
+  display_manager.set_scanout_compensation(scanout);
+
+  // Bake the distortion once, then map it on later runs
+  display_manager.set_distortion_cache_directory(".");
 
   // Enable keyboard
   window_ptr->enable_keyboard();
   framework.define_key("escape", "Exit", &key_escape_handler, &framework);
   framework.define_key("f", "Toggle fullscreen", &key_fullscreen_handler, window_ptr);
   framework.define_key("r", "Toggle Rift view", &key_rift_handler, &display_manager);
+  framework.define_key("c", "Toggle capture", &key_capture_handler, &display_manager);
+  framework.define_key("p", "Toggle pause", &key_pause_handler, &display_manager);
+  framework.define_key("i", "Toggle headset idle", &key_idle_handler, &display_manager);
+
+  // Stop drawing while the window is minimized
+  MinimizeWatch minimize_watch = { window_ptr, &display_manager };
+  framework.get_event_handler().add_hook("window-event", &window_event_handler, &minimize_watch);
 
   // Create the scene
   World world(window_ptr,
               window_ptr->get_render(),
               window_ptr->get_camera_group());
   world.set_rift_manager(rift_manager_ptr);
+  world.set_display_manager(&display_manager);
   world.create_scene();
 
+  // Sample the scene's textures with less detail towards the edge of each lens
+  if (eccentricity_lod)
+  {
+    PT(Shader) scene_shader_ptr = DisplayManager::load_periphery_shader(cSceneVertexShader, cSceneFragmentShader);
+    if (scene_shader_ptr)
+    {
+      window_ptr->get_render().set_shader(scene_shader_ptr);
+
+      // The window's own camera, for the non-Rift view, gets full detail from a zero lens scale
+      CPT(RenderAttrib) shader_attrib = ShaderAttrib::make();
+      shader_attrib = DCAST(ShaderAttrib, shader_attrib)->set_shader_input("PeripheryViewport", LVecBase4f(0, 0, 1, 1));
+      shader_attrib = DCAST(ShaderAttrib, shader_attrib)->set_shader_input("PeripheryLens", LVecBase4f(0, 0, 0, 0));
+      shader_attrib = DCAST(ShaderAttrib, shader_attrib)->set_shader_input("HmdWarpParam", LVecBase4f(1, 0, 0, 0));
+      Camera *camera_ptr = window_ptr->get_camera(0);
+      camera_ptr->set_initial_state(camera_ptr->get_initial_state()->set_attrib(shader_attrib));
+    }
+    else
+    {
+      cerr << "Unable to load the scene shader" << endl;
+    }
+  }
+
+  // Pace the frames to finish just before vsync
+  FrameScheduler frame_scheduler;
+  frame_scheduler.set_rift_manager(rift_manager_ptr);
+  frame_scheduler.set_drive_clock(true);
+  frame_scheduler.start(window_ptr->get_graphics_output());
+
+  // Measure with the Rift display, as there is no one to press 'r'
+  LatencyMonitor latency_monitor;
+  if (measure_latency)
+  {
+    display_manager.create_display();
+
+    latency_monitor.set_rift_manager(rift_manager_ptr);
+    latency_monitor.start(window_ptr->get_graphics_output());
+  }
+
+  // Hand the eye buffer to the compositor executable rather than warping here
+  if (!publish_ring_name.empty())
+  {
+    if (!display_manager.is_created())
+      display_manager.create_display();
+
+    if (!display_manager.start_publishing(publish_ring_name))
+      cerr << "Unable to publish to " << publish_ring_name << endl;
+  }
+
+  // Fail the run if the frame loop allocates once warmed up
+  AuditWarmup audit_warmup = { &world, cAuditWarmupFrames };
+  if (audit_allocations)
+  {
+    if (!display_manager.is_created())
+      display_manager.create_display();
+
+    // Everything the frame loop allocates counts, not just the sites
+    AllocationAudit::audit_thread();
+
+    PT(GenericAsyncTask) audit_task_ptr = new GenericAsyncTask("allocation audit task", &allocation_audit_task, &audit_warmup);
+    audit_task_ptr->set_sort(cAuditTaskSort);
+    AsyncTaskManager::get_global_ptr()->add(audit_task_ptr);
+  }
+
+  ExitAfterFrames exit_after_frames = { &framework, exit_frames };
+  if (exit_frames > 0)
+    AsyncTaskManager::get_global_ptr()->add(new GenericAsyncTask("exit task", &exit_task, &exit_after_frames));
+
   // Run the main loop until exit flag set
   framework.main_loop();
 
+  FrameScheduler::Statistics statistics;
+  frame_scheduler.get_statistics(statistics);
+  frame_scheduler.stop();
+
+  cerr << "Frames: " << statistics.frames
+       << ", missed: " << statistics.missed_frames
+       << ", refresh: " << statistics.refresh_period * 1000.0 << "ms"
+       << ", work: " << statistics.work_seconds * 1000.0 << "ms"
+       << ", latency mean/max: " << statistics.mean_latency_seconds * 1000.0
+       << "/" << statistics.max_latency_seconds * 1000.0 << "ms" << endl;
+
+  // App-stage time on the main thread versus moved onto the animation threads
+  cerr << "Task time per frame, main: "
+       << get_task_chain_seconds("default", cAppTaskFirstSort, cPoseTaskSort) * 1000.0 << "ms"
+       << ", threaded: " << get_task_chain_seconds(cAnimationTaskChain) * 1000.0 << "ms" << endl;
+
+  if (latency_monitor.is_started())
+  {
+    LatencyMonitor::Statistics latency_statistics;
+    latency_monitor.get_statistics(latency_statistics);
+    latency_monitor.stop();
+
+    cerr << "Latency frames: " << latency_statistics.frames
+         << ", verified: " << latency_statistics.verified_frames
+         << ", corrupt: " << latency_statistics.corrupt_frames
+         << ", dropped: " << latency_statistics.dropped_frames
+         << ", sample to swap mean/median/p95/max: " << latency_statistics.mean_seconds * 1000.0
+         << "/" << latency_statistics.median_seconds * 1000.0
+         << "/" << latency_statistics.p95_seconds * 1000.0
+         << "/" << latency_statistics.max_seconds * 1000.0 << "ms" << endl;
+  }
+
+  if (display_manager.is_publishing())
+    cerr << "Published frames: " << display_manager.get_published_frames() << endl;
+
+  boost::shared_ptr<RenderTargetPool> render_target_pool_ptr = display_manager.get_render_target_pool();
+  cerr << "Render targets: " << render_target_pool_ptr->get_allocated_bytes() / (1024 * 1024) << "MB"
+       << " (" << render_target_pool_ptr->get_free_bytes() / (1024 * 1024) << "MB free)"
+       << " of " << render_target_pool_ptr->get_budget_bytes() / (1024 * 1024) << "MB budget" << endl;
+
+  int result = 0;
+  if (audit_allocations)
+  {
+    AllocationAudit::report(cerr);
+    cerr << "Allocating frames: " << AllocationAudit::get_allocating_frames()
+         << " of " << AllocationAudit::get_frames() << endl;
+
+    // A run too short to warm up proves nothing
+    if (0 == AllocationAudit::get_frames() || AllocationAudit::get_allocating_frames() > 0)
+      result = 1;
+  }
+
+  rift_manager_ptr->stop_imu_replay();
+
+  // Free the GL objects while the window is still open
+  display_manager.shutdown();
   framework.close_framework();
 
-  return 0;
+  return result;
 }
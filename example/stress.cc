@@ -0,0 +1,314 @@
+/*################################################################
+Pandrift
+Copyright (c) 2013 Warren Moore
+
+This software may be redistributed under the terms of the MIT License.
+See the file LICENSE for details.
+################################################################*/
+
+#include "pandaFramework.h"
+#include "pandaSystem.h"
+#include "load_prc_file.h"
+#include "cIntervalManager.h"
+#include "trueClock.h"
+#include "stress_scene.hh"
+#include "pandrift_rift_manager.hh"
+#include "pandrift_display_manager.hh"
+#include "pandrift_task_chains.hh"
+#include "boost/shared_ptr.hpp"
+#include <stdlib.h>
+#include <algorithm>
+#include <utility>
+
+using namespace pandrift;
+
+namespace
+{
+
+const int cDefaultCounts[] = { 0, 25, 50, 100, 200, 400 };
+const int cDefaultWarmupFrames = 30;
+const int cDefaultMeasureFrames = 200;
+const int cAnimationThreads = 1;
+
+AsyncTask::DoneStatus step_interval_manager(GenericAsyncTask *task_ptr,
+                                            void *data_ptr)
+{
+  CIntervalManager::get_global_ptr()->step();
+
+  return AsyncTask::DS_cont;
+}
+
+const char *get_warp_mode_name(DisplayManager::WarpMode warp_mode)
+{
+  switch (warp_mode)
+  {
+    case DisplayManager::cStereo:
+      return "stereo";
+
+    case DisplayManager::cShader:
+      return "shader";
+
+    case DisplayManager::cShaderChromaticAberration:
+      return "chroma";
+
+    case DisplayManager::cLookupTexture:
+      return "lookup";
+  }
+
+  return "unknown";
+}
+
+void parse_counts(const string &text, pvector<int> &counts)
+{
+  counts.clear();
+
+  size_t start = 0;
+  while (start < text.size())
+  {
+    size_t end = text.find(',', start);
+    if (end == string::npos)
+      end = text.size();
+
+    counts.push_back(atoi(text.substr(start, end - start).c_str()));
+    start = end + 1;
+  }
+}
+
+bool parse_point(const string &text, float point[2])
+{
+  const size_t cComma = text.find(',');
+  if (cComma == string::npos)
+    return false;
+
+  point[0] = atof(text.substr(0, cComma).c_str());
+  point[1] = atof(text.substr(cComma + 1).c_str());
+
+  return true;
+}
+
+}
+
+// Sweep the number of actors and props for each warp mode, printing the frame time curve
+int main(int argc, char *argv[])
+{
+  pvector<int> actor_counts(cDefaultCounts, cDefaultCounts + sizeof(cDefaultCounts) / sizeof(cDefaultCounts[0]));
+  pvector<int> prop_counts(actor_counts);
+  bool paired_counts = true;
+  int warmup_frames = cDefaultWarmupFrames;
+  int measure_frames = cDefaultMeasureFrames;
+  StressScene::StaticMode static_mode = StressScene::cStaticSeparate;
+  bool interior = false;
+  bool offscreen = false;
+  bool tight_culling = false;
+  float far_field_distance = 0;
+  bool fit_point_set = false;
+  float fit_point[2];
+  for (int arg = 1; arg < argc; ++arg)
+  {
+    const string cArg = argv[arg];
+    if ("-counts" == cArg && arg + 1 < argc)
+    {
+      parse_counts(argv[++arg], actor_counts);
+      prop_counts = actor_counts;
+      paired_counts = true;
+    }
+    else if ("-actors" == cArg && arg + 1 < argc)
+    {
+      parse_counts(argv[++arg], actor_counts);
+      paired_counts = false;
+    }
+    else if ("-props" == cArg && arg + 1 < argc)
+    {
+      parse_counts(argv[++arg], prop_counts);
+      paired_counts = false;
+    }
+    else if ("-warmup" == cArg && arg + 1 < argc)
+      warmup_frames = atoi(argv[++arg]);
+    else if ("-frames" == cArg && arg + 1 < argc)
+      measure_frames = max(1, atoi(argv[++arg]));
+    else if ("-flatten" == cArg)
+      static_mode = StressScene::cStaticFlatten;
+    else if ("-instance" == cArg)
+      static_mode = StressScene::cStaticInstance;
+    else if ("-interior" == cArg)
+      interior = true;
+    else if ("-offscreen" == cArg)
+      offscreen = true;
+    else if ("-tight-culling" == cArg)
+      tight_culling = true;
+    else if ("-far-field" == cArg && arg + 1 < argc)
+      far_field_distance = max(0.0, atof(argv[++arg]));
+    else if ("-fit-point" == cArg && arg + 1 < argc && parse_point(argv[++arg], fit_point))
+      fit_point_set = true;
+    else
+    {
+      cerr << "Usage: stress [-counts n,n,...] [-actors n,n,...] [-props n,n,...] [-warmup frames] [-frames frames] "
+           << "[-flatten|-instance] [-interior] [-tight-culling] [-far-field distance] [-fit-point x,y] [-offscreen]" << endl;
+      return 1;
+    }
+  }
+
+  // Occlusion culls each prop separately, which flattening would merge
+  if (interior && StressScene::cStaticFlatten == static_mode)
+  {
+    cerr << "-interior can't be used with -flatten" << endl;
+    return 1;
+  }
+
+  boost::shared_ptr<RiftManager> rift_manager_ptr(new RiftManager());
+
+  // The default fit samples the whole eye buffer, leaving tight culling
+  // nothing to cut; -fit-point -1,1 leaves the inner corners unsampled
+  if (fit_point_set)
+    rift_manager_ptr->set_distortion_fit_point(fit_point[0], fit_point[1]);
+
+  PandaFramework framework;
+  framework.open_framework(argc, argv);
+  framework.set_window_title("Pandrift Stress");
+
+  // Measure the work, not the wait for vsync
+  load_prc_file_data("", "sync-video 0");
+  if (offscreen)
+    load_prc_file_data("", "window-type offscreen");
+
+  WindowProperties window_properties;
+  framework.get_default_window_props(window_properties);
+  window_properties.set_size(rift_manager_ptr->get_display_width_pixels(),
+                             rift_manager_ptr->get_display_height_pixels());
+  window_properties.set_fixed_size(true);
+
+  PT(WindowFramework) window_ptr = framework.open_window(window_properties, 0);
+  if (!window_ptr)
+    return 1;
+
+  DisplayManager display_manager(window_ptr);
+  NodePath display_camera_group = display_manager.get_camera_root();
+  display_camera_group.reparent_to(window_ptr->get_camera_group());
+  display_manager.set_rift_manager(rift_manager_ptr);
+
+  window_ptr->get_camera_group().set_pos(0, -20, 3);
+
+  // Step intervals off the main thread, finishing before the render culls them
+  configure_task_chains(cAnimationThreads);
+  add_chain_task(cAnimationTaskChain,
+                 "interval manager task",
+                 &step_interval_manager,
+                 NULL);
+
+  // -counts steps the actors and props together; -actors or -props sweeps
+  // every combination of the two
+  pvector<pair<int, int> > sweep;
+  for (size_t actors = 0; actors < actor_counts.size(); ++actors)
+  {
+    if (paired_counts)
+      sweep.push_back(make_pair(actor_counts[actors], prop_counts[actors]));
+    else
+      for (size_t props = 0; props < prop_counts.size(); ++props)
+        sweep.push_back(make_pair(actor_counts[actors], prop_counts[props]));
+  }
+
+  // The interior is measured with and without occlusion culling, tight
+  // culling with and without its footprint planes, and the far field with
+  // each eye drawing everything and with the distant scene drawn once
+  cout << "mode,actors,props,mean_ms,p95_ms,max_ms";
+  if (interior)
+    cout << ",occlusion,hidden_props";
+  if (tight_culling)
+    cout << ",tight_culling,coverage";
+  if (far_field_distance > 0)
+    cout << ",far_field";
+  cout << endl;
+
+  TrueClock *clock_ptr = TrueClock::get_global_ptr();
+  Thread *thread_ptr = Thread::get_current_thread();
+  const DisplayManager::WarpMode cWarpModes[] = { DisplayManager::cStereo,
+                                                  DisplayManager::cShader,
+                                                  DisplayManager::cShaderChromaticAberration,
+                                                  DisplayManager::cLookupTexture };
+  boost::shared_ptr<OcclusionCuller> occlusion_culler_ptr = display_manager.get_occlusion_culler();
+  const int cOcclusionSettings = interior ? 2 : 1;
+  const int cCullingSettings = tight_culling ? 2 : 1;
+  const int cFarFieldSettings = far_field_distance > 0 ? 2 : 1;
+  for (int mode = 0; mode < 4; ++mode)
+  {
+    for (int setting = 0; setting < cOcclusionSettings * cCullingSettings * cFarFieldSettings; ++setting)
+    {
+      const int cOcclusion = setting / (cCullingSettings * cFarFieldSettings);
+      const int cCulling = (setting / cFarFieldSettings) % cCullingSettings;
+      const int cFarField = setting % cFarFieldSettings;
+      display_manager.set_warp_mode(cWarpModes[mode]);
+      display_manager.set_occlusion_culling(cOcclusion != 0);
+      display_manager.set_tight_culling(cCulling != 0);
+      display_manager.set_far_field_distance(cFarField != 0 ? far_field_distance : 0);
+      if (!display_manager.create_display())
+      {
+        cerr << "Unable to create the " << get_warp_mode_name(cWarpModes[mode]) << " display" << endl;
+        continue;
+      }
+
+      for (size_t count = 0; count < sweep.size(); ++count)
+      {
+        StressScene scene(window_ptr->get_render());
+        scene.set_actor_count(sweep[count].first);
+        scene.set_prop_count(sweep[count].second);
+        scene.set_static_mode(static_mode);
+        scene.set_interior(interior);
+        if (!scene.create())
+          return 1;
+
+        // The walls stand in for themselves; the walking actors aren't static
+        if (cOcclusion != 0)
+        {
+          occlusion_culler_ptr->add_occluder(scene.get_walls());
+          NodePathCollection props = scene.get_props();
+          for (int prop = 0; prop < props.get_num_paths(); ++prop)
+            occlusion_culler_ptr->add_occludee(props.get_path(prop));
+        }
+
+        for (int frame = 0; frame < warmup_frames; ++frame)
+          framework.do_frame(thread_ptr);
+
+        pvector<double> frame_seconds(measure_frames);
+        double hidden_total = 0;
+        for (int frame = 0; frame < measure_frames; ++frame)
+        {
+          const double cStart = clock_ptr->get_short_time();
+          framework.do_frame(thread_ptr);
+          frame_seconds[frame] = clock_ptr->get_short_time() - cStart;
+          hidden_total += occlusion_culler_ptr->get_hidden_count();
+        }
+
+        occlusion_culler_ptr->clear();
+
+        sort(frame_seconds.begin(), frame_seconds.end());
+        double total = 0;
+        for (int frame = 0; frame < measure_frames; ++frame)
+          total += frame_seconds[frame];
+
+        cout << get_warp_mode_name(cWarpModes[mode])
+             << "," << sweep[count].first
+             << "," << sweep[count].second
+             << "," << (total / measure_frames) * 1000.0
+             << "," << frame_seconds[(measure_frames * 95) / 100] * 1000.0
+             << "," << frame_seconds.back() * 1000.0;
+        if (interior)
+          cout << "," << (cOcclusion != 0 ? "on" : "off")
+               << "," << hidden_total / measure_frames;
+        if (tight_culling)
+          cout << "," << (cCulling != 0 ? "on" : "off")
+               << "," << (display_manager.get_cull_coverage(cEyeLeft) +
+                          display_manager.get_cull_coverage(cEyeRight)) * 0.5;
+        if (far_field_distance > 0)
+          cout << "," << (cFarField != 0 ? "on" : "off");
+        cout << endl;
+      }
+
+      display_manager.destroy_display();
+    }
+  }
+
+  display_manager.shutdown();
+  framework.close_framework();
+
+  return 0;
+}
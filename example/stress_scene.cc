@@ -0,0 +1,307 @@
+/*################################################################
+Pandrift
+Copyright (c) 2013 Warren Moore
+
+This software may be redistributed under the terms of the MIT License.
+See the file LICENSE for details.
+################################################################*/
+
+#include "stress_scene.hh"
+#include "cLerpNodePathInterval.h"
+#include "auto_bind.h"
+#include "loader.h"
+#include "cardMaker.h"
+#include <math.h>
+
+using namespace pandrift;
+
+namespace
+{
+
+const char *cActorModelName = "panda-model";
+const char *cActorAnimName = "panda-walk4";
+// panda-model is a skinned character, which flattening can't merge, so the
+// props use the static panda that ships alongside it
+const char *cPropModelName = "models/panda";
+const float cActorScale = 0.005;
+const float cPropScale = 0.1;
+const float cGridSpacing = 4.0;
+const float cWalkDistance = 1.5;
+const float cWalkSeconds = 4.0;
+const float cTurnSeconds = 1.0;
+const int cRoomCells = 3;
+// Above the stress camera, so the rooms are only seen into through doorways
+const float cWallHeight = 5.0;
+const float cDoorwayWidth = 2.0;
+const float cDoorwayHeight = 4.0;
+
+// Place items on a square grid, centred in front of the camera
+LPoint3f get_grid_position(int item, int item_count, float y_offset)
+{
+  const int cSide = int(ceil(sqrt(float(item_count))));
+  const int cColumn = item % cSide;
+  const int cRow = item / cSide;
+
+  return LPoint3f((float(cColumn) - float(cSide - 1) * 0.5) * cGridSpacing,
+                  float(cRow) * cGridSpacing + y_offset,
+                  0);
+}
+
+}
+
+StressScene::StressScene(NodePath scene_np) :
+  scene_np_(scene_np),
+  actor_count_(0),
+  prop_count_(0),
+  static_mode_(cStaticSeparate),
+  interior_(false)
+{
+}
+
+StressScene::~StressScene()
+{
+  destroy();
+}
+
+void StressScene::set_actor_count(int actor_count)
+{
+  actor_count_ = max(0, actor_count);
+}
+
+void StressScene::set_prop_count(int prop_count)
+{
+  prop_count_ = max(0, prop_count);
+}
+
+void StressScene::set_static_mode(StaticMode static_mode)
+{
+  static_mode_ = static_mode;
+}
+
+void StressScene::set_interior(bool interior)
+{
+  interior_ = interior;
+}
+
+bool StressScene::create()
+{
+  assert(!is_created());
+
+  Loader *loader_ptr = Loader::get_global_ptr();
+  PT(PandaNode) actor_model_ptr = loader_ptr->load_sync(Filename(cActorModelName));
+  PT(PandaNode) actor_anim_ptr = loader_ptr->load_sync(Filename(cActorAnimName));
+  PT(PandaNode) prop_model_ptr = loader_ptr->load_sync(Filename(cPropModelName));
+  if (!actor_model_ptr || !actor_anim_ptr || !prop_model_ptr)
+  {
+    cerr << "Unable to load the stress scene models" << endl;
+    return false;
+  }
+
+  root_np_ = scene_np_.attach_new_node("stress scene");
+
+  // Actors in front, props behind them
+  NodePath actor_model_np(actor_model_ptr);
+  NodePath actor_anim_np(actor_anim_ptr);
+  anim_controls_.resize(actor_count_);
+  for (int actor = 0; actor < actor_count_; ++actor)
+  {
+    const LPoint3f cCentre = get_grid_position(actor, actor_count_, cGridSpacing);
+
+    // Each actor needs its own joints and animation to walk independently
+    NodePath actor_np = root_np_.attach_new_node("stress actor");
+    actor_np.set_scale(cActorScale);
+    actor_model_np.copy_to(actor_np);
+    actor_anim_np.copy_to(actor_np);
+
+    auto_bind(actor_np.node(), anim_controls_[actor], 0);
+    anim_controls_[actor].loop_all(true);
+    bundle_updater_.add_bundles(anim_controls_[actor]);
+
+    create_pace(actor_np, actor, cCentre);
+  }
+
+  NodePath prop_model_np(prop_model_ptr);
+  props_np_ = root_np_.attach_new_node("stress props");
+  const float cPropOffset = (ceil(sqrt(float(actor_count_))) + 1.0) * cGridSpacing;
+  for (int prop = 0; prop < prop_count_; ++prop)
+  {
+    NodePath prop_np = props_np_.attach_new_node("stress prop");
+    prop_np.set_pos(get_grid_position(prop, prop_count_, cPropOffset));
+    prop_np.set_h(float(prop * 37 % 360));
+    prop_np.set_scale(cPropScale);
+
+    if (cStaticInstance == static_mode_)
+      prop_model_np.instance_to(prop_np);
+    else
+      prop_model_np.copy_to(prop_np);
+  }
+
+  // Collapse the props into as few nodes and Geoms as possible
+  if (cStaticFlatten == static_mode_)
+    props_np_.flatten_strong();
+
+  if (interior_)
+    create_walls(cPropOffset);
+
+  bundle_updater_.start();
+
+  return true;
+}
+
+void StressScene::destroy()
+{
+  if (!is_created())
+    return;
+
+  for (size_t pace = 0; pace < paces_.size(); ++pace)
+    paces_[pace]->finish();
+  paces_.clear();
+
+  bundle_updater_.stop();
+  bundle_updater_.clear_bundles();
+
+  for (size_t actor = 0; actor < anim_controls_.size(); ++actor)
+    anim_controls_[actor].stop_all();
+  anim_controls_.clear();
+
+  root_np_.remove_node();
+  props_np_ = NodePath();
+  walls_np_ = NodePath();
+}
+
+bool StressScene::is_created()
+{
+  return !root_np_.is_empty();
+}
+
+NodePath StressScene::get_walls()
+{
+  return walls_np_;
+}
+
+NodePathCollection StressScene::get_props()
+{
+  if (props_np_.is_empty())
+    return NodePathCollection();
+
+  return props_np_.get_children();
+}
+
+void StressScene::create_pace(NodePath actor_np, int actor, const LPoint3f &centre)
+{
+  const LPoint3f cStart = centre + LVector3f(0, cWalkDistance, 0);
+  const LPoint3f cEnd = centre - LVector3f(0, cWalkDistance, 0);
+
+  // Walk back and forth as the World panda does, over a shorter distance
+  PT(CLerpNodePathInterval) pos_interval1 = new CLerpNodePathInterval("stress_pos_interval1",
+                                                                      cWalkSeconds,
+                                                                      CLerpInterval::BT_no_blend,
+                                                                      true,
+                                                                      false,
+                                                                      actor_np,
+                                                                      NodePath());
+  pos_interval1->set_start_pos(cStart);
+  pos_interval1->set_end_pos(cEnd);
+
+  PT(CLerpNodePathInterval) hpr_interval1 = new CLerpNodePathInterval("stress_hpr_interval1",
+                                                                      cTurnSeconds,
+                                                                      CLerpInterval::BT_no_blend,
+                                                                      true,
+                                                                      false,
+                                                                      actor_np,
+                                                                      NodePath());
+  hpr_interval1->set_start_hpr(LPoint3f(0, 0, 0));
+  hpr_interval1->set_end_hpr(LPoint3f(180, 0, 0));
+
+  PT(CLerpNodePathInterval) pos_interval2 = new CLerpNodePathInterval("stress_pos_interval2",
+                                                                      cWalkSeconds,
+                                                                      CLerpInterval::BT_no_blend,
+                                                                      true,
+                                                                      false,
+                                                                      actor_np,
+                                                                      NodePath());
+  pos_interval2->set_start_pos(cEnd);
+  pos_interval2->set_end_pos(cStart);
+
+  PT(CLerpNodePathInterval) hpr_interval2 = new CLerpNodePathInterval("stress_hpr_interval2",
+                                                                      cTurnSeconds,
+                                                                      CLerpInterval::BT_no_blend,
+                                                                      true,
+                                                                      false,
+                                                                      actor_np,
+                                                                      NodePath());
+  hpr_interval2->set_start_hpr(LPoint3f(180, 0, 0));
+  hpr_interval2->set_end_hpr(LPoint3f(0, 0, 0));
+
+  PT(CMetaInterval) pace = new CMetaInterval("stress_pace");
+  pace->add_c_interval(pos_interval1, 0, CMetaInterval::RS_previous_end);
+  pace->add_c_interval(hpr_interval1, 0, CMetaInterval::RS_previous_end);
+  pace->add_c_interval(pos_interval2, 0, CMetaInterval::RS_previous_end);
+  pace->add_c_interval(hpr_interval2, 0, CMetaInterval::RS_previous_end);
+
+  // Stagger the actors so they don't all turn on the same frame
+  const double cCycle = (cWalkSeconds + cTurnSeconds) * 2.0;
+  pace->loop(fmod(actor * 0.37 * cCycle, cCycle));
+
+  paces_.push_back(pace);
+}
+
+void StressScene::create_walls(float y_offset)
+{
+  walls_np_ = root_np_.attach_new_node("stress walls");
+  walls_np_.set_two_sided(true);
+  walls_np_.set_color(0.6, 0.6, 0.55, 1);
+
+  // Walls on the grid lines between props, round rooms of cRoomCells a side
+  const int cSide = max(1, int(ceil(sqrt(float(prop_count_)))));
+  const int cRooms = (cSide + cRoomCells - 1) / cRoomCells;
+  const float cLeft = -float(cSide) * 0.5 * cGridSpacing;
+  const float cFront = y_offset - 0.5 * cGridSpacing;
+  const float cRoomSize = cRoomCells * cGridSpacing;
+
+  // Walls facing the camera have a doorway in each room, so there's a view
+  // into the next room, and past it through the next doorway along
+  for (int row = 0; row <= cRooms; ++row)
+  {
+    const float cY = cFront + row * cRoomSize;
+    for (int room = 0; room < cRooms; ++room)
+      create_wall(LPoint3f(cLeft + room * cRoomSize, cY, 0),
+                  LPoint3f(cLeft + (room + 1) * cRoomSize, cY, 0),
+                  row < cRooms);
+  }
+
+  for (int column = 0; column <= cRooms; ++column)
+  {
+    const float cX = cLeft + column * cRoomSize;
+    create_wall(LPoint3f(cX, cFront, 0), LPoint3f(cX, cFront + cRooms * cRoomSize, 0), false);
+  }
+}
+
+void StressScene::create_wall(const LPoint3f &start, const LPoint3f &end, bool doorway)
+{
+  // Cards are made in the XZ plane, so turn each to run from start to end
+  const LVector3f cRun = end - start;
+  const float cLength = cRun.length();
+  NodePath wall_np = walls_np_.attach_new_node("stress wall");
+  wall_np.set_pos(start);
+  wall_np.set_h(atan2(cRun[1], cRun[0]) * (180.0 / M_PI));
+
+  CardMaker card_maker("stress wall card");
+  if (doorway)
+  {
+    const float cDoorwayLeft = (cLength - cDoorwayWidth) * 0.5;
+    const float cDoorwayRight = cDoorwayLeft + cDoorwayWidth;
+
+    card_maker.set_frame(0, cDoorwayLeft, 0, cWallHeight);
+    wall_np.attach_new_node(card_maker.generate());
+    card_maker.set_frame(cDoorwayRight, cLength, 0, cWallHeight);
+    wall_np.attach_new_node(card_maker.generate());
+    card_maker.set_frame(cDoorwayLeft, cDoorwayRight, cDoorwayHeight, cWallHeight);
+    wall_np.attach_new_node(card_maker.generate());
+  }
+  else
+  {
+    card_maker.set_frame(0, cLength, 0, cWallHeight);
+    wall_np.attach_new_node(card_maker.generate());
+  }
+}
@@ -0,0 +1,78 @@
+/*################################################################
+Pandrift
+Copyright (c) 2013 Warren Moore
+
+This software may be redistributed under the terms of the MIT License.
+See the file LICENSE for details.
+################################################################*/
+
+#ifndef PANDRIFT_EXAMPLE_STRESS_SCENE_HEADER
+#define PANDRIFT_EXAMPLE_STRESS_SCENE_HEADER
+
+#include "nodePath.h"
+#include "nodePathCollection.h"
+#include "animControlCollection.h"
+#include "cMetaInterval.h"
+#include "pvector.h"
+#include "pandrift_task_chains.hh"
+
+// A crowd of walking pandas among static props, laid out on a grid, for
+// finding where the frame time stops scaling. The props can be walled into
+// rooms, for measuring occlusion culling.
+class StressScene
+{
+public:
+  enum StaticMode
+  {
+    cStaticSeparate = 0,
+    cStaticFlatten,
+    cStaticInstance
+  };
+
+  StressScene(NodePath scene_np);
+
+  ~StressScene();
+
+  void set_actor_count(int actor_count);
+
+  void set_prop_count(int prop_count);
+
+  // How the props are built: a copy each, copies flattened together, or instances of one copy
+  void set_static_mode(StaticMode static_mode);
+
+  // Wall the props into rooms, three grid cells a side, seen through doorways
+  void set_interior(bool interior);
+
+  bool create();
+
+  void destroy();
+
+  bool is_created();
+
+  // The interior's walls, empty without one
+  NodePath get_walls();
+
+  // Each prop's node, unless flattened together
+  NodePathCollection get_props();
+
+private:
+  void create_pace(NodePath actor_np, int actor, const LPoint3f &centre);
+
+  void create_walls(float y_offset);
+
+  void create_wall(const LPoint3f &start, const LPoint3f &end, bool doorway);
+
+  NodePath scene_np_;
+  int actor_count_;
+  int prop_count_;
+  StaticMode static_mode_;
+  bool interior_;
+  NodePath root_np_;
+  NodePath props_np_;
+  NodePath walls_np_;
+  pvector<AnimControlCollection> anim_controls_;
+  pandrift::PartBundleUpdater bundle_updater_;
+  pvector<PT(CMetaInterval)> paces_;
+};
+
+#endif
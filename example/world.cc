@@ -9,6 +9,7 @@ This code is based on the Panda3D Hello World tutorial.
 ################################################################*/
 
 #include "world.hh"
+#include "pandrift_allocation_audit.hh"
 #include "pandaFramework.h"
 #include "cLerpNodePathInterval.h"
 #include "cMetaInterval.h"
@@ -16,6 +17,9 @@ This code is based on the Panda3D Hello World tutorial.
 #include "mouseWatcher.h"
 #include "cardMaker.h"
 #include "textNode.h"
+#include "loader.h"
+#include "asyncTaskManager.h"
+#include "asyncTaskChain.h"
 
 using namespace pandrift;
 
@@ -23,6 +27,10 @@ namespace
 {
 
 const float cMouseScale = 45;
+const char *cLoaderTaskChainName = "world loader";
+const int cLoaderThreads = 2;
+const int cAnimationThreads = 1;
+const char *cModelLoadedEvent = "world model loaded";
 
 AsyncTask::DoneStatus step_interval_manager(GenericAsyncTask *task_ptr,
                                             void *data_ptr)
@@ -43,6 +51,14 @@ AsyncTask::DoneStatus update_camera_task(GenericAsyncTask *task_ptr,
   return AsyncTask::DS_cont;
 }
 
+void model_loaded_handler(const Event *event, void *data)
+{
+  World *world_ptr = reinterpret_cast<World*>(data);
+  assert(world_ptr);
+
+  world_ptr->attach_loaded_models();
+}
+
 }
 
 World::World(PT(WindowFramework) window_ptr,
@@ -50,9 +66,13 @@ World::World(PT(WindowFramework) window_ptr,
              NodePath camera_np) :
   window_ptr_(window_ptr),
   scene_np_(scene_np),
-  camera_np_(camera_np)
+  camera_np_(camera_np),
+  display_manager_ptr_(NULL)
 {
   assert(window_ptr_);
+
+  for (int model = 0; model < cModelCount; ++model)
+    model_attached_[model] = false;
 }
 
 World::~World()
@@ -64,17 +84,32 @@ void World::set_rift_manager(boost::shared_ptr<pandrift::RiftManager> rift_manag
   rift_manager_ptr_ = rift_manager_ptr;
 }
 
-void World::create_scene()
+void World::set_display_manager(pandrift::DisplayManager *display_manager_ptr)
 {
-  // Create a task for the interval manager
-  AsyncTaskManager::get_global_ptr()->add(new GenericAsyncTask("interval manager task",
-                                                               &step_interval_manager,
-                                                               NULL));
+  display_manager_ptr_ = display_manager_ptr;
+}
 
-  // Create a task for the camera update
-  AsyncTaskManager::get_global_ptr()->add(new GenericAsyncTask("camera update task",
-                                                               &update_camera_task,
-                                                               this));
+void World::create_scene()
+{
+  // Step intervals and blend animation off the main thread
+  configure_task_chains(cAnimationThreads);
+  add_chain_task(cAnimationTaskChain,
+                 "interval manager task",
+                 &step_interval_manager,
+                 NULL);
+  bundle_updater_.start();
+
+  // Update the camera from the pose last, on the main thread before the render
+  add_chain_task("default",
+                 "camera update task",
+                 &update_camera_task,
+                 this,
+                 cPoseTaskSort);
+
+  // The mouse steers the camera without a sensor
+  NodePath mouse_np = window_ptr_->get_mouse();
+  if (!mouse_np.is_empty())
+    mouse_watcher_ptr_ = DCAST(MouseWatcher, mouse_np.node());
 
   // Place the camera
   camera_np_.set_pos(0, -20, 3);
@@ -101,24 +136,35 @@ void World::create_scene()
   NodePath text_node_np = window_ptr_->get_aspect_2d().attach_new_node(text_node_ptr);
   text_node_np.set_scale(0.25);
 
-  // Load the background
-  NodePath environ = window_ptr_->load_model(framework->get_models(),
-                                             "models/environment");
+  // The HUD is a compositor layer that only renders when it changes
+  if (display_manager_ptr_)
+    display_manager_ptr_->get_hud_layer()->set_dirty();
 
-  environ.reparent_to(scene_np_);
-  environ.set_scale(0.25, 0.25, 0.25);
-  environ.set_pos(-8, 42, 0);
+  // Load the models in the background on a thread-backed task chain
+  AsyncTaskChain *loader_chain_ptr = AsyncTaskManager::get_global_ptr()->make_task_chain(cLoaderTaskChainName);
+  loader_chain_ptr->set_num_threads(cLoaderThreads);
+  loader_chain_ptr->set_thread_priority(TP_low);
+  framework->define_key(cModelLoadedEvent, "Model loaded", &model_loaded_handler, this);
 
-  // Load the panda
-  NodePath panda_actor = window_ptr_->load_model(framework->get_models(),
-                                                 "panda-model");
-  panda_actor.set_scale(0.005);
-  panda_actor.reparent_to(scene_np_);
+  // Placeholders stand in for the models, so they can be placed and animated now
+  model_placeholder_np_[cModelEnvironment] = scene_np_.attach_new_node("environment placeholder");
+  model_placeholder_np_[cModelEnvironment].set_scale(0.25, 0.25, 0.25);
+  model_placeholder_np_[cModelEnvironment].set_pos(-8, 42, 0);
 
-  // Load the walk animation
-  window_ptr_->load_model(panda_actor, "panda-walk4");
-  auto_bind(scene_np_.node(), anim_control_, 0);
-  anim_control_.loop_all(true);
+  model_placeholder_np_[cModelPanda] = scene_np_.attach_new_node("panda placeholder");
+  model_placeholder_np_[cModelPanda].set_scale(0.005);
+  NodePath panda_actor = model_placeholder_np_[cModelPanda];
+
+  // The walk animation is bound under the panda once both are in
+  model_placeholder_np_[cModelPandaWalk] = panda_actor;
+
+  request_model(cModelEnvironment, "models/environment");
+  request_model(cModelPanda, "panda-model");
+  request_model(cModelPandaWalk, "panda-walk4");
+
+  // Keep presenting the last frame at full rate until the scene is complete
+  if (display_manager_ptr_)
+    display_manager_ptr_->set_loading(true);
 
   // Create the lerp intervals needed to walk back and forth
   PT(CLerpNodePathInterval) panda_pos_interval1,
@@ -182,8 +228,75 @@ void World::create_scene()
   panda_pace->loop();
 }
 
+bool World::is_loading()
+{
+  for (int model = 0; model < cModelCount; ++model)
+    if (!model_attached_[model])
+      return true;
+
+  return false;
+}
+
+void World::attach_loaded_models()
+{
+  for (int model = 0; model < cModelCount; ++model)
+  {
+    if (model_attached_[model] || !model_request_ptr_[model]->is_ready())
+      continue;
+
+    // Hold the animation back until the panda it binds to is in
+    if (cModelPandaWalk == model && !model_attached_[cModelPanda])
+      continue;
+
+    PT(PandaNode) model_ptr = model_request_ptr_[model]->get_model();
+    if (model_ptr)
+    {
+      NodePath model_np = model_placeholder_np_[model].attach_new_node(model_ptr);
+
+      // The environment never moves, so it can be culled ahead of the view
+      if (cModelEnvironment == model && display_manager_ptr_)
+        display_manager_ptr_->get_guard_band_culler()->add_static_root(model_np);
+    }
+    else
+      cerr << "Unable to load " << model_request_ptr_[model]->get_filename() << endl;
+
+    model_attached_[model] = true;
+    model_request_ptr_[model] = NULL;
+  }
+
+  if (model_attached_[cModelPandaWalk] && anim_control_.get_num_anims() == 0)
+  {
+    // Bind and play the walk animation
+    auto_bind(model_placeholder_np_[cModelPanda].node(), anim_control_, 0);
+    anim_control_.loop_all(true);
+    bundle_updater_.add_bundles(anim_control_);
+  }
+
+  if (display_manager_ptr_)
+  {
+    // The models may bring LODNodes
+    display_manager_ptr_->refresh_lod_nodes();
+
+    if (!is_loading())
+      display_manager_ptr_->set_loading(false);
+  }
+}
+
+void World::request_model(Model model, const std::string &file_name)
+{
+  PT(AsyncTask) request_ptr = Loader::get_global_ptr()->make_async_request(Filename(file_name));
+  model_request_ptr_[model] = DCAST(ModelLoadRequest, request_ptr);
+
+  // Add the request to our chain directly; Loader::load_async would use its own
+  request_ptr->set_task_chain(cLoaderTaskChainName);
+  request_ptr->set_done_event(cModelLoadedEvent);
+  AsyncTaskManager::get_global_ptr()->add(request_ptr);
+}
+
 void World::update_camera()
 {
+  PANDRIFT_AUDIT_SITE("World::update_camera");
+
   float yaw = 0, pitch = 0, roll = 0;
   if (rift_manager_ptr_ && rift_manager_ptr_->get_sensor_euler_angles(yaw, pitch, roll))
   {
@@ -194,10 +307,9 @@ void World::update_camera()
   else
   {
     float mouse_x = 0, mouse_y = 0;
-    PT(MouseWatcher) mouse_watcher_ptr = DCAST(MouseWatcher, window_ptr_->get_mouse().node());
-    if (mouse_watcher_ptr->has_mouse())
+    if (mouse_watcher_ptr_ && mouse_watcher_ptr_->has_mouse())
     {
-       const LPoint2f &mouse_pos = mouse_watcher_ptr->get_mouse();
+       const LPoint2f &mouse_pos = mouse_watcher_ptr_->get_mouse();
        mouse_x = mouse_pos.get_x(); // -1 to 1
        mouse_y = mouse_pos.get_y(); // -1 to 1
     }
@@ -206,5 +318,7 @@ void World::update_camera()
     pitch = mouse_y * cMouseScale;
   }
 
+  // Each new pose makes a new transform
+  PANDRIFT_AUDIT_EXPECTED("World camera transform");
   camera_np_.set_hpr(yaw, pitch, -roll);
 }
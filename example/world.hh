@@ -14,6 +14,10 @@ See the file LICENSE for details.
 #include "cIntervalManager.h"
 #include "boost/shared_ptr.hpp"
 #include "pandrift_rift_manager.hh"
+#include "pandrift_display_manager.hh"
+#include "pandrift_task_chains.hh"
+#include "modelLoadRequest.h"
+#include "mouseWatcher.h"
 
 class World
 {
@@ -26,16 +30,40 @@ public:
 
   void set_rift_manager(boost::shared_ptr<pandrift::RiftManager> rift_manager_ptr);
 
+  // Optional; holds the display in its loading mode until the models are in
+  void set_display_manager(pandrift::DisplayManager *display_manager_ptr);
+
   void create_scene();
 
   void update_camera();
 
+  bool is_loading();
+
+  void attach_loaded_models();
+
 private:
+  enum Model
+  {
+    cModelEnvironment = 0,
+    cModelPanda,
+    cModelPandaWalk,
+    cModelCount
+  };
+
+  void request_model(Model model, const std::string &file_name);
+
   PT(WindowFramework) window_ptr_;
   NodePath scene_np_;
   NodePath camera_np_;
   boost::shared_ptr<pandrift::RiftManager> rift_manager_ptr_;
+  pandrift::DisplayManager *display_manager_ptr_;
+  // Looked up once rather than every frame
+  PT(MouseWatcher) mouse_watcher_ptr_;
   AnimControlCollection anim_control_;
+  pandrift::PartBundleUpdater bundle_updater_;
+  PT(ModelLoadRequest) model_request_ptr_[cModelCount];
+  NodePath model_placeholder_np_[cModelCount];
+  bool model_attached_[cModelCount];
 };
 
 #endif
@@ -0,0 +1,11 @@
+//GLSL
+
+// Loaded after pandrift-composite.glsl, for the screen and layer uniforms
+
+uniform sampler2D p3d_Texture0;
+varying vec2 texcoord0; 
+
+void main()
+{
+  gl_FragColor = CompositeLayers(texture2D(p3d_Texture0, texcoord0), texcoord0);
+}
@@ -0,0 +1,56 @@
+//GLSL
+
+// Layer compositing and scanout compensation, shared by the warp fragment
+// shaders. Panda's GLSL has no #include, so DisplayManager prepends this to
+// each of them when it loads them.
+
+uniform vec2 ScreenCenter;
+uniform vec2 ScreenHalfSize;
+uniform float LayerCount;
+uniform vec4 LayerRect0;
+uniform vec4 LayerRect1;
+uniform sampler2D LayerTexture0;
+uniform sampler2D LayerTexture1;
+uniform mat4 Projection;
+uniform mat4 InverseProjection;
+uniform vec4 ScanRotation;
+
+vec4 CompositeLayer(vec4 colour, sampler2D layer, vec4 rect, vec2 eye01)
+{
+  vec2 tc = eye01 * rect.xy + rect.zw;
+  if (!all(equal(clamp(tc, vec2(0.0), vec2(1.0)), tc)))
+    return colour;
+
+  // Premultiplied: CompositorLayer blends colour and alpha in separate passes
+  vec4 layerColour = texture2D(layer, tc);
+  return vec4(colour.rgb * (1.0 - layerColour.a) + layerColour.rgb, colour.a);
+}
+
+vec4 CompositeLayers(vec4 colour, vec2 tc)
+{
+  vec2 eye01 = (tc - ScreenCenter + ScreenHalfSize) / (2.0 * ScreenHalfSize);
+  if (LayerCount > 0.5)
+    colour = CompositeLayer(colour, LayerTexture0, LayerRect0, eye01);
+  if (LayerCount > 1.5)
+    colour = CompositeLayer(colour, LayerTexture1, LayerRect1, eye01);
+  return colour;
+}
+
+// Turn a scene UV by the head's rotation between the top row scanning out
+// and this one, scan01 of the way down, as ScanRotation's axis and angle
+// over the whole scanout
+vec2 ScanCompensate(vec2 tc, float scan01)
+{
+  float angle = ScanRotation.w * scan01;
+  if (angle == 0.0)
+    return tc;
+
+  vec2 eye01 = (tc - ScreenCenter + ScreenHalfSize) / (2.0 * ScreenHalfSize);
+  vec4 view = InverseProjection * vec4(eye01 * 2.0 - 1.0, 0.0, 1.0);
+  vec3 ray = view.xyz / view.w;
+  vec3 axis = ScanRotation.xyz;
+  ray = ray * cos(angle) + cross(axis, ray) * sin(angle) + axis * dot(axis, ray) * (1.0 - cos(angle));
+  vec4 turned = Projection * vec4(ray, 1.0);
+  vec2 turned01 = (turned.xy / turned.w) * 0.5 + 0.5;
+  return turned01 * (2.0 * ScreenHalfSize) + ScreenCenter - ScreenHalfSize;
+}
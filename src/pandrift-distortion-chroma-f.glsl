@@ -1,7 +1,8 @@
 //GLSL
 
+// Loaded after pandrift-composite.glsl, for the screen, layer and scanout uniforms
+
 uniform vec2 LensCenter;
-uniform vec2 ScreenCenter;
 uniform vec2 Scale;
 uniform vec2 ScaleIn;
 uniform vec4 HmdWarpParam;
@@ -16,9 +17,13 @@ void main()
   vec2 theta1 = theta * (HmdWarpParam.x + HmdWarpParam.y * rSq +
                          HmdWarpParam.z * rSq * rSq + HmdWarpParam.w * rSq * rSq * rSq);
  
+  // Turn once, at the green position, and shift all three channels by it
+  vec2 tcGreen = LensCenter + Scale * theta1;
+  vec2 shift = ScanCompensate(tcGreen, 1.0 - texcoord0.y) - tcGreen;
+
   vec2 thetaBlue = theta1 * (ChromAbParam.z + ChromAbParam.w * rSq);
-  vec2 tcBlue = LensCenter + Scale * thetaBlue;
-  if (!all(equal(clamp(tcBlue, ScreenCenter-vec2(0.25, 0.5), ScreenCenter+vec2(0.25, 0.5)), tcBlue)))
+  vec2 tcBlue = LensCenter + Scale * thetaBlue + shift;
+  if (!all(equal(clamp(tcBlue, ScreenCenter-ScreenHalfSize, ScreenCenter+ScreenHalfSize), tcBlue)))
   {
     gl_FragColor = vec4(0);
     return;
@@ -26,12 +31,12 @@ void main()
 
   float blue = texture2D(p3d_Texture0, tcBlue).b;
 
-  vec2 tcGreen = LensCenter + Scale * theta1;
-  vec4 center = texture2D(p3d_Texture0, tcGreen);
+  vec4 center = texture2D(p3d_Texture0, tcGreen + shift);
 
   vec2 thetaRed = theta1 * (ChromAbParam.x + ChromAbParam.y * rSq);
-  vec2 tcRed = LensCenter + Scale * thetaRed;
+  vec2 tcRed = LensCenter + Scale * thetaRed + shift;
   float red = texture2D(p3d_Texture0, tcRed).r;
 
-  gl_FragColor = vec4(red, center.g, blue, 1);
+  // Layers are placed at the green position
+  gl_FragColor = CompositeLayers(vec4(red, center.g, blue, 1), tcGreen);
 }
@@ -1,7 +1,8 @@
 //GLSL
 
+// Loaded after pandrift-composite.glsl, for the screen, layer and scanout uniforms
+
 uniform vec2 LensCenter;
-uniform vec2 ScreenCenter;
 uniform vec2 Scale;
 uniform vec2 ScaleIn;
 uniform vec4 HmdWarpParam;
@@ -20,8 +21,9 @@ vec2 HmdWarp(vec2 in01)
 void main()
 {
   vec2 tc = HmdWarp(texcoord0);
-  if (!all(equal(clamp(tc, ScreenCenter-vec2(0.25, 0.5), ScreenCenter+vec2(0.25, 0.5)), tc)))
+  vec2 scanTc = ScanCompensate(tc, 1.0 - texcoord0.y);
+  if (!all(equal(clamp(scanTc, ScreenCenter-ScreenHalfSize, ScreenCenter+ScreenHalfSize), scanTc)))
     gl_FragColor = vec4(0);
   else
-    gl_FragColor = texture2D(p3d_Texture0, tc);
+    gl_FragColor = CompositeLayers(texture2D(p3d_Texture0, scanTc), tc);
 }
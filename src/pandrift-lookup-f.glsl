@@ -0,0 +1,20 @@
+//GLSL
+
+// Loaded after pandrift-composite.glsl, for the screen, layer and scanout uniforms
+
+uniform vec4 LookupTransform;
+uniform sampler2D p3d_Texture0;
+uniform sampler2D WarpLookup;
+varying vec2 texcoord0; 
+
+void main()
+{
+  // The lookup covers the whole panel and holds side-by-side scene UVs
+  vec4 lookup = texture2D(WarpLookup, texcoord0 * LookupTransform.xy + LookupTransform.zw);
+  vec2 tc = (lookup.rg - LookupTransform.zw) / LookupTransform.xy;
+  vec2 scanTc = ScanCompensate(tc, 1.0 - texcoord0.y);
+  if (lookup.a < 0.5 || !all(equal(clamp(scanTc, ScreenCenter-ScreenHalfSize, ScreenCenter+ScreenHalfSize), scanTc)))
+    gl_FragColor = vec4(0);
+  else
+    gl_FragColor = CompositeLayers(texture2D(p3d_Texture0, scanTc), tc);
+}
@@ -0,0 +1,37 @@
+//GLSL
+
+// Texture LOD bias for scene fragment shaders, from how far out in the lens
+// the fragment is. With DisplayManager::set_eccentricity_lod(true) the scene
+// cameras supply these inputs. Load the scene shader with
+// DisplayManager::load_periphery_shader, which prepends this to its fragment
+// shader, and sample with texture2D(sampler, uv, PeripheryLodBias()).
+// pandrift-scene-f.glsl is an example.
+
+uniform vec4 PeripheryViewport;
+uniform vec4 PeripheryLens;
+uniform vec4 HmdWarpParam;
+
+const float cPeripheryMaxBias = 2.0;
+
+float PeripheryLodBias()
+{
+  // Window pixel to the eye's view [0, 1], then to the warp's scene radius
+  vec2 eye01 = (gl_FragCoord.xy - PeripheryViewport.xy) / PeripheryViewport.zw;
+  vec2 theta = (eye01 - PeripheryLens.xy) * PeripheryLens.zw;
+  float warped = length(theta);
+
+  // Back to the panel radius, with Newton steps from the warped radius
+  float r = warped;
+  for (int step = 0; step < 2; ++step)
+  {
+    float rSq = r * r;
+    float f = r * (HmdWarpParam.x + rSq * (HmdWarpParam.y + rSq * (HmdWarpParam.z + rSq * HmdWarpParam.w)));
+    float slope = HmdWarpParam.x + rSq * (3.0 * HmdWarpParam.y + rSq * (5.0 * HmdWarpParam.z + rSq * 7.0 * HmdWarpParam.w));
+    r -= (f - warped) / slope;
+  }
+
+  // One panel pixel spans the slope's worth of scene texels
+  float rSq = r * r;
+  float slope = HmdWarpParam.x + rSq * (3.0 * HmdWarpParam.y + rSq * (5.0 * HmdWarpParam.z + rSq * 7.0 * HmdWarpParam.w));
+  return clamp(log2(slope / HmdWarpParam.x), 0.0, cPeripheryMaxBias);
+}
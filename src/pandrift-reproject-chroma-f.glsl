@@ -0,0 +1,56 @@
+//GLSL
+
+// Loaded after pandrift-composite.glsl, for the screen, layer and scanout uniforms
+
+uniform vec2 LensCenter;
+uniform vec2 Scale;
+uniform vec2 ScaleIn;
+uniform vec4 HmdWarpParam;
+uniform vec4 ChromAbParam;
+uniform sampler2D p3d_Texture0;
+uniform sampler2D DepthTexture;
+uniform mat4 PoseDelta;
+varying vec2 texcoord0; 
+
+// Move a scene UV from where the current pose sees it to where the scene was
+// drawn, taking the depth the scene had at that UV
+vec2 Reproject(vec2 tc)
+{
+  vec2 eye01 = (tc - ScreenCenter + ScreenHalfSize) / (2.0 * ScreenHalfSize);
+  vec4 clip = vec4(eye01 * 2.0 - 1.0, texture2D(DepthTexture, tc).r * 2.0 - 1.0, 1.0);
+  vec4 view = InverseProjection * clip;
+  vec4 drawn = Projection * (PoseDelta * (view / view.w));
+  vec2 drawn01 = (drawn.xy / drawn.w) * 0.5 + 0.5;
+  return drawn01 * (2.0 * ScreenHalfSize) + ScreenCenter - ScreenHalfSize;
+}
+
+void main()
+{
+  vec2 theta = (texcoord0 - LensCenter) * ScaleIn;
+  float rSq= theta.x * theta.x + theta.y * theta.y;
+  vec2 theta1 = theta * (HmdWarpParam.x + HmdWarpParam.y * rSq +
+                         HmdWarpParam.z * rSq * rSq + HmdWarpParam.w * rSq * rSq * rSq);
+
+  // Turn and reproject once, at the green position, and shift all three channels by it
+  vec2 tcGreen = LensCenter + Scale * theta1;
+  vec2 shift = Reproject(ScanCompensate(tcGreen, 1.0 - texcoord0.y)) - tcGreen;
+
+  vec2 thetaBlue = theta1 * (ChromAbParam.z + ChromAbParam.w * rSq);
+  vec2 tcBlue = LensCenter + Scale * thetaBlue + shift;
+  if (!all(equal(clamp(tcBlue, ScreenCenter-ScreenHalfSize, ScreenCenter+ScreenHalfSize), tcBlue)))
+  {
+    gl_FragColor = vec4(0);
+    return;
+  }
+
+  float blue = texture2D(p3d_Texture0, tcBlue).b;
+
+  vec4 center = texture2D(p3d_Texture0, tcGreen + shift);
+
+  vec2 thetaRed = theta1 * (ChromAbParam.x + ChromAbParam.y * rSq);
+  vec2 tcRed = LensCenter + Scale * thetaRed + shift;
+  float red = texture2D(p3d_Texture0, tcRed).r;
+
+  // Layers are placed at the green position
+  gl_FragColor = CompositeLayers(vec4(red, center.g, blue, 1), tcGreen);
+}
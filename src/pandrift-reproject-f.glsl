@@ -0,0 +1,43 @@
+//GLSL
+
+// Loaded after pandrift-composite.glsl, for the screen, layer and scanout uniforms
+
+uniform vec2 LensCenter;
+uniform vec2 Scale;
+uniform vec2 ScaleIn;
+uniform vec4 HmdWarpParam;
+uniform sampler2D p3d_Texture0;
+uniform sampler2D DepthTexture;
+uniform mat4 PoseDelta;
+varying vec2 texcoord0; 
+
+vec2 HmdWarp(vec2 in01)
+{
+  vec2 theta = (in01 - LensCenter) * ScaleIn;
+  float rSq = theta.x * theta.x + theta.y * theta.y;
+  vec2 theta1 = theta * (HmdWarpParam.x + HmdWarpParam.y * rSq +
+                         HmdWarpParam.z * rSq * rSq + HmdWarpParam.w * rSq * rSq * rSq);
+  return LensCenter + Scale * theta1;
+}
+
+// Move a scene UV from where the current pose sees it to where the scene was
+// drawn, taking the depth the scene had at that UV
+vec2 Reproject(vec2 tc)
+{
+  vec2 eye01 = (tc - ScreenCenter + ScreenHalfSize) / (2.0 * ScreenHalfSize);
+  vec4 clip = vec4(eye01 * 2.0 - 1.0, texture2D(DepthTexture, tc).r * 2.0 - 1.0, 1.0);
+  vec4 view = InverseProjection * clip;
+  vec4 drawn = Projection * (PoseDelta * (view / view.w));
+  vec2 drawn01 = (drawn.xy / drawn.w) * 0.5 + 0.5;
+  return drawn01 * (2.0 * ScreenHalfSize) + ScreenCenter - ScreenHalfSize;
+}
+
+void main()
+{
+  vec2 tc = HmdWarp(texcoord0);
+  vec2 drawnTc = Reproject(ScanCompensate(tc, 1.0 - texcoord0.y));
+  if (!all(equal(clamp(drawnTc, ScreenCenter-ScreenHalfSize, ScreenCenter+ScreenHalfSize), drawnTc)))
+    gl_FragColor = vec4(0);
+  else
+    gl_FragColor = CompositeLayers(texture2D(p3d_Texture0, drawnTc), tc);
+}
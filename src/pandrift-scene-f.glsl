@@ -0,0 +1,14 @@
+//GLSL
+
+// Loaded after pandrift-periphery-lod.glsl, for PeripheryLodBias
+
+uniform sampler2D p3d_Texture0;
+varying vec2 texcoord0;
+varying vec4 colour;
+
+// Unlit and textured, as the example's models are, with less texture
+// detail towards the edge of each lens
+void main()
+{
+  gl_FragColor = texture2D(p3d_Texture0, texcoord0, PeripheryLodBias()) * colour;
+}
@@ -0,0 +1,11 @@
+//GLSL
+
+varying vec2 texcoord0;
+varying vec4 colour;
+
+void main()
+{
+  gl_Position = gl_ModelViewProjectionMatrix * gl_Vertex;
+  texcoord0 = vec2(gl_MultiTexCoord0[0], gl_MultiTexCoord0[1]);
+  colour = gl_Color;
+}
@@ -0,0 +1,61 @@
+//GLSL
+
+uniform sampler2D SourceTexture;
+uniform sampler2D HistoryTexture;
+uniform vec2 SourceTexelSize;
+uniform vec2 SourceScale;
+uniform vec2 Jitter;
+uniform mat4 Projection;
+uniform mat4 InverseProjection;
+uniform mat4 RotationDelta;
+uniform float Blend;
+varying vec2 texcoord0; 
+
+// Where the view through a UV was last frame. The history is treated as
+// being at infinity, so only the rotation moves it.
+vec4 ReprojectHistory(vec2 tc)
+{
+  vec4 view = InverseProjection * vec4(tc * 2.0 - 1.0, 1.0, 1.0);
+  vec4 previous = Projection * (RotationDelta * vec4(view.xyz / view.w, 0.0));
+  return vec4((previous.xy / previous.w) * 0.5 + 0.5, previous.w, 0.0);
+}
+
+void main()
+{
+  // The source was drawn offset by the jitter; undo it to find this texel's view,
+  // in source pixels
+  vec2 sourcePos = (texcoord0 + Jitter) / SourceTexelSize;
+  vec2 baseTexel = floor(sourcePos);
+
+  // Weight the 3x3 source texels around it by how close each one's sample fell
+  // to this texel's centre, in output pixels. The same texels bound the history,
+  // so what has moved doesn't ghost.
+  vec3 current = vec3(0.0);
+  float weight = 0.0;
+  vec3 low = vec3(1.0e6);
+  vec3 high = vec3(-1.0e6);
+  for (int y = -1; y <= 1; ++y)
+  {
+    for (int x = -1; x <= 1; ++x)
+    {
+      vec2 centre = baseTexel + vec2(float(x), float(y)) + 0.5;
+      vec3 texel = texture2D(SourceTexture, centre * SourceTexelSize).rgb;
+      vec2 offset = (centre - sourcePos) * SourceScale;
+      float texelWeight = exp(-2.29 * dot(offset, offset));
+      current += texel * texelWeight;
+      weight += texelWeight;
+      low = min(low, texel);
+      high = max(high, texel);
+    }
+  }
+  current /= weight;
+
+  // Where the samples fell far from this texel, trust the history more
+  float blend = Blend < 1.0 ? Blend * min(weight, 1.0) : 1.0;
+
+  vec4 previous = ReprojectHistory(texcoord0);
+  if (previous.z <= 0.0 || !all(equal(clamp(previous.xy, vec2(0.0), vec2(1.0)), previous.xy)))
+    gl_FragColor = vec4(current, 1.0);
+  else
+    gl_FragColor = vec4(mix(clamp(texture2D(HistoryTexture, previous.xy).rgb, low, high), current, blend), 1.0);
+}
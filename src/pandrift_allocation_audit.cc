@@ -0,0 +1,249 @@
+/*################################################################
+Pandrift
+Copyright (c) 2013 Warren Moore
+
+This software may be redistributed under the terms of the MIT License.
+See the file LICENSE for details.
+################################################################*/
+
+#include "pandrift_allocation_audit.hh"
+#include <string.h>
+#include <stdlib.h>
+#include <algorithm>
+
+using namespace std;
+
+namespace
+{
+
+const int cMaxSites = 64;
+// What the audited thread allocates outside any site
+const int cUntaggedSite = 0;
+const char *cUntaggedSiteName = "untagged";
+
+struct Site
+{
+  const char *name;
+  bool expected;
+  // Since the last end_frame(), from any thread
+  volatile unsigned long frame_allocations;
+  volatile unsigned long frame_frees;
+  volatile unsigned long frame_bytes;
+  // Since the last reset()
+  unsigned long allocations;
+  unsigned long frees;
+  unsigned long bytes;
+  unsigned long max_frame_allocations;
+  int allocating_frames;
+};
+
+// Static storage, so counting never allocates
+Site sites[cMaxSites] = { { cUntaggedSiteName, false } };
+volatile int site_count = 1;
+volatile int register_lock = 0;
+int frames = 0;
+int allocating_frames = 0;
+
+// The site the calling thread's allocations go to, if any
+__thread int current_site = -1;
+__thread bool audited_thread = false;
+
+#ifdef PANDRIFT_ALLOCATION_AUDIT
+
+int get_counted_site()
+{
+  if (current_site >= 0)
+    return current_site;
+
+  return audited_thread ? cUntaggedSite : -1;
+}
+
+void count_allocation(size_t bytes)
+{
+  const int cSite = get_counted_site();
+  if (cSite < 0)
+    return;
+
+  __sync_fetch_and_add(&sites[cSite].frame_allocations, 1);
+  __sync_fetch_and_add(&sites[cSite].frame_bytes, bytes);
+}
+
+void count_free(void *ptr)
+{
+  const int cSite = get_counted_site();
+  if (cSite < 0 || !ptr)
+    return;
+
+  __sync_fetch_and_add(&sites[cSite].frame_frees, 1);
+}
+
+#endif
+
+}
+
+#ifdef PANDRIFT_ALLOCATION_AUDIT
+
+// glibc's own entry points, which these wrap
+extern "C" void *__libc_malloc(size_t bytes);
+extern "C" void *__libc_calloc(size_t count, size_t bytes);
+extern "C" void *__libc_realloc(void *ptr, size_t bytes);
+extern "C" void __libc_free(void *ptr);
+
+// Linked into the executable, these take the place of libc's for Panda too.
+// Panda must use the system allocator rather than its own dlmalloc.
+extern "C" void *malloc(size_t bytes)
+{
+  count_allocation(bytes);
+  return __libc_malloc(bytes);
+}
+
+extern "C" void *calloc(size_t count, size_t bytes)
+{
+  count_allocation(count * bytes);
+  return __libc_calloc(count, bytes);
+}
+
+extern "C" void *realloc(void *ptr, size_t bytes)
+{
+  count_allocation(bytes);
+  return __libc_realloc(ptr, bytes);
+}
+
+extern "C" void free(void *ptr)
+{
+  count_free(ptr);
+  __libc_free(ptr);
+}
+
+#endif
+
+namespace pandrift
+{
+
+bool AllocationAudit::is_compiled()
+{
+#ifdef PANDRIFT_ALLOCATION_AUDIT
+  return true;
+#else
+  return false;
+#endif
+}
+
+void AllocationAudit::audit_thread()
+{
+  audited_thread = true;
+}
+
+int AllocationAudit::register_site(const char *name, bool expected)
+{
+  while (__sync_lock_test_and_set(&register_lock, 1))
+    ;
+
+  int site = 0;
+  while (site < site_count && strcmp(sites[site].name, name) != 0)
+    ++site;
+
+  if (site == site_count)
+  {
+    if (site_count < cMaxSites)
+    {
+      sites[site].name = name;
+      sites[site].expected = expected;
+      __sync_synchronize();
+      ++site_count;
+    }
+    else
+    {
+      // Out of room; the site goes uncounted
+      site = -1;
+    }
+  }
+
+  __sync_lock_release(&register_lock);
+
+  return site;
+}
+
+void AllocationAudit::end_frame()
+{
+  bool allocated = false;
+  for (int site = 0; site < site_count; ++site)
+  {
+    Site &frame_site = sites[site];
+    const unsigned long cAllocations = __sync_lock_test_and_set(&frame_site.frame_allocations, 0);
+    frame_site.frees += __sync_lock_test_and_set(&frame_site.frame_frees, 0);
+    frame_site.bytes += __sync_lock_test_and_set(&frame_site.frame_bytes, 0);
+
+    if (0 == cAllocations)
+      continue;
+
+    frame_site.allocations += cAllocations;
+    frame_site.max_frame_allocations = max(frame_site.max_frame_allocations, cAllocations);
+    ++frame_site.allocating_frames;
+
+    if (!frame_site.expected)
+      allocated = true;
+  }
+
+  ++frames;
+  if (allocated)
+    ++allocating_frames;
+}
+
+void AllocationAudit::reset()
+{
+  for (int site = 0; site < site_count; ++site)
+  {
+    Site &frame_site = sites[site];
+    frame_site.frame_allocations = 0;
+    frame_site.frame_frees = 0;
+    frame_site.frame_bytes = 0;
+    frame_site.allocations = 0;
+    frame_site.frees = 0;
+    frame_site.bytes = 0;
+    frame_site.max_frame_allocations = 0;
+    frame_site.allocating_frames = 0;
+  }
+
+  frames = 0;
+  allocating_frames = 0;
+}
+
+int AllocationAudit::get_frames()
+{
+  return frames;
+}
+
+int AllocationAudit::get_allocating_frames()
+{
+  return allocating_frames;
+}
+
+void AllocationAudit::report(ostream &out)
+{
+  for (int site = 0; site < site_count; ++site)
+  {
+    const Site &frame_site = sites[site];
+    out << frame_site.name << (frame_site.expected ? " (expected)" : "")
+        << ": " << frame_site.allocations << " allocations, "
+        << frame_site.frees << " frees, "
+        << frame_site.bytes << " bytes in "
+        << frame_site.allocating_frames << "/" << frames << " frames, at most "
+        << frame_site.max_frame_allocations << " a frame" << endl;
+  }
+}
+
+AllocationAudit::Scope::Scope(int site) :
+  previous_site_(current_site)
+{
+  // An uncounted site leaves the enclosing one counting
+  if (site >= 0)
+    current_site = site;
+}
+
+AllocationAudit::Scope::~Scope()
+{
+  current_site = previous_site_;
+}
+
+}
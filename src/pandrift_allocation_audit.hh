@@ -0,0 +1,91 @@
+/*################################################################
+Pandrift
+Copyright (c) 2013 Warren Moore
+
+This software may be redistributed under the terms of the MIT License.
+See the file LICENSE for details.
+################################################################*/
+
+#ifndef PANDRIFT_ALLOCATION_AUDIT_HEADER
+#define PANDRIFT_ALLOCATION_AUDIT_HEADER
+
+#include "pandrift.hh"
+#include <iostream>
+
+// The audit stands in for glibc's malloc, so elsewhere, as on OS X, it
+// compiles out and is_compiled() says so
+#if defined(PANDRIFT_ALLOCATION_AUDIT) && !defined(__GLIBC__)
+#undef PANDRIFT_ALLOCATION_AUDIT
+#endif
+
+// Attribute the heap allocations made in the rest of the enclosing scope to a
+// named call site, rather than to the untagged total. An expected site is reported but doesn't fail the audit,
+// for allocations Panda makes that we can't avoid, such as composing the
+// transform of a moving camera. Both compile to nothing unless the build
+// defines PANDRIFT_ALLOCATION_AUDIT.
+#ifdef PANDRIFT_ALLOCATION_AUDIT
+#define PANDRIFT_AUDIT_JOIN(a, b) a##b
+#define PANDRIFT_AUDIT_SCOPE(name, expected, line) \
+  static const int PANDRIFT_AUDIT_JOIN(cAuditSite, line) = pandrift::AllocationAudit::register_site(name, expected); \
+  pandrift::AllocationAudit::Scope PANDRIFT_AUDIT_JOIN(audit_scope_, line)(PANDRIFT_AUDIT_JOIN(cAuditSite, line))
+#define PANDRIFT_AUDIT_SITE(name) PANDRIFT_AUDIT_SCOPE(name, false, __LINE__)
+#define PANDRIFT_AUDIT_EXPECTED(name) PANDRIFT_AUDIT_SCOPE(name, true, __LINE__)
+#else
+#define PANDRIFT_AUDIT_SITE(name)
+#define PANDRIFT_AUDIT_EXPECTED(name)
+#endif
+
+namespace pandrift
+{
+
+// Counts the heap allocations and frees made each frame, by standing in for
+// malloc. Every allocation on the audited thread counts, with sites only
+// saying where it came from; other threads count inside sites. Frees count as
+// churn alongside the allocations.
+//
+// Reference count churn isn't counted. ReferenceCount's ref and unref are
+// inline atomics compiled into Panda, with nothing to stand in for short of
+// rebuilding Panda. They don't touch the heap until a count reaches zero,
+// and then the free is counted here.
+class AllocationAudit
+{
+public:
+  // Whether the build counts anything
+  static bool is_compiled();
+
+  // Count everything the calling thread allocates, in a site or not
+  static void audit_thread();
+
+  // Returns the site's index, the same for every registration of a name
+  static int register_site(const char *name, bool expected);
+
+  // Fold the counts since the last call into the totals
+  static void end_frame();
+
+  // Forget the totals, as once warmed up
+  static void reset();
+
+  static int get_frames();
+
+  // Frames in which an unexpected site allocated
+  static int get_allocating_frames();
+
+  // Per-site totals, one line each
+  static void report(std::ostream &out);
+
+  // Attributes the current thread's allocations to a site while in scope
+  class Scope
+  {
+  public:
+    Scope(int site);
+
+    ~Scope();
+
+  private:
+    int previous_site_;
+  };
+};
+
+}
+
+#endif
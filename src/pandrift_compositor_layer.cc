@@ -0,0 +1,282 @@
+/*################################################################
+Pandrift
+Copyright (c) 2013 Warren Moore
+
+This software may be redistributed under the terms of the MIT License.
+See the file LICENSE for details.
+################################################################*/
+
+#include "pandrift_compositor_layer.hh"
+#include "pandrift_allocation_audit.hh"
+#include "asyncTaskManager.h"
+#include "frameBufferProperties.h"
+#include "orthographicLens.h"
+#include "camera.h"
+#include "colorBlendAttrib.h"
+#include "colorWriteAttrib.h"
+#include "renderState.h"
+#include "trueClock.h"
+#include <algorithm>
+
+using namespace std;
+
+namespace
+{
+
+const char *cLayerCameraName = "compositor layer camera";
+const char *cLayerAlphaCameraName = "compositor layer alpha camera";
+const char *cLayerTaskName = "pandrift compositor layer";
+const float cLayerLensNear = -1000;
+const float cLayerLensFar = 1000;
+const int cLayerBufferSort = -90;
+// Above any attribs on the layer's scene
+const int cLayerPassPriority = 1000;
+
+}
+
+namespace pandrift
+{
+
+CompositorLayer::CompositorLayer(const string &name) :
+  name_(name),
+  dirty_(true),
+  suspended_(false),
+  update_period_(0),
+  last_update_time_(0),
+  update_count_(0)
+{
+  for (int eye = 0; eye <= 1; ++eye)
+    // Default to the whole layer over the whole eye
+    placement_[eye].set(1.0, 1.0, 0.0, 0.0);
+}
+
+CompositorLayer::~CompositorLayer()
+{
+  destroy();
+}
+
+bool CompositorLayer::create(GraphicsOutput *host_ptr,
+                             NodePath scene_np,
+                             int width,
+                             int height,
+                             const LVecBase2f &film_size)
+{
+  assert(!is_created());
+
+  if (!host_ptr || scene_np.is_empty() || width <= 0 || height <= 0)
+    return false;
+
+  // The layer needs alpha to be composited over the scene
+  if (render_target_pool_ptr_)
+  {
+    RenderTargetPool::Format format;
+    format.alpha = true;
+    format.depth_texture = false;
+
+    RenderTargetPool::RenderTarget target;
+    if (render_target_pool_ptr_->acquire(host_ptr, name_, width, height, format, target))
+      buffer_ptr_ = target.buffer_ptr;
+  }
+  else
+  {
+    FrameBufferProperties fb_props;
+    fb_props.set_rgb_color(true);
+    fb_props.set_color_bits(24);
+    fb_props.set_alpha_bits(8);
+
+    buffer_ptr_ = host_ptr->make_texture_buffer(name_, width, height, NULL, false, &fb_props);
+  }
+
+  if (!buffer_ptr_)
+  {
+    pandrift_cat.error() << "create: Unable to create layer buffer";
+    return false;
+  }
+
+  // Render after the scene buffers, into a transparent background
+  buffer_ptr_->set_sort(cLayerBufferSort);
+  buffer_ptr_->set_clear_color(LColor(0.0, 0.0, 0.0, 0.0));
+
+  PT(Texture) texture_ptr = buffer_ptr_->get_texture();
+  texture_ptr->set_magfilter(Texture::FT_linear);
+  texture_ptr->set_minfilter(Texture::FT_linear);
+  texture_ptr->set_wrap_u(Texture::WM_clamp);
+  texture_ptr->set_wrap_v(Texture::WM_clamp);
+
+  PT(OrthographicLens) lens_ptr = new OrthographicLens();
+  lens_ptr->set_film_size(film_size);
+  lens_ptr->set_near_far(cLayerLensNear, cLayerLensFar);
+
+  // The warp composites the layer as premultiplied. Alpha blending gives
+  // premultiplied colour, but squares a lone draw's alpha, and Panda has no
+  // separate alpha blend. So draw the scene twice: colour alpha blended,
+  // then alpha alone blended as premultiplied (ONE, ONE_MINUS_SRC_ALPHA).
+  PT(Camera) camera_ptr = new Camera(cLayerCameraName);
+  camera_ptr->set_lens(lens_ptr);
+  camera_ptr->set_initial_state(RenderState::make(ColorWriteAttrib::make(ColorWriteAttrib::C_rgb),
+                                                  cLayerPassPriority));
+
+  PT(Camera) alpha_camera_ptr = new Camera(cLayerAlphaCameraName);
+  alpha_camera_ptr->set_lens(lens_ptr);
+  alpha_camera_ptr->set_initial_state(
+    RenderState::make(ColorWriteAttrib::make(ColorWriteAttrib::C_alpha),
+                      ColorBlendAttrib::make(ColorBlendAttrib::M_add,
+                                             ColorBlendAttrib::O_one,
+                                             ColorBlendAttrib::O_one_minus_incoming_alpha),
+                      cLayerPassPriority));
+
+  // Attach the cameras to the scene so its transform applies
+  camera_np_ = NodePath(camera_ptr);
+  camera_np_.reparent_to(scene_np);
+  alpha_camera_np_ = NodePath(alpha_camera_ptr);
+  alpha_camera_np_.reparent_to(scene_np);
+
+  region_ptr_ = buffer_ptr_->make_display_region();
+  region_ptr_->set_camera(camera_np_);
+
+  // Clear depth again, so the alpha pass draws what the colour pass drew
+  alpha_region_ptr_ = buffer_ptr_->make_display_region();
+  alpha_region_ptr_->set_sort(1);
+  alpha_region_ptr_->set_clear_depth_active(true);
+  alpha_region_ptr_->set_camera(alpha_camera_np_);
+
+  update_task_ptr_ = new GenericAsyncTask(cLayerTaskName, &update_task, this);
+  AsyncTaskManager::get_global_ptr()->add(update_task_ptr_);
+
+  // Draw the first frame
+  dirty_ = true;
+  update();
+
+  return true;
+}
+
+void CompositorLayer::destroy()
+{
+  if (update_task_ptr_)
+  {
+    update_task_ptr_->remove();
+    update_task_ptr_ = NULL;
+  }
+
+  if (region_ptr_)
+  {
+    buffer_ptr_->remove_display_region(region_ptr_);
+    region_ptr_ = NULL;
+    buffer_ptr_->remove_display_region(alpha_region_ptr_);
+    alpha_region_ptr_ = NULL;
+  }
+
+  if (!camera_np_.is_empty())
+  {
+    camera_np_.remove_node();
+    alpha_camera_np_.remove_node();
+  }
+
+  if (buffer_ptr_)
+  {
+    if (render_target_pool_ptr_)
+      render_target_pool_ptr_->release(buffer_ptr_);
+    else
+      buffer_ptr_->get_engine()->remove_window(buffer_ptr_);
+    buffer_ptr_ = NULL;
+  }
+}
+
+bool CompositorLayer::is_created()
+{
+  return buffer_ptr_ != NULL;
+}
+
+void CompositorLayer::set_render_target_pool(boost::shared_ptr<RenderTargetPool> render_target_pool_ptr)
+{
+  assert(!is_created());
+
+  render_target_pool_ptr_ = render_target_pool_ptr;
+}
+
+void CompositorLayer::set_dirty()
+{
+  dirty_ = true;
+}
+
+void CompositorLayer::set_update_period(double seconds)
+{
+  update_period_ = max(0.0, seconds);
+}
+
+void CompositorLayer::set_placement(int eye, const LVecBase4f &placement)
+{
+  placement_[eye] = placement;
+}
+
+const LVecBase4f &CompositorLayer::get_placement(int eye)
+{
+  return placement_[eye];
+}
+
+Texture *CompositorLayer::get_texture()
+{
+  if (!buffer_ptr_)
+    return NULL;
+
+  return buffer_ptr_->get_texture();
+}
+
+int CompositorLayer::get_update_count()
+{
+  return update_count_;
+}
+
+LColor CompositorLayer::composite_reference(const LColor &scene,
+                                            const LColor *draws_ptr,
+                                            int draw_count)
+{
+  // Cleared to transparent black, then the two passes
+  LColor layer(0.0, 0.0, 0.0, 0.0);
+  for (int draw = 0; draw < draw_count; ++draw)
+  {
+    const LColor &cDraw = draws_ptr[draw];
+    for (int channel = 0; channel < 3; ++channel)
+      layer[channel] = cDraw[channel] * cDraw[3] + layer[channel] * (1.0 - cDraw[3]);
+    layer[3] = cDraw[3] + layer[3] * (1.0 - cDraw[3]);
+  }
+
+  // CompositeLayer in pandrift-composite.glsl
+  LColor composited = scene;
+  for (int channel = 0; channel < 3; ++channel)
+    composited[channel] = scene[channel] * (1.0 - layer[3]) + layer[channel];
+
+  return composited;
+}
+
+AsyncTask::DoneStatus CompositorLayer::update_task(GenericAsyncTask *task_ptr, void *data_ptr)
+{
+  CompositorLayer *layer_ptr = reinterpret_cast<CompositorLayer *>(data_ptr);
+  layer_ptr->update();
+
+  return AsyncTask::DS_cont;
+}
+
+void CompositorLayer::update()
+{
+  PANDRIFT_AUDIT_SITE("CompositorLayer::update");
+
+  if (suspended_)
+    return;
+
+  const double cTime = TrueClock::get_global_ptr()->get_short_time();
+
+  if (!dirty_ && (update_period_ <= 0 || cTime - last_update_time_ < update_period_))
+    return;
+
+  // Render this frame only, then the buffer goes back to sleep and the
+  // warp keeps sampling the texture
+  buffer_ptr_->set_active(true);
+  buffer_ptr_->set_one_shot(true);
+
+  dirty_ = false;
+  last_update_time_ = cTime;
+  ++update_count_;
+}
+
+}
@@ -0,0 +1,99 @@
+/*################################################################
+Pandrift
+Copyright (c) 2013 Warren Moore
+
+This software may be redistributed under the terms of the MIT License.
+See the file LICENSE for details.
+################################################################*/
+
+#ifndef PANDRIFT_COMPOSITOR_LAYER_HEADER
+#define PANDRIFT_COMPOSITOR_LAYER_HEADER
+
+#include "pandrift.hh"
+#include "pandrift_render_target_pool.hh"
+#include "graphicsOutput.h"
+#include "genericAsyncTask.h"
+#include "nodePath.h"
+#include "texture.h"
+#include "lvecBase2.h"
+#include "lvecBase4.h"
+#include "luse.h"
+#include "boost/shared_ptr.hpp"
+
+namespace pandrift
+{
+
+// A quad composited over the eye views inside the warp pass. The layer
+// renders its scene through an orthographic camera into its own texture,
+// only when marked dirty or when its update period has elapsed.
+class CompositorLayer
+{
+public:
+  CompositorLayer(const std::string &name);
+
+  ~CompositorLayer();
+
+  // Draw the layer's buffer from a pool, rather than making its own
+  void set_render_target_pool(boost::shared_ptr<RenderTargetPool> render_target_pool_ptr);
+
+  // Render the scene under scene_np over the film rectangle centred on its origin
+  bool create(GraphicsOutput *host_ptr,
+              NodePath scene_np,
+              int width,
+              int height,
+              const LVecBase2f &film_size);
+
+  void destroy();
+
+  bool is_created();
+
+  // Render the layer again on the next frame
+  void set_dirty();
+
+  // Hold off rendering, keeping the texture, until resumed. Marking the
+  // layer dirty meanwhile renders it on resuming.
+  void set_suspended(bool suspended);
+
+  // Also render the layer at this interval. Zero renders only when dirty.
+  void set_update_period(double seconds);
+
+  // Maps an eye's view UVs to layer UVs as (scale u, scale v, offset u, offset v)
+  void set_placement(int eye, const LVecBase4f &placement);
+
+  const LVecBase4f &get_placement(int eye);
+
+  Texture *get_texture();
+
+  int get_update_count();
+
+  // The layer passes and the warp's composite on the CPU, for draws of
+  // unpremultiplied colours in order over a scene pixel. Matches the blend
+  // state and the shader, to check translucent layers without a GPU.
+  static LColor composite_reference(const LColor &scene,
+                                    const LColor *draws_ptr,
+                                    int draw_count);
+
+private:
+  static AsyncTask::DoneStatus update_task(GenericAsyncTask *task_ptr, void *data_ptr);
+
+  void update();
+
+  std::string name_;
+  bool dirty_;
+  bool suspended_;
+  double update_period_;
+  double last_update_time_;
+  int update_count_;
+  boost::shared_ptr<RenderTargetPool> render_target_pool_ptr_;
+  LVecBase4f placement_[2];
+  PT(GraphicsOutput) buffer_ptr_;
+  PT(DisplayRegion) region_ptr_;
+  PT(DisplayRegion) alpha_region_ptr_;
+  NodePath camera_np_;
+  NodePath alpha_camera_np_;
+  PT(GenericAsyncTask) update_task_ptr_;
+};
+
+}
+
+#endif
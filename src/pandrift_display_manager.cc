@@ -7,12 +7,30 @@ See the file LICENSE for details.
 ################################################################*/
 
 #include "pandrift_display_manager.hh"
+#include "pandrift_allocation_audit.hh"
 #include "orthographicLens.h"
+#include "perspectiveLens.h"
 #include <iostream>
 #include "cardMaker.h"
 #include "lmatrix.h"
 #include <math.h>
 #include "matrixLens.h"
+#include "callbackObject.h"
+#include "callbackData.h"
+#include "planeNode.h"
+#include "clipPlaneAttrib.h"
+#include "renderState.h"
+#include "shaderAttrib.h"
+#include "lodNode.h"
+#include "asyncTaskManager.h"
+#include "displayRegionDrawCallbackData.h"
+#include "sceneSetup.h"
+#include "virtualFileSystem.h"
+#include "config_util.h"
+#include <algorithm>
+#include <sstream>
+#include <iomanip>
+#include <string.h>
 
 using namespace std;
 
@@ -32,13 +50,148 @@ const char *cRenderCameraName = "render 2d camera";
 const char *cRenderCardRootName = "render 2d cards";
 const char *cRenderShaderCardName = "render 2d shader card";
 const char *cSceneBufferName = "scene buffer";
+const char *cHistoryBufferName = "history buffer";
 const char *cSceneCameraRootName = "scene 3d camera root";
 const char *cSceneCameraName = "scene 3d camera";
-const float cSceneCameraNear = 0.01;
-const float cSceneCameraFar = 2000.0;
-const float cDefaultFOV2D = 85.0 * (M_PI / 180.0);
-const float cHUDDistance = 0.8;
-const char *cHUDCameraName = "scene 2d camera";
+const char *cSceneCullPlaneName = "scene 3d cull plane";
+const char *cHUDLayerName = "hud layer";
+const char *cFarFieldBufferName = "far field buffer";
+const char *cFarFieldCameraName = "far field camera";
+const char *cFarFieldCardRootName = "far field cards";
+const char *cFarFieldCardName = "far field card";
+const char *cFarFieldCardCameraName = "far field card camera";
+const char *cFarFieldSplitPlaneName = "far field split plane";
+// After the occlusion queries, before the eyes draw over it
+const int cFarFieldBufferSort = -105;
+// Behind the eye's own scene region
+const int cFarFieldCardRegionSort = -1;
+const int cMaxLayers = 2;
+const char *cWarpTaskName = "pandrift warp update";
+// Just before the framework's igLoop renders the frame
+const int cWarpTaskSort = 48;
+const char *cCaptureCameraName = "capture camera";
+const int cCaptureSort = 1000;
+const int cCaptureReadbackDepth = 4;
+const int cCaptureQueueDepth = 8;
+const int cCaptureFrameRate = 60;
+const char *cPublishCameraName = "publish camera";
+// Just after the capture, if both are running
+const int cPublishSort = 1001;
+const int cPublishReadbackDepth = 2;
+const int cPublishRingSlots = 3;
+// While nobody is looking the sensor and the frame rate are turned down
+const int cIdleSensorReportRate = 50;
+const double cLowPowerFramePeriod = 0.1;
+// Updates after creation before the scene can be held: the frame of the
+// first update draws it, so a held scene is never an uninitialised buffer
+const int cScenePrimeUpdates = 2;
+const int cDistortionTableSize = 256;
+// Of the refresh period the panel spends scanning out, rather than blanking
+const float cScanoutFraction = 0.9;
+// Never drop below this fraction of the central detail
+const float cMinimumEccentricityDetail = 0.25;
+const char *cDistortionCacheFilePrefix = "pandrift-distortion-";
+const char *cDistortionCacheFileSuffix = ".bin";
+const char *cLookupTextureName = "warp lookup";
+const char *cCompositeShaderFileName = "pandrift-composite.glsl";
+const char *cPeripheryShaderFileName = "pandrift-periphery-lod.glsl";
+
+class CaptureCallback : public CallbackObject
+{
+public:
+  CaptureCallback(pandrift::FrameCapture *capture_ptr) :
+    capture_ptr_(capture_ptr)
+  {
+  }
+
+  virtual void do_callback(CallbackData *cbdata)
+  {
+    // Draw the region as normal then queue the read of the whole target
+    cbdata->upcall();
+    capture_ptr_->capture_frame();
+  }
+
+private:
+  pandrift::FrameCapture *capture_ptr_;
+};
+
+class PublishCallback : public CallbackObject
+{
+public:
+  PublishCallback(pandrift::FramePublisher *publisher_ptr) :
+    publisher_ptr_(publisher_ptr)
+  {
+  }
+
+  virtual void do_callback(CallbackData *cbdata)
+  {
+    // Draw the region as normal then queue the read of the eye buffer
+    cbdata->upcall();
+    publisher_ptr_->publish_frame();
+  }
+
+private:
+  pandrift::FramePublisher *publisher_ptr_;
+};
+
+class DrawnPoseCallback : public CallbackObject
+{
+public:
+  DrawnPoseCallback(pandrift::FramePublisher *publisher_ptr, int eye) :
+    publisher_ptr_(publisher_ptr),
+    eye_(eye)
+  {
+  }
+
+  virtual void do_callback(CallbackData *cbdata)
+  {
+    // The camera transform the eye was culled and drawn with
+    DisplayRegionDrawCallbackData *draw_data_ptr = DCAST(DisplayRegionDrawCallbackData, cbdata);
+    publisher_ptr_->set_drawn_pose(eye_, draw_data_ptr->get_scene_setup()->get_camera_transform()->get_mat());
+    cbdata->upcall();
+  }
+
+private:
+  pandrift::FramePublisher *publisher_ptr_;
+  int eye_;
+};
+
+bool read_shader_source(const string &file_name, string &source)
+{
+  // Found as Shader::load finds a file
+  VirtualFileSystem *vfs_ptr = VirtualFileSystem::get_global_ptr();
+  Filename path(file_name);
+  vfs_ptr->resolve_filename(path, get_model_path().get_value());
+
+  if (!vfs_ptr->read_file(path, source, true))
+  {
+    pandrift_cat.error() << "read_shader_source: Unable to read " << file_name;
+    return false;
+  }
+
+  return true;
+}
+
+// Panda's GLSL has no #include, so shared functions are prepended to the
+// fragment shader
+PT(Shader) load_shader(const string &vertex_file_name,
+                       const string &shared_file_name,
+                       const string &fragment_file_name)
+{
+  string vertex_source, shared_source, fragment_source;
+  if (!read_shader_source(vertex_file_name, vertex_source) ||
+      !read_shader_source(shared_file_name, shared_source) ||
+      !read_shader_source(fragment_file_name, fragment_source))
+    return NULL;
+
+  return Shader::make(Shader::SL_GLSL, vertex_source, shared_source + "\n" + fragment_source);
+}
+
+// With the layer compositing and scanout compensation the warp fragment shaders share
+PT(Shader) load_warp_shader(const string &vertex_file_name, const string &fragment_file_name)
+{
+  return load_shader(vertex_file_name, cCompositeShaderFileName, fragment_file_name);
+}
 
 }
 
@@ -49,13 +202,57 @@ DisplayManager::DisplayManager(PT(WindowFramework) window_ptr) :
   warp_mode_(cShader),
   scene_width_(cDefaultSceneWidth),
   scene_height_(cDefaultSceneHeight),
+  scene_layout_(cLayoutSideBySide),
   lookup_width_(cDefaultLookupWidth),
   lookup_height_(cDefaultLookupHeight),
+  tight_culling_(false),
+  reprojection_(false),
+  upscale_render_scale_(1.0),
+  eccentricity_lod_(false),
+  guard_band_culling_(false),
+  occlusion_culling_(false),
+  far_field_distance_(0),
+  scanout_compensation_(false),
+  loading_(false),
+  display_state_(cStateActive),
+  enabled_(false),
+  frame_rate_limited_(false),
+  unlimited_clock_mode_(ClockObject::M_normal),
   window_ptr_(window_ptr),
   created_(false),
+  distortion_table_version_(0),
   render_root_np_(cRenderRootName),
-  scene_camera_root_np_(cSceneCameraRootName)
+  render_target_pool_ptr_(new RenderTargetPool()),
+  scene_camera_root_np_(cSceneCameraRootName),
+  lod_refresh_(true),
+  scene_prime_updates_(0),
+  guard_band_culler_ptr_(new GuardBandCuller()),
+  occlusion_culler_ptr_(new OcclusionCuller()),
+  hud_layer_ptr_(new CompositorLayer(cHUDLayerName)),
+  distortion_table_(cDistortionTableSize)
 {
+  // The HUD is always the first layer
+  hud_layer_ptr_->set_render_target_pool(render_target_pool_ptr_);
+  layers_.push_back(hud_layer_ptr_);
+  occlusion_culler_ptr_->set_render_target_pool(render_target_pool_ptr_);
+
+  // No turn, until the warp has a rate
+  scan_rotation_input_ = PTA_LVecBase4f::empty_array(1);
+  scan_rotation_input_[0] = LVecBase4f(0, 0, 1, 0);
+
+  for (int eye = 0; eye <= 1; ++eye)
+  {
+    // Zero size follows the scene resolution
+    eye_width_[eye] = 0;
+    eye_height_[eye] = 0;
+
+    upscaler_ptr_[eye].reset(new TemporalUpscaler(cHistoryBufferName));
+    upscaler_ptr_[eye]->set_render_target_pool(render_target_pool_ptr_);
+
+    pose_delta_input_[eye] = PTA_LMatrix4f::empty_array(1);
+    pose_delta_input_[eye][0] = LMatrix4f::ident_mat();
+  }
+
 //  pandrift_cat->set_severity(NS_debug);
 }
 
@@ -86,6 +283,37 @@ void DisplayManager::set_scene_resolution(int width, int height)
   }
 }
 
+void DisplayManager::set_scene_layout(SceneLayout scene_layout)
+{
+  scene_layout_ = scene_layout;
+}
+
+void DisplayManager::set_eye_resolution(int eye, int width, int height)
+{
+  if ((cEyeLeft == eye || cEyeRight == eye) && width > 0 && height > 0)
+  {
+    eye_width_[eye] = width;
+    eye_height_[eye] = height;
+  }
+}
+
+void DisplayManager::set_render_target_pool(boost::shared_ptr<RenderTargetPool> render_target_pool_ptr)
+{
+  if (created_ || !render_target_pool_ptr)
+    return;
+
+  render_target_pool_ptr_ = render_target_pool_ptr;
+  hud_layer_ptr_->set_render_target_pool(render_target_pool_ptr_);
+  occlusion_culler_ptr_->set_render_target_pool(render_target_pool_ptr_);
+  for (int eye = 0; eye <= 1; ++eye)
+    upscaler_ptr_[eye]->set_render_target_pool(render_target_pool_ptr_);
+}
+
+boost::shared_ptr<RenderTargetPool> DisplayManager::get_render_target_pool()
+{
+  return render_target_pool_ptr_;
+}
+
 void DisplayManager::set_lookup_resolution(int width, int height)
 {
   if (width > 0 && height > 0)
@@ -95,6 +323,81 @@ void DisplayManager::set_lookup_resolution(int width, int height)
   }
 }
 
+void DisplayManager::set_distortion_cache_directory(const string &directory)
+{
+  distortion_cache_directory_ = directory;
+}
+
+void DisplayManager::set_tight_culling(bool tight_culling)
+{
+  tight_culling_ = tight_culling;
+}
+
+void DisplayManager::set_reprojection(bool reprojection)
+{
+  reprojection_ = reprojection;
+}
+
+void DisplayManager::set_eccentricity_lod(bool eccentricity_lod)
+{
+  eccentricity_lod_ = eccentricity_lod;
+}
+
+PT(Shader) DisplayManager::load_periphery_shader(const string &vertex_file_name,
+                                                 const string &fragment_file_name)
+{
+  return load_shader(vertex_file_name, cPeripheryShaderFileName, fragment_file_name);
+}
+
+void DisplayManager::set_guard_band_culling(bool guard_band_culling)
+{
+  guard_band_culling_ = guard_band_culling;
+}
+
+boost::shared_ptr<GuardBandCuller> DisplayManager::get_guard_band_culler()
+{
+  return guard_band_culler_ptr_;
+}
+
+void DisplayManager::set_occlusion_culling(bool occlusion_culling)
+{
+  occlusion_culling_ = occlusion_culling;
+}
+
+boost::shared_ptr<OcclusionCuller> DisplayManager::get_occlusion_culler()
+{
+  return occlusion_culler_ptr_;
+}
+
+void DisplayManager::set_far_field_distance(float distance)
+{
+  far_field_distance_ = max(0.0f, distance);
+}
+
+void DisplayManager::set_scanout_compensation(bool scanout_compensation)
+{
+  scanout_compensation_ = scanout_compensation;
+}
+
+void DisplayManager::set_eye_source(Texture *texture_ptr)
+{
+  eye_source_ptr_ = texture_ptr;
+}
+
+void DisplayManager::set_upscale_render_scale(float render_scale)
+{
+  if (render_scale > 0 && render_scale <= 1.0)
+    upscale_render_scale_ = render_scale;
+}
+
+float DisplayManager::get_cull_coverage(int eye)
+{
+  if (!tight_culling_ || scene_camera_np_[eye].is_empty())
+    return 1.0;
+
+  return scene_footprint_[eye].coverage;
+}
+
 NodePath DisplayManager::get_camera_root()
 {
   return scene_camera_root_np_;
@@ -128,10 +431,13 @@ bool DisplayManager::create_display(bool enabled)
     return false;
   }
 
-  // Create the common components of the display
-  bool created = create_scene_buffer() &&
-                 create_scene_cameras() &&
-                 create_hud_cameras() &&
+  // Take the parameter snapshot the display will be built from
+  parameters_ptr_ = rift_manager_ptr_->get_stereo_parameters();
+
+  // Create the common components of the display. An eye source stands in
+  // for the scene buffer and everything drawing into it.
+  bool created = (eye_source_ptr_ || (create_scene_buffer() && create_scene_cameras() && create_far_field() && create_upscalers())) &&
+                 create_hud_layer() &&
                  create_render_region() &&
                  create_render_camera();
 
@@ -145,22 +451,27 @@ bool DisplayManager::create_display(bool enabled)
         create_shader_cards(render_root_np_);
 
         // Bind the scene texture to the shader cards
-        render_card_np_[cEyeLeft].set_texture(scene_buffer_ptr_->get_texture());
-        render_card_np_[cEyeRight].set_texture(scene_buffer_ptr_->get_texture());
+        render_card_np_[cEyeLeft].set_texture(get_eye_texture(cEyeLeft));
+        render_card_np_[cEyeRight].set_texture(get_eye_texture(cEyeRight));
+
+        // Apply the unwarped shader, which still composites the layers
+        created = apply_shader();
 
         break;
 
       case cShader:
       case cShaderChromaticAberration:
+      case cLookupTexture:
         // Create the shader cards under the render root
         create_shader_cards(render_root_np_);
 
         // Bind the scene texture to the shader cards
-        render_card_np_[cEyeLeft].set_texture(scene_buffer_ptr_->get_texture());
-        render_card_np_[cEyeRight].set_texture(scene_buffer_ptr_->get_texture());
+        render_card_np_[cEyeLeft].set_texture(get_eye_texture(cEyeLeft));
+        render_card_np_[cEyeRight].set_texture(get_eye_texture(cEyeRight));
 
-        // Apply the appropriate shader to the shader cards
-        created = apply_shader();
+        // The lookup mode samples the baked warp rather than evaluating it, then
+        // apply the appropriate shader to the shader cards
+        created = (cLookupTexture != warp_mode_ || create_lookup_texture()) && apply_shader();
 
         break;
 
@@ -172,6 +483,7 @@ bool DisplayManager::create_display(bool enabled)
   if (created)
   {
     created_ = true;
+    scene_prime_updates_ = cScenePrimeUpdates;
 
     set_enabled(enabled);
   }
@@ -183,193 +495,520 @@ bool DisplayManager::create_display(bool enabled)
   return created;
 }
 
+bool DisplayManager::refresh_stereo_parameters()
+{
+  if (!created_)
+    return false;
+
+  // Nothing to do unless the configuration has changed
+  boost::shared_ptr<const StereoParameters> parameters_ptr = rift_manager_ptr_->get_stereo_parameters();
+  if (parameters_ptr->version == parameters_ptr_->version)
+    return false;
+
+  parameters_ptr_ = parameters_ptr;
+
+  destroy_hud_layer();
+  if (!eye_source_ptr_)
+  {
+    destroy_far_field();
+    destroy_scene_cameras();
+    create_scene_cameras();
+    create_far_field();
+  }
+  create_hud_layer();
+
+  if (lookup_texture_ptr_)
+  {
+    destroy_lookup_texture();
+    create_lookup_texture();
+  }
+
+  if (render_shader_)
+    set_shader_inputs();
+
+  return true;
+}
+
 void DisplayManager::destroy_display()
 {
+  stop_capture();
+  stop_publishing();
   set_enabled(false);
 
+  // Leave the sensor reporting, and the frame loop running, at its usual rate
+  if (rift_manager_ptr_)
+    rift_manager_ptr_->set_sensor_report_rate(0);
+  limit_frame_rate(false);
+
   remove_shader();
+  destroy_lookup_texture();
+
+  // Give the LODNodes back their full detail
+  for (int node = 0; node < lod_nodes_.get_num_paths(); ++node)
+    if (!lod_nodes_.get_path(node).is_empty())
+      DCAST(LODNode, lod_nodes_.get_path(node).node())->set_lod_scale(1.0);
+  lod_nodes_.clear();
   destroy_shader_cards();
   destroy_render_camera();
   destroy_render_region();
-  destroy_hud_cameras();
+  destroy_hud_layer();
+  destroy_upscalers();
+  destroy_far_field();
   destroy_scene_cameras();
   destroy_scene_buffer();
 
   created_ = false;
 }
 
+void DisplayManager::shutdown()
+{
+  destroy_display();
+
+  // Nothing is in use once the display is gone
+  render_target_pool_ptr_->clear();
+}
+
 bool DisplayManager::is_enabled()
 {
-  return render_region_ptr_ && render_region_ptr_->is_active();
+  return render_region_ptr_ && enabled_;
 }
 
 void DisplayManager::set_enabled(bool enabled)
 {
-  if (is_enabled() == enabled)
-    return;
-
-  // As we want to ensure the default 2D region is deactivated,
-  // access the root to ensure it has been created.
-  NodePath scene_2d_root_np = window_ptr_->get_render_2d();
+  enabled_ = enabled;
 
-  // Enable/disable the default 3D display region
-  PT(DisplayRegion) region_3d_ptr = window_ptr_->get_display_region_3d();
-  assert(region_3d_ptr);
-  region_3d_ptr->set_active(!enabled);
+  apply_display_state();
+}
 
-  // Enabled/disable the default 2D display region
-  PT(DisplayRegion) region_2d_ptr = window_ptr_->get_display_region_2d();
-  assert(region_2d_ptr);
-  region_2d_ptr->set_active(!enabled);
+void DisplayManager::set_loading(bool loading)
+{
+  loading_ = loading;
 
-  // Enable/disable our render region
-  render_region_ptr_->set_active(enabled);
+  apply_display_state();
 }
 
-bool DisplayManager::create_render_region()
+bool DisplayManager::is_loading()
 {
-  assert(window_ptr_);
-  assert(!render_region_ptr_);
+  return loading_;
+}
 
-  // Create the render region: our display region filling the window
-  PT(GraphicsOutput) graphics_output_ptr = window_ptr_->get_graphics_output();
-  render_region_ptr_ = graphics_output_ptr->make_display_region();
+void DisplayManager::set_display_state(DisplayState state)
+{
+  if (state == display_state_)
+    return;
 
-  // Only activate through set_enabled(true)
-  render_region_ptr_->set_active(false);
+  display_state_ = state;
 
-  return render_region_ptr_;
+  apply_display_state();
 }
 
-void DisplayManager::destroy_render_region()
+DisplayManager::DisplayState DisplayManager::get_display_state()
 {
-  if (!render_region_ptr_)
-    return;
-
-  // Remove our render region from window
-  PT(GraphicsOutput) graphics_output_ptr = window_ptr_->get_graphics_output();
-  graphics_output_ptr->remove_display_region(render_region_ptr_);
-  render_region_ptr_ = NULL;
+  return display_state_;
 }
 
-bool DisplayManager::create_render_camera()
+bool DisplayManager::start_capture(const string &file_name, CaptureSource source)
 {
-  assert(render_camera_np_.is_empty());
+  if (!created_)
+  {
+    pandrift_cat.error() << "start_capture: Display not created";
+    return false;
+  }
 
-  // Create an orthographic lens [-1, 1] for the render region
-  PT(OrthographicLens) lens_ptr = new OrthographicLens();
-  lens_ptr->set_film_size(cOrthographicLensFilmWidth,
-                          cOrthographicLensFilmHeight);
-  lens_ptr->set_near_far(cOrthographicLensNear,
-                         cOrthographicLensFar);
+  stop_capture();
 
-  // Create a camera for the orthographic lens
-  PT(Camera) camera_ptr = new Camera(cRenderCameraName);
-  camera_ptr->set_lens(lens_ptr);
+  // Read back the window after the warp, or the scene buffer after both eyes
+  GraphicsOutput *graphics_output_ptr = NULL;
+  if (cCaptureEyeBuffer == source)
+  {
+    if (eye_source_ptr_)
+    {
+      pandrift_cat.error() << "start_capture: No eye buffer with an eye source";
+      return false;
+    }
 
-  // Attach the render camera to our own render root node
-  render_camera_np_ = NodePath(camera_ptr);
-  render_camera_np_.reparent_to(render_root_np_);
+    graphics_output_ptr = get_scene_buffer(cEyeLeft);
+  }
+  else
+    graphics_output_ptr = window_ptr_->get_graphics_output();
 
-  // Attach the camera to the render region
-  render_region_ptr_->set_camera(render_camera_np_);
+  capture_ptr_.reset(new FrameCapture(cCaptureReadbackDepth, cCaptureQueueDepth));
+  if (!capture_ptr_->open(file_name,
+                          graphics_output_ptr->get_x_size(),
+                          graphics_output_ptr->get_y_size(),
+                          cCaptureFrameRate))
+    return false;
 
-  return true;
+  return create_capture_region(graphics_output_ptr);
 }
 
-void DisplayManager::destroy_render_camera()
+void DisplayManager::stop_capture()
 {
-  if (render_camera_np_.is_empty())
-    return;
+  destroy_capture_region();
 
-  // Remove the render region camera
-  render_camera_np_.remove_node();
+  if (capture_ptr_)
+    // Keep the capture around so the frame counts can still be queried
+    capture_ptr_->close();
 }
 
-void DisplayManager::create_shader_cards(NodePath root_np)
+bool DisplayManager::is_capturing()
 {
-  assert(!root_np.is_empty());
-  assert(render_card_np_[cEyeLeft].is_empty());
-  assert(render_card_np_[cEyeRight].is_empty());
+  return capture_ptr_ && capture_ptr_->is_open();
+}
 
-  // Card maker should white, texture-mapped cards
-  CardMaker card_maker(cRenderShaderCardName);
-  card_maker.set_has_uvs(true);
-  card_maker.set_color(1.0, 1.0, 1.0, 1.0);
+int DisplayManager::get_capture_dropped_frames()
+{
+  return capture_ptr_ ? capture_ptr_->get_dropped_frames() : 0;
+}
 
-  // Generate two cards; one left and one right
-  for (int eye = 0; eye <= 1; eye += 1)
+bool DisplayManager::start_publishing(const string &ring_name)
+{
+  if (!created_ || eye_source_ptr_)
   {
-    const float cEye = eye;
+    pandrift_cat.error() << "start_publishing: No scene buffer to publish";
+    return false;
+  }
 
-    // Set U [0.0, 0.5] for left, [0.5, 1.0] for right. Set V [0.0, 1.0] for both.
-    card_maker.set_uv_range(LTexCoord(cEye / 2.0, 0.0), LTexCoord((cEye + 1.0) / 2.0, 1.0));
-    // Set X [-1.0, 0.0] for left, [0.0, 1.0] for right. Set Y [-1.0, 1.0] for both.
-    card_maker.set_frame(cEye - 1.0, cEye, -1.0, 1.0);
+  // The compositor warps one side-by-side texture
+  if (is_per_eye())
+  {
+    pandrift_cat.error() << "start_publishing: Needs the side-by-side layout";
+    return false;
+  }
 
-    render_card_np_[eye] = NodePath(card_maker.generate());
+  stop_publishing();
 
-    // Disable the depth buffer
-    render_card_np_[eye].set_depth_test(false);
-    render_card_np_[eye].set_depth_write(false);
+  GraphicsOutput *scene_buffer_ptr = get_scene_buffer(cEyeLeft);
+  publisher_ptr_.reset(new FramePublisher(cPublishReadbackDepth));
+  if (!publisher_ptr_->open(ring_name,
+                            scene_buffer_ptr->get_x_size(),
+                            scene_buffer_ptr->get_y_size(),
+                            cPublishRingSlots))
+    return false;
 
-    // Attach to the specific node
-    render_card_np_[eye].reparent_to(root_np);
-  }
+  if (!create_publish_region())
+    return false;
+
+  // The compositor presents instead
+  apply_display_state();
+
+  return true;
 }
 
-void DisplayManager::destroy_shader_cards()
+void DisplayManager::stop_publishing()
 {
-  for (int eye = 0; eye <= 1; eye += 1)
-    if (!render_card_np_[eye].is_empty())
-      // Remove the render cards
-      render_card_np_[eye].remove_node();
+  destroy_publish_region();
+
+  if (publisher_ptr_)
+    // Keep the publisher around so the frame counts can still be queried
+    publisher_ptr_->close();
+
+  apply_display_state();
 }
 
-bool DisplayManager::create_scene_buffer()
+bool DisplayManager::is_publishing()
 {
-  assert(window_ptr_);
-  assert(!scene_buffer_ptr_);
-  assert(!scene_region_ptr_[cEyeLeft]);
-  assert(!scene_region_ptr_[cEyeRight]);
+  return publisher_ptr_ && publisher_ptr_->is_open();
+}
+
+int DisplayManager::get_published_frames()
+{
+  return publisher_ptr_ ? publisher_ptr_->get_published_frames() : 0;
+}
 
-  // Create the buffer in which to render our scene
-  scene_buffer_ptr_ = window_ptr_->get_graphics_output()->make_texture_buffer(cSceneBufferName,
-                                                                              scene_width_,
-                                                                              scene_height_);
-  if (!scene_buffer_ptr_)
+bool DisplayManager::map_panel_to_eye(const LPoint2f *pixels_ptr, LPoint2f *uvs_ptr, int count)
+{
+  if (!created_ || !update_distortion_table())
   {
-    pandrift_cat.error() << "create_scene_buffer: Unable to create scene buffer";
+    pandrift_cat.error() << "map_panel_to_eye: Display not created";
     return false;
   }
 
-  // Make sure the scene is rendered first
-  scene_buffer_ptr_->set_sort(-100);
+  // Convert to panel UVs in place, then warp
+  const float cWidth = window_ptr_->get_graphics_output()->get_x_size();
+  const float cHeight = window_ptr_->get_graphics_output()->get_y_size();
+  for (int point = 0; point < count; ++point)
+    uvs_ptr[point].set(pixels_ptr[point][0] / cWidth, 1.0 - pixels_ptr[point][1] / cHeight);
 
-  // Attach the buffer to a usable texture
-  PT(Texture) scene_texture_ptr = scene_buffer_ptr_->get_texture();
+  distortion_table_.warp(uvs_ptr, uvs_ptr, count);
 
-  // Set some texture parameters
-  //TODO(WM) These look good but need further investigation
-  scene_texture_ptr->set_magfilter(Texture::FT_linear);
-  scene_texture_ptr->set_minfilter(Texture::FT_linear);
-  scene_texture_ptr->set_anisotropic_degree(2);
+  return true;
+}
 
-  for (int eye = 0; eye <= 1; ++eye)
+bool DisplayManager::map_eye_to_panel(const LPoint2f *uvs_ptr, LPoint2f *pixels_ptr, int count)
+{
+  if (!created_ || !update_distortion_table())
   {
-    // Create the left and right display regions in which to render the 3D scene
-    // Set X [0.0, 0.5] for left, [0.5, 1.0] for right. Set Y [0.0, 1.0] for both.
-    scene_region_ptr_[eye] = scene_buffer_ptr_->make_mono_display_region(float(eye) * 0.5,
-                                                                         float(eye + 1) * 0.5,
-                                                                         0.0,
-                                                                         1.0);
-
-    // Create the left and right display regions in which to render the 2D scene
-    // Set X [0.0, 0.5] for left, [0.5, 1.0] for right. Set Y [0.0, 1.0] for both.
-    hud_region_ptr_[eye] = scene_buffer_ptr_->make_mono_display_region(float(eye) * 0.5,
-                                                                       float(eye + 1) * 0.5,
-                                                                       0.0,
-                                                                       1.0);
+    pandrift_cat.error() << "map_eye_to_panel: Display not created";
+    return false;
+  }
+
+  distortion_table_.unwarp(uvs_ptr, pixels_ptr, count);
+
+  // Convert the panel UVs to pixels in place
+  const float cWidth = window_ptr_->get_graphics_output()->get_x_size();
+  const float cHeight = window_ptr_->get_graphics_output()->get_y_size();
+  for (int point = 0; point < count; ++point)
+    pixels_ptr[point].set(pixels_ptr[point][0] * cWidth, (1.0 - pixels_ptr[point][1]) * cHeight);
+
+  return true;
+}
+
+boost::shared_ptr<CompositorLayer> DisplayManager::get_hud_layer()
+{
+  return hud_layer_ptr_;
+}
+
+bool DisplayManager::add_layer(boost::shared_ptr<CompositorLayer> layer_ptr)
+{
+  if (!layer_ptr || int(layers_.size()) >= cMaxLayers)
+    return false;
+
+  layers_.push_back(layer_ptr);
+
+  if (render_shader_)
+    set_shader_inputs();
+
+  // Suspend it along with the others, if need be
+  apply_display_state();
+
+  return true;
+}
+
+void DisplayManager::remove_layer(boost::shared_ptr<CompositorLayer> layer_ptr)
+{
+  // The HUD layer stays
+  if (layer_ptr == hud_layer_ptr_)
+    return;
+
+  pvector<boost::shared_ptr<CompositorLayer> >::iterator layer_it = find(layers_.begin(), layers_.end(), layer_ptr);
+  if (layer_it == layers_.end())
+    return;
+
+  layers_.erase(layer_it);
+
+  // Hand it back running
+  layer_ptr->set_suspended(false);
+
+  if (render_shader_)
+    set_shader_inputs();
+}
+
+bool DisplayManager::map_panel_to_hud(const LPoint2f *pixels_ptr, LPoint2f *hud_ptr, int count)
+{
+  if (!map_panel_to_eye(pixels_ptr, hud_ptr, count))
+    return false;
+
+  // Each eye's half of the buffer spans the HUD camera film around its offset
+  for (int point = 0; point < count; ++point)
+  {
+    const int cEye = hud_ptr[point][0] < 0.5 ? cEyeLeft : cEyeRight;
+    const float cEyeU = hud_ptr[point][0] * 2.0 - float(cEye);
+
+    hud_ptr[point].set((cEyeU - 0.5) * hud_film_size_[0] + hud_film_offset_[cEye],
+                       (hud_ptr[point][1] - 0.5) * hud_film_size_[1]);
+  }
+
+  return true;
+}
+
+bool DisplayManager::create_render_region()
+{
+  assert(window_ptr_);
+  assert(!render_region_ptr_);
+
+  // Create the render region: our display region filling the window
+  PT(GraphicsOutput) graphics_output_ptr = window_ptr_->get_graphics_output();
+  render_region_ptr_ = graphics_output_ptr->make_display_region();
+
+  // Only activate through set_enabled(true)
+  render_region_ptr_->set_active(false);
+
+  // Cleared only while the headset is idle, when there is nothing to warp
+  render_region_ptr_->set_clear_color(LColor(0, 0, 0, 1));
+  render_region_ptr_->set_clear_color_active(false);
+
+  return render_region_ptr_;
+}
+
+void DisplayManager::destroy_render_region()
+{
+  if (!render_region_ptr_)
+    return;
+
+  // Remove our render region from window
+  PT(GraphicsOutput) graphics_output_ptr = window_ptr_->get_graphics_output();
+  graphics_output_ptr->remove_display_region(render_region_ptr_);
+  render_region_ptr_ = NULL;
+}
+
+bool DisplayManager::create_render_camera()
+{
+  assert(render_camera_np_.is_empty());
+
+  // Create an orthographic lens [-1, 1] for the render region
+  PT(OrthographicLens) lens_ptr = new OrthographicLens();
+  lens_ptr->set_film_size(cOrthographicLensFilmWidth,
+                          cOrthographicLensFilmHeight);
+  lens_ptr->set_near_far(cOrthographicLensNear,
+                         cOrthographicLensFar);
+
+  // Create a camera for the orthographic lens
+  PT(Camera) camera_ptr = new Camera(cRenderCameraName);
+  camera_ptr->set_lens(lens_ptr);
+
+  // Attach the render camera to our own render root node
+  render_camera_np_ = NodePath(camera_ptr);
+  render_camera_np_.reparent_to(render_root_np_);
+
+  // Attach the camera to the render region
+  render_region_ptr_->set_camera(render_camera_np_);
+
+  return true;
+}
+
+void DisplayManager::destroy_render_camera()
+{
+  if (render_camera_np_.is_empty())
+    return;
+
+  // Remove the render region camera
+  render_camera_np_.remove_node();
+}
+
+void DisplayManager::create_shader_cards(NodePath root_np)
+{
+  assert(!root_np.is_empty());
+  assert(render_card_np_[cEyeLeft].is_empty());
+  assert(render_card_np_[cEyeRight].is_empty());
+
+  // Card maker should white, texture-mapped cards
+  CardMaker card_maker(cRenderShaderCardName);
+  card_maker.set_has_uvs(true);
+  card_maker.set_color(1.0, 1.0, 1.0, 1.0);
+
+  // Generate two cards; one left and one right
+  for (int eye = 0; eye <= 1; eye += 1)
+  {
+    const float cEye = eye;
+
+    if (is_per_eye())
+      // Set U [0.0, 1.0] and V [0.0, 1.0] for both, over each eye's own texture
+      card_maker.set_uv_range(LTexCoord(0.0, 0.0), LTexCoord(1.0, 1.0));
+    else
+      // Set U [0.0, 0.5] for left, [0.5, 1.0] for right. Set V [0.0, 1.0] for both.
+      card_maker.set_uv_range(LTexCoord(cEye / 2.0, 0.0), LTexCoord((cEye + 1.0) / 2.0, 1.0));
+    // Set X [-1.0, 0.0] for left, [0.0, 1.0] for right. Set Y [-1.0, 1.0] for both.
+    card_maker.set_frame(cEye - 1.0, cEye, -1.0, 1.0);
+
+    render_card_np_[eye] = NodePath(card_maker.generate());
+
+    // Disable the depth buffer
+    render_card_np_[eye].set_depth_test(false);
+    render_card_np_[eye].set_depth_write(false);
+
+    // Attach to the specific node
+    render_card_np_[eye].reparent_to(root_np);
+  }
+}
+
+void DisplayManager::destroy_shader_cards()
+{
+  for (int eye = 0; eye <= 1; eye += 1)
+    if (!render_card_np_[eye].is_empty())
+      // Remove the render cards
+      render_card_np_[eye].remove_node();
+}
+
+bool DisplayManager::create_scene_buffer()
+{
+  assert(window_ptr_);
+  assert(!scene_buffer_ptr_[cEyeLeft]);
+  assert(!scene_buffer_ptr_[cEyeRight]);
+  assert(!scene_region_ptr_[cEyeLeft]);
+  assert(!scene_region_ptr_[cEyeRight]);
+
+  // One buffer shared side-by-side, or one for each eye. Upscaling
+  // accumulates each eye on its own.
+  const bool cPerEye = (cLayoutPerEye == scene_layout_) || (upscale_render_scale_ < 1.0);
+  const int cBufferCount = cPerEye ? 2 : 1;
+  for (int buffer = 0; buffer < cBufferCount; ++buffer)
+  {
+    int width = scene_width_, height = scene_height_;
+    if (cPerEye)
+    {
+      width = (eye_width_[buffer] > 0) ? eye_width_[buffer] : scene_width_ / 2;
+      height = (eye_height_[buffer] > 0) ? eye_height_[buffer] : scene_height_;
+
+      // Render at the reduced resolution; the history is at the full one
+      width = max(1, int(ceil(width * upscale_render_scale_)));
+      height = max(1, int(ceil(height * upscale_render_scale_)));
+    }
+
+    // Take the buffer in which to render our scene from the pool, keeping
+    // the depth for reprojection
+    RenderTargetPool::Format format;
+    format.alpha = false;
+    format.depth_texture = reprojection_;
+
+    RenderTargetPool::RenderTarget target;
+    if (!render_target_pool_ptr_->acquire(window_ptr_->get_graphics_output(),
+                                          cSceneBufferName,
+                                          width,
+                                          height,
+                                          format,
+                                          target))
+    {
+      pandrift_cat.error() << "create_scene_buffer: Unable to create scene buffer";
+      return false;
+    }
+
+    scene_buffer_ptr_[buffer] = target.buffer_ptr;
+    scene_depth_ptr_[buffer] = target.depth_ptr;
+
+    // Make sure the scene is rendered first
+    scene_buffer_ptr_[buffer]->set_sort(-100);
+    scene_buffer_ptr_[buffer]->set_active(!is_scene_held());
+
+    // Attach the buffer to a usable texture
+    PT(Texture) scene_texture_ptr = scene_buffer_ptr_[buffer]->get_texture();
+
+    // Set some texture parameters
+    //TODO(WM) These look good but need further investigation
+    scene_texture_ptr->set_magfilter(Texture::FT_linear);
+    scene_texture_ptr->set_minfilter(Texture::FT_linear);
+    scene_texture_ptr->set_anisotropic_degree(2);
+
+    // An eye's own texture has no neighbour to bleed from, so clamp at its edges
+    if (cPerEye)
+    {
+      scene_texture_ptr->set_wrap_u(Texture::WM_clamp);
+      scene_texture_ptr->set_wrap_v(Texture::WM_clamp);
+    }
+
+    // Depths don't interpolate across edges
+    if (scene_depth_ptr_[buffer])
+    {
+      scene_depth_ptr_[buffer]->set_magfilter(Texture::FT_nearest);
+      scene_depth_ptr_[buffer]->set_minfilter(Texture::FT_nearest);
+    }
+  }
+
+  for (int eye = 0; eye <= 1; ++eye)
+  {
+    PT(GraphicsOutput) scene_buffer_ptr = get_scene_buffer(eye);
+
+    // Set X [0.0, 0.5] for left, [0.5, 1.0] for right, or [0.0, 1.0] for the eye's
+    // own buffer. Set Y [0.0, 1.0] for both.
+    float left = float(eye) * 0.5, right = float(eye + 1) * 0.5;
+    if (cPerEye)
+    {
+      left = 0.0;
+      right = 1.0;
+    }
+
+    // Create the left and right display regions in which to render the 3D scene
+    scene_region_ptr_[eye] = scene_buffer_ptr->make_mono_display_region(left, right, 0.0, 1.0);
   }
 
   return true;
@@ -382,156 +1021,842 @@ void DisplayManager::destroy_scene_buffer()
     if (scene_region_ptr_[eye])
     {
       // Remove and reset the 3D scene display regions
-      scene_buffer_ptr_->remove_display_region(scene_region_ptr_[eye]);
+      scene_region_ptr_[eye]->get_window()->remove_display_region(scene_region_ptr_[eye]);
       scene_region_ptr_[eye] = NULL;
     }
+  }
+
+  for (int buffer = 0; buffer <= 1; ++buffer)
+  {
+    if (!scene_buffer_ptr_[buffer])
+      continue;
+
+    // Return the scene render buffer to the pool for the next display
+    render_target_pool_ptr_->release(scene_buffer_ptr_[buffer]);
+    scene_buffer_ptr_[buffer] = NULL;
+    scene_depth_ptr_[buffer] = NULL;
+  }
+}
+
+bool DisplayManager::is_per_eye()
+{
+  // The layout the buffers were created with, which may since have been changed
+  return scene_buffer_ptr_[cEyeRight] != NULL;
+}
+
+PT(GraphicsOutput) DisplayManager::get_scene_buffer(int eye)
+{
+  // Both eyes share the first buffer when side-by-side
+  return scene_buffer_ptr_[is_per_eye() ? eye : cEyeLeft];
+}
+
+Texture *DisplayManager::get_eye_texture(int eye)
+{
+  if (eye_source_ptr_)
+    return eye_source_ptr_;
+
+  // The warp samples the accumulated history when upscaling
+  if (is_upscaling())
+    return upscaler_ptr_[eye]->get_texture();
+
+  return get_scene_buffer(eye)->get_texture();
+}
+
+bool DisplayManager::create_upscalers()
+{
+  if (upscale_render_scale_ >= 1.0)
+    return true;
+
+  assert(is_per_eye());
+
+  for (int eye = 0; eye <= 1; ++eye)
+  {
+    // Accumulate at the resolution the eye would have had without upscaling
+    const int cWidth = (eye_width_[eye] > 0) ? eye_width_[eye] : scene_width_ / 2;
+    const int cHeight = (eye_height_[eye] > 0) ? eye_height_[eye] : scene_height_;
+    if (!upscaler_ptr_[eye]->create(window_ptr_->get_graphics_output(), get_scene_buffer(eye), cWidth, cHeight))
+    {
+      pandrift_cat.error() << "create_upscalers: Unable to create upscaler";
+      return false;
+    }
+
+    // The first frame has no history, so only needs somewhere to start from
+    upscaled_rotation_mat_[eye] = scene_camera_np_[eye].get_mat(NodePath());
+    upscaled_rotation_mat_[eye].set_row(3, LVecBase3f(0, 0, 0));
+  }
+
+  return true;
+}
+
+void DisplayManager::destroy_upscalers()
+{
+  for (int eye = 0; eye <= 1; ++eye)
+    upscaler_ptr_[eye]->destroy();
+}
+
+bool DisplayManager::is_upscaling()
+{
+  return upscaler_ptr_[cEyeLeft]->is_created();
+}
+
+void DisplayManager::update_upscaling(int eye, const LMatrix4f &camera_mat)
+{
+  // While the scene is held back there is nothing new to accumulate
+  if (is_scene_held())
+    return;
+
+  // The history is moved by the rotation alone
+  LMatrix4f rotation_mat = camera_mat;
+  rotation_mat.set_row(3, LVecBase3f(0, 0, 0));
+
+  LMatrix4f previous_inverse_mat;
+  previous_inverse_mat.invert_from(upscaled_rotation_mat_[eye]);
+  upscaler_ptr_[eye]->update(parameters_ptr_->projection[eye], rotation_mat * previous_inverse_mat);
+  upscaled_rotation_mat_[eye] = rotation_mat;
+
+  // Draw this frame's scene with the upscaler's jitter, as a shift in clip space
+  const LVecBase2f &jitter_v = upscaler_ptr_[eye]->get_jitter();
+  GraphicsOutput *scene_buffer_ptr = get_scene_buffer(eye);
+  const LMatrix4f cJitterMat = LMatrix4f::translate_mat(2.0 * jitter_v[0] / float(scene_buffer_ptr->get_x_size()),
+                                                        2.0 * jitter_v[1] / float(scene_buffer_ptr->get_y_size()),
+                                                        0);
+
+  Lens *lens_ptr = DCAST(Camera, scene_camera_np_[eye].node())->get_lens();
+  DCAST(MatrixLens, lens_ptr)->set_user_mat(parameters_ptr_->projection[eye] * cJitterMat);
+
+  // Warp from the history written this frame. The card flips between two
+  // states, so keep each rather than making a new texture attribute each frame.
+  CPT(RenderState) &card_state = upscaled_card_state_[eye][upscaler_ptr_[eye]->get_current_history()];
+  if (card_state)
+  {
+    render_card_np_[eye].set_state(card_state);
+  }
+  else
+  {
+    render_card_np_[eye].set_texture(upscaler_ptr_[eye]->get_texture());
+    card_state = render_card_np_[eye].get_state();
+  }
+}
+
+bool DisplayManager::create_scene_cameras()
+{
+  assert(parameters_ptr_);
+  assert(scene_region_ptr_[cEyeLeft]);
+  assert(scene_region_ptr_[cEyeRight]);
+
+  for (int eye = 0; eye <= 1; ++eye)
+  {
+    // Create the scene render camera
+    PT(Camera) scene_camera_ptr = new Camera(cSceneCameraName);
+    PT(MatrixLens) camera_lens_ptr = new MatrixLens();
+
+    // Set the precomputed projection matrix and attach it to the scene camera
+    camera_lens_ptr->set_user_mat(parameters_ptr_->projection[eye]);
+    scene_camera_ptr->set_lens(camera_lens_ptr);
+
+    scene_camera_np_[eye] = NodePath(scene_camera_ptr);
+
+    // Move the camera by the eye separation distance
+    scene_camera_np_[eye].set_pos(parameters_ptr_->eye_offset[eye], 0, 0);
+    scene_camera_np_[eye].reparent_to(scene_camera_root_np_);
+
+    // Attach the camera to the scene display region
+    scene_region_ptr_[eye]->set_camera(scene_camera_np_[eye]);
+
+    if (tight_culling_)
+      apply_tight_culling(eye);
+
+    if (eccentricity_lod_)
+      apply_periphery_inputs(eye);
+  }
+
+  if (guard_band_culling_)
+    start_guard_band_culling();
+
+  if (occlusion_culling_)
+    start_occlusion_culling();
+
+  return true;
+}
+
+void DisplayManager::destroy_scene_cameras()
+{
+  // Show everything again before the cameras go
+  guard_band_culler_ptr_->stop();
+  occlusion_culler_ptr_->stop();
+
+  for (int eye = 0; eye <= 1; ++eye)
+  {
+    if (!scene_camera_np_[eye].is_empty())
+      // Remove the scene camera
+      scene_camera_np_[eye].remove_node();
+  }
+}
+
+void DisplayManager::apply_tight_culling(int eye)
+{
+  if (!update_distortion_table())
+    return;
+
+  calculate_lens_footprint(distortion_table_, eye, scene_footprint_[eye]);
+
+  Camera *camera_ptr = DCAST(Camera, scene_camera_np_[eye].node());
+  Lens *lens_ptr = camera_ptr->get_lens();
+
+  // The middle of the view is always sampled; use it to face the planes inwards
+  LPoint3f centre_near, centre_far;
+  lens_ptr->extrude(LPoint2f(0, 0), centre_near, centre_far);
+
+  CPT(RenderAttrib) clip_attrib = ClipPlaneAttrib::make();
+  int planes = 0;
+  for (int direction = 0; direction < cFootprintDirections; ++direction)
+  {
+    // Skip the edges which don't cut into the lens frustum
+    const float cExtent = scene_footprint_[eye].extent[direction];
+    if (cExtent >= get_footprint_limit(direction))
+      continue;
+
+    // Extrude two points on the footprint edge into the view
+    const LVector2f direction_v = get_footprint_direction(direction);
+    const LVector2f edge_v(-direction_v[1], direction_v[0]);
+    LPoint3f near_point, far_point[2];
+    lens_ptr->extrude(LPoint2f(direction_v * cExtent + edge_v), near_point, far_point[0]);
+    lens_ptr->extrude(LPoint2f(direction_v * cExtent - edge_v), near_point, far_point[1]);
+
+    // The rays meet at the eye, so the plane passes through the camera origin
+    LVector3f normal_v = far_point[0].cross(far_point[1]);
+    if (normal_v.dot(centre_far) < 0)
+      normal_v = -normal_v;
+
+    // Cull-only planes: nothing is clipped, but Panda's cull skips what's behind them
+    PT(PlaneNode) plane_ptr = new PlaneNode(cSceneCullPlaneName, LPlanef(normal_v, LPoint3f(0, 0, 0)));
+    plane_ptr->set_clip_effect(PlaneNode::CE_cull);
+    NodePath plane_np = scene_camera_np_[eye].attach_new_node(plane_ptr);
+
+    clip_attrib = DCAST(ClipPlaneAttrib, clip_attrib)->add_on_plane(plane_np);
+    ++planes;
+  }
+
+  if (planes > 0)
+    camera_ptr->set_initial_state(RenderState::make(clip_attrib));
+
+  if (pandrift_cat.is_info())
+    pandrift_cat.info() << "apply_tight_culling: Eye " << eye << " culls against "
+                        << planes << " footprint planes, keeping "
+                        << scene_footprint_[eye].coverage * 100.0 << "% of the view" << endl;
+}
+
+void DisplayManager::apply_periphery_inputs(int eye)
+{
+  if (!update_distortion_table())
+    return;
+
+  // The eye's part of its scene buffer in window coordinates, as gl_FragCoord sees it
+  int left, right, bottom, top;
+  scene_region_ptr_[eye]->get_pixels(left, right, bottom, top);
+
+  // Each eye's view spans [0, 1] in the per-eye parameters, whatever the layout
+  const WarpParameters &params = parameters_ptr_->eye_warp;
+  const LVecBase4f cViewport(left, bottom, right - left, top - bottom);
+  const LVecBase4f cLens(params.lens_centre[eye][0],
+                         params.lens_centre[eye][1],
+                         1.0 / params.scale[0],
+                         1.0 / params.scale[1]);
+
+  // Below any shader the scene sets, so its inputs reach it
+  CPT(RenderAttrib) shader_attrib = ShaderAttrib::make();
+  shader_attrib = DCAST(ShaderAttrib, shader_attrib)->set_shader_input("PeripheryViewport", cViewport);
+  shader_attrib = DCAST(ShaderAttrib, shader_attrib)->set_shader_input("PeripheryLens", cLens);
+  shader_attrib = DCAST(ShaderAttrib, shader_attrib)->set_shader_input("HmdWarpParam", params.distortion);
+
+  Camera *camera_ptr = DCAST(Camera, scene_camera_np_[eye].node());
+  camera_ptr->set_initial_state(camera_ptr->get_initial_state()->set_attrib(shader_attrib));
+}
+
+void DisplayManager::start_guard_band_culling()
+{
+  // Cull for both eyes' views around the camera root, which only offsets the eyes
+  float half_angle = 0, far_distance = 0, view_radius = 0;
+  for (int eye = 0; eye <= 1; ++eye)
+  {
+    Lens *lens_ptr = DCAST(Camera, scene_camera_np_[eye].node())->get_lens();
+
+    // The projection is off centre, so the widest corner sets the angle
+    for (int corner = 0; corner < 4; ++corner)
+    {
+      LPoint3f near_point, far_point;
+      lens_ptr->extrude(LPoint2f((corner & 1) ? 1.0 : -1.0, (corner & 2) ? 1.0 : -1.0), near_point, far_point);
+
+      const float cDistance = far_point.length();
+      half_angle = max(half_angle, float(acos(min(1.0f, far_point.dot(LVector3f::forward()) / cDistance))));
+      far_distance = max(far_distance, cDistance);
+    }
+
+    view_radius = max(view_radius, float(fabs(parameters_ptr_->eye_offset[eye])));
+  }
+
+  if (!guard_band_culler_ptr_->start(scene_camera_root_np_, half_angle, far_distance, view_radius))
+    return;
+
+  if (pandrift_cat.is_info())
+    pandrift_cat.info() << "start_guard_band_culling: Culling static objects beyond "
+                        << half_angle * (180.0 / M_PI) << " degrees of the view" << endl;
+}
+
+void DisplayManager::start_occlusion_culling()
+{
+  float horizontal_half_angle = 0, vertical_half_angle = 0, near_distance = 0, far_distance = 0;
+  calculate_union_view(horizontal_half_angle, vertical_half_angle, near_distance, far_distance);
 
-    if (hud_region_ptr_[eye])
+  float view_radius = 0;
+  for (int eye = 0; eye <= 1; ++eye)
+    view_radius = max(view_radius, float(fabs(parameters_ptr_->eye_offset[eye])));
+
+  // Same pipe as the scene, drawn just before it
+  if (!occlusion_culler_ptr_->start(window_ptr_->get_graphics_output(),
+                                    scene_camera_root_np_,
+                                    horizontal_half_angle,
+                                    vertical_half_angle,
+                                    near_distance,
+                                    far_distance,
+                                    view_radius))
+    return;
+
+  occlusion_culler_ptr_->set_active(!is_scene_held());
+
+  if (pandrift_cat.is_info())
+    pandrift_cat.info() << "start_occlusion_culling: Querying "
+                        << occlusion_culler_ptr_->get_occludee_count() << " occludees over "
+                        << horizontal_half_angle * (360.0 / M_PI) << "x"
+                        << vertical_half_angle * (360.0 / M_PI) << " degrees" << endl;
+}
+
+void DisplayManager::calculate_union_view(float &horizontal_half_angle,
+                                          float &vertical_half_angle,
+                                          float &near_distance,
+                                          float &far_distance)
+{
+  // One view from the camera root, bounding both eyes' off-centre frustums
+  float left = 0, right = 0, bottom = 0, top = 0;
+  near_distance = 0;
+  far_distance = 0;
+  for (int eye = 0; eye <= 1; ++eye)
+  {
+    Lens *lens_ptr = DCAST(Camera, scene_camera_np_[eye].node())->get_lens();
+
+    for (int corner = 0; corner < 4; ++corner)
     {
-      // Remove and reset the 2D scene display regions
-      scene_buffer_ptr_->remove_display_region(hud_region_ptr_[eye]);
-      hud_region_ptr_[eye] = NULL;
+      LPoint3f near_point, far_point;
+      lens_ptr->extrude(LPoint2f((corner & 1) ? 1.0 : -1.0, (corner & 2) ? 1.0 : -1.0), near_point, far_point);
+
+      // Slopes either side of forward
+      left = min(left, far_point[0] / far_point[1]);
+      right = max(right, far_point[0] / far_point[1]);
+      bottom = min(bottom, far_point[2] / far_point[1]);
+      top = max(top, far_point[2] / far_point[1]);
+
+      // The matrix lens' planes, which its near and far settings don't describe
+      near_distance = (0 == eye && 0 == corner) ? near_point[1] : min(near_distance, near_point[1]);
+      far_distance = max(far_distance, far_point[1]);
     }
   }
 
-  if (!scene_buffer_ptr_)
+  // Symmetric, as the view is centred on forward
+  horizontal_half_angle = atan(max(-left, right));
+  vertical_half_angle = atan(max(-bottom, top));
+}
+
+bool DisplayManager::create_far_field()
+{
+  if (far_field_distance_ <= 0)
+    return true;
+
+  float horizontal_half_angle = 0, vertical_half_angle = 0, near_distance = 0, far_distance = 0;
+  calculate_union_view(horizontal_half_angle, vertical_half_angle, near_distance, far_distance);
+  if (far_field_distance_ <= near_distance || far_field_distance_ >= far_distance)
+  {
+    pandrift_cat.warning() << "create_far_field: Far field distance " << far_field_distance_
+                           << " is outside the view; drawing everything for each eye" << endl;
+    return true;
+  }
+
+  // Keep each eye's pixel density, over the wider view
+  float pixels_per_slope[2] = { 0, 0 };
+  for (int eye = 0; eye <= 1; ++eye)
+  {
+    Lens *lens_ptr = DCAST(Camera, scene_camera_np_[eye].node())->get_lens();
+    LPoint3f near_point, far_point[2];
+    lens_ptr->extrude(LPoint2f(-1.0, -1.0), near_point, far_point[0]);
+    lens_ptr->extrude(LPoint2f(1.0, 1.0), near_point, far_point[1]);
+
+    pixels_per_slope[0] = max(pixels_per_slope[0],
+                              float(scene_region_ptr_[eye]->get_pixel_width()) /
+                              (far_point[1][0] / far_point[1][1] - far_point[0][0] / far_point[0][1]));
+    pixels_per_slope[1] = max(pixels_per_slope[1],
+                              float(scene_region_ptr_[eye]->get_pixel_height()) /
+                              (far_point[1][2] / far_point[1][1] - far_point[0][2] / far_point[0][1]));
+  }
+
+  const int cWidth = max(1, int(ceil(2.0 * tan(horizontal_half_angle) * pixels_per_slope[0])));
+  const int cHeight = max(1, int(ceil(2.0 * tan(vertical_half_angle) * pixels_per_slope[1])));
+
+  RenderTargetPool::Format format;
+  format.alpha = false;
+  format.depth_texture = false;
+
+  RenderTargetPool::RenderTarget target;
+  if (!render_target_pool_ptr_->acquire(window_ptr_->get_graphics_output(),
+                                        cFarFieldBufferName,
+                                        cWidth,
+                                        cHeight,
+                                        format,
+                                        target))
+  {
+    pandrift_cat.error() << "create_far_field: Unable to create far field buffer";
+    return false;
+  }
+
+  far_field_buffer_ptr_ = target.buffer_ptr;
+  far_field_buffer_ptr_->set_sort(cFarFieldBufferSort);
+  far_field_buffer_ptr_->set_active(!is_scene_held());
+
+  Texture *far_field_texture_ptr = far_field_buffer_ptr_->get_texture();
+  far_field_texture_ptr->set_magfilter(Texture::FT_linear);
+  far_field_texture_ptr->set_minfilter(Texture::FT_linear);
+  far_field_texture_ptr->set_wrap_u(Texture::WM_clamp);
+  far_field_texture_ptr->set_wrap_v(Texture::WM_clamp);
+
+  // Everything past the split, once, from between the eyes
+  PT(PerspectiveLens) lens_ptr = new PerspectiveLens();
+  lens_ptr->set_fov(horizontal_half_angle * (360.0 / M_PI), vertical_half_angle * (360.0 / M_PI));
+  lens_ptr->set_near_far(far_field_distance_, far_distance);
+
+  PT(Camera) camera_ptr = new Camera(cFarFieldCameraName);
+  camera_ptr->set_lens(lens_ptr);
+
+  // Scene shaders expect the periphery inputs; a zero lens scale gives full detail
+  if (eccentricity_lod_)
+  {
+    CPT(RenderAttrib) shader_attrib = ShaderAttrib::make();
+    shader_attrib = DCAST(ShaderAttrib, shader_attrib)->set_shader_input("PeripheryViewport", LVecBase4f(0, 0, cWidth, cHeight));
+    shader_attrib = DCAST(ShaderAttrib, shader_attrib)->set_shader_input("PeripheryLens", LVecBase4f(0, 0, 0, 0));
+    shader_attrib = DCAST(ShaderAttrib, shader_attrib)->set_shader_input("HmdWarpParam", parameters_ptr_->eye_warp.distortion);
+    camera_ptr->set_initial_state(RenderState::make(shader_attrib));
+  }
+
+  far_field_camera_np_ = scene_camera_root_np_.attach_new_node(camera_ptr);
+  far_field_region_ptr_ = far_field_buffer_ptr_->make_display_region();
+  far_field_region_ptr_->set_camera(far_field_camera_np_);
+
+  for (int eye = 0; eye <= 1; ++eye)
+  {
+    create_far_field_card(eye, horizontal_half_angle, vertical_half_angle);
+    apply_far_field_split(eye);
+  }
+
+  if (pandrift_cat.is_info())
+    pandrift_cat.info() << "create_far_field: Drawing beyond " << far_field_distance_
+                        << " once, into " << cWidth << "x" << cHeight << endl;
+
+  return true;
+}
+
+void DisplayManager::destroy_far_field()
+{
+  for (int eye = 0; eye <= 1; ++eye)
+    destroy_far_field_card(eye);
+
+  if (far_field_region_ptr_)
+  {
+    far_field_buffer_ptr_->remove_display_region(far_field_region_ptr_);
+    far_field_region_ptr_ = NULL;
+  }
+
+  if (!far_field_camera_np_.is_empty())
+    far_field_camera_np_.remove_node();
+
+  if (far_field_buffer_ptr_)
+  {
+    render_target_pool_ptr_->release(far_field_buffer_ptr_);
+    far_field_buffer_ptr_ = NULL;
+  }
+}
+
+void DisplayManager::create_far_field_card(int eye, float horizontal_half_angle, float vertical_half_angle)
+{
+  // The eye is only moved from the middle, not turned, so its view maps
+  // onto the far field's linearly; its corners give the card's UVs
+  Lens *eye_lens_ptr = DCAST(Camera, scene_camera_np_[eye].node())->get_lens();
+  LPoint3f near_point, far_point[2];
+  eye_lens_ptr->extrude(LPoint2f(-1.0, -1.0), near_point, far_point[0]);
+  eye_lens_ptr->extrude(LPoint2f(1.0, 1.0), near_point, far_point[1]);
+
+  LTexCoord uvs[2];
+  for (int corner = 0; corner <= 1; ++corner)
+    uvs[corner].set((far_point[corner][0] / far_point[corner][1] / tan(horizontal_half_angle) + 1.0) * 0.5,
+                    (far_point[corner][2] / far_point[corner][1] / tan(vertical_half_angle) + 1.0) * 0.5);
+
+  CardMaker card_maker(cFarFieldCardName);
+  card_maker.set_has_uvs(true);
+  card_maker.set_uv_range(uvs[0], uvs[1]);
+  card_maker.set_frame(-1.0, 1.0, -1.0, 1.0);
+
+  far_field_card_root_np_[eye] = NodePath(cFarFieldCardRootName);
+  NodePath card_np = far_field_card_root_np_[eye].attach_new_node(card_maker.generate());
+  card_np.set_texture(far_field_buffer_ptr_->get_texture());
+
+  // Leave the depth clear for the eye's own geometry
+  card_np.set_depth_test(false);
+  card_np.set_depth_write(false);
+
+  PT(OrthographicLens) card_lens_ptr = new OrthographicLens();
+  card_lens_ptr->set_film_size(cOrthographicLensFilmWidth, cOrthographicLensFilmHeight);
+  card_lens_ptr->set_near_far(cOrthographicLensNear, cOrthographicLensFar);
+
+  PT(Camera) card_camera_ptr = new Camera(cFarFieldCardCameraName);
+  card_camera_ptr->set_lens(card_lens_ptr);
+  NodePath card_camera_np = far_field_card_root_np_[eye].attach_new_node(card_camera_ptr);
+
+  // Drawn over the eye's part of its buffer, just before its scene region
+  float left, right, bottom, top;
+  scene_region_ptr_[eye]->get_dimensions(left, right, bottom, top);
+  far_field_card_region_ptr_[eye] = scene_region_ptr_[eye]->get_window()->make_mono_display_region(left, right, bottom, top);
+  far_field_card_region_ptr_[eye]->set_sort(cFarFieldCardRegionSort);
+  far_field_card_region_ptr_[eye]->set_camera(card_camera_np);
+}
+
+void DisplayManager::destroy_far_field_card(int eye)
+{
+  if (far_field_card_region_ptr_[eye])
+  {
+    far_field_card_region_ptr_[eye]->get_window()->remove_display_region(far_field_card_region_ptr_[eye]);
+    far_field_card_region_ptr_[eye] = NULL;
+  }
+
+  if (!far_field_card_root_np_[eye].is_empty())
+    far_field_card_root_np_[eye].remove_node();
+}
+
+void DisplayManager::refit_far_field_cards()
+{
+  // Each card was made over its scene region; remake any whose region has
+  // since been moved, resized or put in another buffer
+  float horizontal_half_angle = 0, vertical_half_angle = 0, near_distance = 0, far_distance = 0;
+  bool has_view = false;
+  for (int eye = 0; eye <= 1; ++eye)
+  {
+    float scene_dimensions[4], card_dimensions[4];
+    scene_region_ptr_[eye]->get_dimensions(scene_dimensions[0], scene_dimensions[1], scene_dimensions[2], scene_dimensions[3]);
+    far_field_card_region_ptr_[eye]->get_dimensions(card_dimensions[0], card_dimensions[1], card_dimensions[2], card_dimensions[3]);
+    if (far_field_card_region_ptr_[eye]->get_window() == scene_region_ptr_[eye]->get_window() &&
+        memcmp(scene_dimensions, card_dimensions, sizeof(scene_dimensions)) == 0)
+      continue;
+
+    if (!has_view)
+    {
+      calculate_union_view(horizontal_half_angle, vertical_half_angle, near_distance, far_distance);
+      has_view = true;
+    }
+
+    destroy_far_field_card(eye);
+    create_far_field_card(eye, horizontal_half_angle, vertical_half_angle);
+  }
+}
+
+void DisplayManager::apply_far_field_split(int eye)
+{
+  // The eye draws up to the split and the far field from it. The plane is
+  // square to forward, as the far field's near plane is, so they meet.
+  PT(PlaneNode) plane_ptr = new PlaneNode(cFarFieldSplitPlaneName,
+                                          LPlanef(LVector3f(0, -1, 0), LPoint3f(0, far_field_distance_, 0)));
+  NodePath plane_np = scene_camera_np_[eye].attach_new_node(plane_ptr);
+
+  // Added to any tight culling planes
+  Camera *camera_ptr = DCAST(Camera, scene_camera_np_[eye].node());
+  CPT(RenderState) state = camera_ptr->get_initial_state();
+  CPT(RenderAttrib) clip_attrib = state->get_attrib(ClipPlaneAttrib::get_class_slot());
+  if (!clip_attrib)
+    clip_attrib = ClipPlaneAttrib::make();
+
+  clip_attrib = DCAST(ClipPlaneAttrib, clip_attrib)->add_on_plane(plane_np);
+  camera_ptr->set_initial_state(state->set_attrib(clip_attrib));
+}
+
+void DisplayManager::refresh_lod_nodes()
+{
+  lod_refresh_ = true;
+}
+
+void DisplayManager::update_eccentricity_lod()
+{
+  // Only scan the scene once it has changed
+  if (lod_refresh_)
+  {
+    lod_nodes_ = scene_camera_root_np_.get_top().find_all_matches("**/+LODNode");
+    lod_refresh_ = false;
+  }
+
+  if (0 == lod_nodes_.get_num_paths())
     return;
 
-  // Remove and reset the scene render buffer
-  PT(GraphicsEngine) graphics_engine_ptr = scene_buffer_ptr_->get_engine();
-  graphics_engine_ptr->remove_window(scene_buffer_ptr_);
-  scene_buffer_ptr_ = NULL;
+  // Each eye's view of the world, once for all the nodes
+  LMatrix4f world_to_camera_mat[2];
+  {
+    // The camera moves every frame, so Panda composes a new net transform for it
+    PANDRIFT_AUDIT_EXPECTED("scene camera net transform");
+    for (int eye = 0; eye <= 1; ++eye)
+      world_to_camera_mat[eye].invert_from(scene_camera_np_[eye].get_net_transform()->get_mat());
+  }
+
+  for (int node = 0; node < lod_nodes_.get_num_paths(); ++node)
+  {
+    NodePath lod_np = lod_nodes_.get_path(node);
+    if (lod_np.is_empty())
+      continue;
+
+    LODNode *lod_node_ptr = DCAST(LODNode, lod_np.node());
+
+    // Composed once and cached by Panda while the node stays put
+    CPT(TransformState) node_transform = lod_np.get_net_transform();
+    const LPoint3f cWorldCentre = node_transform->get_mat().xform_point(lod_node_ptr->get_center());
+
+    // Both eyes share the node, so keep the detail of the eye seeing it more centrally
+    float detail = cMinimumEccentricityDetail;
+    for (int eye = 0; eye <= 1; ++eye)
+      detail = max(detail, get_eccentricity_detail(eye, world_to_camera_mat[eye].xform_point(cWorldCentre)));
+
+    // A smaller scale brings the switch distances in
+    lod_node_ptr->set_lod_scale(detail);
+  }
 }
 
-bool DisplayManager::create_scene_cameras()
+float DisplayManager::get_eccentricity_detail(int eye, const LPoint3f &point)
 {
-  assert(rift_manager_ptr_);
-  assert(scene_region_ptr_[cEyeLeft]);
-  assert(scene_region_ptr_[cEyeRight]);
+  Lens *lens_ptr = DCAST(Camera, scene_camera_np_[eye].node())->get_lens();
+
+  LPoint2f film_point;
+  if (!lens_ptr->project(point, film_point))
+    return cMinimumEccentricityDetail;
+
+  // Film to side-by-side scene UV, then back through the warp to the panel
+  const float cEyeU = (film_point[0] + 1.0) * 0.5;
+  const LPoint2f cSceneUV((float(eye) + cEyeU) * 0.5, (film_point[1] + 1.0) * 0.5);
+  LPoint2f panel_uv;
+  distortion_table_.unwarp(&cSceneUV, &panel_uv, 1);
+
+  const WarpParameters &params = parameters_ptr_->warp;
+  const float cThetaX = (panel_uv[0] - params.lens_centre[eye][0]) * params.scale_in[0];
+  const float cThetaY = (panel_uv[1] - params.lens_centre[eye][1]) * params.scale_in[1];
+  const float cRadiusSquared = cThetaX * cThetaX + cThetaY * cThetaY;
+
+  // The warp's radial slope is how many scene texels one panel pixel spans
+  const LVector4f &k = params.distortion;
+  const float cSlope = k[0] + cRadiusSquared * (3.0 * k[1] + cRadiusSquared * (5.0 * k[2] + cRadiusSquared * 7.0 * k[3]));
+  if (cSlope <= 0)
+    return cMinimumEccentricityDetail;
+
+  return min(1.0f, max(cMinimumEccentricityDetail, k[0] / cSlope));
+}
 
-  // Calculate the Rift projection matrix
-  const float cYFOV = rift_manager_ptr_->get_y_fov_radians();
-  const float cDisplayAspectRatio = rift_manager_ptr_->get_display_aspect_ratio();
-  const float cTanHalfFOV = tan(cYFOV * 0.5);
+bool DisplayManager::create_hud_layer()
+{
+  assert(parameters_ptr_);
+  assert(!hud_layer_ptr_->is_created());
+
+  // Get the HUD aspect ratio from the window aspect_2d node
+  LVecBase3f aspect_scale_vec = window_ptr_->get_aspect_2d().get_scale();
 
-  LMatrix4f projection = LMatrix4f::zeros_mat();
-  projection[0][0] = 1.0 / (cTanHalfFOV * cDisplayAspectRatio); // or tan(get_y_fov_radians() * cDisplayAspectRatio * 0.5)?
-  projection[2][1] = 1.0 / cTanHalfFOV;
-  projection[1][2] = cSceneCameraFar / (cSceneCameraFar - cSceneCameraNear);
-  projection[1][3] = 1;
-  projection[3][2] = -cSceneCameraFar * cSceneCameraNear / (cSceneCameraFar - cSceneCameraNear);
+  // Calculate the HUD size seen by each eye, keeping the film for mapping
+  // panel positions onto the HUD
+  hud_film_size_.set(parameters_ptr_->hud_film_width_scale / aspect_scale_vec.get_z(),
+                     parameters_ptr_->hud_film_height_scale / aspect_scale_vec.get_x());
 
-  const float cIPDOffset = rift_manager_ptr_->get_interpupillary_distance() / 2.0;
-  const float cProjectionCentreOffset = rift_manager_ptr_->get_projection_centre_offset();
+  float max_offset = 0.0;
   for (int eye = 0; eye <= 1; ++eye)
   {
-    const float cSign = (eye * 2) - 1;
-
-    // Create the scene render camera
-    PT(Camera) scene_camera_ptr = new Camera(cSceneCameraName);
-    PT(MatrixLens) camera_lens_ptr = new MatrixLens();
-
-    // Translate the projection matrix by the projection offset
-    LMatrix4f projection_offset = projection * LMatrix4f::translate_mat(-cSign * cProjectionCentreOffset, 0, 0);
-
-    // Set the lens matrix and attach it to the scene camera
-    camera_lens_ptr->set_user_mat(projection_offset);
-    scene_camera_ptr->set_lens(camera_lens_ptr);
+    hud_film_offset_[eye] = parameters_ptr_->hud_film_offset[eye];
+    max_offset = max(max_offset, float(fabs(hud_film_offset_[eye])));
+  }
 
-    scene_camera_np_[eye] = NodePath(scene_camera_ptr);
+  // Render the HUD once, wide enough for both eyes' offset views of it
+  const LVecBase2f cLayerFilmSize(hud_film_size_[0] + max_offset * 2.0, hud_film_size_[1]);
 
-    // Move the camera by the eye separation distance
-    scene_camera_np_[eye].set_pos(cSign * cIPDOffset, 0, 0);
-    scene_camera_np_[eye].reparent_to(scene_camera_root_np_);
+  // Match the eye buffer's texel density
+  int eye_width = 0, layer_height = 0;
+  if (eye_source_ptr_)
+  {
+    eye_width = eye_source_ptr_->get_x_size() / 2;
+    layer_height = eye_source_ptr_->get_y_size();
+  }
+  else
+  {
+    PT(GraphicsOutput) scene_buffer_ptr = get_scene_buffer(cEyeLeft);
+    eye_width = scene_buffer_ptr->get_x_size() / (is_per_eye() ? 1 : 2);
+    layer_height = scene_buffer_ptr->get_y_size();
+  }
+  const int cLayerWidth = int(ceil(eye_width * cLayerFilmSize[0] / hud_film_size_[0]));
+
+  // Attach the camera to the render_2d node so the aspect_2d scale is applied correctly
+  if (!hud_layer_ptr_->create(window_ptr_->get_graphics_output(),
+                              window_ptr_->get_render_2d(),
+                              cLayerWidth,
+                              layer_height,
+                              cLayerFilmSize))
+    return false;
 
-    // Attach the camera to the scene display region
-    scene_region_ptr_[eye]->set_camera(scene_camera_np_[eye]);
+  for (int eye = 0; eye <= 1; ++eye)
+  {
+    // The eye sees its film's part of the layer
+    const float cScaleU = hud_film_size_[0] / cLayerFilmSize[0];
+    hud_layer_ptr_->set_placement(eye, LVecBase4f(cScaleU,
+                                                  1.0,
+                                                  (1.0 - cScaleU) * 0.5 + hud_film_offset_[eye] / cLayerFilmSize[0],
+                                                  0.0));
   }
 
   return true;
 }
 
-void DisplayManager::destroy_scene_cameras()
+void DisplayManager::destroy_hud_layer()
 {
-  for (int eye = 0; eye <= 1; ++eye)
+  hud_layer_ptr_->destroy();
+}
+
+bool DisplayManager::update_distortion_table()
+{
+  if (!parameters_ptr_)
+    return false;
+
+  // Only rebuild when the parameters have changed
+  if (!distortion_table_.is_valid() || distortion_table_version_ != parameters_ptr_->version)
   {
-    if (!scene_camera_np_[eye].is_empty())
-      // Remove the scene camera
-      scene_camera_np_[eye].remove_node();
+    distortion_table_version_ = parameters_ptr_->version;
+
+    // Use what an earlier run baked for these parameters, or bake it for the next
+    if (open_distortion_cache())
+    {
+      distortion_table_.restore(parameters_ptr_->warp,
+                                distortion_cache_.get_max_warped_radius(),
+                                distortion_cache_.get_radius_ratios());
+    }
+    else
+    {
+      distortion_table_.update(parameters_ptr_->warp);
+      save_distortion_cache();
+    }
   }
+
+  return distortion_table_.is_valid();
 }
 
-bool DisplayManager::create_hud_cameras()
+string DisplayManager::get_distortion_cache_file_name()
 {
-  assert(rift_manager_ptr_);
-  assert(hud_region_ptr_[cEyeLeft]);
-  assert(hud_region_ptr_[cEyeRight]);
+  ostringstream file_name;
+  file_name << distortion_cache_directory_ << "/" << cDistortionCacheFilePrefix
+            << hex << setw(16) << setfill('0') << get_distortion_cache_key()
+            << cDistortionCacheFileSuffix;
 
-  // Get the device values
-  const float cWidthPixels = rift_manager_ptr_->get_display_width_pixels();
-  const float cHeightPixels = rift_manager_ptr_->get_display_height_pixels();
-  const float cHalfWidthPixels = cWidthPixels * 0.5;
-  const float cWidthMetres = rift_manager_ptr_->get_display_width_metres();
-  const float cLensSeparationInMetres = rift_manager_ptr_->get_lens_separation();
-  const float cEyeDistanceToScreenInMetres = rift_manager_ptr_->get_eye_screen_distance();
+  return file_name.str();
+}
 
-  // Calculate distances
-  const float cMetresToPixels = cWidthPixels / cWidthMetres;
-  const float cLensSeparationInPixels = cLensSeparationInMetres * cMetresToPixels;
-  const float cEyeSeparationInPixels = rift_manager_ptr_->get_interpupillary_distance() * cMetresToPixels;
+PN_uint64 DisplayManager::get_distortion_cache_key()
+{
+  // The warp parameters all follow from the device key; the sizes are ours
+  CacheKey key;
+  key.add(&parameters_ptr_->device_key, sizeof(parameters_ptr_->device_key));
+  key.add(lookup_width_);
+  key.add(lookup_height_);
+  key.add(cDistortionTableSize);
+
+  return key.get_value();
+}
 
-  // Calculate the target HUD resolution
-  const float cHalfScreenDistance = tan(cDefaultFOV2D * 0.5) * cEyeDistanceToScreenInMetres;
-  const float cFOVMetres = (2.0 * cHalfScreenDistance) / rift_manager_ptr_->get_distortion_scale();
-  const float cFOVPixels = cFOVMetres * cMetresToPixels;
+bool DisplayManager::open_distortion_cache()
+{
+  distortion_cache_.close();
 
-  // Get the HUD aspect ratio from the window aspect_2d node
-  LVecBase3f aspect_scale_vec = window_ptr_->get_aspect_2d().get_scale();
+  if (distortion_cache_directory_.empty())
+    return false;
 
-  // Calculate the HUD size as orthographic camera parameters
-  const float cCameraOffsetInPixels = (cEyeDistanceToScreenInMetres / cHUDDistance) * cEyeSeparationInPixels;
-  const float cCameraFilmWidth = cWidthPixels / (aspect_scale_vec.get_z() * cFOVPixels);
-  const float cCameraFilmHeight = (cHeightPixels * 2.0) / (aspect_scale_vec.get_x() * cFOVPixels);
+  const string cFileName = get_distortion_cache_file_name();
+  if (!distortion_cache_.open(cFileName,
+                              get_distortion_cache_key(),
+                              lookup_width_,
+                              lookup_height_,
+                              cDistortionTableSize))
+    return false;
 
-  // Calculate the orthographic camera offset from the centre
-  const float cLensOffsetInPixels = cHalfWidthPixels - cLensSeparationInPixels;
-  const float cOffsetInPixels = cLensOffsetInPixels + cCameraOffsetInPixels / rift_manager_ptr_->get_distortion_scale();
-  const float cCameraOffset = cOffsetInPixels / cFOVPixels;
+  if (pandrift_cat.is_info())
+    pandrift_cat.info() << "open_distortion_cache: Mapped " << cFileName << endl;
 
-  for (int eye = 0; eye <= 1; ++eye)
-  {
-    const float cSign = (eye * 2) - 1;
+  return true;
+}
+
+void DisplayManager::save_distortion_cache()
+{
+  if (distortion_cache_directory_.empty() || !distortion_table_.is_valid())
+    return;
 
-    // Create the orthographic lens
-    PT(OrthographicLens) lens_ptr = new OrthographicLens();
-    lens_ptr->set_film_size(cCameraFilmWidth, cCameraFilmHeight);
-    lens_ptr->set_film_offset(cCameraOffset * cSign, 0);
-    lens_ptr->set_near_far(cOrthographicLensNear,
-                           cOrthographicLensFar);
+  // Bake the lookup whether or not this display samples it, so the file
+  // serves every warp mode
+  pvector<float> lookup(DistortionCache::get_lookup_bytes(lookup_width_, lookup_height_) / sizeof(float));
+  distortion_table_.bake_lookup(lookup_width_, lookup_height_, &lookup[0]);
+
+  const string cFileName = get_distortion_cache_file_name();
+  if (!DistortionCache::save(cFileName,
+                             get_distortion_cache_key(),
+                             lookup_width_,
+                             lookup_height_,
+                             reinterpret_cast<const unsigned char *>(&lookup[0]),
+                             distortion_table_.get_size(),
+                             distortion_table_.get_max_warped_radius(),
+                             distortion_table_.get_radius_ratios()))
+    return;
+
+  if (pandrift_cat.is_info())
+    pandrift_cat.info() << "save_distortion_cache: Baked " << cFileName << endl;
 
-    // Create the camera and set the lens
-    PT(Camera) camera_ptr = new Camera(cHUDCameraName);
-    camera_ptr->set_lens(lens_ptr);
+  // Map it straight back, so the lookup texture comes from the file either way
+  open_distortion_cache();
+}
 
-    // Attach the camera to the render_2d node so the aspect_2d scale is applied correctly
-    hud_camera_np_[eye] = NodePath(camera_ptr);
-    hud_camera_np_[eye].reparent_to(window_ptr_->get_render_2d());
+bool DisplayManager::create_lookup_texture()
+{
+  assert(!lookup_texture_ptr_);
 
-    // Attach the camera to the 2D display region
-    hud_region_ptr_[eye]->set_camera(hud_camera_np_[eye]);
+  if (!update_distortion_table())
+  {
+    pandrift_cat.error() << "create_lookup_texture: Invalid distortion table";
+    return false;
   }
 
+  // Scene UVs for every panel texel, side-by-side
+  lookup_texture_ptr_ = new Texture(cLookupTextureName);
+  lookup_texture_ptr_->setup_2d_texture(lookup_width_, lookup_height_, Texture::T_float, Texture::F_rgba32);
+  lookup_texture_ptr_->set_magfilter(Texture::FT_linear);
+  lookup_texture_ptr_->set_minfilter(Texture::FT_linear);
+  lookup_texture_ptr_->set_wrap_u(Texture::WM_clamp);
+  lookup_texture_ptr_->set_wrap_v(Texture::WM_clamp);
+
+  // The cache mapping stays as the CPU copy, so drop the RAM image once uploaded
+  lookup_texture_ptr_->set_keep_ram_image(false);
+
+  // The mapped file is laid out as the RAM image, so it is copied straight in
+  const size_t cLookupBytes = DistortionCache::get_lookup_bytes(lookup_width_, lookup_height_);
+  PTA_uchar image = PTA_uchar::empty_array(cLookupBytes);
+  if (distortion_cache_.is_open() && distortion_cache_.get_lookup_bytes() == cLookupBytes)
+    memcpy(image.p(), distortion_cache_.get_lookup(), cLookupBytes);
+  else
+    distortion_table_.bake_lookup(lookup_width_, lookup_height_, reinterpret_cast<float *>(image.p()));
+
+  lookup_texture_ptr_->set_ram_image(image);
+
   return true;
 }
 
-void DisplayManager::destroy_hud_cameras()
+void DisplayManager::destroy_lookup_texture()
 {
-  for (int eye = 0; eye <= 1; ++eye)
-  {
-    if (!hud_camera_np_[eye].is_empty())
-
-      hud_camera_np_[eye].remove_node();
-  }
+  lookup_texture_ptr_ = NULL;
 }
 
 bool DisplayManager::apply_shader()
@@ -547,6 +1872,11 @@ bool DisplayManager::apply_shader()
   // It avoids path issues and seems to be common practice
   switch (warp_mode_)
   {
+    case cStereo:
+      vertex_shader_file_name = "pandrift-distortion-v.glsl";
+      fragment_shader_file_name = "pandrift-composite-f.glsl";
+      break;
+
     case cShader:
       vertex_shader_file_name = "pandrift-distortion-v.glsl";
       fragment_shader_file_name = "pandrift-distortion-f.glsl";
@@ -557,14 +1887,17 @@ bool DisplayManager::apply_shader()
       fragment_shader_file_name = "pandrift-distortion-chroma-f.glsl";
       break;
 
+    case cLookupTexture:
+      vertex_shader_file_name = "pandrift-distortion-v.glsl";
+      fragment_shader_file_name = "pandrift-lookup-f.glsl";
+      break;
+
     default:
       return false;
   }
 
   // Load and compile the shader
-  render_shader_ = Shader::load(Shader::SL_GLSL,
-                                vertex_shader_file_name.c_str(),
-                                fragment_shader_file_name.c_str());
+  render_shader_ = load_warp_shader(vertex_shader_file_name, fragment_shader_file_name);
 
   if (!render_shader_)
   {
@@ -572,41 +1905,351 @@ bool DisplayManager::apply_shader()
     return false;
   }
 
-  // Calculate the shader parameters
-  const float cY = 0.0, cW = 0.5, cH = 1.0;
-  const float cScaleFactor = 1.0 / rift_manager_ptr_->get_distortion_scale();
-  const float cAspectRatio = rift_manager_ptr_->get_display_aspect_ratio();
-  LVector2f rift_scale_in_v = LVector2f((2.0 / cW), (2.0 / cH) / cAspectRatio);
-  LVector2f rift_scale_v = LVector2f((cW / 2.0) * cScaleFactor, (cH / 2.0) * cScaleFactor * cAspectRatio);
-  LVector4f distortion_params_v = rift_manager_ptr_->get_distortion_coefficients();
-  LVector4f chroma_params_v = rift_manager_ptr_->get_chromatic_aberration_coefficients();
+  // The drawn scene needs no reprojecting, so this is only swapped in while it's held
+  if (is_reprojecting())
+  {
+    reproject_shader_ = load_warp_shader(vertex_shader_file_name,
+                                         cShaderChromaticAberration == warp_mode_ ? "pandrift-reproject-chroma-f.glsl" :
+                                                                                    "pandrift-reproject-f.glsl");
+
+    if (!reproject_shader_)
+    {
+      pandrift_cat.error() << "apply_shader: Unable to load reprojection shader";
+      render_shader_ = NULL;
+      return false;
+    }
+  }
+
+  // Apply the same shader to both shader cards
+  apply_reprojection();
+
+  set_shader_inputs();
+
+  // Start from the pose the first scene is drawn from, if there are scene cameras
+  if (!eye_source_ptr_)
+    for (int eye = 0; eye <= 1; ++eye)
+      drawn_camera_mat_[eye] = scene_camera_np_[eye].get_mat(NodePath());
+
+  // Scan for LODNodes on the first update
+  lod_refresh_ = true;
+
+  // Give the warp the camera movement each frame, before the frame renders
+  warp_task_ptr_ = new GenericAsyncTask(cWarpTaskName, &warp_update_task, this);
+  warp_task_ptr_->set_sort(cWarpTaskSort);
+  AsyncTaskManager::get_global_ptr()->add(warp_task_ptr_);
+
+  update_warp();
+
+  return true;
+}
+
+const WarpParameters &DisplayManager::get_warp_parameters()
+{
+  // The per-eye layout samples each eye's texture over [0, 1]
+  if (is_per_eye())
+    return parameters_ptr_->eye_warp;
 
-  float cDistortionCentreOffset = rift_manager_ptr_->get_distortion_centre_offset() * 0.5;
+  return parameters_ptr_->warp;
+}
+
+void DisplayManager::apply_reprojection()
+{
+  Shader *shader_ptr = (reproject_shader_ && is_scene_held()) ? reproject_shader_ : render_shader_;
   for (int eye = 0; eye <= 1; ++eye)
   {
-    const float cSign = (eye * 2) - 1;
-    const float cX = float(eye) * 0.5;
+    if (render_card_np_[eye].get_shader() == shader_ptr)
+      continue;
+
+    render_card_np_[eye].set_shader(shader_ptr);
 
-    // Apply the same shader to both shader cards
-    render_card_np_[eye].set_shader(render_shader_);
+    // The kept card states hold the other shader
+    upscaled_card_state_[eye][0] = NULL;
+    upscaled_card_state_[eye][1] = NULL;
+  }
+}
+
+void DisplayManager::set_shader_inputs()
+{
+  const WarpParameters &params = get_warp_parameters();
 
-    // Apply the eye offset
-    LVector2f rift_screen_centre_v = LVector2f(cX + 0.25, 0.5);
-    LVector2f rift_lens_centre_v = LVector2f(cX + (cW + cDistortionCentreOffset * -cSign) * 0.5, 0.5);
+  for (int eye = 0; eye <= 1; ++eye)
+  {
+    // The kept card states are out of date
+    upscaled_card_state_[eye][0] = NULL;
+    upscaled_card_state_[eye][1] = NULL;
 
     // Attach the shader paramters to the card
-    render_card_np_[eye].set_shader_input("ScaleIn", rift_scale_in_v);
-    render_card_np_[eye].set_shader_input("Scale", rift_scale_v);
-    render_card_np_[eye].set_shader_input("ScreenCenter", rift_screen_centre_v);
-    render_card_np_[eye].set_shader_input("LensCenter", rift_lens_centre_v);
-    render_card_np_[eye].set_shader_input("HmdWarpParam", distortion_params_v);
+    render_card_np_[eye].set_shader_input("ScaleIn", params.scale_in);
+    render_card_np_[eye].set_shader_input("Scale", params.scale);
+    render_card_np_[eye].set_shader_input("ScreenCenter", params.screen_centre[eye]);
+    render_card_np_[eye].set_shader_input("ScreenHalfSize", params.screen_half_size);
+    render_card_np_[eye].set_shader_input("LensCenter", params.lens_centre[eye]);
+    render_card_np_[eye].set_shader_input("HmdWarpParam", params.distortion);
 
     // Attach the chromatic aberration parameter, if needed
     if (cShaderChromaticAberration == warp_mode_)
-      render_card_np_[eye].set_shader_input("ChromAbParam", chroma_params_v);
+      render_card_np_[eye].set_shader_input("ChromAbParam", params.chroma);
+
+    // Attach the lookup, and the map from the card's UVs to the panel's, if needed
+    if (lookup_texture_ptr_)
+    {
+      render_card_np_[eye].set_shader_input("WarpLookup", lookup_texture_ptr_);
+      if (is_per_eye())
+        render_card_np_[eye].set_shader_input("LookupTransform", LVecBase4f(0.5, 1.0, float(eye) * 0.5, 0.0));
+      else
+        render_card_np_[eye].set_shader_input("LookupTransform", LVecBase4f(1.0, 1.0, 0.0, 0.0));
+    }
+
+    // Attach the layers. Every sampler needs a texture, so unused slots
+    // repeat the scene texture.
+    int layer_count = 0;
+    for (int layer = 0; layer < cMaxLayers; ++layer)
+    {
+      const string cIndex = (layer == 0) ? "0" : "1";
+      Texture *texture_ptr = get_eye_texture(eye);
+      LVecBase4f placement(1.0, 1.0, 0.0, 0.0);
+
+      if (layer < int(layers_.size()) && layers_[layer]->is_created())
+      {
+        texture_ptr = layers_[layer]->get_texture();
+        placement = layers_[layer]->get_placement(eye);
+        ++layer_count;
+      }
+
+      render_card_np_[eye].set_shader_input("LayerTexture" + cIndex, texture_ptr);
+      render_card_np_[eye].set_shader_input("LayerRect" + cIndex, placement);
+    }
+    render_card_np_[eye].set_shader_input("LayerCount", float(layer_count));
+
+    // Attach the eye's projection, for turning and reprojecting its view
+    LMatrix4f projection_mat, inverse_mat;
+    get_eye_projection(eye, projection_mat, inverse_mat);
+    render_card_np_[eye].set_shader_input("Projection", projection_mat);
+    render_card_np_[eye].set_shader_input("InverseProjection", inverse_mat);
+    render_card_np_[eye].set_shader_input("ScanRotation", scan_rotation_input_);
+
+    // Attach the eye's depth for reprojection, if needed
+    if (is_reprojecting())
+    {
+      render_card_np_[eye].set_shader_input("DepthTexture", scene_depth_ptr_[is_per_eye() ? eye : cEyeLeft]);
+      render_card_np_[eye].set_shader_input("PoseDelta", pose_delta_input_[eye]);
+    }
   }
+}
 
-  return true;
+bool DisplayManager::is_reprojecting()
+{
+  return scene_depth_ptr_[cEyeLeft] != NULL &&
+         (cShader == warp_mode_ || cShaderChromaticAberration == warp_mode_);
+}
+
+void DisplayManager::get_eye_projection(int eye, LMatrix4f &projection_mat, LMatrix4f &inverse_mat)
+{
+  // The scene camera's lens, or the one it would have for an eye source
+  PT(Lens) lens_ptr;
+  if (!scene_camera_np_[eye].is_empty())
+  {
+    lens_ptr = DCAST(Camera, scene_camera_np_[eye].node())->get_lens();
+  }
+  else
+  {
+    PT(MatrixLens) matrix_lens_ptr = new MatrixLens();
+    matrix_lens_ptr->set_user_mat(parameters_ptr_->projection[eye]);
+    lens_ptr = matrix_lens_ptr;
+  }
+
+  projection_mat = lens_ptr->get_projection_mat();
+  inverse_mat = lens_ptr->get_projection_mat_inv();
+}
+
+void DisplayManager::update_scanout()
+{
+  LVector3f rate_v;
+  if (!scanout_compensation_ || !rift_manager_ptr_->get_sensor_angular_velocity(rate_v) || rate_v.length() <= 0)
+  {
+    scan_rotation_input_[0] = LVecBase4f(0, 0, 1, 0);
+    return;
+  }
+
+  // The eyes aren't turned from the head, so share its axes. Over a scanout
+  // the rate barely changes, so the turn grows evenly down the panel.
+  const float cRate = rate_v.length();
+  rate_v /= cRate;
+  scan_rotation_input_[0] = LVecBase4f(rate_v[0], rate_v[1], rate_v[2],
+                                       cRate * rift_manager_ptr_->get_refresh_period() * cScanoutFraction);
+}
+
+AsyncTask::DoneStatus DisplayManager::warp_update_task(GenericAsyncTask *task_ptr, void *data_ptr)
+{
+  DisplayManager *display_manager_ptr = reinterpret_cast<DisplayManager *>(data_ptr);
+  display_manager_ptr->update_warp();
+
+  return AsyncTask::DS_cont;
+}
+
+void DisplayManager::update_warp()
+{
+  PANDRIFT_AUDIT_SITE("DisplayManager::update_warp");
+
+  // Last frame drew the scene for the first time; it may be held from now on
+  if (scene_prime_updates_ > 0 && --scene_prime_updates_ == 0)
+    apply_display_state();
+
+  if (is_low_power())
+    return;
+
+  // For the pose the warp presents at, eye source or not
+  update_scanout();
+
+  // Each of these follows the scene cameras, which an eye source doesn't have
+  if (eye_source_ptr_)
+    return;
+
+  if (far_field_buffer_ptr_)
+    refit_far_field_cards();
+
+  for (int eye = 0; eye <= 1; ++eye)
+  {
+    LMatrix4f camera_mat;
+    {
+      // Panda composes a new net transform each time the camera moves
+      PANDRIFT_AUDIT_EXPECTED("scene camera transform");
+      camera_mat = scene_camera_np_[eye].get_mat(NodePath());
+    }
+
+    if (is_upscaling())
+      update_upscaling(eye, camera_mat);
+
+    if (!is_reprojecting())
+      continue;
+
+    // While the scene is drawn it is drawn from the current pose, and the
+    // plain warp presents it; while it is held back, the warp makes up the difference
+    if (!is_scene_held())
+    {
+      drawn_camera_mat_[eye] = camera_mat;
+      continue;
+    }
+
+    // From the current eye's space to the space the scene was drawn in
+    LMatrix4f drawn_inverse_mat;
+    drawn_inverse_mat.invert_from(drawn_camera_mat_[eye]);
+    pose_delta_input_[eye][0] = camera_mat * drawn_inverse_mat;
+  }
+
+  if (eccentricity_lod_ && !is_scene_held())
+    update_eccentricity_lod();
+
+  // Apply the worker's last cull before this frame's, and ask for the next
+  if (guard_band_culling_ && !is_scene_held())
+    guard_band_culler_ptr_->update();
+
+  // Last frame's query results, for both eyes
+  if (occlusion_culling_ && !is_scene_held())
+    occlusion_culler_ptr_->update();
+}
+
+void DisplayManager::apply_display_state()
+{
+  if (!created_)
+    return;
+
+  // Everything is switched on and off in place, never created or released
+  const bool cDrawn = cStateMinimized != display_state_;
+  const bool cIdle = cStateHeadsetIdle == display_state_;
+
+  // As we want to ensure the default 2D region is deactivated,
+  // access the root to ensure it has been created.
+  window_ptr_->get_render_2d();
+
+  // Enable/disable the default 3D display region
+  DisplayRegion *region_3d_ptr = window_ptr_->get_display_region_3d();
+  assert(region_3d_ptr);
+  region_3d_ptr->set_active(!enabled_ && cDrawn);
+
+  // Enabled/disable the default 2D display region
+  DisplayRegion *region_2d_ptr = window_ptr_->get_display_region_2d();
+  assert(region_2d_ptr);
+  region_2d_ptr->set_active(!enabled_ && cDrawn);
+
+  // Enable/disable our render region
+  render_region_ptr_->set_active(enabled_ && cDrawn);
+  render_region_ptr_->set_clear_color_active(cIdle);
+
+  // The warp presents unless the compositor does, or the headset is idle
+  for (int eye = 0; eye <= 1; ++eye)
+  {
+    if (render_card_np_[eye].is_empty())
+      continue;
+
+    if (is_publishing() || cIdle)
+      render_card_np_[eye].hide();
+    else
+      render_card_np_[eye].show();
+  }
+
+  // The scene, and everything following it, only draws while it's shown
+  const bool cSceneDrawn = !is_scene_held();
+  for (int buffer = 0; buffer <= 1; ++buffer)
+    if (scene_buffer_ptr_[buffer])
+      scene_buffer_ptr_[buffer]->set_active(cSceneDrawn);
+  if (far_field_buffer_ptr_)
+    far_field_buffer_ptr_->set_active(cSceneDrawn);
+  occlusion_culler_ptr_->set_active(cSceneDrawn);
+
+  if (!cSceneDrawn)
+    for (int eye = 0; eye <= 1; ++eye)
+      if (upscaler_ptr_[eye]->is_created())
+        upscaler_ptr_[eye]->hold();
+
+  // The warp only reprojects the scene while it's held
+  if (render_shader_)
+    apply_reprojection();
+
+  // Paused still shows the layers over the held scene
+  const bool cLayersShown = enabled_ && (cStateActive == display_state_ || cStatePaused == display_state_);
+  for (size_t layer = 0; layer < layers_.size(); ++layer)
+    layers_[layer]->set_suspended(!cLayersShown);
+
+  if (rift_manager_ptr_)
+    rift_manager_ptr_->set_sensor_report_rate(is_low_power() ? cIdleSensorReportRate : 0);
+
+  limit_frame_rate(is_low_power());
+}
+
+bool DisplayManager::is_scene_held()
+{
+  if (scene_prime_updates_ > 0)
+    return false;
+
+  return loading_ || !enabled_ || cStateActive != display_state_;
+}
+
+bool DisplayManager::is_low_power()
+{
+  return cStateMinimized == display_state_ || cStateHeadsetIdle == display_state_;
+}
+
+void DisplayManager::limit_frame_rate(bool limited)
+{
+  if (limited == frame_rate_limited_)
+    return;
+
+  // The clock waits out the period as it ticks at the end of the frame,
+  // rather than any task holding up the chain mid-frame
+  ClockObject *clock_ptr = ClockObject::get_global_clock();
+  if (limited)
+  {
+    unlimited_clock_mode_ = clock_ptr->get_mode();
+    clock_ptr->set_mode(ClockObject::M_limited);
+    clock_ptr->set_frame_rate(1.0 / cLowPowerFramePeriod);
+  }
+  else
+  {
+    clock_ptr->set_mode(unlimited_clock_mode_);
+  }
+
+  frame_rate_limited_ = limited;
 }
 
 void DisplayManager::remove_shader()
@@ -616,6 +2259,9 @@ void DisplayManager::remove_shader()
     if (!render_card_np_[eye].is_empty())
       // Remove the render card
       render_card_np_[eye].clear_shader();
+
+    upscaled_card_state_[eye][0] = NULL;
+    upscaled_card_state_[eye][1] = NULL;
   }
 
   if (render_shader_)
@@ -623,6 +2269,81 @@ void DisplayManager::remove_shader()
     // Reset the shader
     render_shader_ = NULL;
   }
+  reproject_shader_ = NULL;
+
+  if (warp_task_ptr_)
+  {
+    warp_task_ptr_->remove();
+    warp_task_ptr_ = NULL;
+  }
+}
+
+bool DisplayManager::create_capture_region(GraphicsOutput *graphics_output_ptr)
+{
+  assert(capture_ptr_);
+  assert(!capture_region_ptr_);
+
+  // A region drawn after everything else on the target, whose camera sees
+  // nothing, gives us a draw callback at the end of the target's frame
+  capture_region_ptr_ = graphics_output_ptr->make_display_region();
+  capture_region_ptr_->set_sort(cCaptureSort);
+  capture_region_ptr_->set_draw_callback(new CaptureCallback(capture_ptr_.get()));
+
+  capture_camera_np_ = NodePath(new Camera(cCaptureCameraName));
+  capture_region_ptr_->set_camera(capture_camera_np_);
+
+  return true;
+}
+
+bool DisplayManager::create_publish_region()
+{
+  assert(publisher_ptr_);
+  assert(!publish_region_ptr_);
+
+  // As with capture, a region drawn last on the scene buffer reads it back
+  GraphicsOutput *scene_buffer_ptr = get_scene_buffer(cEyeLeft);
+  publish_region_ptr_ = scene_buffer_ptr->make_display_region();
+  publish_region_ptr_->set_sort(cPublishSort);
+  publish_region_ptr_->set_draw_callback(new PublishCallback(publisher_ptr_.get()));
+
+  publish_camera_np_ = NodePath(new Camera(cPublishCameraName));
+  publish_region_ptr_->set_camera(publish_camera_np_);
+
+  // Each eye's region reports the pose it was drawn with
+  for (int eye = 0; eye <= 1; ++eye)
+    scene_region_ptr_[eye]->set_draw_callback(new DrawnPoseCallback(publisher_ptr_.get(), eye));
+
+  return true;
+}
+
+void DisplayManager::destroy_publish_region()
+{
+  for (int eye = 0; eye <= 1; ++eye)
+    if (scene_region_ptr_[eye])
+      scene_region_ptr_[eye]->clear_draw_callback();
+
+  if (publish_region_ptr_)
+  {
+    // Remove the publish region before its publisher can go away
+    publish_region_ptr_->get_window()->remove_display_region(publish_region_ptr_);
+    publish_region_ptr_ = NULL;
+  }
+
+  if (!publish_camera_np_.is_empty())
+    publish_camera_np_.remove_node();
+}
+
+void DisplayManager::destroy_capture_region()
+{
+  if (capture_region_ptr_)
+  {
+    // Remove the capture region before its capture can go away
+    capture_region_ptr_->get_window()->remove_display_region(capture_region_ptr_);
+    capture_region_ptr_ = NULL;
+  }
+
+  if (!capture_camera_np_.is_empty())
+    capture_camera_np_.remove_node();
 }
 
 }
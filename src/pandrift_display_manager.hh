@@ -11,8 +11,24 @@ See the file LICENSE for details.
 
 #include "pandrift.hh"
 #include "pandrift_rift_manager.hh"
+#include "pandrift_frame_capture.hh"
+#include "pandrift_distortion_table.hh"
+#include "pandrift_distortion_cache.hh"
+#include "pandrift_lens_footprint.hh"
+#include "pandrift_compositor_layer.hh"
+#include "pandrift_render_target_pool.hh"
+#include "pandrift_temporal_upscaler.hh"
+#include "pandrift_guard_band_culler.hh"
+#include "pandrift_occlusion_culler.hh"
+#include "pandrift_frame_publisher.hh"
 #include "pandaFramework.h"
 #include "pandaSystem.h"
+#include "genericAsyncTask.h"
+#include "nodePathCollection.h"
+#include "pta_LMatrix4.h"
+#include "pta_LVecBase4.h"
+#include "renderState.h"
+#include "clockObject.h"
 #include "boost/shared_ptr.hpp"
 
 namespace pandrift
@@ -25,7 +41,28 @@ public:
   {
     cStereo = 0,
     cShader,
-    cShaderChromaticAberration
+    cShaderChromaticAberration,
+    cLookupTexture
+  };
+
+  enum SceneLayout
+  {
+    cLayoutSideBySide = 0,
+    cLayoutPerEye
+  };
+
+  enum CaptureSource
+  {
+    cCaptureWarped = 0,
+    cCaptureEyeBuffer
+  };
+
+  enum DisplayState
+  {
+    cStateActive = 0,
+    cStatePaused,
+    cStateMinimized,
+    cStateHeadsetIdle
   };
 
   DisplayManager(PT(WindowFramework) window_ptr);
@@ -36,8 +73,93 @@ public:
 
   void set_scene_resolution(int width, int height);
 
+  // Render each eye into its own buffer rather than one half of a shared one.
+  // Takes effect when the display is next created.
+  void set_scene_layout(SceneLayout scene_layout);
+
+  // Size of an eye's buffer in the per-eye layout. Defaults to half the scene resolution.
+  void set_eye_resolution(int eye, int width, int height);
+
   void set_lookup_resolution(int width, int height);
 
+  // Keep the baked distortion lookup and inverse table in this directory,
+  // named by the parameters they were baked from, and map them on later runs
+  // rather than baking again. Empty, the default, disables the cache.
+  void set_distortion_cache_directory(const std::string &directory);
+
+  // Buffers are drawn from and returned to the pool, so recreating the display
+  // reuses them. Can be shared; only changed while the display isn't created.
+  void set_render_target_pool(boost::shared_ptr<RenderTargetPool> render_target_pool_ptr);
+
+  boost::shared_ptr<RenderTargetPool> get_render_target_pool();
+
+  // Cull each eye against the part of its view the warp actually samples.
+  // Takes effect when the display is next created.
+  void set_tight_culling(bool tight_culling);
+
+  // Fraction of the eye's view left by the tight cull volume
+  float get_cull_coverage(int eye);
+
+  // Keep each eye's depth, and while the scene is held back, as when loading,
+  // have the warp reproject it by the camera movement since it was last drawn.
+  // Applies to the shader warp modes. Takes effect when the display is next created.
+  void set_reprojection(bool reprojection);
+
+  // Render each eye at this fraction of its resolution, jittered, and rebuild
+  // full resolution by accumulating frames before the warp. Uses one buffer
+  // per eye whatever the layout. 1 disables. Takes effect when the display is next created.
+  void set_upscale_render_scale(float render_scale);
+
+  // Lower detail where the lenses spread the scene over fewer panel pixels.
+  // Each frame the LODNodes in the scene get a LOD scale from how far out
+  // either eye sees them, and the scene cameras pass scene shaders the inputs
+  // of pandrift-periphery-lod.glsl for a texture LOD bias. Both follow the
+  // slope of the HmdWarpParam polynomial. Overrides any LOD scale set on the
+  // nodes. Takes effect when the display is next created.
+  void set_eccentricity_lod(bool eccentricity_lod);
+
+  // The LODNodes are found when the display is created. Call this after
+  // adding models to or removing them from the scene to find them again.
+  void refresh_lod_nodes();
+
+  // A scene shader whose fragment shader can call PeripheryLodBias(), as
+  // pandrift-periphery-lod.glsl is loaded ahead of it
+  static PT(Shader) load_periphery_shader(const std::string &vertex_file_name,
+                                          const std::string &fragment_file_name);
+
+  // Hide the culler's static objects that are well outside the view, from a
+  // cull a worker thread runs ahead of the head's motion. Add static roots
+  // through get_guard_band_culler. Takes effect when the display is next created.
+  void set_guard_band_culling(bool guard_band_culling);
+
+  boost::shared_ptr<GuardBandCuller> get_guard_band_culler();
+
+  // Hide the culler's static objects behind its occluder proxies, from one
+  // set of occlusion queries covering both eyes. Add occluders and occludees
+  // through get_occlusion_culler. Takes effect when the display is next created.
+  void set_occlusion_culling(bool occlusion_culling);
+
+  boost::shared_ptr<OcclusionCuller> get_occlusion_culler();
+
+  // Draw what lies beyond this distance once, from between the eyes, into a
+  // far field buffer each eye draws its nearer geometry over. At the Rift's
+  // eye separation, disparity past a few tens of metres is under a pixel. The
+  // eyes clip at the distance, so scene shaders must honour clip planes. 0,
+  // the default, draws everything for each eye. Takes effect when the display is next created.
+  void set_far_field_distance(float distance);
+
+  // The panel lights its rows top to bottom over most of a refresh, so a
+  // turning head sees lower rows from a later pose than the frame was drawn
+  // for. Turn each row's view by the rotation since the top row, from the
+  // sensor's rate of turn and the RiftManager's refresh period, removing the
+  // shear. Applies to the warp modes other than stereo.
+  void set_scanout_compensation(bool scanout_compensation);
+
+  // Warp this texture, laid out side by side, rather than rendering the
+  // scene; as a compositor presenting frames another process publishes.
+  // NULL, the default, renders the scene. Takes effect when the display is next created.
+  void set_eye_source(Texture *texture_ptr);
+
   NodePath get_camera_root();
 
   bool set_rift_manager(boost::shared_ptr<RiftManager> rift_manager_ptr);
@@ -48,10 +170,74 @@ public:
 
   void destroy_display();
 
+  // Destroy the display and free the pooled buffers while the window, and so
+  // its GL context, still exists. Call before closing the framework.
+  void shutdown();
+
+  // Pick up a new RiftManager parameter snapshot, if there is one.
+  // Returns true if the display was updated.
+  bool refresh_stereo_parameters();
+
   bool is_enabled();
 
   void set_enabled(bool enabled);
 
+  // While loading the scene isn't rendered; the warp keeps presenting the
+  // last eye buffer at full rate. A new display always draws its first
+  // frame, so there is a last eye buffer to present.
+  void set_loading(bool loading);
+
+  bool is_loading();
+
+  // Paused holds the scene as loading does, while the warp and layers keep
+  // presenting. Headset idle presents black, and minimized draws nothing at
+  // all; both suspend the layers, drop the sensor to its idle rate and
+  // throttle the frame rate. Switching state never creates or releases
+  // anything, so returning to active is immediate.
+  void set_display_state(DisplayState state);
+
+  DisplayState get_display_state();
+
+  // With the per-eye layout the eye buffer source captures the left eye
+  bool start_capture(const std::string &file_name, CaptureSource source = cCaptureWarped);
+
+  void stop_capture();
+
+  bool is_capturing();
+
+  int get_capture_dropped_frames();
+
+  // Publish the eye buffer, with the pose each eye was drawn with, to a
+  // SharedFrameRing of this name for a compositor process to warp and
+  // present. The local warp is hidden meanwhile. Needs the side-by-side layout.
+  bool start_publishing(const std::string &ring_name);
+
+  void stop_publishing();
+
+  bool is_publishing();
+
+  int get_published_frames();
+
+  // Map window pixels (origin top left) to side-by-side scene buffer UVs, as the warp samples them.
+  // Pixels the warp doesn't sample map outside their eye's half of the buffer.
+  // Returns false, leaving the output unset, if the display isn't created.
+  bool map_panel_to_eye(const LPoint2f *pixels_ptr, LPoint2f *uvs_ptr, int count);
+
+  // Map scene buffer UVs to window pixels through the inverse distortion table
+  bool map_eye_to_panel(const LPoint2f *uvs_ptr, LPoint2f *pixels_ptr, int count);
+
+  // Map window pixels to render_2d coordinates of the HUD seen at that point
+  bool map_panel_to_hud(const LPoint2f *pixels_ptr, LPoint2f *hud_ptr, int count);
+
+  // The layer rendering render_2d. Mark it dirty when the HUD changes.
+  boost::shared_ptr<CompositorLayer> get_hud_layer();
+
+  // Composite a layer over both eyes in the warp pass, after the HUD.
+  // Returns false when there is no room for another layer.
+  bool add_layer(boost::shared_ptr<CompositorLayer> layer_ptr);
+
+  void remove_layer(boost::shared_ptr<CompositorLayer> layer_ptr);
+
 private:
   bool create_render_region();
 
@@ -69,35 +255,181 @@ private:
 
   void destroy_scene_buffer();
 
+  bool is_per_eye();
+
+  PT(GraphicsOutput) get_scene_buffer(int eye);
+
+  const WarpParameters &get_warp_parameters();
+
+  bool is_reprojecting();
+
+  void get_eye_projection(int eye, LMatrix4f &projection_mat, LMatrix4f &inverse_mat);
+
+  void update_scanout();
+
+  bool create_upscalers();
+
+  void destroy_upscalers();
+
+  bool is_upscaling();
+
+  void update_upscaling(int eye, const LMatrix4f &camera_mat);
+
+  Texture *get_eye_texture(int eye);
+
+  static AsyncTask::DoneStatus warp_update_task(GenericAsyncTask *task_ptr, void *data_ptr);
+
+  void update_warp();
+
+  void apply_display_state();
+
+  bool is_scene_held();
+
+  bool is_low_power();
+
+  void limit_frame_rate(bool limited);
+
   bool create_scene_cameras();
 
   void destroy_scene_cameras();
 
-  bool create_hud_cameras();
+  void apply_tight_culling(int eye);
+
+  void apply_periphery_inputs(int eye);
+
+  void start_guard_band_culling();
+
+  void start_occlusion_culling();
+
+  void calculate_union_view(float &horizontal_half_angle,
+                            float &vertical_half_angle,
+                            float &near_distance,
+                            float &far_distance);
+
+  bool create_far_field();
+
+  void destroy_far_field();
+
+  void create_far_field_card(int eye, float horizontal_half_angle, float vertical_half_angle);
+
+  void destroy_far_field_card(int eye);
 
-  void destroy_hud_cameras();
+  void refit_far_field_cards();
+
+  void apply_far_field_split(int eye);
+
+  void update_eccentricity_lod();
+
+  float get_eccentricity_detail(int eye, const LPoint3f &point);
+
+  bool create_hud_layer();
+
+  void destroy_hud_layer();
+
+  bool update_distortion_table();
+
+  std::string get_distortion_cache_file_name();
+
+  PN_uint64 get_distortion_cache_key();
+
+  bool open_distortion_cache();
+
+  void save_distortion_cache();
+
+  bool create_lookup_texture();
+
+  void destroy_lookup_texture();
 
   bool apply_shader();
 
+  void set_shader_inputs();
+
+  // Put the reprojecting shader on the cards only while the scene is held
+  void apply_reprojection();
+
   void remove_shader();
 
+  bool create_publish_region();
+
+  void destroy_publish_region();
+
+  bool create_capture_region(GraphicsOutput *graphics_output_ptr);
+
+  void destroy_capture_region();
+
   WarpMode warp_mode_;
   int scene_width_, scene_height_;
+  SceneLayout scene_layout_;
+  int eye_width_[2], eye_height_[2];
   int lookup_width_, lookup_height_;
+  std::string distortion_cache_directory_;
+  bool tight_culling_;
+  bool reprojection_;
+  float upscale_render_scale_;
+  bool eccentricity_lod_;
+  bool guard_band_culling_;
+  bool occlusion_culling_;
+  float far_field_distance_;
+  bool scanout_compensation_;
+  PT(Texture) eye_source_ptr_;
+  bool loading_;
+  DisplayState display_state_;
+  bool enabled_;
+  // The global clock's mode before the low power states limited it
+  bool frame_rate_limited_;
+  ClockObject::Mode unlimited_clock_mode_;
   PT(WindowFramework) window_ptr_;
   boost::shared_ptr<RiftManager> rift_manager_ptr_;
   bool created_;
+  boost::shared_ptr<const StereoParameters> parameters_ptr_;
+  unsigned int distortion_table_version_;
   PT(DisplayRegion) render_region_ptr_;
   NodePath render_root_np_;
   NodePath render_camera_np_;
   NodePath render_card_np_[2];
   PT(Shader) render_shader_;
-  PT(GraphicsOutput) scene_buffer_ptr_;
+  PT(Shader) reproject_shader_;
+  boost::shared_ptr<RenderTargetPool> render_target_pool_ptr_;
+  PT(GraphicsOutput) scene_buffer_ptr_[2];
+  PT(Texture) scene_depth_ptr_[2];
+  PT(GenericAsyncTask) warp_task_ptr_;
+  LMatrix4f drawn_camera_mat_[2];
+  // Bound once and updated in place each frame
+  PTA_LMatrix4f pose_delta_input_[2];
+  // The head's turn over the scanout, as an axis and angle; shared by both eyes
+  PTA_LVecBase4f scan_rotation_input_;
+  boost::shared_ptr<TemporalUpscaler> upscaler_ptr_[2];
+  LMatrix4f upscaled_rotation_mat_[2];
+  // Each card's state warping from each history, kept to flip between
+  CPT(RenderState) upscaled_card_state_[2][2];
+  NodePathCollection lod_nodes_;
+  bool lod_refresh_;
+  // Counts down the updates until the scene has drawn once
+  int scene_prime_updates_;
+  boost::shared_ptr<GuardBandCuller> guard_band_culler_ptr_;
+  boost::shared_ptr<OcclusionCuller> occlusion_culler_ptr_;
+  PT(GraphicsOutput) far_field_buffer_ptr_;
+  PT(DisplayRegion) far_field_region_ptr_;
+  NodePath far_field_camera_np_;
+  PT(DisplayRegion) far_field_card_region_ptr_[2];
+  NodePath far_field_card_root_np_[2];
   PT(DisplayRegion) scene_region_ptr_[2];
   NodePath scene_camera_root_np_;
   NodePath scene_camera_np_[2];
-  PT(DisplayRegion) hud_region_ptr_[2];
-  NodePath hud_camera_np_[2];
+  LensFootprint scene_footprint_[2];
+  boost::shared_ptr<CompositorLayer> hud_layer_ptr_;
+  pvector<boost::shared_ptr<CompositorLayer> > layers_;
+  LVecBase2f hud_film_size_;
+  float hud_film_offset_[2];
+  DistortionTable distortion_table_;
+  DistortionCache distortion_cache_;
+  PT(Texture) lookup_texture_ptr_;
+  boost::shared_ptr<FrameCapture> capture_ptr_;
+  PT(DisplayRegion) capture_region_ptr_;
+  NodePath capture_camera_np_;
+  boost::shared_ptr<FramePublisher> publisher_ptr_;
+  PT(DisplayRegion) publish_region_ptr_;
+  NodePath publish_camera_np_;
 };
 
 }
@@ -0,0 +1,238 @@
+/*################################################################
+Pandrift
+Copyright (c) 2013 Warren Moore
+
+This software may be redistributed under the terms of the MIT License.
+See the file LICENSE for details.
+################################################################*/
+
+#include "pandrift_distortion_cache.hh"
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+using namespace std;
+
+namespace
+{
+
+const PN_uint64 cFNVOffsetBasis = 14695981039346656037ULL;
+const PN_uint64 cFNVPrime = 1099511628211ULL;
+const char cMagic[8] = { 'P', 'D', 'R', 'F', 'T', 'D', 'C', '\0' };
+// Bump whenever the layout or the baking changes
+const PN_uint32 cVersion = 1;
+const int cLookupComponents = 4;
+
+}
+
+namespace pandrift
+{
+
+// Native byte order; the file is a cache for this machine, not an interchange format
+struct DistortionCache::Header
+{
+  char magic[8];
+  PN_uint32 version;
+  PN_uint32 header_bytes;
+  PN_uint64 key;
+  PN_int32 lookup_width;
+  PN_int32 lookup_height;
+  PN_int32 table_size;
+  float max_warped_radius;
+};
+
+CacheKey::CacheKey() :
+  value_(cFNVOffsetBasis)
+{
+}
+
+void CacheKey::add(const void *data_ptr, size_t bytes)
+{
+  const unsigned char *byte_ptr = reinterpret_cast<const unsigned char *>(data_ptr);
+  for (size_t byte = 0; byte < bytes; ++byte)
+  {
+    value_ ^= byte_ptr[byte];
+    value_ *= cFNVPrime;
+  }
+}
+
+void CacheKey::add(int value)
+{
+  const PN_int32 cValue = value;
+  add(&cValue, sizeof(cValue));
+}
+
+void CacheKey::add(float value)
+{
+  add(&value, sizeof(value));
+}
+
+PN_uint64 CacheKey::get_value() const
+{
+  return value_;
+}
+
+DistortionCache::DistortionCache() :
+  map_ptr_(NULL),
+  map_bytes_(0)
+{
+}
+
+DistortionCache::~DistortionCache()
+{
+  close();
+}
+
+bool DistortionCache::open(const string &file_name, PN_uint64 key, int lookup_width, int lookup_height, int table_size)
+{
+  close();
+
+  const int cFile = ::open(file_name.c_str(), O_RDONLY);
+  if (cFile < 0)
+    // Not baked yet
+    return false;
+
+  const size_t cExpectedBytes = sizeof(Header) +
+                                get_lookup_bytes(lookup_width, lookup_height) +
+                                size_t(table_size) * sizeof(float);
+
+  struct stat file_stat;
+  if (fstat(cFile, &file_stat) != 0 || size_t(file_stat.st_size) != cExpectedBytes)
+  {
+    ::close(cFile);
+    pandrift_cat.warning() << "open: Ignoring " << file_name << " of the wrong size" << endl;
+    return false;
+  }
+
+  void *map_ptr = mmap(NULL, cExpectedBytes, PROT_READ, MAP_SHARED, cFile, 0);
+  // The mapping holds its own reference to the file
+  ::close(cFile);
+  if (MAP_FAILED == map_ptr)
+  {
+    pandrift_cat.error() << "open: Unable to map " << file_name;
+    return false;
+  }
+
+  map_ptr_ = map_ptr;
+  map_bytes_ = cExpectedBytes;
+
+  const Header *header_ptr = get_header();
+  if (memcmp(header_ptr->magic, cMagic, sizeof(cMagic)) != 0 ||
+      header_ptr->version != cVersion ||
+      header_ptr->header_bytes != sizeof(Header) ||
+      header_ptr->key != key ||
+      header_ptr->lookup_width != lookup_width ||
+      header_ptr->lookup_height != lookup_height ||
+      header_ptr->table_size != table_size ||
+      header_ptr->max_warped_radius <= 0)
+  {
+    pandrift_cat.warning() << "open: Ignoring stale " << file_name << endl;
+    close();
+    return false;
+  }
+
+  return true;
+}
+
+void DistortionCache::close()
+{
+  if (!map_ptr_)
+    return;
+
+  munmap(map_ptr_, map_bytes_);
+  map_ptr_ = NULL;
+  map_bytes_ = 0;
+}
+
+bool DistortionCache::is_open()
+{
+  return map_ptr_ != NULL;
+}
+
+const unsigned char *DistortionCache::get_lookup()
+{
+  assert(map_ptr_);
+
+  return reinterpret_cast<const unsigned char *>(map_ptr_) + sizeof(Header);
+}
+
+size_t DistortionCache::get_lookup_bytes()
+{
+  assert(map_ptr_);
+
+  return get_lookup_bytes(get_header()->lookup_width, get_header()->lookup_height);
+}
+
+float DistortionCache::get_max_warped_radius()
+{
+  assert(map_ptr_);
+
+  return get_header()->max_warped_radius;
+}
+
+const float *DistortionCache::get_radius_ratios()
+{
+  assert(map_ptr_);
+
+  // The lookup is whole floats, so the table stays aligned
+  return reinterpret_cast<const float *>(get_lookup() + get_lookup_bytes());
+}
+
+bool DistortionCache::save(const string &file_name,
+                           PN_uint64 key,
+                           int lookup_width,
+                           int lookup_height,
+                           const unsigned char *lookup_ptr,
+                           int table_size,
+                           float max_warped_radius,
+                           const float *radius_ratios_ptr)
+{
+  Header header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, cMagic, sizeof(cMagic));
+  header.version = cVersion;
+  header.header_bytes = sizeof(Header);
+  header.key = key;
+  header.lookup_width = lookup_width;
+  header.lookup_height = lookup_height;
+  header.table_size = table_size;
+  header.max_warped_radius = max_warped_radius;
+
+  const string cTemporaryName = file_name + ".tmp";
+  FILE *file_ptr = fopen(cTemporaryName.c_str(), "wb");
+  if (!file_ptr)
+  {
+    pandrift_cat.error() << "save: Unable to open " << cTemporaryName;
+    return false;
+  }
+
+  const size_t cLookupBytes = get_lookup_bytes(lookup_width, lookup_height);
+  bool written = fwrite(&header, sizeof(header), 1, file_ptr) == 1 &&
+                 fwrite(lookup_ptr, 1, cLookupBytes, file_ptr) == cLookupBytes &&
+                 fwrite(radius_ratios_ptr, sizeof(float), table_size, file_ptr) == size_t(table_size);
+  written = (fclose(file_ptr) == 0) && written;
+
+  if (!written || rename(cTemporaryName.c_str(), file_name.c_str()) != 0)
+  {
+    remove(cTemporaryName.c_str());
+    pandrift_cat.error() << "save: Unable to write " << file_name;
+    return false;
+  }
+
+  return true;
+}
+
+size_t DistortionCache::get_lookup_bytes(int lookup_width, int lookup_height)
+{
+  return size_t(lookup_width) * size_t(lookup_height) * cLookupComponents * sizeof(float);
+}
+
+const DistortionCache::Header *DistortionCache::get_header()
+{
+  return reinterpret_cast<const Header *>(map_ptr_);
+}
+
+}
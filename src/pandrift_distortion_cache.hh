@@ -0,0 +1,86 @@
+/*################################################################
+Pandrift
+Copyright (c) 2013 Warren Moore
+
+This software may be redistributed under the terms of the MIT License.
+See the file LICENSE for details.
+################################################################*/
+
+#ifndef PANDRIFT_DISTORTION_CACHE_HEADER
+#define PANDRIFT_DISTORTION_CACHE_HEADER
+
+#include "pandrift.hh"
+#include "numeric_types.h"
+#include <string>
+
+namespace pandrift
+{
+
+// FNV-1a over the values baked data was made from, for naming and checking it
+class CacheKey
+{
+public:
+  CacheKey();
+
+  void add(const void *data_ptr, size_t bytes);
+
+  void add(int value);
+
+  void add(float value);
+
+  PN_uint64 get_value() const;
+
+private:
+  PN_uint64 value_;
+};
+
+// A versioned binary file holding the baked distortion lookup and inverse
+// radius table. It is memory-mapped, so opening costs no parsing, and the
+// lookup is laid out as the texture's RAM image for copying straight in.
+class DistortionCache
+{
+public:
+  DistortionCache();
+
+  ~DistortionCache();
+
+  // Map the file, if it was baked with this key and these sizes
+  bool open(const std::string &file_name, PN_uint64 key, int lookup_width, int lookup_height, int table_size);
+
+  void close();
+
+  bool is_open();
+
+  // Four floats a texel, in the RGBA32 RAM image order of blue, green, red, alpha
+  const unsigned char *get_lookup();
+
+  size_t get_lookup_bytes();
+
+  float get_max_warped_radius();
+
+  const float *get_radius_ratios();
+
+  // Write through a temporary file, so a reader never maps a partial one
+  static bool save(const std::string &file_name,
+                   PN_uint64 key,
+                   int lookup_width,
+                   int lookup_height,
+                   const unsigned char *lookup_ptr,
+                   int table_size,
+                   float max_warped_radius,
+                   const float *radius_ratios_ptr);
+
+  static size_t get_lookup_bytes(int lookup_width, int lookup_height);
+
+private:
+  struct Header;
+
+  const Header *get_header();
+
+  void *map_ptr_;
+  size_t map_bytes_;
+};
+
+}
+
+#endif
@@ -0,0 +1,214 @@
+/*################################################################
+Pandrift
+Copyright (c) 2013 Warren Moore
+
+This software may be redistributed under the terms of the MIT License.
+See the file LICENSE for details.
+################################################################*/
+
+#include "pandrift_distortion_table.hh"
+#include <math.h>
+#include <algorithm>
+
+using namespace std;
+
+namespace
+{
+
+const int cMinimumSize = 16;
+const int cOversample = 4;
+const float cRadiusMargin = 1.5;
+
+float warp_scale(const LVector4f &k, float radius_squared)
+{
+  return k[0] + radius_squared * (k[1] + radius_squared * (k[2] + radius_squared * k[3]));
+}
+
+}
+
+namespace pandrift
+{
+
+DistortionTable::DistortionTable(int size) :
+  size_(size < cMinimumSize ? cMinimumSize : size),
+  valid_(false),
+  max_warped_radius_(0),
+  warped_radius_to_index_(0),
+  radius_ratio_(size_)
+{
+}
+
+bool DistortionTable::update(const WarpParameters &params)
+{
+  if (valid_ && params == params_)
+    return false;
+
+  params_ = params;
+
+  // Find the largest unwarped radius on the panel, at the corners of either eye
+  float max_radius = 0;
+  for (int eye = 0; eye <= 1; ++eye)
+  {
+    for (int corner = 0; corner < 4; ++corner)
+    {
+      const float cSignX = (corner & 1) ? 1.0 : -1.0;
+      const float cSignY = (corner & 2) ? 1.0 : -1.0;
+      LVector2f panel_v(params_.screen_centre[eye][0] + params_.screen_half_size[0] * cSignX,
+                        params_.screen_centre[eye][1] + params_.screen_half_size[1] * cSignY);
+      LVector2f theta = panel_v - params_.lens_centre[eye];
+      theta.set(theta[0] * params_.scale_in[0], theta[1] * params_.scale_in[1]);
+      max_radius = max(max_radius, theta.length());
+    }
+  }
+  max_radius *= cRadiusMargin;
+
+  const float cMaxRadiusSquared = max_radius * max_radius;
+  max_warped_radius_ = max_radius * warp_scale(params_.distortion, cMaxRadiusSquared);
+  if (max_warped_radius_ <= 0)
+  {
+    pandrift_cat.error() << "DistortionTable: Invalid distortion parameters";
+    valid_ = false;
+    return true;
+  }
+
+  // Walk the forward mapping finely, filling in the uniformly spaced warped radii it passes
+  const int cSteps = size_ * cOversample;
+  warped_radius_to_index_ = float(size_ - 1) / max_warped_radius_;
+  radius_ratio_[0] = 1.0 / params_.distortion[0];
+
+  int index = 1;
+  float previous_radius = 0, previous_warped_radius = 0;
+  for (int step = 1; step <= cSteps && index < size_; ++step)
+  {
+    const float cRadius = max_radius * float(step) / float(cSteps);
+    const float cWarpedRadius = cRadius * warp_scale(params_.distortion, cRadius * cRadius);
+
+    while (index < size_ && float(index) / warped_radius_to_index_ <= cWarpedRadius)
+    {
+      // Interpolate the unwarped radius between the two forward samples
+      const float cTarget = float(index) / warped_radius_to_index_;
+      const float cSpan = cWarpedRadius - previous_warped_radius;
+      const float cT = cSpan > 0 ? (cTarget - previous_warped_radius) / cSpan : 0;
+      radius_ratio_[index] = (previous_radius + (cRadius - previous_radius) * cT) / cTarget;
+      ++index;
+    }
+
+    previous_radius = cRadius;
+    previous_warped_radius = cWarpedRadius;
+  }
+
+  // A non-monotonic polynomial stops short; hold the last ratio
+  for (; index < size_; ++index)
+    radius_ratio_[index] = radius_ratio_[index - 1];
+
+  valid_ = true;
+
+  return true;
+}
+
+void DistortionTable::restore(const WarpParameters &params, float max_warped_radius, const float *radius_ratios_ptr)
+{
+  assert(max_warped_radius > 0);
+
+  params_ = params;
+  max_warped_radius_ = max_warped_radius;
+  warped_radius_to_index_ = float(size_ - 1) / max_warped_radius_;
+  radius_ratio_.assign(radius_ratios_ptr, radius_ratios_ptr + size_);
+  valid_ = true;
+}
+
+bool DistortionTable::is_valid()
+{
+  return valid_;
+}
+
+void DistortionTable::warp(const LPoint2f *in_ptr, LPoint2f *out_ptr, int count)
+{
+  for (int point = 0; point < count; ++point)
+  {
+    const int cEye = in_ptr[point][0] < 0.5 ? cEyeLeft : cEyeRight;
+    const LVector2f &lens_centre_v = params_.lens_centre[cEye];
+
+    const float cThetaX = (in_ptr[point][0] - lens_centre_v[0]) * params_.scale_in[0];
+    const float cThetaY = (in_ptr[point][1] - lens_centre_v[1]) * params_.scale_in[1];
+    const float cScale = warp_scale(params_.distortion, cThetaX * cThetaX + cThetaY * cThetaY);
+
+    out_ptr[point].set(lens_centre_v[0] + params_.scale[0] * cThetaX * cScale,
+                       lens_centre_v[1] + params_.scale[1] * cThetaY * cScale);
+  }
+}
+
+void DistortionTable::unwarp(const LPoint2f *in_ptr, LPoint2f *out_ptr, int count)
+{
+  assert(valid_);
+
+  for (int point = 0; point < count; ++point)
+  {
+    const int cEye = in_ptr[point][0] < 0.5 ? cEyeLeft : cEyeRight;
+    const LVector2f &lens_centre_v = params_.lens_centre[cEye];
+
+    const float cThetaX = (in_ptr[point][0] - lens_centre_v[0]) / params_.scale[0];
+    const float cThetaY = (in_ptr[point][1] - lens_centre_v[1]) / params_.scale[1];
+    const float cRatio = get_radius_ratio(sqrtf(cThetaX * cThetaX + cThetaY * cThetaY));
+
+    out_ptr[point].set(lens_centre_v[0] + cThetaX * cRatio / params_.scale_in[0],
+                       lens_centre_v[1] + cThetaY * cRatio / params_.scale_in[1]);
+  }
+}
+
+void DistortionTable::bake_lookup(int width, int height, float *texels_ptr)
+{
+  // One row at a time; RAM image rows run bottom to top, as V does
+  pvector<LPoint2f> row(width);
+  for (int y = 0; y < height; ++y)
+  {
+    const float cV = (float(y) + 0.5) / float(height);
+    for (int x = 0; x < width; ++x)
+      row[x].set((float(x) + 0.5) / float(width), cV);
+
+    warp(&row[0], &row[0], width);
+
+    for (int x = 0; x < width; ++x)
+    {
+      const int cEye = (float(x) + 0.5) / float(width) < 0.5 ? cEyeLeft : cEyeRight;
+      const LVector2f cOffset = row[x] - params_.screen_centre[cEye];
+      const bool cSampled = fabs(cOffset[0]) <= params_.screen_half_size[0] &&
+                            fabs(cOffset[1]) <= params_.screen_half_size[1];
+
+      float *texel_ptr = texels_ptr + (size_t(y) * size_t(width) + size_t(x)) * 4;
+      texel_ptr[0] = 0.0;
+      texel_ptr[1] = row[x][1];
+      texel_ptr[2] = row[x][0];
+      texel_ptr[3] = cSampled ? 1.0 : 0.0;
+    }
+  }
+}
+
+int DistortionTable::get_size()
+{
+  return size_;
+}
+
+float DistortionTable::get_max_warped_radius()
+{
+  return max_warped_radius_;
+}
+
+const float *DistortionTable::get_radius_ratios()
+{
+  return &radius_ratio_[0];
+}
+
+float DistortionTable::get_radius_ratio(float warped_radius)
+{
+  const float cIndex = warped_radius * warped_radius_to_index_;
+  if (cIndex >= float(size_ - 1))
+    return radius_ratio_[size_ - 1];
+
+  const int cLower = int(cIndex);
+  const float cT = cIndex - float(cLower);
+
+  return radius_ratio_[cLower] + (radius_ratio_[cLower + 1] - radius_ratio_[cLower]) * cT;
+}
+
+}
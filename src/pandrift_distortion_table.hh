@@ -0,0 +1,66 @@
+/*################################################################
+Pandrift
+Copyright (c) 2013 Warren Moore
+
+This software may be redistributed under the terms of the MIT License.
+See the file LICENSE for details.
+################################################################*/
+
+#ifndef PANDRIFT_DISTORTION_TABLE_HEADER
+#define PANDRIFT_DISTORTION_TABLE_HEADER
+
+#include "pandrift.hh"
+#include "pandrift_stereo_parameters.hh"
+#include "lpoint2.h"
+#include "pvector.h"
+
+namespace pandrift
+{
+
+// Maps between panel and scene texture coordinates as HmdWarp does. The
+// forward polynomial is evaluated directly; its inverse is a lookup table
+// over the warped radius, rebuilt only when the parameters change.
+class DistortionTable
+{
+public:
+  DistortionTable(int size);
+
+  // Returns true if the table had to be rebuilt
+  bool update(const WarpParameters &params);
+
+  // Adopt a previously built inverse for these parameters, rather than rebuilding it
+  void restore(const WarpParameters &params, float max_warped_radius, const float *radius_ratios_ptr);
+
+  bool is_valid();
+
+  // Panel UV to scene UV, the same mapping as the shader
+  void warp(const LPoint2f *in_ptr, LPoint2f *out_ptr, int count);
+
+  // Scene UV to panel UV
+  void unwarp(const LPoint2f *in_ptr, LPoint2f *out_ptr, int count);
+
+  // Warp the centre of every texel of a panel-sized lookup, as four floats a
+  // texel in RGBA32 RAM image order: blue unused, green scene V, red scene U,
+  // alpha 1 where the scene is sampled and 0 outside the eye's buffer
+  void bake_lookup(int width, int height, float *texels_ptr);
+
+  int get_size();
+
+  float get_max_warped_radius();
+
+  const float *get_radius_ratios();
+
+private:
+  float get_radius_ratio(float warped_radius);
+
+  int size_;
+  bool valid_;
+  WarpParameters params_;
+  float max_warped_radius_;
+  float warped_radius_to_index_;
+  pvector<float> radius_ratio_;
+};
+
+}
+
+#endif
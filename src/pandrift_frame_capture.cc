@@ -0,0 +1,268 @@
+/*################################################################
+Pandrift
+Copyright (c) 2013 Warren Moore
+
+This software may be redistributed under the terms of the MIT License.
+See the file LICENSE for details.
+################################################################*/
+
+#include "pandrift_frame_capture.hh"
+#include "pandrift_allocation_audit.hh"
+#include "mutexHolder.h"
+#include "trueClock.h"
+#include <string.h>
+
+using namespace std;
+
+namespace
+{
+
+const char *cWriterThreadName = "pandrift capture writer";
+const int cBytesPerPixel = 4;
+
+unsigned char clamp_byte(float value)
+{
+  return value < 0.0 ? 0 : (value > 255.0 ? 255 : (unsigned char)(value + 0.5));
+}
+
+}
+
+namespace pandrift
+{
+
+FrameCapture::FrameCapture(int readback_depth, int queue_depth) :
+  readback_(readback_depth),
+  queue_depth_(queue_depth < 1 ? 1 : queue_depth),
+  width_(0),
+  height_(0),
+  file_ptr_(NULL),
+  frame_id_(0),
+  queue_cvar_(lock_),
+  queue_read_(0),
+  queue_count_(0),
+  closing_(false),
+  captured_frames_(0),
+  dropped_frames_(0)
+{
+}
+
+FrameCapture::~FrameCapture()
+{
+  close();
+}
+
+bool FrameCapture::open(const string &file_name, int width, int height, int frame_rate)
+{
+  assert(!file_ptr_);
+
+  if (width <= 0 || height <= 0 || frame_rate <= 0)
+    return false;
+
+  file_ptr_ = fopen(file_name.c_str(), "wb");
+  if (!file_ptr_)
+  {
+    pandrift_cat.error() << "FrameCapture: Unable to open " << file_name;
+    return false;
+  }
+
+  // Full resolution chroma avoids a downsample on the writer thread
+  fprintf(file_ptr_, "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C444\n", width, height, frame_rate);
+
+  width_ = width;
+  height_ = height;
+
+  // Allocate the whole queue up front so capturing never allocates
+  frames_.resize(queue_depth_);
+  for (int frame = 0; frame < queue_depth_; ++frame)
+    frames_[frame].resize(width_ * height_ * cBytesPerPixel);
+  plane_buffer_.resize(width_ * height_ * 3);
+
+  frame_id_ = 0;
+  queue_read_ = 0;
+  queue_count_ = 0;
+  closing_ = false;
+  captured_frames_ = 0;
+  dropped_frames_ = 0;
+
+  writer_ptr_ = new WriterThread(this);
+  if (!writer_ptr_->start(TP_low, true))
+  {
+    pandrift_cat.error() << "FrameCapture: Unable to start writer thread";
+    writer_ptr_ = NULL;
+    fclose(file_ptr_);
+    file_ptr_ = NULL;
+    return false;
+  }
+
+  return true;
+}
+
+void FrameCapture::close()
+{
+  if (!file_ptr_)
+    return;
+
+  // Reads are only collected on the draw thread, so give up on those in flight
+  const int cInFlight = readback_.get_pending_count();
+  readback_.release();
+
+  {
+    MutexHolder holder(lock_);
+    dropped_frames_ += cInFlight;
+    closing_ = true;
+    queue_cvar_.notify();
+  }
+
+  // The writer drains the queue before exiting
+  writer_ptr_->join();
+  writer_ptr_ = NULL;
+
+  fclose(file_ptr_);
+  file_ptr_ = NULL;
+
+  if (pandrift_cat.is_info())
+    pandrift_cat.info() << "FrameCapture: Captured " << captured_frames_
+                        << " frames, dropped " << dropped_frames_ << endl;
+}
+
+bool FrameCapture::is_open()
+{
+  return file_ptr_ != NULL;
+}
+
+void FrameCapture::capture_frame()
+{
+  PANDRIFT_AUDIT_SITE("FrameCapture::capture_frame");
+
+  if (!file_ptr_)
+    return;
+
+  // Hand over finished reads first to free their slots
+  collect_readbacks();
+
+  const double cTime = TrueClock::get_global_ptr()->get_short_time();
+  if (!readback_.request(0, 0, width_, height_, frame_id_++, cTime))
+  {
+    MutexHolder holder(lock_);
+    ++dropped_frames_;
+  }
+}
+
+int FrameCapture::get_captured_frames()
+{
+  MutexHolder holder(lock_);
+  return captured_frames_;
+}
+
+int FrameCapture::get_dropped_frames()
+{
+  MutexHolder holder(lock_);
+  return dropped_frames_;
+}
+
+FrameCapture::WriterThread::WriterThread(FrameCapture *capture_ptr) :
+  Thread(cWriterThreadName, cWriterThreadName),
+  capture_ptr_(capture_ptr)
+{
+}
+
+void FrameCapture::WriterThread::thread_main()
+{
+  capture_ptr_->write_frames();
+}
+
+void FrameCapture::collect_readbacks()
+{
+  PixelReadback::Result result;
+  while (readback_.map_completed(result))
+  {
+    if (!queue_frame(result))
+    {
+      MutexHolder holder(lock_);
+      ++dropped_frames_;
+    }
+
+    readback_.unmap();
+  }
+}
+
+bool FrameCapture::queue_frame(const PixelReadback::Result &result)
+{
+  if (result.width != width_ || result.height != height_)
+    return false;
+
+  int queue_write;
+  {
+    MutexHolder holder(lock_);
+
+    // Never wait on the writer; drop the frame if it has fallen behind
+    if (queue_count_ == queue_depth_)
+      return false;
+
+    queue_write = (queue_read_ + queue_count_) % queue_depth_;
+  }
+
+  // Only this thread writes into free slots, so copy outside the lock
+  memcpy(&frames_[queue_write][0], result.pixels_ptr, width_ * height_ * cBytesPerPixel);
+
+  MutexHolder holder(lock_);
+  ++queue_count_;
+  queue_cvar_.notify();
+
+  return true;
+}
+
+void FrameCapture::write_frames()
+{
+  while (true)
+  {
+    int queue_read;
+    {
+      MutexHolder holder(lock_);
+      while (queue_count_ == 0 && !closing_)
+        queue_cvar_.wait();
+
+      if (queue_count_ == 0)
+        return;
+
+      queue_read = queue_read_;
+    }
+
+    write_frame(&frames_[queue_read][0]);
+
+    MutexHolder holder(lock_);
+    queue_read_ = (queue_read_ + 1) % queue_depth_;
+    --queue_count_;
+    ++captured_frames_;
+  }
+}
+
+void FrameCapture::write_frame(const unsigned char *pixels_ptr)
+{
+  const int cPlaneSize = width_ * height_;
+  unsigned char *y_ptr = &plane_buffer_[0];
+  unsigned char *u_ptr = y_ptr + cPlaneSize;
+  unsigned char *v_ptr = u_ptr + cPlaneSize;
+
+  for (int row = 0; row < height_; ++row)
+  {
+    // GL rows are bottom-up, Y4M rows are top-down
+    const unsigned char *rgba_ptr = pixels_ptr + (height_ - 1 - row) * width_ * cBytesPerPixel;
+    const int cRowOffset = row * width_;
+
+    for (int column = 0; column < width_; ++column, rgba_ptr += cBytesPerPixel)
+    {
+      const float cR = rgba_ptr[0], cG = rgba_ptr[1], cB = rgba_ptr[2];
+
+      // BT.601 studio range
+      y_ptr[cRowOffset + column] = clamp_byte(16.0 + 0.257 * cR + 0.504 * cG + 0.098 * cB);
+      u_ptr[cRowOffset + column] = clamp_byte(128.0 - 0.148 * cR - 0.291 * cG + 0.439 * cB);
+      v_ptr[cRowOffset + column] = clamp_byte(128.0 + 0.439 * cR - 0.368 * cG - 0.071 * cB);
+    }
+  }
+
+  fputs("FRAME\n", file_ptr_);
+  fwrite(y_ptr, 1, cPlaneSize * 3, file_ptr_);
+}
+
+}
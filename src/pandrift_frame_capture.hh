@@ -0,0 +1,89 @@
+/*################################################################
+Pandrift
+Copyright (c) 2013 Warren Moore
+
+This software may be redistributed under the terms of the MIT License.
+See the file LICENSE for details.
+################################################################*/
+
+#ifndef PANDRIFT_FRAME_CAPTURE_HEADER
+#define PANDRIFT_FRAME_CAPTURE_HEADER
+
+#include "pandrift.hh"
+#include "pandrift_pixel_readback.hh"
+#include "thread.h"
+#include "pmutex.h"
+#include "conditionVar.h"
+#include "pvector.h"
+#include <stdio.h>
+#include <string>
+
+namespace pandrift
+{
+
+// Records frames to a raw YUV4MPEG2 file. Pixels are read back asynchronously
+// on the draw thread and written by a background thread, so a slow disk
+// drops capture frames rather than rendered ones.
+class FrameCapture
+{
+public:
+  FrameCapture(int readback_depth, int queue_depth);
+
+  ~FrameCapture();
+
+  bool open(const std::string &file_name, int width, int height, int frame_rate);
+
+  void close();
+
+  bool is_open();
+
+  // Read back the current framebuffer. Draw thread only.
+  void capture_frame();
+
+  int get_captured_frames();
+
+  int get_dropped_frames();
+
+private:
+  class WriterThread : public Thread
+  {
+  public:
+    WriterThread(FrameCapture *capture_ptr);
+
+  protected:
+    virtual void thread_main();
+
+  private:
+    FrameCapture *capture_ptr_;
+  };
+
+  void collect_readbacks();
+
+  bool queue_frame(const PixelReadback::Result &result);
+
+  void write_frames();
+
+  void write_frame(const unsigned char *pixels_ptr);
+
+  PixelReadback readback_;
+  int queue_depth_;
+  int width_, height_;
+  FILE *file_ptr_;
+  PT(WriterThread) writer_ptr_;
+  unsigned int frame_id_;
+
+  // Guards the frame queue and the counters below
+  Mutex lock_;
+  ConditionVar queue_cvar_;
+  pvector<pvector<unsigned char> > frames_;
+  int queue_read_, queue_count_;
+  bool closing_;
+  int captured_frames_, dropped_frames_;
+
+  // Writer thread only
+  pvector<unsigned char> plane_buffer_;
+};
+
+}
+
+#endif
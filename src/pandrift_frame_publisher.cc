@@ -0,0 +1,149 @@
+/*################################################################
+Pandrift
+Copyright (c) 2013 Warren Moore
+
+This software may be redistributed under the terms of the MIT License.
+See the file LICENSE for details.
+################################################################*/
+
+#include "pandrift_frame_publisher.hh"
+#include "pandrift_allocation_audit.hh"
+#include "mutexHolder.h"
+
+using namespace std;
+
+namespace pandrift
+{
+
+FramePublisher::FramePublisher(int readback_depth) :
+  readback_(readback_depth, GL_BGRA),
+  width_(0),
+  height_(0),
+  frame_id_(0),
+  pending_poses_(readback_.get_depth()),
+  published_frames_(0),
+  dropped_frames_(0)
+{
+  for (int eye = 0; eye <= 1; ++eye)
+    drawn_mat_[eye] = LMatrix4f::ident_mat();
+}
+
+FramePublisher::~FramePublisher()
+{
+  close();
+}
+
+bool FramePublisher::open(const string &ring_name, int width, int height, int slot_count)
+{
+  assert(!is_open());
+
+  if (!ring_.create(ring_name, width, height, slot_count))
+    return false;
+
+  width_ = width;
+  height_ = height;
+  frame_id_ = 0;
+
+  MutexHolder holder(lock_);
+  published_frames_ = 0;
+  dropped_frames_ = 0;
+
+  return true;
+}
+
+void FramePublisher::close()
+{
+  if (!is_open())
+    return;
+
+  // Reads are only collected on the draw thread, so give up on those in flight
+  {
+    MutexHolder holder(lock_);
+    dropped_frames_ += readback_.get_pending_count();
+  }
+  readback_.release();
+
+  ring_.close();
+
+  if (pandrift_cat.is_info())
+    pandrift_cat.info() << "FramePublisher: Published " << published_frames_
+                        << " frames, dropped " << dropped_frames_ << endl;
+}
+
+bool FramePublisher::is_open()
+{
+  return ring_.is_open();
+}
+
+void FramePublisher::set_drawn_pose(int eye, const LMatrix4f &camera_mat)
+{
+  drawn_mat_[eye] = camera_mat;
+}
+
+void FramePublisher::publish_frame()
+{
+  PANDRIFT_AUDIT_SITE("FramePublisher::publish_frame");
+
+  if (!is_open())
+    return;
+
+  // Hand over finished reads first to free their slots
+  collect_readbacks();
+
+  const double cTime = SharedFrameRing::get_time();
+  if (!readback_.request(0, 0, width_, height_, frame_id_, cTime))
+  {
+    MutexHolder holder(lock_);
+    ++dropped_frames_;
+    return;
+  }
+
+  // Reads complete in order and at most the depth are in flight, so
+  // consecutive IDs never share a pose slot
+  Pose &pose = pending_poses_[frame_id_ % pending_poses_.size()];
+  pose.camera_mat[cEyeLeft] = drawn_mat_[cEyeLeft];
+  pose.camera_mat[cEyeRight] = drawn_mat_[cEyeRight];
+  pose.drawn_time = cTime;
+
+  ++frame_id_;
+}
+
+int FramePublisher::get_published_frames()
+{
+  MutexHolder holder(lock_);
+  return published_frames_;
+}
+
+int FramePublisher::get_dropped_frames()
+{
+  MutexHolder holder(lock_);
+  return dropped_frames_;
+}
+
+void FramePublisher::collect_readbacks()
+{
+  PixelReadback::Result result;
+  while (readback_.map_completed(result))
+  {
+    if (result.width == width_ && result.height == height_)
+    {
+      const Pose &pose = pending_poses_[result.frame_id % pending_poses_.size()];
+
+      SharedFrameRing::Frame frame;
+      frame.frame_id = result.frame_id;
+      frame.drawn_time = pose.drawn_time;
+      frame.camera_mat[cEyeLeft] = pose.camera_mat[cEyeLeft];
+      frame.camera_mat[cEyeRight] = pose.camera_mat[cEyeRight];
+
+      // Straight from the mapped buffer into shared memory
+      ring_.write(result.pixels_ptr, frame);
+
+      MutexHolder holder(lock_);
+      ++published_frames_;
+    }
+
+    readback_.unmap();
+  }
+}
+
+}
@@ -0,0 +1,73 @@
+/*################################################################
+Pandrift
+Copyright (c) 2013 Warren Moore
+
+This software may be redistributed under the terms of the MIT License.
+See the file LICENSE for details.
+################################################################*/
+
+#ifndef PANDRIFT_FRAME_PUBLISHER_HEADER
+#define PANDRIFT_FRAME_PUBLISHER_HEADER
+
+#include "pandrift.hh"
+#include "pandrift_pixel_readback.hh"
+#include "pandrift_shared_frame_ring.hh"
+#include "pmutex.h"
+#include "pvector.h"
+#include <string>
+
+namespace pandrift
+{
+
+// Hands the eye buffer to a compositor in another process. The buffer is
+// read back asynchronously on the draw thread, and written with the poses it
+// was drawn with into a SharedFrameRing as each read completes.
+class FramePublisher
+{
+public:
+  FramePublisher(int readback_depth);
+
+  ~FramePublisher();
+
+  bool open(const std::string &ring_name, int width, int height, int slot_count);
+
+  void close();
+
+  bool is_open();
+
+  // The pose an eye of the current frame was drawn with. Draw thread only.
+  void set_drawn_pose(int eye, const LMatrix4f &camera_mat);
+
+  // Read back the current framebuffer. Draw thread only.
+  void publish_frame();
+
+  int get_published_frames();
+
+  int get_dropped_frames();
+
+private:
+  struct Pose
+  {
+    LMatrix4f camera_mat[2];
+    double drawn_time;
+  };
+
+  void collect_readbacks();
+
+  PixelReadback readback_;
+  SharedFrameRing ring_;
+  int width_, height_;
+
+  // Draw thread only
+  unsigned int frame_id_;
+  LMatrix4f drawn_mat_[2];
+  pvector<Pose> pending_poses_;
+
+  // Guards the counters below
+  Mutex lock_;
+  int published_frames_, dropped_frames_;
+};
+
+}
+
+#endif
@@ -0,0 +1,302 @@
+/*################################################################
+Pandrift
+Copyright (c) 2013 Warren Moore
+
+This software may be redistributed under the terms of the MIT License.
+See the file LICENSE for details.
+################################################################*/
+
+#include "pandrift_frame_scheduler.hh"
+#include "pandrift_allocation_audit.hh"
+#include "asyncTaskManager.h"
+#include "callbackObject.h"
+#include "callbackData.h"
+#include "clockObject.h"
+#include "trueClock.h"
+#include "mutexHolder.h"
+#include "camera.h"
+#include <math.h>
+#include <algorithm>
+
+using namespace std;
+
+namespace
+{
+
+const char *cFrameStartTaskName = "pandrift frame start";
+const int cFrameStartTaskSort = -1000;
+const char *cDrawCameraName = "frame scheduler camera";
+const int cDrawRegionSort = 2000;
+const double cDefaultRefreshPeriod = 1.0 / 60.0;
+const double cDefaultSafetyMargin = 0.002;
+const double cRefreshSmoothing = 0.05;
+const double cWorkSmoothing = 0.1;
+const double cWorkDeviations = 2.0;
+const double cMissedFrameRatio = 1.5;
+
+}
+
+namespace pandrift
+{
+
+class DrawCompleteCallback : public CallbackObject
+{
+public:
+  DrawCompleteCallback(FrameScheduler *scheduler_ptr) :
+    scheduler_ptr_(scheduler_ptr)
+  {
+  }
+
+  virtual void do_callback(CallbackData *cbdata)
+  {
+    // Drawn last on the window, so this is the end of the frame's work
+    cbdata->upcall();
+    scheduler_ptr_->draw_complete(TrueClock::get_global_ptr()->get_short_time());
+  }
+
+private:
+  FrameScheduler *scheduler_ptr_;
+};
+
+FrameScheduler::FrameScheduler() :
+  safety_margin_(cDefaultSafetyMargin),
+  drive_clock_(false),
+  refresh_period_(cDefaultRefreshPeriod),
+  last_vsync_time_(0),
+  display_time_(0),
+  clock_display_time_(0),
+  has_vsync_(false),
+  has_clock_display_time_(false),
+  work_start_time_(0),
+  work_refresh_period_(cDefaultRefreshPeriod),
+  work_seconds_(0),
+  work_deviation_(0),
+  has_work_(false)
+{
+  reset_statistics();
+}
+
+FrameScheduler::~FrameScheduler()
+{
+  stop();
+}
+
+void FrameScheduler::set_rift_manager(boost::shared_ptr<RiftManager> rift_manager_ptr)
+{
+  rift_manager_ptr_ = rift_manager_ptr;
+}
+
+void FrameScheduler::set_refresh_period(double seconds)
+{
+  if (seconds > 0)
+    refresh_period_ = seconds;
+}
+
+void FrameScheduler::set_safety_margin(double seconds)
+{
+  safety_margin_ = max(0.0, seconds);
+}
+
+void FrameScheduler::set_drive_clock(bool drive_clock)
+{
+  drive_clock_ = drive_clock;
+}
+
+bool FrameScheduler::start(GraphicsOutput *window_ptr)
+{
+  assert(!is_started());
+
+  if (!window_ptr)
+    return false;
+
+  // A region drawn after everything else on the window, whose camera sees
+  // nothing, tells us when the frame's drawing is complete
+  draw_region_ptr_ = window_ptr->make_display_region();
+  draw_region_ptr_->set_sort(cDrawRegionSort);
+  draw_region_ptr_->set_draw_callback(new DrawCompleteCallback(this));
+  draw_camera_np_ = NodePath(new Camera(cDrawCameraName));
+  draw_region_ptr_->set_camera(draw_camera_np_);
+
+  if (drive_clock_)
+    ClockObject::get_global_clock()->set_mode(ClockObject::M_slave);
+
+  // Run before every other task on the frame
+  frame_start_task_ptr_ = new GenericAsyncTask(cFrameStartTaskName,
+                                               &frame_start_task,
+                                               this);
+  frame_start_task_ptr_->set_sort(cFrameStartTaskSort);
+  AsyncTaskManager::get_global_ptr()->add(frame_start_task_ptr_);
+
+  has_vsync_ = false;
+  has_clock_display_time_ = false;
+
+  return true;
+}
+
+void FrameScheduler::stop()
+{
+  if (!is_started())
+    return;
+
+  frame_start_task_ptr_->remove();
+  frame_start_task_ptr_ = NULL;
+
+  draw_region_ptr_->get_window()->remove_display_region(draw_region_ptr_);
+  draw_region_ptr_ = NULL;
+  draw_camera_np_.remove_node();
+
+  if (drive_clock_)
+    ClockObject::get_global_clock()->set_mode(ClockObject::M_normal);
+
+  if (rift_manager_ptr_)
+    rift_manager_ptr_->set_predicted_display_time(0);
+}
+
+bool FrameScheduler::is_started()
+{
+  return frame_start_task_ptr_ != NULL;
+}
+
+double FrameScheduler::get_predicted_display_time()
+{
+  return display_time_;
+}
+
+void FrameScheduler::get_statistics(Statistics &statistics)
+{
+  statistics.frames = frames_;
+  statistics.missed_frames = missed_frames_;
+  statistics.refresh_period = refresh_period_;
+  statistics.mean_latency_seconds = frames_ > 0 ? total_latency_ / double(frames_) : 0;
+  statistics.max_latency_seconds = max_latency_;
+
+  MutexHolder holder(lock_);
+  statistics.work_seconds = work_seconds_;
+}
+
+void FrameScheduler::reset_statistics()
+{
+  frames_ = 0;
+  missed_frames_ = 0;
+  total_latency_ = 0;
+  max_latency_ = 0;
+}
+
+AsyncTask::DoneStatus FrameScheduler::frame_start_task(GenericAsyncTask *task_ptr,
+                                                       void *data_ptr)
+{
+  FrameScheduler *scheduler_ptr = reinterpret_cast<FrameScheduler*>(data_ptr);
+  assert(scheduler_ptr);
+
+  scheduler_ptr->start_frame();
+
+  return AsyncTask::DS_cont;
+}
+
+void FrameScheduler::start_frame()
+{
+  PANDRIFT_AUDIT_SITE("FrameScheduler::start_frame");
+
+  TrueClock *true_clock_ptr = TrueClock::get_global_ptr();
+
+  // With auto-flip the previous frame's flip has just returned, on vsync if it made it
+  const double cNow = true_clock_ptr->get_short_time();
+  if (has_vsync_)
+  {
+    const double cInterval = cNow - last_vsync_time_;
+    const double cPeriods = floor(cInterval / refresh_period_ + 0.5);
+
+    if (cInterval > refresh_period_ * cMissedFrameRatio)
+      ++missed_frames_;
+
+    // Refine the period from intervals that look like whole refreshes
+    if (cPeriods >= 1.0 && cPeriods <= 4.0)
+      refresh_period_ += (cInterval / cPeriods - refresh_period_) * cRefreshSmoothing;
+  }
+  last_vsync_time_ = cNow;
+  has_vsync_ = true;
+
+  double work_estimate = 0;
+  {
+    MutexHolder holder(lock_);
+    if (has_work_)
+      work_estimate = work_seconds_ + work_deviation_ * cWorkDeviations;
+  }
+
+  // Sleep until the work is expected to end just before the next vsync
+  display_time_ = last_vsync_time_ + refresh_period_;
+  const double cWait = display_time_ - work_estimate - safety_margin_ - cNow;
+  if (cWait > 0)
+    Thread::sleep(cWait);
+
+  const double cWorkStart = true_clock_ptr->get_short_time();
+
+  // The work overran the period; aim for the vsync after
+  while (display_time_ < cWorkStart)
+    display_time_ += refresh_period_;
+
+  {
+    // Handed to the draw thread to time the work against
+    MutexHolder holder(lock_);
+    work_start_time_ = cWorkStart;
+    work_refresh_period_ = refresh_period_;
+  }
+
+  // The pose is sampled from here on, so predict it for the display time.
+  // The refresh period also times the warp's scanout compensation.
+  if (rift_manager_ptr_)
+  {
+    rift_manager_ptr_->set_predicted_display_time(display_time_);
+    rift_manager_ptr_->set_refresh_period(refresh_period_);
+  }
+
+  // Leave the clock alone while someone else has taken it out of slave mode,
+  // such as the display limiting the frame rate while idle
+  ClockObject *clock_ptr = ClockObject::get_global_clock();
+  if (drive_clock_ && clock_ptr->get_mode() != ClockObject::M_slave)
+    has_clock_display_time_ = false;
+  else if (drive_clock_)
+  {
+    // Intervals and animation are stepped to when the frame will be seen
+    const double cClockDisplayTime = clock_ptr->get_real_time() + (display_time_ - cWorkStart);
+
+    // The first frame steps by a period rather than from the clock's start
+    if (!has_clock_display_time_)
+    {
+      clock_display_time_ = cClockDisplayTime - refresh_period_;
+      has_clock_display_time_ = true;
+    }
+
+    clock_ptr->set_dt(max(0.0, cClockDisplayTime - clock_display_time_));
+    clock_ptr->set_frame_time(cClockDisplayTime);
+    clock_display_time_ = cClockDisplayTime;
+  }
+
+  const double cLatency = display_time_ - cWorkStart;
+  ++frames_;
+  total_latency_ += cLatency;
+  max_latency_ = max(max_latency_, cLatency);
+}
+
+void FrameScheduler::draw_complete(double time)
+{
+  MutexHolder holder(lock_);
+  const double cWork = time - work_start_time_;
+  if (cWork <= 0 || cWork > work_refresh_period_ * 4.0)
+    return;
+
+  // Track the mean and deviation so the estimate covers most frames
+  if (!has_work_)
+  {
+    work_seconds_ = cWork;
+    work_deviation_ = 0;
+    has_work_ = true;
+  }
+  else
+  {
+    work_deviation_ += (fabs(cWork - work_seconds_) - work_deviation_) * cWorkSmoothing;
+    work_seconds_ += (cWork - work_seconds_) * cWorkSmoothing;
+  }
+}
+
+}
@@ -0,0 +1,108 @@
+/*################################################################
+Pandrift
+Copyright (c) 2013 Warren Moore
+
+This software may be redistributed under the terms of the MIT License.
+See the file LICENSE for details.
+################################################################*/
+
+#ifndef PANDRIFT_FRAME_SCHEDULER_HEADER
+#define PANDRIFT_FRAME_SCHEDULER_HEADER
+
+#include "pandrift.hh"
+#include "pandrift_rift_manager.hh"
+#include "graphicsOutput.h"
+#include "genericAsyncTask.h"
+#include "pmutex.h"
+#include "boost/shared_ptr.hpp"
+
+namespace pandrift
+{
+
+// Delays the start of each frame so that its work finishes just before the
+// next vsync, then samples the pose for that vsync. Learns the refresh
+// period from the frame intervals and the work cost from the time drawing
+// completes. Needs sync-video and auto-flip so the flip returns on vsync.
+class FrameScheduler
+{
+public:
+  struct Statistics
+  {
+    int frames;
+    int missed_frames;
+    double refresh_period;
+    double work_seconds;
+    double mean_latency_seconds;
+    double max_latency_seconds;
+  };
+
+  FrameScheduler();
+
+  ~FrameScheduler();
+
+  void set_rift_manager(boost::shared_ptr<RiftManager> rift_manager_ptr);
+
+  // Initial guess at the refresh period, refined as frames are presented
+  void set_refresh_period(double seconds);
+
+  // Extra time left between the predicted end of the work and vsync
+  void set_safety_margin(double seconds);
+
+  // Step the global clock, and so intervals and animation, to the predicted
+  // display time. Paused while another mode is set, as the display does to
+  // limit the frame rate while idle.
+  void set_drive_clock(bool drive_clock);
+
+  bool start(GraphicsOutput *window_ptr);
+
+  void stop();
+
+  bool is_started();
+
+  // TrueClock time at which the current frame is expected to be displayed
+  double get_predicted_display_time();
+
+  void get_statistics(Statistics &statistics);
+
+  void reset_statistics();
+
+private:
+  static AsyncTask::DoneStatus frame_start_task(GenericAsyncTask *task_ptr, void *data_ptr);
+
+  void start_frame();
+
+  void draw_complete(double time);
+
+  friend class DrawCompleteCallback;
+
+  boost::shared_ptr<RiftManager> rift_manager_ptr_;
+  double safety_margin_;
+  bool drive_clock_;
+  PT(GenericAsyncTask) frame_start_task_ptr_;
+  PT(DisplayRegion) draw_region_ptr_;
+  NodePath draw_camera_np_;
+
+  // Main thread only
+  double refresh_period_;
+  double last_vsync_time_;
+  double display_time_;
+  double clock_display_time_;
+  bool has_vsync_;
+  bool has_clock_display_time_;
+  int frames_;
+  int missed_frames_;
+  double total_latency_;
+  double max_latency_;
+
+  // Guards the frame timing and work estimate shared with the draw thread
+  Mutex lock_;
+  double work_start_time_;
+  double work_refresh_period_;
+  double work_seconds_;
+  double work_deviation_;
+  bool has_work_;
+};
+
+}
+
+#endif
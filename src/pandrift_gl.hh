@@ -0,0 +1,28 @@
+/*################################################################
+Pandrift
+Copyright (c) 2013 Warren Moore
+
+This software may be redistributed under the terms of the MIT License.
+See the file LICENSE for details.
+################################################################*/
+
+#ifndef PANDRIFT_GL_HEADER
+#define PANDRIFT_GL_HEADER
+
+// Direct OpenGL access for the few places Panda doesn't expose what we need
+// (asynchronous readback). Only call into GL from the draw thread.
+#ifdef __APPLE__
+#include <OpenGL/gl.h>
+#include <OpenGL/glext.h>
+#else
+#define GL_GLEXT_PROTOTYPES
+#include <GL/gl.h>
+#include <GL/glext.h>
+#endif
+
+// Fences let us poll for readback completion, otherwise fall back to frame counting
+#ifdef GL_SYNC_GPU_COMMANDS_COMPLETE
+#define PANDRIFT_GL_HAS_SYNC 1
+#endif
+
+#endif
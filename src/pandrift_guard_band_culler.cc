@@ -0,0 +1,347 @@
+/*################################################################
+Pandrift
+Copyright (c) 2013 Warren Moore
+
+This software may be redistributed under the terms of the MIT License.
+See the file LICENSE for details.
+################################################################*/
+
+#include "pandrift_guard_band_culler.hh"
+#include "pandrift_allocation_audit.hh"
+#include "mutexHolder.h"
+#include "nodePathCollection.h"
+#include <math.h>
+#include <algorithm>
+
+using namespace std;
+
+namespace
+{
+
+const char *cCullThreadName = "pandrift guard band cull";
+const float cDefaultGuardAngle = 10.0 * (M_PI / 180.0);
+const float cDefaultGuardDistance = 0.5;
+// Ask for the next cull this far into the band, so it's ready before the view leaves it
+const float cRequestFraction = 0.5;
+
+float get_angle(const LVector3f &a, const LVector3f &b)
+{
+  return acos(min(1.0f, max(-1.0f, a.dot(b))));
+}
+
+}
+
+namespace pandrift
+{
+
+GuardBandCuller::GuardBandCuller() :
+  guard_angle_(cDefaultGuardAngle),
+  guard_distance_(cDefaultGuardDistance),
+  view_half_angle_(0),
+  far_distance_(0),
+  view_radius_(0),
+  applied_(false),
+  hidden_count_(0),
+  cull_count_(0),
+  cull_cvar_(lock_),
+  stopping_(false),
+  request_pending_(false),
+  request_half_angle_(0),
+  request_far_distance_(0),
+  request_guard_distance_(0),
+  result_ready_(false)
+{
+}
+
+GuardBandCuller::~GuardBandCuller()
+{
+  stop();
+  clear_static_roots();
+}
+
+void GuardBandCuller::set_guard_band(float radians, float distance)
+{
+  guard_angle_ = max(0.0f, radians);
+  guard_distance_ = max(0.0f, distance);
+}
+
+void GuardBandCuller::add_static_root(NodePath root_np)
+{
+  if (root_np.is_empty())
+    return;
+
+  NodePath top_np = root_np.get_top();
+  NodePathCollection geom_nps = root_np.find_all_matches("**/+GeomNode");
+  for (int geom = 0; geom < geom_nps.get_num_paths(); ++geom)
+  {
+    NodePath geom_np = geom_nps.get_path(geom);
+
+    // World space bounds, as the static node won't move
+    LPoint3f min_point, max_point;
+    if (!geom_np.calc_tight_bounds(min_point, max_point, top_np))
+      continue;
+
+    const LPoint3f cCentre = (min_point + max_point) * 0.5;
+    object_nps_.push_back(geom_np);
+    object_hidden_.push_back(false);
+    object_spheres_.push_back(LVecBase4f(cCentre[0], cCentre[1], cCentre[2], (max_point - min_point).length() * 0.5));
+  }
+
+  // The current result doesn't cover the new objects
+  applied_ = false;
+}
+
+void GuardBandCuller::clear_static_roots()
+{
+  show_all();
+
+  object_nps_.clear();
+  object_hidden_.clear();
+  object_spheres_.clear();
+  applied_ = false;
+}
+
+bool GuardBandCuller::start(NodePath camera_np, float view_half_angle, float far_distance, float view_radius)
+{
+  assert(!is_started());
+
+  if (camera_np.is_empty())
+    return false;
+
+  camera_np_ = camera_np;
+  view_half_angle_ = view_half_angle;
+  far_distance_ = far_distance;
+  view_radius_ = view_radius;
+  applied_ = false;
+  previous_axis_ = camera_np_.get_top().get_relative_vector(camera_np_, LVector3f::forward());
+
+  stopping_ = false;
+  request_pending_ = false;
+  result_ready_ = false;
+
+  cull_thread_ptr_ = new CullThread(this);
+  if (!cull_thread_ptr_->start(TP_normal, true))
+  {
+    pandrift_cat.error() << "start: Unable to start cull thread";
+    cull_thread_ptr_ = NULL;
+    return false;
+  }
+
+  return true;
+}
+
+void GuardBandCuller::stop()
+{
+  if (!cull_thread_ptr_)
+    return;
+
+  {
+    MutexHolder holder(lock_);
+    stopping_ = true;
+    cull_cvar_.notify();
+  }
+
+  cull_thread_ptr_->join();
+  cull_thread_ptr_ = NULL;
+
+  // Without updates the hidden set would go stale
+  show_all();
+  applied_ = false;
+  camera_np_ = NodePath();
+}
+
+bool GuardBandCuller::is_started()
+{
+  return cull_thread_ptr_ != NULL;
+}
+
+void GuardBandCuller::update()
+{
+  PANDRIFT_AUDIT_SITE("GuardBandCuller::update");
+
+  if (!is_started())
+    return;
+
+  View view;
+  {
+    // Panda composes a new net transform each time the camera moves
+    PANDRIFT_AUDIT_EXPECTED("guard band camera transform");
+    NodePath top_np = camera_np_.get_top();
+    view.origin = camera_np_.get_pos(top_np);
+    view.axis = top_np.get_relative_vector(camera_np_, LVector3f::forward());
+  }
+  view.axis.normalize();
+
+  // Aim the next cull where the view will be if it keeps turning as it did last frame
+  View predicted_view = view;
+  predicted_view.axis = view.axis * 2.0 - previous_axis_;
+  predicted_view.axis.normalize();
+  previous_axis_ = view.axis;
+
+  apply_result();
+
+  if (applied_)
+  {
+    const float cAngle = get_angle(view.axis, applied_view_.axis);
+    const float cDistance = (view.origin - applied_view_.origin).length();
+
+    // Outside the band the hidden set may be missing something in view
+    if (cAngle > guard_angle_ || cDistance > guard_distance_)
+    {
+      show_all();
+      applied_ = false;
+    }
+    else if (cAngle > guard_angle_ * cRequestFraction || cDistance > guard_distance_ * cRequestFraction)
+    {
+      request_cull(predicted_view);
+    }
+  }
+
+  if (!applied_)
+    request_cull(predicted_view);
+}
+
+int GuardBandCuller::get_hidden_count()
+{
+  return hidden_count_;
+}
+
+int GuardBandCuller::get_cull_count()
+{
+  return cull_count_;
+}
+
+GuardBandCuller::CullThread::CullThread(GuardBandCuller *culler_ptr) :
+  Thread(cCullThreadName, cCullThreadName),
+  culler_ptr_(culler_ptr)
+{
+}
+
+void GuardBandCuller::CullThread::thread_main()
+{
+  culler_ptr_->cull_objects();
+}
+
+void GuardBandCuller::cull_objects()
+{
+  pvector<LVecBase4f> spheres;
+  pvector<bool> visible;
+
+  while (true)
+  {
+    View view;
+    float half_angle, far_distance, guard_distance;
+    {
+      MutexHolder holder(lock_);
+      while (!request_pending_ && !stopping_)
+        cull_cvar_.wait();
+
+      if (stopping_)
+        return;
+
+      view = request_view_;
+      half_angle = request_half_angle_;
+      far_distance = request_far_distance_;
+      guard_distance = request_guard_distance_;
+      spheres.swap(request_spheres_);
+      request_pending_ = false;
+    }
+
+    visible.resize(spheres.size());
+    for (size_t object = 0; object < spheres.size(); ++object)
+    {
+      // Grow each sphere by how far the view may move while the result is used
+      const LVector3f cOffset = LPoint3f(spheres[object][0], spheres[object][1], spheres[object][2]) - view.origin;
+      const float cRadius = spheres[object][3] + guard_distance;
+      const float cDistance = cOffset.length();
+
+      if (cDistance <= cRadius)
+        visible[object] = true;
+      else if (cDistance - cRadius > far_distance)
+        visible[object] = false;
+      else
+        visible[object] = get_angle(cOffset / cDistance, view.axis) - asin(cRadius / cDistance) <= half_angle;
+    }
+
+    MutexHolder holder(lock_);
+    result_view_ = view;
+    result_visible_.swap(visible);
+    result_ready_ = true;
+  }
+}
+
+void GuardBandCuller::request_cull(const View &view)
+{
+  MutexHolder holder(lock_);
+
+  // One cull at a time; the next request goes in once this one is back
+  if (request_pending_ || object_spheres_.empty())
+    return;
+
+  request_view_ = view;
+  request_spheres_ = object_spheres_;
+  // The eyes sit off the camera, so they count as movement
+  request_half_angle_ = view_half_angle_ + guard_angle_;
+  request_far_distance_ = far_distance_;
+  request_guard_distance_ = guard_distance_ + view_radius_;
+  request_pending_ = true;
+  cull_cvar_.notify();
+}
+
+void GuardBandCuller::apply_result()
+{
+  pvector<bool> visible;
+  View result_view;
+  {
+    MutexHolder holder(lock_);
+    if (!result_ready_)
+      return;
+
+    visible.swap(result_visible_);
+    result_view = result_view_;
+    result_ready_ = false;
+  }
+
+  // Static roots added since the request aren't covered
+  if (visible.size() != object_nps_.size())
+    return;
+
+  // Only touch the nodes that changed
+  for (size_t object = 0; object < object_nps_.size(); ++object)
+  {
+    if (object_hidden_[object] == !visible[object])
+      continue;
+
+    if (visible[object])
+    {
+      object_nps_[object].show();
+      --hidden_count_;
+    }
+    else
+    {
+      object_nps_[object].hide();
+      ++hidden_count_;
+    }
+    object_hidden_[object] = !visible[object];
+  }
+
+  applied_ = true;
+  applied_view_ = result_view;
+  ++cull_count_;
+}
+
+void GuardBandCuller::show_all()
+{
+  for (size_t object = 0; object < object_nps_.size(); ++object)
+  {
+    if (!object_hidden_[object])
+      continue;
+
+    object_nps_[object].show();
+    object_hidden_[object] = false;
+  }
+
+  hidden_count_ = 0;
+}
+
+}
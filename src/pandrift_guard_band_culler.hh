@@ -0,0 +1,116 @@
+/*################################################################
+Pandrift
+Copyright (c) 2013 Warren Moore
+
+This software may be redistributed under the terms of the MIT License.
+See the file LICENSE for details.
+################################################################*/
+
+#ifndef PANDRIFT_GUARD_BAND_CULLER_HEADER
+#define PANDRIFT_GUARD_BAND_CULLER_HEADER
+
+#include "pandrift.hh"
+#include "nodePath.h"
+#include "thread.h"
+#include "pmutex.h"
+#include "conditionVar.h"
+#include "pvector.h"
+#include "lvecBase4.h"
+
+namespace pandrift
+{
+
+// Hides static objects well outside the view, so Panda's cull never visits
+// them. A worker thread finds the static objects inside a cone widened by a
+// guard band and aimed where the head is heading, ahead of when it's needed;
+// the result is reused while the view stays inside the band. Anything not
+// under a static root is left to Panda's cull every frame.
+class GuardBandCuller
+{
+public:
+  GuardBandCuller();
+
+  ~GuardBandCuller();
+
+  // How far the view may turn, and move, before the hidden set is stale
+  void set_guard_band(float radians, float distance);
+
+  // The GeomNodes under the root are static and culled as units. Their
+  // bounds are taken now, so the root must be in the scene.
+  void add_static_root(NodePath root_np);
+
+  // Shows everything hidden and forgets the static roots
+  void clear_static_roots();
+
+  // Cull for the views within view_radius of camera_np, out to the half
+  // angle and far distance
+  bool start(NodePath camera_np, float view_half_angle, float far_distance, float view_radius);
+
+  void stop();
+
+  bool is_started();
+
+  // Main thread, once a frame before cull
+  void update();
+
+  int get_hidden_count();
+
+  int get_cull_count();
+
+private:
+  class CullThread : public Thread
+  {
+  public:
+    CullThread(GuardBandCuller *culler_ptr);
+
+  protected:
+    virtual void thread_main();
+
+  private:
+    GuardBandCuller *culler_ptr_;
+  };
+
+  struct View
+  {
+    LPoint3f origin;
+    LVector3f axis;
+  };
+
+  void cull_objects();
+
+  void request_cull(const View &view);
+
+  void apply_result();
+
+  void show_all();
+
+  // Main thread only
+  NodePath camera_np_;
+  pvector<NodePath> object_nps_;
+  pvector<bool> object_hidden_;
+  pvector<LVecBase4f> object_spheres_;
+  float guard_angle_, guard_distance_;
+  float view_half_angle_, far_distance_, view_radius_;
+  bool applied_;
+  View applied_view_;
+  LVector3f previous_axis_;
+  int hidden_count_;
+  int cull_count_;
+  PT(CullThread) cull_thread_ptr_;
+
+  // Guards the request and result below
+  Mutex lock_;
+  ConditionVar cull_cvar_;
+  bool stopping_;
+  bool request_pending_;
+  View request_view_;
+  pvector<LVecBase4f> request_spheres_;
+  float request_half_angle_, request_far_distance_, request_guard_distance_;
+  bool result_ready_;
+  View result_view_;
+  pvector<bool> result_visible_;
+};
+
+}
+
+#endif
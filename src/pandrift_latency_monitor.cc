@@ -0,0 +1,360 @@
+/*################################################################
+Pandrift
+Copyright (c) 2013 Warren Moore
+
+This software may be redistributed under the terms of the MIT License.
+See the file LICENSE for details.
+################################################################*/
+
+#include "pandrift_latency_monitor.hh"
+#include "pandrift_allocation_audit.hh"
+#include "pandrift_gl.hh"
+#include "asyncTaskManager.h"
+#include "callbackObject.h"
+#include "callbackData.h"
+#include "trueClock.h"
+#include "mutexHolder.h"
+#include "camera.h"
+#include "graphicsWindow.h"
+#include "graphicsEngine.h"
+#include <algorithm>
+
+using namespace std;
+
+namespace
+{
+
+const char *cFrameTaskName = "pandrift latency stamp";
+// Just before the framework's igLoop renders the frame
+const int cFrameTaskSort = 49;
+const char *cSwapTaskName = "pandrift latency swap";
+// Just after igLoop, once auto-flip has swapped the frame
+const int cSwapTaskSort = 51;
+const char *cStampCameraName = "latency monitor camera";
+// After the warp, before the frame scheduler's draw complete region
+const int cStampRegionSort = 1500;
+const int cReadbackDepth = 4;
+const int cStampQueueSize = 16;
+// Enough to cover the frames in flight in the readback ring
+const int cFrameHistory = 64;
+const int cReservedLatencies = 1 << 16;
+const unsigned int cFrameIdMask = 0xffffff;
+
+}
+
+namespace pandrift
+{
+
+class StampCallback : public CallbackObject
+{
+public:
+  StampCallback(LatencyMonitor *monitor_ptr) :
+    monitor_ptr_(monitor_ptr)
+  {
+  }
+
+  virtual void do_callback(CallbackData *cbdata)
+  {
+    // Drawn after the warp, so the stamp goes over the finished frame
+    cbdata->upcall();
+    monitor_ptr_->draw_stamp();
+  }
+
+private:
+  LatencyMonitor *monitor_ptr_;
+};
+
+LatencyMonitor::LatencyMonitor() :
+  verify_(false),
+  next_frame_id_(0),
+  sample_times_(cFrameHistory),
+  readback_(cReadbackDepth),
+  presented_frame_id_(0),
+  has_presented_(false),
+  stamps_(cStampQueueSize),
+  stamp_read_(0),
+  stamp_count_(0),
+  drawn_frame_id_(0),
+  has_drawn_frame_(false),
+  swaps_(cFrameHistory)
+{
+  for (int swap = 0; swap < cFrameHistory; ++swap)
+  {
+    // Matches no frame until one is timed
+    swaps_[swap].frame_id = ~0u;
+    swaps_[swap].latency = 0;
+  }
+
+  latencies_.reserve(cReservedLatencies);
+  reset_statistics();
+}
+
+LatencyMonitor::~LatencyMonitor()
+{
+  stop();
+}
+
+void LatencyMonitor::set_rift_manager(boost::shared_ptr<RiftManager> rift_manager_ptr)
+{
+  rift_manager_ptr_ = rift_manager_ptr;
+}
+
+bool LatencyMonitor::start(GraphicsOutput *window_ptr)
+{
+  assert(!is_started());
+
+  if (!window_ptr)
+    return false;
+
+  if (!window_ptr->get_engine()->get_threading_model().get_draw_name().empty())
+    pandrift_cat.warning() << "start: Drawing on its own thread, so swaps are timed before the flip" << endl;
+
+  // A region drawn after the warp, whose camera sees nothing, lets us
+  // stamp and read back the finished frame
+  stamp_region_ptr_ = window_ptr->make_display_region();
+  stamp_region_ptr_->set_sort(cStampRegionSort);
+  stamp_region_ptr_->set_draw_callback(new StampCallback(this));
+  stamp_camera_np_ = NodePath(new Camera(cStampCameraName));
+  stamp_region_ptr_->set_camera(stamp_camera_np_);
+
+  // Only a double-buffered window has a front buffer to check the stamp in
+  verify_ = window_ptr->is_of_type(GraphicsWindow::get_class_type()) &&
+            !window_ptr->get_fb_properties().is_single_buffered();
+  has_presented_ = false;
+  {
+    MutexHolder holder(lock_);
+    has_drawn_frame_ = false;
+  }
+
+  frame_task_ptr_ = new GenericAsyncTask(cFrameTaskName, &frame_task, this);
+  frame_task_ptr_->set_sort(cFrameTaskSort);
+  AsyncTaskManager::get_global_ptr()->add(frame_task_ptr_);
+
+  swap_task_ptr_ = new GenericAsyncTask(cSwapTaskName, &swap_task, this);
+  swap_task_ptr_->set_sort(cSwapTaskSort);
+  AsyncTaskManager::get_global_ptr()->add(swap_task_ptr_);
+
+  return true;
+}
+
+void LatencyMonitor::stop()
+{
+  if (!is_started())
+    return;
+
+  frame_task_ptr_->remove();
+  frame_task_ptr_ = NULL;
+  swap_task_ptr_->remove();
+  swap_task_ptr_ = NULL;
+
+  stamp_region_ptr_->get_window()->remove_display_region(stamp_region_ptr_);
+  stamp_region_ptr_ = NULL;
+  stamp_camera_np_.remove_node();
+
+  readback_.release();
+}
+
+bool LatencyMonitor::is_started()
+{
+  return frame_task_ptr_ != NULL;
+}
+
+void LatencyMonitor::get_statistics(Statistics &statistics)
+{
+  pvector<float> latencies;
+  {
+    MutexHolder holder(lock_);
+    statistics.frames = frames_;
+    statistics.corrupt_frames = corrupt_frames_;
+    statistics.dropped_frames = dropped_frames_;
+    latencies = latencies_;
+  }
+
+  statistics.verified_frames = latencies.size();
+  statistics.mean_seconds = 0;
+  statistics.median_seconds = 0;
+  statistics.p95_seconds = 0;
+  statistics.max_seconds = 0;
+  if (latencies.empty())
+    return;
+
+  sort(latencies.begin(), latencies.end());
+
+  double total = 0;
+  for (size_t latency = 0; latency < latencies.size(); ++latency)
+    total += latencies[latency];
+
+  statistics.mean_seconds = total / latencies.size();
+  statistics.median_seconds = latencies[latencies.size() / 2];
+  statistics.p95_seconds = latencies[(latencies.size() * 95) / 100];
+  statistics.max_seconds = latencies.back();
+}
+
+void LatencyMonitor::reset_statistics()
+{
+  MutexHolder holder(lock_);
+  frames_ = 0;
+  corrupt_frames_ = 0;
+  dropped_frames_ = 0;
+  latencies_.clear();
+}
+
+AsyncTask::DoneStatus LatencyMonitor::frame_task(GenericAsyncTask *task_ptr, void *data_ptr)
+{
+  LatencyMonitor *monitor_ptr = reinterpret_cast<LatencyMonitor *>(data_ptr);
+  monitor_ptr->stamp_frame();
+
+  return AsyncTask::DS_cont;
+}
+
+AsyncTask::DoneStatus LatencyMonitor::swap_task(GenericAsyncTask *task_ptr, void *data_ptr)
+{
+  LatencyMonitor *monitor_ptr = reinterpret_cast<LatencyMonitor *>(data_ptr);
+  monitor_ptr->time_swap();
+
+  return AsyncTask::DS_cont;
+}
+
+void LatencyMonitor::stamp_frame()
+{
+  PANDRIFT_AUDIT_SITE("LatencyMonitor::stamp_frame");
+
+  // The pose rendered this frame was taken from this sample
+  double sample_time = 0;
+  if (rift_manager_ptr_)
+    sample_time = rift_manager_ptr_->get_pose_sample_time();
+  if (sample_time <= 0)
+    sample_time = TrueClock::get_global_ptr()->get_short_time();
+
+  const unsigned int cFrameId = next_frame_id_++ & cFrameIdMask;
+  sample_times_[cFrameId % sample_times_.size()] = sample_time;
+
+  MutexHolder holder(lock_);
+
+  // If the draw thread has fallen behind, forget the oldest stamp
+  if (stamp_count_ == cStampQueueSize)
+  {
+    stamp_read_ = (stamp_read_ + 1) % cStampQueueSize;
+    --stamp_count_;
+  }
+
+  stamps_[(stamp_read_ + stamp_count_) % cStampQueueSize] = cFrameId;
+  ++stamp_count_;
+}
+
+void LatencyMonitor::time_swap()
+{
+  PANDRIFT_AUDIT_SITE("LatencyMonitor::time_swap");
+
+  // With auto-flip and sync-video, igLoop has returned from the swap
+  const double cSwapTime = TrueClock::get_global_ptr()->get_short_time();
+
+  MutexHolder holder(lock_);
+  if (!has_drawn_frame_)
+    return;
+
+  has_drawn_frame_ = false;
+  const double cLatency = cSwapTime - sample_times_[drawn_frame_id_ % sample_times_.size()];
+
+  // Keep the latency until the front buffer shows which frame was presented
+  if (verify_)
+  {
+    Swap &swap = swaps_[drawn_frame_id_ % swaps_.size()];
+    swap.frame_id = drawn_frame_id_;
+    swap.latency = cLatency;
+  }
+  else
+  {
+    latencies_.push_back(cLatency);
+  }
+}
+
+void LatencyMonitor::draw_stamp()
+{
+  PANDRIFT_AUDIT_SITE("LatencyMonitor::draw_stamp");
+
+  unsigned int frame_id;
+  {
+    MutexHolder holder(lock_);
+    if (0 == stamp_count_)
+      return;
+
+    frame_id = stamps_[stamp_read_];
+    stamp_read_ = (stamp_read_ + 1) % cStampQueueSize;
+    --stamp_count_;
+    ++frames_;
+  }
+
+  // The front buffer holds the frame last swapped; read back its stamp to
+  // check it is the frame drawn before this one
+  if (verify_ && has_presented_)
+  {
+    GLint read_buffer;
+    glGetIntegerv(GL_READ_BUFFER, &read_buffer);
+    glReadBuffer(GL_FRONT);
+    const bool cRequested = readback_.request(0, 0, 1, 1, presented_frame_id_, 0);
+    glReadBuffer(read_buffer);
+
+    if (!cRequested)
+    {
+      MutexHolder holder(lock_);
+      ++dropped_frames_;
+    }
+  }
+
+  // Clear the corner pixel to the ID, one byte per channel, leaving Panda's GL state as it was
+  GLfloat clear_colour[4];
+  GLint scissor_box[4];
+  glGetFloatv(GL_COLOR_CLEAR_VALUE, clear_colour);
+  glGetIntegerv(GL_SCISSOR_BOX, scissor_box);
+  const GLboolean cScissorEnabled = glIsEnabled(GL_SCISSOR_TEST);
+
+  glEnable(GL_SCISSOR_TEST);
+  glScissor(0, 0, 1, 1);
+  glClearColor(float(frame_id & 0xff) / 255.0,
+               float((frame_id >> 8) & 0xff) / 255.0,
+               float((frame_id >> 16) & 0xff) / 255.0,
+               1.0);
+  glClear(GL_COLOR_BUFFER_BIT);
+
+  glClearColor(clear_colour[0], clear_colour[1], clear_colour[2], clear_colour[3]);
+  glScissor(scissor_box[0], scissor_box[1], scissor_box[2], scissor_box[3]);
+  if (!cScissorEnabled)
+    glDisable(GL_SCISSOR_TEST);
+
+  presented_frame_id_ = frame_id;
+  has_presented_ = true;
+
+  {
+    // The swap task times it once auto-flip has swapped it
+    MutexHolder holder(lock_);
+    drawn_frame_id_ = frame_id;
+    has_drawn_frame_ = true;
+  }
+
+  collect_readbacks();
+}
+
+void LatencyMonitor::collect_readbacks()
+{
+  PixelReadback::Result result;
+  while (readback_.map_completed(result))
+  {
+    const unsigned char *pixel_ptr = result.pixels_ptr;
+    const unsigned int cFrameId = pixel_ptr[0] | (pixel_ptr[1] << 8) | (pixel_ptr[2] << 16);
+    readback_.unmap();
+
+    MutexHolder holder(lock_);
+    const Swap &swap = swaps_[result.frame_id % swaps_.size()];
+
+    // Only count frames that were presented intact, and timed at their swap
+    if (cFrameId != result.frame_id)
+      ++corrupt_frames_;
+    else if (swap.frame_id != result.frame_id)
+      ++dropped_frames_;
+    else
+      latencies_.push_back(swap.latency);
+  }
+}
+
+}
@@ -0,0 +1,121 @@
+/*################################################################
+Pandrift
+Copyright (c) 2013 Warren Moore
+
+This software may be redistributed under the terms of the MIT License.
+See the file LICENSE for details.
+################################################################*/
+
+#ifndef PANDRIFT_LATENCY_MONITOR_HEADER
+#define PANDRIFT_LATENCY_MONITOR_HEADER
+
+#include "pandrift.hh"
+#include "pandrift_rift_manager.hh"
+#include "pandrift_pixel_readback.hh"
+#include "graphicsOutput.h"
+#include "genericAsyncTask.h"
+#include "pmutex.h"
+#include "pvector.h"
+#include "boost/shared_ptr.hpp"
+
+namespace pandrift
+{
+
+// Measures sensor sample to buffer swap latency. Each frame is stamped with
+// an ID in the bottom left pixel of the warped output, and a task after
+// igLoop times the frame once auto-flip has swapped it. The next frame reads
+// the pixel back asynchronously from the front buffer; frames whose ID is
+// the one presented contribute the time from the sensor sample behind their
+// pose to their swap. Without a front buffer, offscreen, frames are timed
+// but not verified. Without sensor samples, from a stub device, the time
+// the frame took its pose is used instead.
+//
+// The swap is timed on the main thread, so the figures only hold for the
+// single-threaded pipeline. With a draw thread, igLoop returns before the
+// frame is drawn and flipped, and Panda has no callback after the flip.
+class LatencyMonitor
+{
+public:
+  struct Statistics
+  {
+    int frames;
+    int verified_frames;
+    int corrupt_frames;
+    int dropped_frames;
+    double mean_seconds;
+    double median_seconds;
+    double p95_seconds;
+    double max_seconds;
+  };
+
+  LatencyMonitor();
+
+  ~LatencyMonitor();
+
+  void set_rift_manager(boost::shared_ptr<RiftManager> rift_manager_ptr);
+
+  // Warns if the window draws on a thread other than the main one
+  bool start(GraphicsOutput *window_ptr);
+
+  void stop();
+
+  bool is_started();
+
+  void get_statistics(Statistics &statistics);
+
+  void reset_statistics();
+
+private:
+  struct Swap
+  {
+    unsigned int frame_id;
+    double latency;
+  };
+
+  static AsyncTask::DoneStatus frame_task(GenericAsyncTask *task_ptr, void *data_ptr);
+
+  static AsyncTask::DoneStatus swap_task(GenericAsyncTask *task_ptr, void *data_ptr);
+
+  void stamp_frame();
+
+  void time_swap();
+
+  void draw_stamp();
+
+  void collect_readbacks();
+
+  friend class StampCallback;
+
+  boost::shared_ptr<RiftManager> rift_manager_ptr_;
+  PT(GenericAsyncTask) frame_task_ptr_;
+  PT(GenericAsyncTask) swap_task_ptr_;
+  PT(DisplayRegion) stamp_region_ptr_;
+  NodePath stamp_camera_np_;
+  bool verify_;
+
+  // Main thread only
+  unsigned int next_frame_id_;
+  pvector<double> sample_times_;
+
+  // Draw thread only
+  PixelReadback readback_;
+  unsigned int presented_frame_id_;
+  bool has_presented_;
+
+  // Guards the stamps passed to the draw thread, the frame it hands back
+  // to be timed, and the results
+  Mutex lock_;
+  pvector<unsigned int> stamps_;
+  int stamp_read_, stamp_count_;
+  unsigned int drawn_frame_id_;
+  bool has_drawn_frame_;
+  pvector<Swap> swaps_;
+  int frames_;
+  int corrupt_frames_;
+  int dropped_frames_;
+  pvector<float> latencies_;
+};
+
+}
+
+#endif
@@ -0,0 +1,131 @@
+/*################################################################
+Pandrift
+Copyright (c) 2013 Warren Moore
+
+This software may be redistributed under the terms of the MIT License.
+See the file LICENSE for details.
+################################################################*/
+
+#include "pandrift_lens_footprint.hh"
+#include "pvector.h"
+#include <math.h>
+#include <algorithm>
+
+using namespace std;
+
+namespace
+{
+
+const int cFootprintSamples = 64;
+// Allow for the gaps between samples so the bound stays conservative
+const float cFootprintMargin = 0.05;
+
+typedef pvector<LVector2f> Polygon;
+
+// Keep the part of the polygon where dot(p, direction) <= extent
+void clip_polygon(const Polygon &in, const LVector2f &direction, float extent, Polygon &out)
+{
+  out.clear();
+  for (size_t index = 0; index < in.size(); ++index)
+  {
+    const LVector2f &a = in[index];
+    const LVector2f &b = in[(index + 1) % in.size()];
+    const float cA = a[0] * direction[0] + a[1] * direction[1] - extent;
+    const float cB = b[0] * direction[0] + b[1] * direction[1] - extent;
+
+    if (cA <= 0)
+      out.push_back(a);
+    if ((cA < 0 && cB > 0) || (cA > 0 && cB < 0))
+      out.push_back(a + (b - a) * (cA / (cA - cB)));
+  }
+}
+
+float polygon_area(const Polygon &polygon)
+{
+  float area = 0;
+  for (size_t index = 0; index < polygon.size(); ++index)
+  {
+    const LVector2f &a = polygon[index];
+    const LVector2f &b = polygon[(index + 1) % polygon.size()];
+    area += a[0] * b[1] - b[0] * a[1];
+  }
+
+  return fabs(area) * 0.5;
+}
+
+}
+
+namespace pandrift
+{
+
+LVector2f get_footprint_direction(int index)
+{
+  // Axes first, then diagonals
+  static const float cDiagonal = sqrtf(0.5);
+  static const LVector2f cDirections[cFootprintDirections] =
+  {
+    LVector2f(1, 0), LVector2f(0, 1), LVector2f(-1, 0), LVector2f(0, -1),
+    LVector2f(cDiagonal, cDiagonal), LVector2f(-cDiagonal, cDiagonal),
+    LVector2f(-cDiagonal, -cDiagonal), LVector2f(cDiagonal, -cDiagonal)
+  };
+
+  return cDirections[index];
+}
+
+float get_footprint_limit(int index)
+{
+  return index < 4 ? 1.0 : sqrtf(2.0);
+}
+
+void calculate_lens_footprint(DistortionTable &table, int eye, LensFootprint &footprint)
+{
+  for (int direction = 0; direction < cFootprintDirections; ++direction)
+    footprint.extent[direction] = -get_footprint_limit(direction);
+
+  // Warp a grid over the eye's half of the panel, one row at a time
+  const float cEyeX = float(eye) * 0.5;
+  LPoint2f panel_points[cFootprintSamples + 1];
+  LPoint2f scene_points[cFootprintSamples + 1];
+  for (int row = 0; row <= cFootprintSamples; ++row)
+  {
+    for (int column = 0; column <= cFootprintSamples; ++column)
+      panel_points[column].set(cEyeX + 0.5 * float(column) / float(cFootprintSamples),
+                               float(row) / float(cFootprintSamples));
+
+    table.warp(panel_points, scene_points, cFootprintSamples + 1);
+
+    for (int column = 0; column <= cFootprintSamples; ++column)
+    {
+      // Clamp into the eye's rectangle, as the shader does, in device coordinates
+      const LVector2f point_v(min(max((scene_points[column][0] - cEyeX) * 4.0 - 1.0, -1.0), 1.0),
+                              min(max(scene_points[column][1] * 2.0 - 1.0, -1.0), 1.0));
+
+      for (int direction = 0; direction < cFootprintDirections; ++direction)
+      {
+        const LVector2f direction_v = get_footprint_direction(direction);
+        footprint.extent[direction] = max(footprint.extent[direction],
+                                          point_v[0] * direction_v[0] + point_v[1] * direction_v[1]);
+      }
+    }
+  }
+
+  for (int direction = 0; direction < cFootprintDirections; ++direction)
+    footprint.extent[direction] = min(footprint.extent[direction] + cFootprintMargin,
+                                      get_footprint_limit(direction));
+
+  // Clip the eye's rectangle by the octagon to measure the coverage
+  Polygon polygon, clipped;
+  polygon.push_back(LVector2f(-1, -1));
+  polygon.push_back(LVector2f(1, -1));
+  polygon.push_back(LVector2f(1, 1));
+  polygon.push_back(LVector2f(-1, 1));
+  for (int direction = 0; direction < cFootprintDirections && !polygon.empty(); ++direction)
+  {
+    clip_polygon(polygon, get_footprint_direction(direction), footprint.extent[direction], clipped);
+    polygon.swap(clipped);
+  }
+
+  footprint.coverage = polygon_area(polygon) / 4.0;
+}
+
+}
@@ -0,0 +1,40 @@
+/*################################################################
+Pandrift
+Copyright (c) 2013 Warren Moore
+
+This software may be redistributed under the terms of the MIT License.
+See the file LICENSE for details.
+################################################################*/
+
+#ifndef PANDRIFT_LENS_FOOTPRINT_HEADER
+#define PANDRIFT_LENS_FOOTPRINT_HEADER
+
+#include "pandrift.hh"
+#include "pandrift_distortion_table.hh"
+#include "lvector2.h"
+
+namespace pandrift
+{
+
+const int cFootprintDirections = 8;
+
+// The part of an eye's half of the scene buffer that the warp samples,
+// bounded by an octagon in the eye's normalised device coordinates.
+// Edge i is the line dot(p, get_footprint_direction(i)) = extent[i].
+struct LensFootprint
+{
+  float extent[cFootprintDirections];
+  // Fraction of the eye's area inside the octagon
+  float coverage;
+};
+
+LVector2f get_footprint_direction(int index);
+
+// The largest extent along a direction that still touches the eye's rectangle
+float get_footprint_limit(int index);
+
+void calculate_lens_footprint(DistortionTable &table, int eye, LensFootprint &footprint);
+
+}
+
+#endif
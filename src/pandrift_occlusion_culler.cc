@@ -0,0 +1,489 @@
+/*################################################################
+Pandrift
+Copyright (c) 2013 Warren Moore
+
+This software may be redistributed under the terms of the MIT License.
+See the file LICENSE for details.
+################################################################*/
+
+#include "pandrift_occlusion_culler.hh"
+#include "pandrift_allocation_audit.hh"
+#include "callbackObject.h"
+#include "callbackData.h"
+#include "displayRegionDrawCallbackData.h"
+#include "sceneSetup.h"
+#include "perspectiveLens.h"
+#include "camera.h"
+#include "colorWriteAttrib.h"
+#include "graphicsEngine.h"
+#include "mutexHolder.h"
+#include <math.h>
+#include <algorithm>
+
+using namespace std;
+
+namespace
+{
+
+const char *cOcclusionBufferName = "occlusion buffer";
+const char *cOcclusionCameraName = "occlusion camera";
+const char *cOccluderRootName = "occluder root";
+// Before the scene buffers, which don't wait on the results
+const int cOcclusionBufferSort = -110;
+const int cDefaultBufferWidth = 256;
+// Each frame's queries are read the frame after, while the next set is drawn
+const int cQuerySets = 2;
+// The corners of each face of a box, indexed by the x, y and z bits
+const int cBoxFaces[6][4] = { { 0, 2, 6, 4 }, { 1, 5, 7, 3 },
+                              { 0, 4, 5, 1 }, { 2, 3, 7, 6 },
+                              { 0, 1, 3, 2 }, { 4, 6, 7, 5 } };
+
+}
+
+namespace pandrift
+{
+
+class OcclusionQueryCallback : public CallbackObject
+{
+public:
+  OcclusionQueryCallback(OcclusionCuller *culler_ptr) :
+    culler_ptr_(culler_ptr)
+  {
+  }
+
+  virtual void do_callback(CallbackData *cbdata)
+  {
+    // Draw the occluders' depth, then test the boxes against it from the same view
+    cbdata->upcall();
+
+    DisplayRegionDrawCallbackData *draw_data_ptr = DCAST(DisplayRegionDrawCallbackData, cbdata);
+    SceneSetup *scene_setup_ptr = draw_data_ptr->get_scene_setup();
+    const LMatrix4f &camera_mat = scene_setup_ptr->get_camera_transform()->get_mat();
+
+    LMatrix4f view_mat;
+    view_mat.invert_from(camera_mat);
+    culler_ptr_->draw_queries(view_mat * scene_setup_ptr->get_lens()->get_projection_mat(), camera_mat.get_row3(3));
+  }
+
+private:
+  OcclusionCuller *culler_ptr_;
+};
+
+OcclusionCuller::OcclusionCuller() :
+  buffer_width_(cDefaultBufferWidth),
+  view_radius_(0),
+  active_(true),
+  occluder_root_np_(cOccluderRootName),
+  hidden_count_(0),
+  draw_boxes_version_(0),
+  query_set_(0),
+  boxes_version_(0),
+  result_ready_(false)
+{
+  for (int query_set = 0; query_set < cQuerySets; ++query_set)
+    set_pending_[query_set] = false;
+
+  // Only depth is wanted from the proxies, whatever their own state
+  occluder_root_np_.set_attrib(ColorWriteAttrib::make(ColorWriteAttrib::C_off), 1);
+  occluder_root_np_.set_texture_off(1);
+  occluder_root_np_.set_light_off(1);
+  occluder_root_np_.set_shader_off(1);
+}
+
+OcclusionCuller::~OcclusionCuller()
+{
+  stop();
+}
+
+void OcclusionCuller::set_render_target_pool(boost::shared_ptr<RenderTargetPool> render_target_pool_ptr)
+{
+  assert(!is_started());
+
+  render_target_pool_ptr_ = render_target_pool_ptr;
+}
+
+void OcclusionCuller::set_buffer_width(int width)
+{
+  buffer_width_ = max(width, 16);
+}
+
+void OcclusionCuller::add_occluder(NodePath proxy_np)
+{
+  if (proxy_np.is_empty())
+    return;
+
+  NodePath copy_np = proxy_np.copy_to(occluder_root_np_);
+  copy_np.set_transform(proxy_np.get_net_transform());
+
+  // The proxy may be kept hidden in the scene
+  copy_np.show();
+}
+
+void OcclusionCuller::add_occludee(NodePath occludee_np)
+{
+  if (occludee_np.is_empty())
+    return;
+
+  // World space bounds, as the static node won't move
+  Box box;
+  if (!occludee_np.calc_tight_bounds(box.min_point, box.max_point, occludee_np.get_top()))
+    return;
+
+  occludee_nps_.push_back(occludee_np);
+  occludee_hidden_.push_back(false);
+
+  MutexHolder holder(lock_);
+  boxes_.push_back(box);
+  ++boxes_version_;
+}
+
+void OcclusionCuller::clear()
+{
+  show_all();
+
+  occludee_nps_.clear();
+  occludee_hidden_.clear();
+  occluder_root_np_.node()->remove_all_children();
+
+  MutexHolder holder(lock_);
+  boxes_.clear();
+  ++boxes_version_;
+  result_ready_ = false;
+}
+
+bool OcclusionCuller::start(GraphicsOutput *host_ptr,
+                            NodePath camera_np,
+                            float horizontal_half_angle,
+                            float vertical_half_angle,
+                            float near_distance,
+                            float far_distance,
+                            float view_radius)
+{
+  assert(!is_started());
+
+  if (!host_ptr || camera_np.is_empty() || horizontal_half_angle <= 0 || vertical_half_angle <= 0)
+    return false;
+
+  const int cHeight = max(1, int(float(buffer_width_) * tan(vertical_half_angle) / tan(horizontal_half_angle) + 0.5));
+  if (render_target_pool_ptr_)
+  {
+    RenderTargetPool::Format format;
+    format.alpha = false;
+    format.depth_texture = false;
+
+    RenderTargetPool::RenderTarget target;
+    if (render_target_pool_ptr_->acquire(host_ptr, cOcclusionBufferName, buffer_width_, cHeight, format, target))
+      buffer_ptr_ = target.buffer_ptr;
+  }
+  else
+  {
+    buffer_ptr_ = host_ptr->make_texture_buffer(cOcclusionBufferName, buffer_width_, cHeight);
+  }
+
+  if (!buffer_ptr_)
+  {
+    pandrift_cat.error() << "start: Unable to create occlusion buffer";
+    return false;
+  }
+
+  buffer_ptr_->set_sort(cOcclusionBufferSort);
+  buffer_ptr_->set_clear_color_active(false);
+  buffer_ptr_->set_clear_depth_active(true);
+  buffer_ptr_->set_active(active_);
+
+  // One view from between the eyes, wide enough for both
+  PT(PerspectiveLens) lens_ptr = new PerspectiveLens();
+  lens_ptr->set_fov(horizontal_half_angle * (360.0 / M_PI), vertical_half_angle * (360.0 / M_PI));
+  lens_ptr->set_near_far(near_distance, far_distance);
+
+  // Follows the head, but only sees the proxies
+  PT(Camera) camera_ptr = new Camera(cOcclusionCameraName);
+  camera_ptr->set_lens(lens_ptr);
+  camera_ptr->set_scene(occluder_root_np_);
+  camera_np_ = camera_np.attach_new_node(camera_ptr);
+
+  view_radius_ = view_radius;
+  query_set_ = 0;
+
+  region_ptr_ = buffer_ptr_->make_display_region();
+  region_ptr_->set_camera(camera_np_);
+  region_ptr_->set_draw_callback(new OcclusionQueryCallback(this));
+
+  if (pandrift_cat.is_info())
+    pandrift_cat.info() << "start: Occlusion buffer " << buffer_width_ << "x" << cHeight
+                        << ", " << occludee_nps_.size() << " occludees" << endl;
+
+  return true;
+}
+
+void OcclusionCuller::stop()
+{
+  if (!is_started())
+    return;
+
+  region_ptr_->clear_draw_callback();
+  buffer_ptr_->remove_display_region(region_ptr_);
+  region_ptr_ = NULL;
+
+  if (render_target_pool_ptr_)
+    render_target_pool_ptr_->release(buffer_ptr_);
+  else
+    buffer_ptr_->get_engine()->remove_window(buffer_ptr_);
+  buffer_ptr_ = NULL;
+
+  camera_np_.remove_node();
+
+  // The context isn't current here; the next draw deletes the queries, or
+  // they go with the context
+  retire_queries();
+  draw_boxes_version_ = 0;
+
+  // Without updates the hidden set would go stale
+  show_all();
+
+  MutexHolder holder(lock_);
+  result_ready_ = false;
+  // Have the next start take the boxes afresh
+  ++boxes_version_;
+}
+
+bool OcclusionCuller::is_started()
+{
+  return buffer_ptr_ != NULL;
+}
+
+void OcclusionCuller::set_active(bool active)
+{
+  active_ = active;
+
+  if (buffer_ptr_)
+    buffer_ptr_->set_active(active_);
+}
+
+void OcclusionCuller::update()
+{
+  PANDRIFT_AUDIT_SITE("OcclusionCuller::update");
+
+  if (!is_started())
+    return;
+
+  {
+    MutexHolder holder(lock_);
+    if (!result_ready_)
+      return;
+
+    apply_visible_ = result_visible_;
+    result_ready_ = false;
+  }
+
+  // Both eyes draw the same graph, so hiding a node culls it for both
+  const size_t cCount = min(apply_visible_.size(), occludee_nps_.size());
+  hidden_count_ = 0;
+  for (size_t occludee = 0; occludee < cCount; ++occludee)
+  {
+    const bool cHidden = !apply_visible_[occludee];
+    if (cHidden != occludee_hidden_[occludee])
+    {
+      if (cHidden)
+        occludee_nps_[occludee].hide();
+      else
+        occludee_nps_[occludee].show();
+
+      occludee_hidden_[occludee] = cHidden;
+    }
+
+    if (cHidden)
+      ++hidden_count_;
+  }
+}
+
+int OcclusionCuller::get_hidden_count()
+{
+  return hidden_count_;
+}
+
+int OcclusionCuller::get_occludee_count()
+{
+  return occludee_nps_.size();
+}
+
+void OcclusionCuller::draw_queries(const LMatrix4f &world_to_clip, const LPoint3f &camera_point)
+{
+  delete_retired_queries();
+
+  bool boxes_changed = false;
+  {
+    MutexHolder holder(lock_);
+    if (draw_boxes_version_ != boxes_version_)
+    {
+      draw_boxes_ = boxes_;
+      draw_boxes_version_ = boxes_version_;
+      boxes_changed = true;
+    }
+  }
+
+  // Results in flight are for the old boxes
+  if (boxes_changed)
+    create_queries(draw_boxes_.size());
+
+  // Last frame's queries, if the GPU has finished them
+  collect_queries(1 - query_set_);
+
+  // Skip a frame, rather than stall, while the set to reuse is unread
+  if (set_pending_[query_set_] || draw_boxes_.empty())
+    return;
+
+  // Leave Panda's GL state as it was
+  GLint program = 0;
+  glGetIntegerv(GL_CURRENT_PROGRAM, &program);
+  glPushAttrib(GL_ENABLE_BIT | GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT | GL_TRANSFORM_BIT);
+  glUseProgram(0);
+
+  // Test against the proxies' depth without writing anything
+  glDisable(GL_CULL_FACE);
+  glDisable(GL_BLEND);
+  glDisable(GL_TEXTURE_2D);
+  glDisable(GL_LIGHTING);
+  glDisable(GL_ALPHA_TEST);
+  glDisable(GL_STENCIL_TEST);
+  glEnable(GL_DEPTH_TEST);
+  glDepthFunc(GL_LEQUAL);
+  glDepthMask(GL_FALSE);
+  glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+
+  // The corners go in already in clip space
+  glMatrixMode(GL_PROJECTION);
+  glPushMatrix();
+  glLoadIdentity();
+  glMatrixMode(GL_MODELVIEW);
+  glPushMatrix();
+  glLoadIdentity();
+
+  const LVector3f cEnlarge(view_radius_, view_radius_, view_radius_);
+  const size_t cBase = query_set_ * draw_boxes_.size();
+  for (size_t box = 0; box < draw_boxes_.size(); ++box)
+  {
+    const LPoint3f cMin = draw_boxes_[box].min_point - cEnlarge;
+    const LPoint3f cMax = draw_boxes_[box].max_point + cEnlarge;
+
+    // From inside its box the node is in view, and the near plane would clip the faces
+    if (camera_point[0] >= cMin[0] && camera_point[0] <= cMax[0] &&
+        camera_point[1] >= cMin[1] && camera_point[1] <= cMax[1] &&
+        camera_point[2] >= cMin[2] && camera_point[2] <= cMax[2])
+    {
+      queried_[cBase + box] = false;
+      continue;
+    }
+
+    LVecBase4f corners[8];
+    for (int corner = 0; corner < 8; ++corner)
+      corners[corner] = world_to_clip.xform(LVecBase4f((corner & 1) ? cMax[0] : cMin[0],
+                                                       (corner & 2) ? cMax[1] : cMin[1],
+                                                       (corner & 4) ? cMax[2] : cMin[2],
+                                                       1.0));
+
+    glBeginQuery(GL_SAMPLES_PASSED, queries_[cBase + box]);
+    glBegin(GL_QUADS);
+    for (int face = 0; face < 6; ++face)
+      for (int corner = 0; corner < 4; ++corner)
+        glVertex4fv(corners[cBoxFaces[face][corner]].get_data());
+    glEnd();
+    glEndQuery(GL_SAMPLES_PASSED);
+
+    queried_[cBase + box] = true;
+  }
+
+  glMatrixMode(GL_PROJECTION);
+  glPopMatrix();
+  glMatrixMode(GL_MODELVIEW);
+  glPopMatrix();
+  glPopAttrib();
+  glUseProgram(program);
+
+  set_pending_[query_set_] = true;
+  query_set_ = 1 - query_set_;
+}
+
+void OcclusionCuller::collect_queries(int query_set)
+{
+  if (!set_pending_[query_set])
+    return;
+
+  const size_t cBase = query_set * draw_boxes_.size();
+  for (size_t box = 0; box < draw_boxes_.size(); ++box)
+  {
+    if (!queried_[cBase + box])
+      continue;
+
+    GLuint available = 0;
+    glGetQueryObjectuiv(queries_[cBase + box], GL_QUERY_RESULT_AVAILABLE, &available);
+    if (!available)
+      return;
+  }
+
+  for (size_t box = 0; box < draw_boxes_.size(); ++box)
+  {
+    GLuint samples = 1;
+    if (queried_[cBase + box])
+      glGetQueryObjectuiv(queries_[cBase + box], GL_QUERY_RESULT, &samples);
+
+    draw_visible_[box] = samples > 0;
+  }
+
+  set_pending_[query_set] = false;
+
+  MutexHolder holder(lock_);
+  result_visible_ = draw_visible_;
+  result_ready_ = true;
+}
+
+void OcclusionCuller::create_queries(int box_count)
+{
+  retire_queries();
+  delete_retired_queries();
+
+  queries_.resize(box_count * cQuerySets);
+  if (!queries_.empty())
+    glGenQueries(queries_.size(), &queries_[0]);
+
+  queried_.assign(queries_.size(), false);
+  draw_visible_.assign(box_count, true);
+}
+
+void OcclusionCuller::retire_queries()
+{
+  {
+    MutexHolder holder(lock_);
+    retired_queries_.insert(retired_queries_.end(), queries_.begin(), queries_.end());
+  }
+
+  queries_.clear();
+  for (int query_set = 0; query_set < cQuerySets; ++query_set)
+    set_pending_[query_set] = false;
+  query_set_ = 0;
+}
+
+void OcclusionCuller::delete_retired_queries()
+{
+  MutexHolder holder(lock_);
+  if (!retired_queries_.empty())
+    glDeleteQueries(retired_queries_.size(), &retired_queries_[0]);
+
+  retired_queries_.clear();
+}
+
+void OcclusionCuller::show_all()
+{
+  for (size_t occludee = 0; occludee < occludee_nps_.size(); ++occludee)
+  {
+    if (occludee_hidden_[occludee])
+    {
+      occludee_nps_[occludee].show();
+      occludee_hidden_[occludee] = false;
+    }
+  }
+
+  hidden_count_ = 0;
+}
+
+}
@@ -0,0 +1,141 @@
+/*################################################################
+Pandrift
+Copyright (c) 2013 Warren Moore
+
+This software may be redistributed under the terms of the MIT License.
+See the file LICENSE for details.
+################################################################*/
+
+#ifndef PANDRIFT_OCCLUSION_CULLER_HEADER
+#define PANDRIFT_OCCLUSION_CULLER_HEADER
+
+#include "pandrift.hh"
+#include "pandrift_gl.hh"
+#include "pandrift_render_target_pool.hh"
+#include "graphicsOutput.h"
+#include "displayRegion.h"
+#include "nodePath.h"
+#include "pmutex.h"
+#include "pvector.h"
+#include "lmatrix.h"
+#include "boost/shared_ptr.hpp"
+
+namespace pandrift
+{
+
+// Hides nodes behind occluders, for both eyes at once. Low-poly occluder
+// proxies are drawn into a small depth buffer from between the eyes, with a
+// view covering both eye frustums, then each occludee's bounding box is drawn
+// against that depth inside a hardware occlusion query. The results are read
+// the frame after, so a node coming into view can show a frame late. Boxes
+// are enlarged by the eyes' offset, as each eye sees a little further round
+// an occluder than the middle does.
+class OcclusionCuller
+{
+public:
+  OcclusionCuller();
+
+  ~OcclusionCuller();
+
+  // Draw the depth buffer from a pool, rather than making it
+  void set_render_target_pool(boost::shared_ptr<RenderTargetPool> render_target_pool_ptr);
+
+  // Width of the depth buffer; the height follows the view's aspect
+  void set_buffer_width(int width);
+
+  // The proxy is copied with its world transform, and only drawn into the
+  // depth buffer. It should sit inside the geometry it stands for.
+  void add_occluder(NodePath proxy_np);
+
+  // Hidden while its bounds are occluded. Its bounds are taken now, so it
+  // must be static and in the scene. Don't also cull it with the
+  // GuardBandCuller, as both hide and show nodes.
+  void add_occludee(NodePath occludee_np);
+
+  // Shows everything hidden and forgets the occluders and occludees
+  void clear();
+
+  // View from camera_np, out to the half angles and the near and far
+  // distances, testing boxes enlarged by view_radius. The distances are
+  // where the eyes' lens planes meet forward, which a matrix lens' own near
+  // and far settings don't describe.
+  bool start(GraphicsOutput *host_ptr,
+             NodePath camera_np,
+             float horizontal_half_angle,
+             float vertical_half_angle,
+             float near_distance,
+             float far_distance,
+             float view_radius);
+
+  void stop();
+
+  bool is_started();
+
+  // Only draw and query while the scene is drawn
+  void set_active(bool active);
+
+  // Main thread, once a frame before cull. Applies the latest results.
+  void update();
+
+  int get_hidden_count();
+
+  int get_occludee_count();
+
+private:
+  struct Box
+  {
+    LPoint3f min_point;
+    LPoint3f max_point;
+  };
+
+  void draw_queries(const LMatrix4f &world_to_clip, const LPoint3f &camera_point);
+
+  void collect_queries(int query_set);
+
+  void create_queries(int box_count);
+
+  void retire_queries();
+
+  void delete_retired_queries();
+
+  void show_all();
+
+  friend class OcclusionQueryCallback;
+
+  boost::shared_ptr<RenderTargetPool> render_target_pool_ptr_;
+  int buffer_width_;
+  float view_radius_;
+  bool active_;
+  PT(GraphicsOutput) buffer_ptr_;
+  PT(DisplayRegion) region_ptr_;
+  NodePath camera_np_;
+  NodePath occluder_root_np_;
+
+  // Main thread only
+  pvector<NodePath> occludee_nps_;
+  pvector<bool> occludee_hidden_;
+  pvector<bool> apply_visible_;
+  int hidden_count_;
+
+  // Draw thread only
+  pvector<Box> draw_boxes_;
+  unsigned int draw_boxes_version_;
+  pvector<GLuint> queries_;
+  pvector<bool> queried_;
+  bool set_pending_[2];
+  int query_set_;
+  pvector<bool> draw_visible_;
+
+  // Guards the boxes passed to the draw thread, the results, and the queries
+  // left to delete once the context is current
+  Mutex lock_;
+  pvector<Box> boxes_;
+  unsigned int boxes_version_;
+  bool result_ready_;
+  pvector<bool> result_visible_;
+  pvector<GLuint> retired_queries_;
+};
+
+}
+
+#endif
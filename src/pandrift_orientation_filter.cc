@@ -0,0 +1,336 @@
+/*################################################################
+Pandrift
+Copyright (c) 2013 Warren Moore
+
+This software may be redistributed under the terms of the MIT License.
+See the file LICENSE for details.
+################################################################*/
+
+#include "pandrift_orientation_filter.hh"
+#include "mutexHolder.h"
+#include "trueClock.h"
+#include <stdio.h>
+#include <math.h>
+
+using namespace std;
+
+namespace
+{
+
+const float cDefaultBeta = 0.05;
+const double cMaximumTimeStep = 0.1;
+
+float inverse_length(float x, float y, float z)
+{
+  const float cLengthSquared = x * x + y * y + z * z;
+  return cLengthSquared > 0.0 ? 1.0 / sqrtf(cLengthSquared) : 0.0;
+}
+
+}
+
+namespace pandrift
+{
+
+bool load_imu_samples(const string &file_name, pvector<ImuSample> &samples)
+{
+  FILE *file_ptr = fopen(file_name.c_str(), "r");
+  if (!file_ptr)
+  {
+    pandrift_cat.error() << "load_imu_samples: Unable to open " << file_name;
+    return false;
+  }
+
+  samples.clear();
+
+  ImuSample sample;
+  while (fscanf(file_ptr, "%lf %f %f %f %f %f %f %f %f %f",
+                &sample.time,
+                &sample.gyro[0], &sample.gyro[1], &sample.gyro[2],
+                &sample.accel[0], &sample.accel[1], &sample.accel[2],
+                &sample.mag[0], &sample.mag[1], &sample.mag[2]) == 10)
+    samples.push_back(sample);
+
+  fclose(file_ptr);
+
+  return !samples.empty();
+}
+
+bool save_imu_samples(const string &file_name, const pvector<ImuSample> &samples)
+{
+  FILE *file_ptr = fopen(file_name.c_str(), "w");
+  if (!file_ptr)
+  {
+    pandrift_cat.error() << "save_imu_samples: Unable to open " << file_name;
+    return false;
+  }
+
+  for (size_t index = 0; index < samples.size(); ++index)
+  {
+    const ImuSample &sample = samples[index];
+    fprintf(file_ptr, "%.6f %g %g %g %g %g %g %g %g %g\n",
+            sample.time,
+            sample.gyro[0], sample.gyro[1], sample.gyro[2],
+            sample.accel[0], sample.accel[1], sample.accel[2],
+            sample.mag[0], sample.mag[1], sample.mag[2]);
+  }
+
+  fclose(file_ptr);
+
+  return true;
+}
+
+OrientationFilter::OrientationFilter() :
+  beta_(cDefaultBeta),
+  use_magnetometer_(false)
+{
+  reset();
+}
+
+void OrientationFilter::reset()
+{
+  q0_ = 1.0;
+  q1_ = q2_ = q3_ = 0.0;
+  has_time_ = false;
+  last_time_ = 0;
+
+  MutexHolder holder(lock_);
+  orientation_ = LQuaternionf::ident_quat();
+  angular_velocity_ = LVector3f::zero();
+  orientation_time_ = 0;
+  has_orientation_ = false;
+  samples_ = 0;
+  seconds_ = 0;
+}
+
+void OrientationFilter::set_beta(float beta)
+{
+  beta_ = beta;
+}
+
+void OrientationFilter::set_use_magnetometer(bool use_magnetometer)
+{
+  use_magnetometer_ = use_magnetometer;
+}
+
+void OrientationFilter::update(const ImuSample *samples_ptr, int count)
+{
+  if (count <= 0)
+    return;
+
+  const double cStartTime = TrueClock::get_global_ptr()->get_short_time();
+
+  prepare_batch(samples_ptr, count);
+
+  for (int sample = 0; sample < count; ++sample)
+  {
+    if (use_magnetometer_ && (mx_[sample] != 0.0 || my_[sample] != 0.0 || mz_[sample] != 0.0))
+      integrate_marg(sample);
+    else
+      integrate_imu(sample);
+  }
+
+  const double cEndTime = TrueClock::get_global_ptr()->get_short_time();
+
+  // Publish in the sensor axes: filter (x, y, z) is sensor (x, -z, y)
+  MutexHolder holder(lock_);
+  orientation_ = LQuaternionf(q0_, q1_, q3_, -q2_);
+  angular_velocity_.set(samples_ptr[count - 1].gyro[0],
+                        samples_ptr[count - 1].gyro[1],
+                        samples_ptr[count - 1].gyro[2]);
+  orientation_time_ = last_time_;
+  has_orientation_ = true;
+  samples_ += count;
+  seconds_ += cEndTime - cStartTime;
+}
+
+bool OrientationFilter::get_orientation(LQuaternionf &orientation, double &time)
+{
+  MutexHolder holder(lock_);
+  if (!has_orientation_)
+    return false;
+
+  orientation = orientation_;
+  time = orientation_time_;
+
+  return true;
+}
+
+LVector3f OrientationFilter::get_angular_velocity()
+{
+  MutexHolder holder(lock_);
+  return angular_velocity_;
+}
+
+void OrientationFilter::get_statistics(int &samples, double &seconds)
+{
+  MutexHolder holder(lock_);
+  samples = samples_;
+  seconds = seconds_;
+}
+
+void OrientationFilter::prepare_batch(const ImuSample *samples_ptr, int count)
+{
+  if (int(half_dt_.size()) < count)
+  {
+    half_dt_.resize(count);
+    gx_.resize(count); gy_.resize(count); gz_.resize(count);
+    ax_.resize(count); ay_.resize(count); az_.resize(count);
+    mx_.resize(count); my_.resize(count); mz_.resize(count);
+  }
+
+  // Time steps, clamped so a gap in the stream doesn't throw the filter
+  double previous_time = has_time_ ? last_time_ : samples_ptr[0].time;
+  for (int sample = 0; sample < count; ++sample)
+  {
+    double dt = samples_ptr[sample].time - previous_time;
+    if (dt < 0.0 || dt > cMaximumTimeStep)
+      dt = 0.0;
+    half_dt_[sample] = float(dt * 0.5);
+    previous_time = samples_ptr[sample].time;
+  }
+  last_time_ = previous_time;
+  has_time_ = true;
+
+  // Swap to the filter's Z-up axes: filter (x, y, z) = sensor (x, -z, y)
+  for (int sample = 0; sample < count; ++sample)
+  {
+    gx_[sample] = samples_ptr[sample].gyro[0];
+    gy_[sample] = -samples_ptr[sample].gyro[2];
+    gz_[sample] = samples_ptr[sample].gyro[1];
+    ax_[sample] = samples_ptr[sample].accel[0];
+    ay_[sample] = -samples_ptr[sample].accel[2];
+    az_[sample] = samples_ptr[sample].accel[1];
+    mx_[sample] = samples_ptr[sample].mag[0];
+    my_[sample] = -samples_ptr[sample].mag[2];
+    mz_[sample] = samples_ptr[sample].mag[1];
+  }
+
+  // Normalise the reference vectors; zero length stays zero and skips the correction
+  for (int sample = 0; sample < count; ++sample)
+  {
+    const float cInverse = inverse_length(ax_[sample], ay_[sample], az_[sample]);
+    ax_[sample] *= cInverse;
+    ay_[sample] *= cInverse;
+    az_[sample] *= cInverse;
+  }
+
+  if (use_magnetometer_)
+  {
+    for (int sample = 0; sample < count; ++sample)
+    {
+      const float cInverse = inverse_length(mx_[sample], my_[sample], mz_[sample]);
+      mx_[sample] *= cInverse;
+      my_[sample] *= cInverse;
+      mz_[sample] *= cInverse;
+    }
+  }
+}
+
+void OrientationFilter::integrate_imu(int sample)
+{
+  const float q0 = q0_, q1 = q1_, q2 = q2_, q3 = q3_;
+  const float gx = gx_[sample], gy = gy_[sample], gz = gz_[sample];
+  const float ax = ax_[sample], ay = ay_[sample], az = az_[sample];
+
+  // Rate of change of the quaternion from the gyroscope
+  float q_dot0 = 0.5 * (-q1 * gx - q2 * gy - q3 * gz);
+  float q_dot1 = 0.5 * (q0 * gx + q2 * gz - q3 * gy);
+  float q_dot2 = 0.5 * (q0 * gy - q1 * gz + q3 * gx);
+  float q_dot3 = 0.5 * (q0 * gz + q1 * gy - q2 * gx);
+
+  if (ax != 0.0 || ay != 0.0 || az != 0.0)
+  {
+    // Gradient descent step towards the measured gravity direction
+    const float c2q0 = 2.0 * q0, c2q1 = 2.0 * q1, c2q2 = 2.0 * q2, c2q3 = 2.0 * q3;
+    const float c4q0 = 4.0 * q0, c4q1 = 4.0 * q1, c4q2 = 4.0 * q2;
+    const float c8q1 = 8.0 * q1, c8q2 = 8.0 * q2;
+    const float q0q0 = q0 * q0, q1q1 = q1 * q1, q2q2 = q2 * q2, q3q3 = q3 * q3;
+
+    float s0 = c4q0 * q2q2 + c2q2 * ax + c4q0 * q1q1 - c2q1 * ay;
+    float s1 = c4q1 * q3q3 - c2q3 * ax + 4.0 * q0q0 * q1 - c2q0 * ay - c4q1 + c8q1 * q1q1 + c8q1 * q2q2 + c4q1 * az;
+    float s2 = 4.0 * q0q0 * q2 + c2q0 * ax + c4q2 * q3q3 - c2q3 * ay - c4q2 + c8q2 * q1q1 + c8q2 * q2q2 + c4q2 * az;
+    float s3 = 4.0 * q1q1 * q3 - c2q1 * ax + 4.0 * q2q2 * q3 - c2q2 * ay;
+
+    const float cInverse = beta_ / sqrtf(s0 * s0 + s1 * s1 + s2 * s2 + s3 * s3 + 1e-20f);
+    q_dot0 -= s0 * cInverse;
+    q_dot1 -= s1 * cInverse;
+    q_dot2 -= s2 * cInverse;
+    q_dot3 -= s3 * cInverse;
+  }
+
+  const float cHalfDt2 = half_dt_[sample] * 2.0;
+  float n0 = q0 + q_dot0 * cHalfDt2;
+  float n1 = q1 + q_dot1 * cHalfDt2;
+  float n2 = q2 + q_dot2 * cHalfDt2;
+  float n3 = q3 + q_dot3 * cHalfDt2;
+
+  const float cInverse = 1.0 / sqrtf(n0 * n0 + n1 * n1 + n2 * n2 + n3 * n3);
+  q0_ = n0 * cInverse;
+  q1_ = n1 * cInverse;
+  q2_ = n2 * cInverse;
+  q3_ = n3 * cInverse;
+}
+
+void OrientationFilter::integrate_marg(int sample)
+{
+  const float q0 = q0_, q1 = q1_, q2 = q2_, q3 = q3_;
+  const float gx = gx_[sample], gy = gy_[sample], gz = gz_[sample];
+  const float ax = ax_[sample], ay = ay_[sample], az = az_[sample];
+  const float mx = mx_[sample], my = my_[sample], mz = mz_[sample];
+
+  float q_dot0 = 0.5 * (-q1 * gx - q2 * gy - q3 * gz);
+  float q_dot1 = 0.5 * (q0 * gx + q2 * gz - q3 * gy);
+  float q_dot2 = 0.5 * (q0 * gy - q1 * gz + q3 * gx);
+  float q_dot3 = 0.5 * (q0 * gz + q1 * gy - q2 * gx);
+
+  if (ax != 0.0 || ay != 0.0 || az != 0.0)
+  {
+    const float c2q0mx = 2.0 * q0 * mx, c2q0my = 2.0 * q0 * my, c2q0mz = 2.0 * q0 * mz;
+    const float c2q1mx = 2.0 * q1 * mx;
+    const float c2q0 = 2.0 * q0, c2q1 = 2.0 * q1, c2q2 = 2.0 * q2, c2q3 = 2.0 * q3;
+    const float c2q0q2 = 2.0 * q0 * q2, c2q2q3 = 2.0 * q2 * q3;
+    const float q0q0 = q0 * q0, q0q1 = q0 * q1, q0q2 = q0 * q2, q0q3 = q0 * q3;
+    const float q1q1 = q1 * q1, q1q2 = q1 * q2, q1q3 = q1 * q3;
+    const float q2q2 = q2 * q2, q2q3 = q2 * q3, q3q3 = q3 * q3;
+
+    // Reference direction of the Earth's magnetic field
+    const float hx = mx * q0q0 - c2q0my * q3 + c2q0mz * q2 + mx * q1q1 + c2q1 * my * q2 + c2q1 * mz * q3 - mx * q2q2 - mx * q3q3;
+    const float hy = c2q0mx * q3 + my * q0q0 - c2q0mz * q1 + c2q1mx * q2 - my * q1q1 + my * q2q2 + c2q2 * mz * q3 - my * q3q3;
+    const float c2bx = sqrtf(hx * hx + hy * hy);
+    const float c2bz = -c2q0mx * q2 + c2q0my * q1 + mz * q0q0 + c2q1mx * q3 - mz * q1q1 + c2q2 * my * q3 - mz * q2q2 + mz * q3q3;
+    const float c4bx = 2.0 * c2bx, c4bz = 2.0 * c2bz;
+
+    // Shared error terms of the objective function
+    const float cGx = 2.0 * q1q3 - c2q0q2 - ax;
+    const float cGy = 2.0 * q0q1 + c2q2q3 - ay;
+    const float cGz = 1.0 - 2.0 * q1q1 - 2.0 * q2q2 - az;
+    const float cBx = c2bx * (0.5 - q2q2 - q3q3) + c2bz * (q1q3 - q0q2) - mx;
+    const float cBy = c2bx * (q1q2 - q0q3) + c2bz * (q0q1 + q2q3) - my;
+    const float cBz = c2bx * (q0q2 + q1q3) + c2bz * (0.5 - q1q1 - q2q2) - mz;
+
+    float s0 = -c2q2 * cGx + c2q1 * cGy - c2bz * q2 * cBx + (-c2bx * q3 + c2bz * q1) * cBy + c2bx * q2 * cBz;
+    float s1 = c2q3 * cGx + c2q0 * cGy - 4.0 * q1 * cGz + c2bz * q3 * cBx + (c2bx * q2 + c2bz * q0) * cBy + (c2bx * q3 - c4bz * q1) * cBz;
+    float s2 = -c2q0 * cGx + c2q3 * cGy - 4.0 * q2 * cGz + (-c4bx * q2 - c2bz * q0) * cBx + (c2bx * q1 + c2bz * q3) * cBy + (c2bx * q0 - c4bz * q2) * cBz;
+    float s3 = c2q1 * cGx + c2q2 * cGy + (-c4bx * q3 + c2bz * q1) * cBx + (-c2bx * q0 + c2bz * q2) * cBy + c2bx * q1 * cBz;
+
+    const float cInverse = beta_ / sqrtf(s0 * s0 + s1 * s1 + s2 * s2 + s3 * s3 + 1e-20f);
+    q_dot0 -= s0 * cInverse;
+    q_dot1 -= s1 * cInverse;
+    q_dot2 -= s2 * cInverse;
+    q_dot3 -= s3 * cInverse;
+  }
+
+  const float cHalfDt2 = half_dt_[sample] * 2.0;
+  float n0 = q0 + q_dot0 * cHalfDt2;
+  float n1 = q1 + q_dot1 * cHalfDt2;
+  float n2 = q2 + q_dot2 * cHalfDt2;
+  float n3 = q3 + q_dot3 * cHalfDt2;
+
+  const float cInverse = 1.0 / sqrtf(n0 * n0 + n1 * n1 + n2 * n2 + n3 * n3);
+  q0_ = n0 * cInverse;
+  q1_ = n1 * cInverse;
+  q2_ = n2 * cInverse;
+  q3_ = n3 * cInverse;
+}
+
+}
@@ -0,0 +1,97 @@
+/*################################################################
+Pandrift
+Copyright (c) 2013 Warren Moore
+
+This software may be redistributed under the terms of the MIT License.
+See the file LICENSE for details.
+################################################################*/
+
+#ifndef PANDRIFT_ORIENTATION_FILTER_HEADER
+#define PANDRIFT_ORIENTATION_FILTER_HEADER
+
+#include "pandrift.hh"
+#include "lquaternion.h"
+#include "lvector3.h"
+#include "pmutex.h"
+#include "pvector.h"
+#include <string>
+
+namespace pandrift
+{
+
+// A raw sensor sample in the Rift's sensor axes (Y up, -Z forward)
+struct ImuSample
+{
+  double time;
+  float gyro[3];  // rad/s
+  float accel[3]; // m/s^2
+  float mag[3];   // gauss, all zero if unavailable
+};
+
+// Read and write whitespace separated samples, one per line:
+// time gx gy gz ax ay az mx my mz
+bool load_imu_samples(const std::string &file_name, pvector<ImuSample> &samples);
+
+bool save_imu_samples(const std::string &file_name, const pvector<ImuSample> &samples);
+
+// Madgwick gradient descent orientation filter. Samples are integrated in
+// batches: the per-sample normalisation is done for the whole batch in flat
+// loops before the serial quaternion update.
+class OrientationFilter
+{
+public:
+  OrientationFilter();
+
+  void reset();
+
+  // Gain of the gravity (and magnetic) correction
+  void set_beta(float beta);
+
+  // The DK1 magnetometer needs calibrating before it helps, so it's off by default
+  void set_use_magnetometer(bool use_magnetometer);
+
+  // Integrate samples in time order. Call from a single thread.
+  void update(const ImuSample *samples_ptr, int count);
+
+  // The latest orientation in the sensor axes, as OVR::SensorFusion reports it,
+  // with the time of the last sample it includes. Thread-safe.
+  bool get_orientation(LQuaternionf &orientation, double &time);
+
+  // The latest gyro rate in the sensor axes, for prediction. Thread-safe.
+  LVector3f get_angular_velocity();
+
+  // Samples integrated and the CPU time spent integrating them
+  void get_statistics(int &samples, double &seconds);
+
+private:
+  void prepare_batch(const ImuSample *samples_ptr, int count);
+
+  void integrate_imu(int sample);
+
+  void integrate_marg(int sample);
+
+  float beta_;
+  bool use_magnetometer_;
+  float q0_, q1_, q2_, q3_;
+  double last_time_;
+  bool has_time_;
+
+  // Batch scratch, in filter axes (Z up)
+  pvector<float> half_dt_;
+  pvector<float> gx_, gy_, gz_;
+  pvector<float> ax_, ay_, az_;
+  pvector<float> mx_, my_, mz_;
+
+  // Guards the published orientation and statistics
+  Mutex lock_;
+  LQuaternionf orientation_;
+  LVector3f angular_velocity_;
+  double orientation_time_;
+  bool has_orientation_;
+  int samples_;
+  double seconds_;
+};
+
+}
+
+#endif
@@ -0,0 +1,241 @@
+/*################################################################
+Pandrift
+Copyright (c) 2013 Warren Moore
+
+This software may be redistributed under the terms of the MIT License.
+See the file LICENSE for details.
+################################################################*/
+
+#include "pandrift_pixel_readback.hh"
+#include "pmutex.h"
+#include "mutexHolder.h"
+
+namespace
+{
+
+const int cMinimumDepth = 2;
+const int cBytesPerPixel = 4;
+
+// GL objects released off the draw thread, waiting for it to delete them
+Mutex retired_lock;
+pvector<GLuint> retired_buffers;
+#ifdef PANDRIFT_GL_HAS_SYNC
+pvector<GLsync> retired_fences;
+#endif
+
+void delete_retired()
+{
+  MutexHolder holder(retired_lock);
+
+  if (!retired_buffers.empty())
+    glDeleteBuffers(retired_buffers.size(), &retired_buffers[0]);
+  retired_buffers.clear();
+
+#ifdef PANDRIFT_GL_HAS_SYNC
+  for (size_t fence = 0; fence < retired_fences.size(); ++fence)
+    glDeleteSync(retired_fences[fence]);
+  retired_fences.clear();
+#endif
+}
+
+}
+
+namespace pandrift
+{
+
+PixelReadback::PixelReadback(int depth, GLenum format) :
+  depth_(depth < cMinimumDepth ? cMinimumDepth : depth),
+  format_(format),
+  slots_(depth_),
+  created_(false),
+  next_slot_(0),
+  oldest_slot_(0),
+  mapped_slot_(-1),
+  frame_count_(0)
+{
+  for (int slot = 0; slot < depth_; ++slot)
+  {
+    slots_[slot].buffer = 0;
+#ifdef PANDRIFT_GL_HAS_SYNC
+    slots_[slot].fence = 0;
+#endif
+    slots_[slot].pending = false;
+  }
+}
+
+PixelReadback::~PixelReadback()
+{
+  release();
+}
+
+int PixelReadback::get_depth()
+{
+  return depth_;
+}
+
+bool PixelReadback::request(int x, int y, int width, int height, unsigned int frame_id, double time)
+{
+  // Count every frame, including dropped ones, so unfenced slots age correctly
+  ++frame_count_;
+
+  // The context is current here, so free whatever was released elsewhere
+  delete_retired();
+
+  if (!created_ && !create_buffers())
+    return false;
+
+  Slot &slot = slots_[next_slot_];
+  if (slot.pending)
+    return false;
+
+  // Grow the buffer storage if the read is larger than before
+  const int cSize = width * height * cBytesPerPixel;
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.buffer);
+  if (cSize > slot.width * slot.height * cBytesPerPixel)
+    glBufferData(GL_PIXEL_PACK_BUFFER, cSize, NULL, GL_STREAM_READ);
+
+  // With a pack buffer bound the read is queued and returns immediately
+  glPixelStorei(GL_PACK_ALIGNMENT, 4);
+  glReadPixels(x, y, width, height, format_, GL_UNSIGNED_BYTE, 0);
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+#ifdef PANDRIFT_GL_HAS_SYNC
+  slot.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+#endif
+  slot.width = width;
+  slot.height = height;
+  slot.frame_id = frame_id;
+  slot.request_time = time;
+  slot.request_frame = frame_count_;
+  slot.pending = true;
+
+  next_slot_ = (next_slot_ + 1) % depth_;
+
+  return true;
+}
+
+bool PixelReadback::map_completed(Result &result)
+{
+  assert(mapped_slot_ < 0);
+
+  if (!created_)
+    return false;
+
+  Slot &slot = slots_[oldest_slot_];
+  if (!slot.pending || !is_complete(slot))
+    return false;
+
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.buffer);
+  void *pixels_ptr = glMapBuffer(GL_PIXEL_PACK_BUFFER, GL_READ_ONLY);
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+  if (!pixels_ptr)
+  {
+    // Give up on this read rather than retrying it forever
+    slot.pending = false;
+    oldest_slot_ = (oldest_slot_ + 1) % depth_;
+    return false;
+  }
+
+  result.pixels_ptr = reinterpret_cast<const unsigned char*>(pixels_ptr);
+  result.width = slot.width;
+  result.height = slot.height;
+  result.frame_id = slot.frame_id;
+  result.request_time = slot.request_time;
+
+  mapped_slot_ = oldest_slot_;
+
+  return true;
+}
+
+void PixelReadback::unmap()
+{
+  if (mapped_slot_ < 0)
+    return;
+
+  Slot &slot = slots_[mapped_slot_];
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.buffer);
+  glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+  // Free the slot for another request
+  slot.pending = false;
+  oldest_slot_ = (mapped_slot_ + 1) % depth_;
+  mapped_slot_ = -1;
+}
+
+int PixelReadback::get_pending_count()
+{
+  int pending_count = 0;
+  for (int slot = 0; slot < depth_; ++slot)
+    if (slots_[slot].pending)
+      ++pending_count;
+
+  return pending_count;
+}
+
+void PixelReadback::release()
+{
+  if (!created_)
+    return;
+
+  // Deleting a mapped buffer unmaps it, so a mapped slot is simply dropped
+  MutexHolder holder(retired_lock);
+  for (int slot = 0; slot < depth_; ++slot)
+  {
+#ifdef PANDRIFT_GL_HAS_SYNC
+    if (slots_[slot].fence)
+      retired_fences.push_back(slots_[slot].fence);
+    slots_[slot].fence = 0;
+#endif
+    retired_buffers.push_back(slots_[slot].buffer);
+    slots_[slot].buffer = 0;
+    slots_[slot].pending = false;
+  }
+
+  mapped_slot_ = -1;
+  created_ = false;
+}
+
+bool PixelReadback::create_buffers()
+{
+  for (int slot = 0; slot < depth_; ++slot)
+  {
+    glGenBuffers(1, &slots_[slot].buffer);
+    if (!slots_[slot].buffer)
+    {
+      pandrift_cat.error() << "PixelReadback: Unable to create pixel buffer";
+      return false;
+    }
+
+    slots_[slot].width = 0;
+    slots_[slot].height = 0;
+  }
+
+  created_ = true;
+
+  return true;
+}
+
+bool PixelReadback::is_complete(Slot &slot)
+{
+#ifdef PANDRIFT_GL_HAS_SYNC
+  if (slot.fence)
+  {
+    // Poll the fence without waiting
+    GLenum status = glClientWaitSync(slot.fence, 0, 0);
+    if (GL_ALREADY_SIGNALED != status && GL_CONDITION_SATISFIED != status)
+      return false;
+
+    glDeleteSync(slot.fence);
+    slot.fence = 0;
+  }
+
+  return true;
+#else
+  // Without fences assume a read has landed once the rest of the ring has been requested
+  return (frame_count_ - slot.request_frame) >= (unsigned int)(depth_ - 1);
+#endif
+}
+
+}
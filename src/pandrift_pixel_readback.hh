@@ -0,0 +1,88 @@
+/*################################################################
+Pandrift
+Copyright (c) 2013 Warren Moore
+
+This software may be redistributed under the terms of the MIT License.
+See the file LICENSE for details.
+################################################################*/
+
+#ifndef PANDRIFT_PIXEL_READBACK_HEADER
+#define PANDRIFT_PIXEL_READBACK_HEADER
+
+#include "pandrift.hh"
+#include "pandrift_gl.hh"
+#include "pvector.h"
+
+namespace pandrift
+{
+
+// A ring of pixel buffer objects used to read back the current framebuffer
+// without waiting for the GPU. Results are collected some frames later.
+// All methods but release() must be called from the draw thread with the GL
+// context current.
+class PixelReadback
+{
+public:
+  struct Result
+  {
+    const unsigned char *pixels_ptr;
+    int width, height;
+    unsigned int frame_id;
+    double request_time;
+  };
+
+  // Pixels are read as GL_RGBA, or GL_BGRA to match Panda's RAM images
+  PixelReadback(int depth, GLenum format = GL_RGBA);
+
+  ~PixelReadback();
+
+  int get_depth();
+
+  // Queue a read of the pixels in the given rectangle.
+  // Returns false, without blocking, if every slot is still in flight.
+  bool request(int x, int y, int width, int height, unsigned int frame_id, double time);
+
+  // Map the oldest completed read, if there is one. Must be followed by unmap().
+  bool map_completed(Result &result);
+
+  void unmap();
+
+  // The number of reads requested but not yet collected
+  int get_pending_count();
+
+  // Give up the GL objects and any reads in flight. Safe from any thread:
+  // the objects are deleted by the next request from any ring, on the draw
+  // thread, or go with the context. The ring can't be used afterwards.
+  void release();
+
+private:
+  struct Slot
+  {
+    GLuint buffer;
+#ifdef PANDRIFT_GL_HAS_SYNC
+    GLsync fence;
+#endif
+    int width, height;
+    unsigned int frame_id;
+    double request_time;
+    unsigned int request_frame;
+    bool pending;
+  };
+
+  bool create_buffers();
+
+  bool is_complete(Slot &slot);
+
+  int depth_;
+  GLenum format_;
+  pvector<Slot> slots_;
+  bool created_;
+  int next_slot_;
+  int oldest_slot_;
+  int mapped_slot_;
+  unsigned int frame_count_;
+};
+
+}
+
+#endif
@@ -0,0 +1,228 @@
+/*################################################################
+Pandrift
+Copyright (c) 2013 Warren Moore
+
+This software may be redistributed under the terms of the MIT License.
+See the file LICENSE for details.
+################################################################*/
+
+#include "pandrift_render_target_pool.hh"
+#include "graphicsEngine.h"
+#include "frameBufferProperties.h"
+
+using namespace std;
+
+namespace
+{
+
+const size_t cDefaultBudgetBytes = 256 * 1024 * 1024;
+// RGBA colour, and the depth-stencil every buffer gets
+const size_t cColourBytesPerPixel = 4;
+const size_t cDepthBytesPerPixel = 4;
+
+}
+
+namespace pandrift
+{
+
+RenderTargetPool::RenderTargetPool() :
+  budget_bytes_(cDefaultBudgetBytes),
+  allocated_bytes_(0),
+  release_count_(0)
+{
+}
+
+RenderTargetPool::~RenderTargetPool()
+{
+  clear();
+}
+
+void RenderTargetPool::set_budget_bytes(size_t budget_bytes)
+{
+  budget_bytes_ = budget_bytes;
+
+  evict(0);
+}
+
+size_t RenderTargetPool::get_budget_bytes()
+{
+  return budget_bytes_;
+}
+
+size_t RenderTargetPool::get_allocated_bytes()
+{
+  return allocated_bytes_;
+}
+
+size_t RenderTargetPool::get_free_bytes()
+{
+  size_t free_bytes = 0;
+  for (size_t entry = 0; entry < entries_.size(); ++entry)
+    if (!entries_[entry].in_use)
+      free_bytes += entries_[entry].bytes;
+
+  return free_bytes;
+}
+
+bool RenderTargetPool::acquire(GraphicsOutput *host_ptr,
+                               const string &name,
+                               int width,
+                               int height,
+                               const Format &format,
+                               RenderTarget &target)
+{
+  assert(host_ptr);
+
+  // Reuse a free buffer of the same size and format, on the same GSG
+  for (size_t entry = 0; entry < entries_.size(); ++entry)
+  {
+    Entry &pool_entry = entries_[entry];
+    if (pool_entry.in_use ||
+        pool_entry.gsg_ptr != host_ptr->get_gsg() ||
+        pool_entry.width != width ||
+        pool_entry.height != height ||
+        pool_entry.format.alpha != format.alpha ||
+        pool_entry.format.depth_texture != format.depth_texture)
+      continue;
+
+    pool_entry.in_use = true;
+    reset_buffer(pool_entry);
+    target = pool_entry.target;
+
+    if (pandrift_cat.is_debug())
+      pandrift_cat.debug() << "acquire: Reused " << width << "x" << height << " buffer" << endl;
+
+    return true;
+  }
+
+  // Make room for the new buffer
+  const size_t cBytes = size_t(width) * size_t(height) * (cColourBytesPerPixel + cDepthBytesPerPixel);
+  evict(cBytes);
+
+  FrameBufferProperties fb_props = FrameBufferProperties::get_default();
+  if (format.alpha)
+  {
+    fb_props.set_rgb_color(true);
+    fb_props.set_color_bits(24);
+    fb_props.set_alpha_bits(8);
+  }
+
+  Entry pool_entry;
+  pool_entry.target.buffer_ptr = host_ptr->make_texture_buffer(name, width, height, NULL, false, &fb_props);
+  if (!pool_entry.target.buffer_ptr)
+  {
+    pandrift_cat.error() << "acquire: Unable to create buffer";
+    return false;
+  }
+
+  if (format.depth_texture)
+  {
+    pool_entry.target.depth_ptr = new Texture(name);
+    pool_entry.target.depth_ptr->set_format(Texture::F_depth_component);
+    pool_entry.target.buffer_ptr->add_render_texture(pool_entry.target.depth_ptr,
+                                                     GraphicsOutput::RTM_bind_or_copy,
+                                                     GraphicsOutput::RTP_depth);
+  }
+
+  pool_entry.gsg_ptr = host_ptr->get_gsg();
+  pool_entry.width = width;
+  pool_entry.height = height;
+  pool_entry.format = format;
+  pool_entry.bytes = cBytes;
+  pool_entry.in_use = true;
+  pool_entry.release_count = 0;
+  pool_entry.sort = pool_entry.target.buffer_ptr->get_sort();
+  for (int plane = 0; plane < DrawableRegion::RTP_COUNT; ++plane)
+  {
+    pool_entry.clear_active[plane] = pool_entry.target.buffer_ptr->get_clear_active(plane);
+    pool_entry.clear_value[plane] = pool_entry.target.buffer_ptr->get_clear_value(plane);
+  }
+  entries_.push_back(pool_entry);
+
+  allocated_bytes_ += cBytes;
+  if (allocated_bytes_ > budget_bytes_)
+    pandrift_cat.warning() << "acquire: " << allocated_bytes_ / (1024 * 1024) << "MB in use exceeds the "
+                           << budget_bytes_ / (1024 * 1024) << "MB budget" << endl;
+
+  target = pool_entry.target;
+
+  return true;
+}
+
+void RenderTargetPool::release(GraphicsOutput *buffer_ptr)
+{
+  for (size_t entry = 0; entry < entries_.size(); ++entry)
+  {
+    Entry &pool_entry = entries_[entry];
+    if (pool_entry.target.buffer_ptr != buffer_ptr)
+      continue;
+
+    assert(pool_entry.in_use);
+
+    // Stop it rendering, but keep its memory
+    buffer_ptr->set_active(false);
+    buffer_ptr->set_one_shot(false);
+    pool_entry.in_use = false;
+    pool_entry.release_count = ++release_count_;
+
+    return;
+  }
+
+  pandrift_cat.error() << "release: Buffer not from the pool";
+}
+
+void RenderTargetPool::clear()
+{
+  for (int entry = int(entries_.size()) - 1; entry >= 0; --entry)
+    if (!entries_[entry].in_use)
+      remove_entry(entry);
+}
+
+void RenderTargetPool::evict(size_t needed_bytes)
+{
+  while (allocated_bytes_ + needed_bytes > budget_bytes_)
+  {
+    // Find the free buffer released longest ago
+    int oldest = -1;
+    for (size_t entry = 0; entry < entries_.size(); ++entry)
+      if (!entries_[entry].in_use &&
+          (oldest < 0 || entries_[entry].release_count < entries_[oldest].release_count))
+        oldest = entry;
+
+    // Everything left is in use
+    if (oldest < 0)
+      return;
+
+    if (pandrift_cat.is_info())
+      pandrift_cat.info() << "evict: Freeing " << entries_[oldest].width << "x" << entries_[oldest].height
+                          << " buffer" << endl;
+
+    remove_entry(oldest);
+  }
+}
+
+void RenderTargetPool::reset_buffer(Entry &pool_entry)
+{
+  // The last user may have turned clears off or moved it in the render order
+  GraphicsOutput *buffer_ptr = pool_entry.target.buffer_ptr;
+  buffer_ptr->set_sort(pool_entry.sort);
+  for (int plane = 0; plane < DrawableRegion::RTP_COUNT; ++plane)
+  {
+    buffer_ptr->set_clear_active(plane, pool_entry.clear_active[plane]);
+    buffer_ptr->set_clear_value(plane, pool_entry.clear_value[plane]);
+  }
+
+  buffer_ptr->set_one_shot(false);
+  buffer_ptr->set_active(true);
+}
+
+void RenderTargetPool::remove_entry(int entry)
+{
+  PT(GraphicsOutput) buffer_ptr = entries_[entry].target.buffer_ptr;
+  buffer_ptr->get_engine()->remove_window(buffer_ptr);
+
+  allocated_bytes_ -= entries_[entry].bytes;
+  entries_.erase(entries_.begin() + entry);
+}
+
+}
@@ -0,0 +1,98 @@
+/*################################################################
+Pandrift
+Copyright (c) 2013 Warren Moore
+
+This software may be redistributed under the terms of the MIT License.
+See the file LICENSE for details.
+################################################################*/
+
+#ifndef PANDRIFT_RENDER_TARGET_POOL_HEADER
+#define PANDRIFT_RENDER_TARGET_POOL_HEADER
+
+#include "pandrift.hh"
+#include "graphicsOutput.h"
+#include "texture.h"
+#include "pvector.h"
+
+namespace pandrift
+{
+
+// Keeps released texture buffers for reuse by later requests of the same
+// size and format, so recreating a display doesn't reallocate GPU memory.
+// Free buffers are evicted, least recently released first, when the
+// estimated memory would exceed the budget. Main thread only.
+class RenderTargetPool
+{
+public:
+  struct Format
+  {
+    bool alpha;
+    bool depth_texture;
+  };
+
+  struct RenderTarget
+  {
+    PT(GraphicsOutput) buffer_ptr;
+    PT(Texture) depth_ptr;
+  };
+
+  RenderTargetPool();
+
+  ~RenderTargetPool();
+
+  void set_budget_bytes(size_t budget_bytes);
+
+  size_t get_budget_bytes();
+
+  // Estimated memory of every buffer, in use or free
+  size_t get_allocated_bytes();
+
+  size_t get_free_bytes();
+
+  // Reuse a free buffer, or make one on the host's GSG. The buffer comes back
+  // active, without display regions, and with the sort and clears it was
+  // made with, whatever the last user changed them to.
+  bool acquire(GraphicsOutput *host_ptr,
+               const std::string &name,
+               int width,
+               int height,
+               const Format &format,
+               RenderTarget &target);
+
+  // Return a buffer once its display regions have been removed
+  void release(GraphicsOutput *buffer_ptr);
+
+  // Free every buffer not in use
+  void clear();
+
+private:
+  struct Entry
+  {
+    RenderTarget target;
+    GraphicsStateGuardian *gsg_ptr;
+    int width, height;
+    Format format;
+    size_t bytes;
+    bool in_use;
+    unsigned int release_count;
+    // As made, to restore on reuse
+    int sort;
+    bool clear_active[DrawableRegion::RTP_COUNT];
+    LColor clear_value[DrawableRegion::RTP_COUNT];
+  };
+
+  void evict(size_t needed_bytes);
+
+  void reset_buffer(Entry &pool_entry);
+
+  void remove_entry(int entry);
+
+  size_t budget_bytes_;
+  size_t allocated_bytes_;
+  unsigned int release_count_;
+  pvector<Entry> entries_;
+};
+
+}
+
+#endif
@@ -7,7 +7,12 @@ See the file LICENSE for details.
 ################################################################*/
 
 #include "pandrift_rift_manager.hh"
+#include "pandrift_allocation_audit.hh"
+#include "pandrift_distortion_cache.hh"
+#include "mutexHolder.h"
+#include "trueClock.h"
 #include <iostream>
+#include <algorithm>
 
 using namespace std;
 using namespace OVR;
@@ -17,15 +22,43 @@ namespace
 {
 
 const float cDefaultIPD = 0.0655;
-const float cDistortionFitPoint[2] = { -0.75, 0.0 };
+const float cDefaultDistortionFitPoint[2] = { -0.75, 0.0 };
+const int cDefaultFusionBatchSize = 1;
+const int cMaximumFusionBatchSize = 64;
+const float cMaximumPrediction = 0.1;
+const double cDefaultRefreshPeriod = 1.0 / 60.0;
+const char *cReplayThreadName = "pandrift imu replay";
 
 }
 
 namespace pandrift
 {
 
-RiftManager::RiftManager()
+RiftManager::RiftManager() :
+  sensor_handler_(this),
+  default_report_rate_(0),
+  requested_report_rate_(0),
+  report_rate_(0),
+  fusion_engine_(cFusionOVR),
+  predicted_display_time_(0),
+  refresh_period_(cDefaultRefreshPeriod),
+  pose_sample_time_(0),
+  replay_loop_(false),
+  pending_receive_time_(0),
+  sensor_time_(0),
+  has_sensor_time_(false),
+  fusion_batch_size_(cDefaultFusionBatchSize),
+  ovr_samples_(0),
+  ovr_seconds_(0),
+  latency_batches_(0),
+  latency_seconds_(0),
+  recording_(false),
+  last_sample_time_(0),
+  replaying_(false),
+  parameters_version_(0)
 {
+  pending_samples_.reserve(cMaximumFusionBatchSize);
+
   System::Init(Log::ConfigureDefaultLog(LogMask_All));
 
   // Quick and dirty!
@@ -35,110 +68,587 @@ RiftManager::RiftManager()
   HMDInfo rift_info;
   if (device_ptr_ && device_ptr_->GetDeviceInfo(&rift_info))
   {
-    Ptr<SensorDevice> sensor_ptr = device_ptr_->GetSensor();
-    sensor_fusion_.AttachToSensor(sensor_ptr);
+    // Take the sensor messages ourselves so they can feed both fusion engines
+    sensor_ptr_ = *device_ptr_->GetSensor();
+    if (sensor_ptr_)
+    {
+      sensor_ptr_->SetMessageHandler(&sensor_handler_);
+      default_report_rate_ = sensor_ptr_->GetReportRate();
+      requested_report_rate_ = report_rate_ = default_report_rate_;
+    }
 
     stereo_config_.SetHMDInfo(rift_info);
   }
 
   stereo_config_.SetIPD(cDefaultIPD);
-  stereo_config_.SetDistortionFitPointVP(cDistortionFitPoint[0],
-                                         cDistortionFitPoint[1]);
+  distortion_fit_point_[0] = cDefaultDistortionFitPoint[0];
+  distortion_fit_point_[1] = cDefaultDistortionFitPoint[1];
+  stereo_config_.SetDistortionFitPointVP(distortion_fit_point_[0],
+                                         distortion_fit_point_[1]);
 
-  // No difference in the parameters I'm using between each eye
-  eye_params_ = stereo_config_.GetEyeRenderParams(StereoEye_Left);
+  update_stereo_parameters();
 }
 
 RiftManager::~RiftManager()
 {
+  stop_imu_replay();
+  sensor_handler_.RemoveHandlerFromDevices();
+  sensor_ptr_.Clear();
+}
+
+boost::shared_ptr<const StereoParameters> RiftManager::get_stereo_parameters()
+{
+  return boost::atomic_load(&parameters_ptr_);
+}
+
+void RiftManager::set_interpupillary_distance(float ipd)
+{
+  stereo_config_.SetIPD(ipd);
+  update_stereo_parameters();
+}
 
+void RiftManager::set_distortion_fit_point(float x, float y)
+{
+  distortion_fit_point_[0] = x;
+  distortion_fit_point_[1] = y;
+  stereo_config_.SetDistortionFitPointVP(x, y);
+  update_stereo_parameters();
 }
 
 int RiftManager::get_display_width_pixels()
 {
-  return stereo_config_.GetHMDInfo().HResolution;
+  return get_stereo_parameters()->display_width_pixels;
 }
 
 int RiftManager::get_display_height_pixels()
 {
-  return stereo_config_.GetHMDInfo().VResolution;
+  return get_stereo_parameters()->display_height_pixels;
 }
 
 float RiftManager::get_display_width_metres()
 {
-  return stereo_config_.GetHMDInfo().HScreenSize;
+  return get_stereo_parameters()->display_width_metres;
 }
 
 float RiftManager::get_display_height_metres()
 {
-  return stereo_config_.GetHMDInfo().VScreenSize;
+  return get_stereo_parameters()->display_height_metres;
 }
 
 float RiftManager::get_lens_separation()
 {
-  return stereo_config_.GetHMDInfo().LensSeparationDistance;
+  return get_stereo_parameters()->lens_separation;
 }
 
 float RiftManager::get_eye_screen_distance()
 {
-  return stereo_config_.GetHMDInfo().EyeToScreenDistance;
+  return get_stereo_parameters()->eye_screen_distance;
 }
 
 float RiftManager::get_y_fov_radians()
 {
-  return stereo_config_.GetYFOVRadians();
+  return get_stereo_parameters()->y_fov_radians;
 }
 
 float RiftManager::get_display_aspect_ratio()
 {
-  return (float(stereo_config_.GetHMDInfo().HResolution) * 0.5) / float(stereo_config_.GetHMDInfo().VResolution);
+  return get_stereo_parameters()->display_aspect_ratio;
 }
 
 float RiftManager::get_interpupillary_distance()
 {
-  return stereo_config_.GetIPD();
+  return get_stereo_parameters()->interpupillary_distance;
 }
 
 float RiftManager::get_projection_centre_offset()
 {
-  return stereo_config_.GetProjectionCenterOffset();
+  return get_stereo_parameters()->projection_centre_offset;
 }
 
 float RiftManager::get_distortion_scale()
 {
-  return eye_params_.pDistortion->Scale;
+  return get_stereo_parameters()->distortion_scale;
 }
 
 float RiftManager::get_distortion_centre_offset()
 {
-  return eye_params_.pDistortion->XCenterOffset;
+  return get_stereo_parameters()->distortion_centre_offset;
 }
 
 LVector4f RiftManager::get_distortion_coefficients()
 {
-  return LVector4f(eye_params_.pDistortion->K[0],
-                   eye_params_.pDistortion->K[1],
-                   eye_params_.pDistortion->K[2],
-                   eye_params_.pDistortion->K[3]);
+  return get_stereo_parameters()->distortion_coefficients;
 }
 
 LVector4f RiftManager::get_chromatic_aberration_coefficients()
 {
-  return LVector4f(eye_params_.pDistortion->ChromaticAberration[0],
-                   eye_params_.pDistortion->ChromaticAberration[1],
-                   eye_params_.pDistortion->ChromaticAberration[2],
-                   eye_params_.pDistortion->ChromaticAberration[3]);
+  return get_stereo_parameters()->chromatic_aberration_coefficients;
 }
 
 bool RiftManager::get_sensor_euler_angles(float &yaw, float &pitch, float &roll)
 {
-  if (!sensor_fusion_.IsAttachedToSensor())
+  PANDRIFT_AUDIT_SITE("RiftManager::get_sensor_euler_angles");
+
+  if (!sensor_ptr_ && !replay_thread_ptr_)
     return false;
 
-  Quatf value = sensor_fusion_.GetOrientation();
+  {
+    // Note the sample this pose is built from
+    MutexHolder holder(fusion_lock_);
+    pose_sample_time_ = last_sample_time_;
+  }
+
+  // How far ahead of now the frame will be seen
+  float prediction = 0;
+  if (predicted_display_time_ > 0)
+  {
+    const double cNow = TrueClock::get_global_ptr()->get_short_time();
+    prediction = min(max(float(predicted_display_time_ - cNow), 0.0f), cMaximumPrediction);
+  }
+
+  Quatf value;
+  if (cFusionPandrift == fusion_engine_)
+  {
+    LQuaternionf orientation;
+    double time;
+    if (!orientation_filter_.get_orientation(orientation, time))
+      return false;
+
+    value = Quatf(orientation.get_i(), orientation.get_j(), orientation.get_k(), orientation.get_r());
+
+    // Extrapolate by the latest body rate
+    LVector3f rate_v = orientation_filter_.get_angular_velocity();
+    const float cAngle = rate_v.length() * prediction;
+    if (cAngle > 0)
+    {
+      Vector3f axis(rate_v[0], rate_v[1], rate_v[2]);
+      value = value * Quatf(axis.Normalized(), cAngle);
+    }
+  }
+  else
+  {
+    value = prediction > 0 ? sensor_fusion_.GetPredictedOrientation(prediction) : sensor_fusion_.GetOrientation();
+  }
+
   value.GetEulerAngles<Axis_Y, Axis_X, Axis_Z>(&yaw, &pitch, &roll);
 
   return true;
 }
 
+bool RiftManager::set_sensor_report_rate(int rate)
+{
+  if (!sensor_ptr_)
+    return false;
+
+  // Reading the rate back is a blocking HID request, so only the rate last
+  // asked for is compared
+  const int cRate = (rate > 0) ? rate : default_report_rate_;
+  if (cRate == requested_report_rate_)
+    return true;
+
+  // The sensor picks the nearest rate it supports
+  sensor_ptr_->SetReportRate(cRate);
+  requested_report_rate_ = cRate;
+  report_rate_ = sensor_ptr_->GetReportRate();
+
+  if (pandrift_cat.is_info())
+    pandrift_cat.info() << "set_sensor_report_rate: Sensor reporting at "
+                        << report_rate_ << "Hz" << endl;
+
+  return true;
+}
+
+int RiftManager::get_sensor_report_rate()
+{
+  return sensor_ptr_ ? report_rate_ : 0;
+}
+
+double RiftManager::get_pose_sample_time()
+{
+  return pose_sample_time_;
+}
+
+void RiftManager::set_predicted_display_time(double display_time)
+{
+  predicted_display_time_ = display_time;
+}
+
+void RiftManager::set_refresh_period(double seconds)
+{
+  if (seconds > 0)
+    refresh_period_ = seconds;
+}
+
+double RiftManager::get_refresh_period()
+{
+  return refresh_period_;
+}
+
+bool RiftManager::get_sensor_angular_velocity(LVector3f &rate_v)
+{
+  if (!sensor_ptr_ && !replay_thread_ptr_)
+    return false;
+
+  LVector3f sensor_rate_v;
+  if (cFusionPandrift == fusion_engine_)
+  {
+    sensor_rate_v = orientation_filter_.get_angular_velocity();
+  }
+  else
+  {
+    const Vector3f cRate = sensor_fusion_.GetAngularVelocity();
+    sensor_rate_v.set(cRate.x, cRate.y, cRate.z);
+  }
+
+  // From the sensor's axes, x right, y up and z back
+  rate_v.set(sensor_rate_v[0], -sensor_rate_v[2], sensor_rate_v[1]);
+
+  return true;
+}
+
+void RiftManager::set_fusion_engine(FusionEngine engine)
+{
+  fusion_engine_ = engine;
+}
+
+void RiftManager::set_fusion_batch_size(int batch_size)
+{
+  MutexHolder holder(fusion_lock_);
+  fusion_batch_size_ = max(1, min(batch_size, cMaximumFusionBatchSize));
+}
+
+bool RiftManager::get_fusion_statistics(FusionStatistics &statistics)
+{
+  int samples;
+  double seconds;
+  orientation_filter_.get_statistics(samples, seconds);
+
+  MutexHolder holder(fusion_lock_);
+  if (samples == 0 || ovr_samples_ == 0)
+    return false;
+
+  statistics.samples = samples;
+  statistics.ovr_seconds_per_sample = ovr_seconds_ / double(ovr_samples_);
+  statistics.pandrift_seconds_per_sample = seconds / double(samples);
+  statistics.pandrift_latency_seconds = latency_batches_ > 0 ? latency_seconds_ / double(latency_batches_) : 0;
+
+  return true;
+}
+
+bool RiftManager::benchmark_fusion(const pvector<ImuSample> &samples, FusionStatistics &statistics)
+{
+  if (samples.empty())
+    return false;
+
+  // Time OVR over the whole recording
+  SensorFusion sensor_fusion;
+  MessageBodyFrame frame(NULL);
+  TrueClock *clock_ptr = TrueClock::get_global_ptr();
+
+  double start_time = clock_ptr->get_short_time();
+  for (size_t index = 0; index < samples.size(); ++index)
+  {
+    const ImuSample &sample = samples[index];
+    frame.TimeDelta = index > 0 ? float(sample.time - samples[index - 1].time) : 0.0f;
+    frame.RotationRate = Vector3f(sample.gyro[0], sample.gyro[1], sample.gyro[2]);
+    frame.Acceleration = Vector3f(sample.accel[0], sample.accel[1], sample.accel[2]);
+    frame.MagneticField = Vector3f(sample.mag[0], sample.mag[1], sample.mag[2]);
+    sensor_fusion.OnMessage(frame);
+  }
+  const double cOVRSeconds = clock_ptr->get_short_time() - start_time;
+
+  // Time our filter in batches of the configured size
+  int batch_size;
+  {
+    MutexHolder holder(fusion_lock_);
+    batch_size = fusion_batch_size_;
+  }
+
+  OrientationFilter filter;
+  double latency_seconds = 0;
+  int batches = 0;
+  for (size_t index = 0; index < samples.size(); index += batch_size, ++batches)
+  {
+    const int cCount = min(int(samples.size() - index), batch_size);
+    filter.update(&samples[index], cCount);
+
+    // The first sample of a batch waits for the rest to arrive
+    latency_seconds += samples[index + cCount - 1].time - samples[index].time;
+  }
+
+  int filter_samples;
+  double filter_seconds;
+  filter.get_statistics(filter_samples, filter_seconds);
+
+  statistics.samples = filter_samples;
+  statistics.ovr_seconds_per_sample = cOVRSeconds / double(samples.size());
+  statistics.pandrift_seconds_per_sample = filter_seconds / double(filter_samples);
+  statistics.pandrift_latency_seconds = latency_seconds / double(batches) + filter_seconds / double(batches);
+
+  return true;
+}
+
+void RiftManager::start_imu_recording()
+{
+  MutexHolder holder(fusion_lock_);
+  recorded_samples_.clear();
+  recording_ = true;
+}
+
+bool RiftManager::stop_imu_recording(const string &file_name)
+{
+  pvector<ImuSample> samples;
+  {
+    MutexHolder holder(fusion_lock_);
+    recording_ = false;
+    samples.swap(recorded_samples_);
+  }
+
+  return save_imu_samples(file_name, samples);
+}
+
+bool RiftManager::start_imu_replay(const pvector<ImuSample> &samples, bool loop)
+{
+  stop_imu_replay();
+
+  if (sensor_ptr_)
+  {
+    pandrift_cat.error() << "start_imu_replay: A sensor is attached";
+    return false;
+  }
+
+  if (samples.size() < 2)
+  {
+    pandrift_cat.error() << "start_imu_replay: Too few samples";
+    return false;
+  }
+
+  replay_samples_ = samples;
+  replay_loop_ = loop;
+
+  {
+    MutexHolder holder(fusion_lock_);
+    replaying_ = true;
+  }
+
+  replay_thread_ptr_ = new ReplayThread(this);
+  if (!replay_thread_ptr_->start(TP_high, true))
+  {
+    pandrift_cat.error() << "start_imu_replay: Unable to start thread";
+    replay_thread_ptr_ = NULL;
+    return false;
+  }
+
+  return true;
+}
+
+void RiftManager::stop_imu_replay()
+{
+  if (!replay_thread_ptr_)
+    return;
+
+  {
+    MutexHolder holder(fusion_lock_);
+    replaying_ = false;
+  }
+
+  replay_thread_ptr_->join();
+  replay_thread_ptr_ = NULL;
+}
+
+bool RiftManager::is_replaying()
+{
+  return replay_thread_ptr_ != NULL;
+}
+
+RiftManager::SensorHandler::SensorHandler(RiftManager *rift_manager_ptr) :
+  rift_manager_ptr_(rift_manager_ptr)
+{
+}
+
+void RiftManager::SensorHandler::OnMessage(const Message &message)
+{
+  if (Message_BodyFrame == message.Type)
+    rift_manager_ptr_->on_body_frame(static_cast<const MessageBodyFrame&>(message));
+}
+
+bool RiftManager::SensorHandler::SupportsMessageType(MessageType type) const
+{
+  return Message_BodyFrame == type;
+}
+
+RiftManager::ReplayThread::ReplayThread(RiftManager *rift_manager_ptr) :
+  Thread(cReplayThreadName, cReplayThreadName),
+  rift_manager_ptr_(rift_manager_ptr)
+{
+}
+
+void RiftManager::ReplayThread::thread_main()
+{
+  rift_manager_ptr_->replay_samples();
+}
+
+void RiftManager::update_stereo_parameters()
+{
+  // No difference in the parameters I'm using between each eye
+  eye_params_ = stereo_config_.GetEyeRenderParams(StereoEye_Left);
+
+  // Query StereoConfig once, here, rather than on every get
+  boost::shared_ptr<StereoParameters> params_ptr(new StereoParameters());
+  const HMDInfo &rift_info = stereo_config_.GetHMDInfo();
+
+  params_ptr->version = ++parameters_version_;
+  params_ptr->display_width_pixels = rift_info.HResolution;
+  params_ptr->display_height_pixels = rift_info.VResolution;
+  params_ptr->display_width_metres = rift_info.HScreenSize;
+  params_ptr->display_height_metres = rift_info.VScreenSize;
+  params_ptr->lens_separation = rift_info.LensSeparationDistance;
+  params_ptr->eye_screen_distance = rift_info.EyeToScreenDistance;
+  params_ptr->y_fov_radians = stereo_config_.GetYFOVRadians();
+  params_ptr->interpupillary_distance = stereo_config_.GetIPD();
+  params_ptr->projection_centre_offset = stereo_config_.GetProjectionCenterOffset();
+  params_ptr->distortion_scale = eye_params_.pDistortion->Scale;
+  params_ptr->distortion_centre_offset = eye_params_.pDistortion->XCenterOffset;
+  params_ptr->distortion_coefficients = LVector4f(eye_params_.pDistortion->K[0],
+                                                  eye_params_.pDistortion->K[1],
+                                                  eye_params_.pDistortion->K[2],
+                                                  eye_params_.pDistortion->K[3]);
+  params_ptr->chromatic_aberration_coefficients = LVector4f(eye_params_.pDistortion->ChromaticAberration[0],
+                                                            eye_params_.pDistortion->ChromaticAberration[1],
+                                                            eye_params_.pDistortion->ChromaticAberration[2],
+                                                            eye_params_.pDistortion->ChromaticAberration[3]);
+
+  // Key on the inputs to StereoConfig rather than its outputs
+  CacheKey device_key;
+  device_key.add(int(rift_info.HResolution));
+  device_key.add(int(rift_info.VResolution));
+  device_key.add(rift_info.HScreenSize);
+  device_key.add(rift_info.VScreenSize);
+  device_key.add(rift_info.VScreenCenter);
+  device_key.add(rift_info.EyeToScreenDistance);
+  device_key.add(rift_info.LensSeparationDistance);
+  device_key.add(rift_info.InterpupillaryDistance);
+  device_key.add(rift_info.DistortionK, sizeof(rift_info.DistortionK));
+  device_key.add(rift_info.ChromaAbCorrection, sizeof(rift_info.ChromaAbCorrection));
+  device_key.add(stereo_config_.GetIPD());
+  device_key.add(distortion_fit_point_, sizeof(distortion_fit_point_));
+  params_ptr->device_key = device_key.get_value();
+
+  calculate_derived_parameters(*params_ptr);
+
+  boost::shared_ptr<const StereoParameters> const_params_ptr(params_ptr);
+  boost::atomic_store(&parameters_ptr_, const_params_ptr);
+}
+
+void RiftManager::on_body_frame(const MessageBodyFrame &frame)
+{
+  PANDRIFT_AUDIT_SITE("RiftManager::on_body_frame");
+
+  TrueClock *clock_ptr = TrueClock::get_global_ptr();
+  const double cReceiveTime = clock_ptr->get_short_time();
+
+  // OVR first, timed
+  sensor_fusion_.OnMessage(frame);
+  const double cOVRSeconds = clock_ptr->get_short_time() - cReceiveTime;
+
+  // Sample times follow the sensor's own deltas, anchored at the first message
+  if (!has_sensor_time_)
+  {
+    sensor_time_ = cReceiveTime;
+    has_sensor_time_ = true;
+  }
+  sensor_time_ += frame.TimeDelta;
+
+  ImuSample sample;
+  sample.time = sensor_time_;
+  sample.gyro[0] = frame.RotationRate.x;
+  sample.gyro[1] = frame.RotationRate.y;
+  sample.gyro[2] = frame.RotationRate.z;
+  sample.accel[0] = frame.Acceleration.x;
+  sample.accel[1] = frame.Acceleration.y;
+  sample.accel[2] = frame.Acceleration.z;
+  sample.mag[0] = frame.MagneticField.x;
+  sample.mag[1] = frame.MagneticField.y;
+  sample.mag[2] = frame.MagneticField.z;
+
+  int batch_size;
+  {
+    MutexHolder holder(fusion_lock_);
+    ++ovr_samples_;
+    ovr_seconds_ += cOVRSeconds;
+    batch_size = fusion_batch_size_;
+
+    last_sample_time_ = cReceiveTime;
+
+    if (recording_)
+      recorded_samples_.push_back(sample);
+  }
+
+  if (pending_samples_.empty())
+    pending_receive_time_ = cReceiveTime;
+  pending_samples_.push_back(sample);
+
+  if (int(pending_samples_.size()) >= batch_size)
+  {
+    fuse_samples(&pending_samples_[0], pending_samples_.size(), pending_receive_time_);
+    pending_samples_.clear();
+  }
+}
+
+void RiftManager::fuse_samples(const ImuSample *samples_ptr, int count, double receive_time)
+{
+  orientation_filter_.update(samples_ptr, count);
+
+  // Latency from the arrival of the batch's first sample to publishing
+  const double cLatency = TrueClock::get_global_ptr()->get_short_time() - receive_time;
+
+  MutexHolder holder(fusion_lock_);
+  ++latency_batches_;
+  latency_seconds_ += cLatency;
+}
+
+void RiftManager::replay_samples()
+{
+  TrueClock *clock_ptr = TrueClock::get_global_ptr();
+  const int cSampleCount = replay_samples_.size();
+  const double cDuration = replay_samples_.back().time - replay_samples_.front().time;
+
+  // Each pass is scheduled against the clock, so slow passes catch up
+  double pass_start_time = clock_ptr->get_short_time();
+  int sample = 0;
+  for (;;)
+  {
+    {
+      MutexHolder holder(fusion_lock_);
+      if (!replaying_)
+        return;
+    }
+
+    const ImuSample &imu_sample = replay_samples_[sample];
+    const double cDelay = (imu_sample.time - replay_samples_.front().time) -
+                          (clock_ptr->get_short_time() - pass_start_time);
+    if (cDelay > 0)
+      Thread::sleep(cDelay);
+
+    // Rebuild the message the sensor would have sent
+    MessageBodyFrame frame(NULL);
+    frame.TimeDelta = (sample > 0) ? float(imu_sample.time - replay_samples_[sample - 1].time) :
+                                     float(replay_samples_[1].time - replay_samples_[0].time);
+    frame.RotationRate = Vector3f(imu_sample.gyro[0], imu_sample.gyro[1], imu_sample.gyro[2]);
+    frame.Acceleration = Vector3f(imu_sample.accel[0], imu_sample.accel[1], imu_sample.accel[2]);
+    frame.MagneticField = Vector3f(imu_sample.mag[0], imu_sample.mag[1], imu_sample.mag[2]);
+    on_body_frame(frame);
+
+    if (++sample < cSampleCount)
+      continue;
+
+    if (!replay_loop_)
+      return;
+
+    // Start the next pass one sample period after the end of this one
+    sample = 0;
+    pass_start_time += cDuration + frame.TimeDelta;
+  }
+}
+
 }
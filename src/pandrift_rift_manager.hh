@@ -10,8 +10,15 @@ See the file LICENSE for details.
 #define PANDRIFT_DISPLAY_RIFT_HEADER
 
 #include "pandrift.hh"
+#include "pandrift_orientation_filter.hh"
+#include "pandrift_stereo_parameters.hh"
 #include "OVR.h"
 #include "lvector4.h"
+#include "pmutex.h"
+#include "pvector.h"
+#include "thread.h"
+#include <string>
+#include "boost/shared_ptr.hpp"
 
 namespace pandrift
 {
@@ -19,10 +26,36 @@ namespace pandrift
 class RiftManager
 {
 public:
+  enum FusionEngine
+  {
+    cFusionOVR = 0,
+    cFusionPandrift
+  };
+
+  struct FusionStatistics
+  {
+    int samples;
+    double ovr_seconds_per_sample;
+    double pandrift_seconds_per_sample;
+    double pandrift_latency_seconds;
+  };
+
   RiftManager();
 
   ~RiftManager();
 
+  // The current immutable parameter snapshot. Safe to call from any thread.
+  boost::shared_ptr<const StereoParameters> get_stereo_parameters();
+
+  // Changing the configuration publishes a new snapshot with a new version
+  void set_interpupillary_distance(float ipd);
+
+  // The point in the left eye's viewport, from (-1, -1) to (1, 1), that the
+  // edge of the eye buffer is scaled to reach. The default of (-0.75, 0) crops
+  // the view so the whole buffer is sampled. The outer corner, (-1, 1), shows
+  // the whole view and leaves the buffer's inner corners unsampled.
+  void set_distortion_fit_point(float x, float y);
+
   int get_display_width_pixels();
 
   int get_display_height_pixels();
@@ -53,12 +86,123 @@ public:
 
   bool get_sensor_euler_angles(float &yaw, float &pitch, float &roll);
 
+  // Samples a second the sensor reports, lowered to save power while the
+  // pose isn't needed. 0 restores the sensor's own rate. False without a sensor.
+  bool set_sensor_report_rate(int rate);
+
+  // 0 without a sensor
+  int get_sensor_report_rate();
+
+  // TrueClock time the newest sample behind the last sensor pose arrived; 0 if none
+  double get_pose_sample_time();
+
+  // Predict the orientation for the given TrueClock display time; 0 disables prediction
+  void set_predicted_display_time(double display_time);
+
+  // The display's refresh period, as a FrameScheduler learns it. Defaults to 60Hz.
+  void set_refresh_period(double seconds);
+
+  double get_refresh_period();
+
+  // The head's rate of turn about its own axes, x right, y forward and z up,
+  // in radians a second. False without a sensor.
+  bool get_sensor_angular_velocity(LVector3f &rate_v);
+
+  // Both engines are fed every sample; this selects the one reported
+  void set_fusion_engine(FusionEngine engine);
+
+  // Samples per pandrift filter update; 1 updates at the full sensor rate
+  void set_fusion_batch_size(int batch_size);
+
+  bool get_fusion_statistics(FusionStatistics &statistics);
+
+  // Run both engines over recorded samples, without a device
+  bool benchmark_fusion(const pvector<ImuSample> &samples, FusionStatistics &statistics);
+
+  void start_imu_recording();
+
+  bool stop_imu_recording(const std::string &file_name);
+
+  // Play recorded samples through both engines at their recorded rate, in place of a device
+  bool start_imu_replay(const pvector<ImuSample> &samples, bool loop = true);
+
+  void stop_imu_replay();
+
+  bool is_replaying();
+
 private:
+  class SensorHandler : public OVR::MessageHandler
+  {
+  public:
+    SensorHandler(RiftManager *rift_manager_ptr);
+
+    virtual void OnMessage(const OVR::Message &message);
+
+    virtual bool SupportsMessageType(OVR::MessageType type) const;
+
+  private:
+    RiftManager *rift_manager_ptr_;
+  };
+
+  class ReplayThread : public Thread
+  {
+  public:
+    ReplayThread(RiftManager *rift_manager_ptr);
+
+  protected:
+    virtual void thread_main();
+
+  private:
+    RiftManager *rift_manager_ptr_;
+  };
+
+  void update_stereo_parameters();
+
+  void replay_samples();
+
+  void on_body_frame(const OVR::MessageBodyFrame &frame);
+
+  void fuse_samples(const ImuSample *samples_ptr, int count, double receive_time);
+
   OVR::Ptr<OVR::DeviceManager> device_manager_ptr_;
   OVR::Ptr<OVR::HMDDevice> device_ptr_;
+  OVR::Ptr<OVR::SensorDevice> sensor_ptr_;
+  SensorHandler sensor_handler_;
   OVR::SensorFusion sensor_fusion_;
+  int default_report_rate_;
+  // The rate last asked of the sensor, and what it chose
+  int requested_report_rate_, report_rate_;
+  float distortion_fit_point_[2];
+  OrientationFilter orientation_filter_;
+  FusionEngine fusion_engine_;
+  double predicted_display_time_;
+  double refresh_period_;
+  double pose_sample_time_;
+  PT(ReplayThread) replay_thread_ptr_;
+  pvector<ImuSample> replay_samples_;
+  bool replay_loop_;
+
+  // Sensor thread only
+  pvector<ImuSample> pending_samples_;
+  double pending_receive_time_;
+  double sensor_time_;
+  bool has_sensor_time_;
+
+  // Guards the batch size, statistics and recording
+  Mutex fusion_lock_;
+  int fusion_batch_size_;
+  int ovr_samples_;
+  double ovr_seconds_;
+  int latency_batches_;
+  double latency_seconds_;
+  bool recording_;
+  pvector<ImuSample> recorded_samples_;
+  double last_sample_time_;
+  bool replaying_;
   OVR::Util::Render::StereoConfig stereo_config_;
   OVR::Util::Render::StereoEyeParams eye_params_;
+  boost::shared_ptr<const StereoParameters> parameters_ptr_;
+  unsigned int parameters_version_;
 };
 
 }
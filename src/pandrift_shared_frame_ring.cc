@@ -0,0 +1,298 @@
+/*################################################################
+Pandrift
+Copyright (c) 2013 Warren Moore
+
+This software may be redistributed under the terms of the MIT License.
+See the file LICENSE for details.
+################################################################*/
+
+#include "pandrift_shared_frame_ring.hh"
+#include <string.h>
+#include <algorithm>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+using namespace std;
+
+namespace
+{
+
+const char cMagic[8] = { 'P', 'D', 'R', 'F', 'T', 'F', 'R', '\0' };
+// Bump whenever the layout changes
+const PN_uint32 cVersion = 1;
+const int cBytesPerPixel = 4;
+// Keeps each slot's pixels on their own cache lines
+const size_t cSlotAlignment = 64;
+const int cMinimumSlots = 2;
+
+}
+
+namespace pandrift
+{
+
+// Native byte order; both processes run on the same machine
+struct SharedFrameRing::Header
+{
+  char magic[8];
+  PN_uint32 version;
+  PN_uint32 header_bytes;
+  PN_uint32 slot_bytes;
+  PN_int32 slot_count;
+  PN_int32 width;
+  PN_int32 height;
+  volatile PN_uint32 latest_sequence;
+};
+
+// The sequence is 0 while the slot is being written
+struct SharedFrameRing::Slot
+{
+  volatile PN_uint32 sequence;
+  PN_uint32 frame_id;
+  double drawn_time;
+  double publish_time;
+  float camera_mat[2][16];
+};
+
+SharedFrameRing::SharedFrameRing() :
+  writer_(false),
+  map_ptr_(NULL),
+  map_bytes_(0)
+{
+}
+
+SharedFrameRing::~SharedFrameRing()
+{
+  close();
+}
+
+bool SharedFrameRing::create(const string &name, int width, int height, int slot_count)
+{
+  close();
+
+  if (width <= 0 || height <= 0)
+    return false;
+
+  slot_count = max(slot_count, cMinimumSlots);
+  const size_t cFrameBytes = size_t(width) * size_t(height) * cBytesPerPixel;
+  const size_t cSlotBytes = ((sizeof(Slot) + cFrameBytes + cSlotAlignment - 1) / cSlotAlignment) * cSlotAlignment;
+  const size_t cHeaderBytes = ((sizeof(Header) + cSlotAlignment - 1) / cSlotAlignment) * cSlotAlignment;
+  const size_t cBytes = cHeaderBytes + cSlotBytes * size_t(slot_count);
+
+  // A ring left by a writer that crashed is replaced, not reused
+  shm_unlink(name.c_str());
+  const int cFile = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR);
+  if (cFile < 0)
+  {
+    pandrift_cat.error() << "create: Unable to create " << name;
+    return false;
+  }
+
+  if (ftruncate(cFile, cBytes) != 0 || !map(cFile, cBytes, true))
+  {
+    ::close(cFile);
+    shm_unlink(name.c_str());
+    pandrift_cat.error() << "create: Unable to size " << name;
+    return false;
+  }
+
+  ::close(cFile);
+  name_ = name;
+  writer_ = true;
+
+  // The new mapping is zeroed, so every slot starts unwritten
+  Header *header_ptr = get_header();
+  header_ptr->version = cVersion;
+  header_ptr->header_bytes = cHeaderBytes;
+  header_ptr->slot_bytes = cSlotBytes;
+  header_ptr->slot_count = slot_count;
+  header_ptr->width = width;
+  header_ptr->height = height;
+  header_ptr->latest_sequence = 0;
+
+  // Readers check the magic, so it goes in once the rest is visible
+  __sync_synchronize();
+  memcpy(header_ptr->magic, cMagic, sizeof(cMagic));
+
+  return true;
+}
+
+bool SharedFrameRing::open(const string &name)
+{
+  close();
+
+  const int cFile = shm_open(name.c_str(), O_RDONLY, 0);
+  if (cFile < 0)
+    // Not created yet
+    return false;
+
+  struct stat file_stat;
+  if (fstat(cFile, &file_stat) != 0 ||
+      size_t(file_stat.st_size) < sizeof(Header) ||
+      !map(cFile, file_stat.st_size, false))
+  {
+    ::close(cFile);
+    return false;
+  }
+
+  ::close(cFile);
+
+  const Header *header_ptr = get_header();
+  if (memcmp(header_ptr->magic, cMagic, sizeof(cMagic)) != 0 ||
+      header_ptr->version != cVersion ||
+      header_ptr->slot_count < cMinimumSlots ||
+      map_bytes_ != size_t(header_ptr->header_bytes) + size_t(header_ptr->slot_bytes) * size_t(header_ptr->slot_count))
+  {
+    pandrift_cat.warning() << "open: Ignoring incompatible " << name << endl;
+    close();
+    return false;
+  }
+
+  __sync_synchronize();
+  name_ = name;
+  writer_ = false;
+
+  return true;
+}
+
+void SharedFrameRing::close()
+{
+  if (map_ptr_)
+  {
+    munmap(map_ptr_, map_bytes_);
+    map_ptr_ = NULL;
+    map_bytes_ = 0;
+  }
+
+  // Readers keep their mappings until they close
+  if (writer_)
+    shm_unlink(name_.c_str());
+
+  writer_ = false;
+  name_.clear();
+}
+
+bool SharedFrameRing::is_open()
+{
+  return map_ptr_ != NULL;
+}
+
+int SharedFrameRing::get_width()
+{
+  return map_ptr_ ? get_header()->width : 0;
+}
+
+int SharedFrameRing::get_height()
+{
+  return map_ptr_ ? get_header()->height : 0;
+}
+
+size_t SharedFrameRing::get_frame_bytes()
+{
+  return size_t(get_width()) * size_t(get_height()) * cBytesPerPixel;
+}
+
+void SharedFrameRing::write(const unsigned char *pixels_ptr, const Frame &frame)
+{
+  assert(writer_);
+
+  Header *header_ptr = get_header();
+  const PN_uint32 cSequence = header_ptr->latest_sequence + 1;
+  Slot *slot_ptr = get_slot(cSequence);
+
+  // Mark the slot torn before touching it, so a reader copying it notices
+  slot_ptr->sequence = 0;
+  __sync_synchronize();
+
+  slot_ptr->frame_id = frame.frame_id;
+  slot_ptr->drawn_time = frame.drawn_time;
+  for (int eye = 0; eye <= 1; ++eye)
+    for (int row = 0; row < 4; ++row)
+      for (int column = 0; column < 4; ++column)
+        slot_ptr->camera_mat[eye][row * 4 + column] = frame.camera_mat[eye](row, column);
+  memcpy(get_pixels(slot_ptr), pixels_ptr, get_frame_bytes());
+  slot_ptr->publish_time = get_time();
+
+  __sync_synchronize();
+  slot_ptr->sequence = cSequence;
+  __sync_synchronize();
+  header_ptr->latest_sequence = cSequence;
+}
+
+PN_uint32 SharedFrameRing::get_latest_sequence()
+{
+  if (!map_ptr_)
+    return 0;
+
+  __sync_synchronize();
+  return get_header()->latest_sequence;
+}
+
+bool SharedFrameRing::read_latest(unsigned char *pixels_ptr, Frame &frame)
+{
+  const PN_uint32 cSequence = get_latest_sequence();
+  if (0 == cSequence)
+    return false;
+
+  Slot *slot_ptr = get_slot(cSequence);
+  if (slot_ptr->sequence != cSequence)
+    return false;
+  __sync_synchronize();
+
+  frame.sequence = cSequence;
+  frame.frame_id = slot_ptr->frame_id;
+  frame.drawn_time = slot_ptr->drawn_time;
+  frame.publish_time = slot_ptr->publish_time;
+  for (int eye = 0; eye <= 1; ++eye)
+    for (int row = 0; row < 4; ++row)
+      for (int column = 0; column < 4; ++column)
+        frame.camera_mat[eye](row, column) = slot_ptr->camera_mat[eye][row * 4 + column];
+  memcpy(pixels_ptr, get_pixels(slot_ptr), get_frame_bytes());
+
+  // The writer came round the ring while we copied
+  __sync_synchronize();
+  return slot_ptr->sequence == cSequence;
+}
+
+double SharedFrameRing::get_time()
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  return double(now.tv_sec) + double(now.tv_nsec) * 1e-9;
+}
+
+bool SharedFrameRing::map(int file, size_t bytes, bool writable)
+{
+  void *map_ptr = mmap(NULL, bytes, writable ? (PROT_READ | PROT_WRITE) : PROT_READ, MAP_SHARED, file, 0);
+  if (MAP_FAILED == map_ptr)
+    return false;
+
+  map_ptr_ = map_ptr;
+  map_bytes_ = bytes;
+
+  return true;
+}
+
+SharedFrameRing::Header *SharedFrameRing::get_header()
+{
+  return reinterpret_cast<Header *>(map_ptr_);
+}
+
+SharedFrameRing::Slot *SharedFrameRing::get_slot(PN_uint32 sequence)
+{
+  const Header *header_ptr = get_header();
+  const size_t cIndex = (sequence - 1) % PN_uint32(header_ptr->slot_count);
+  unsigned char *base_ptr = reinterpret_cast<unsigned char *>(map_ptr_) + header_ptr->header_bytes;
+
+  return reinterpret_cast<Slot *>(base_ptr + cIndex * header_ptr->slot_bytes);
+}
+
+unsigned char *SharedFrameRing::get_pixels(Slot *slot_ptr)
+{
+  return reinterpret_cast<unsigned char *>(slot_ptr) + sizeof(Slot);
+}
+
+}
@@ -0,0 +1,92 @@
+/*################################################################
+Pandrift
+Copyright (c) 2013 Warren Moore
+
+This software may be redistributed under the terms of the MIT License.
+See the file LICENSE for details.
+################################################################*/
+
+#ifndef PANDRIFT_SHARED_FRAME_RING_HEADER
+#define PANDRIFT_SHARED_FRAME_RING_HEADER
+
+#include "pandrift.hh"
+#include "numeric_types.h"
+#include "lmatrix.h"
+#include <string>
+
+namespace pandrift
+{
+
+// A ring of eye buffer frames in POSIX shared memory, passed from the process
+// drawing the scene to a compositor process. The writer never waits: it
+// overwrites the oldest slot, and each slot's sequence number lets the reader
+// spot a frame overwritten while it was copying. Pixels are side-by-side BGRA
+// rows, bottom to top, as in a Panda RGBA texture's RAM image.
+class SharedFrameRing
+{
+public:
+  struct Frame
+  {
+    PN_uint32 sequence;
+    PN_uint32 frame_id;
+    // get_time() when the frame was drawn, and when it was written to the ring
+    double drawn_time;
+    double publish_time;
+    // The world transform of each eye's camera when the frame was drawn
+    LMatrix4f camera_mat[2];
+  };
+
+  SharedFrameRing();
+
+  ~SharedFrameRing();
+
+  // Writer. Replaces any ring of the same name.
+  bool create(const std::string &name, int width, int height, int slot_count);
+
+  // Reader. Fails until the writer has created the ring.
+  bool open(const std::string &name);
+
+  // The writer also removes the name
+  void close();
+
+  bool is_open();
+
+  int get_width();
+
+  int get_height();
+
+  size_t get_frame_bytes();
+
+  // Writer. Stamps the frame's sequence and publish time.
+  void write(const unsigned char *pixels_ptr, const Frame &frame);
+
+  // Sequence of the newest complete frame; 0 before the first
+  PN_uint32 get_latest_sequence();
+
+  // Reader. Copy the newest frame, failing if it was overwritten mid-copy.
+  bool read_latest(unsigned char *pixels_ptr, Frame &frame);
+
+  // Seconds on a clock shared by every process on the machine
+  static double get_time();
+
+private:
+  struct Header;
+  struct Slot;
+
+  bool map(int file, size_t bytes, bool writable);
+
+  Header *get_header();
+
+  Slot *get_slot(PN_uint32 sequence);
+
+  unsigned char *get_pixels(Slot *slot_ptr);
+
+  std::string name_;
+  bool writer_;
+  void *map_ptr_;
+  size_t map_bytes_;
+};
+
+}
+
+#endif
@@ -0,0 +1,149 @@
+/*################################################################
+Pandrift
+Copyright (c) 2013 Warren Moore
+
+This software may be redistributed under the terms of the MIT License.
+See the file LICENSE for details.
+################################################################*/
+
+#include "pandrift_stereo_parameters.hh"
+#include <math.h>
+
+namespace
+{
+
+const float cSceneCameraNear = 0.01;
+const float cSceneCameraFar = 2000.0;
+const float cDefaultFOV2D = 85.0 * (M_PI / 180.0);
+const float cHUDDistance = 0.8;
+
+void calculate_projection(pandrift::StereoParameters &params)
+{
+  // Calculate the Rift projection matrix
+  const float cTanHalfFOV = tan(params.y_fov_radians * 0.5);
+  const float cNear = params.scene_near, cFar = params.scene_far;
+
+  LMatrix4f projection = LMatrix4f::zeros_mat();
+  projection[0][0] = 1.0 / (cTanHalfFOV * params.display_aspect_ratio); // or tan(get_y_fov_radians() * cDisplayAspectRatio * 0.5)?
+  projection[2][1] = 1.0 / cTanHalfFOV;
+  projection[1][2] = cFar / (cFar - cNear);
+  projection[1][3] = 1;
+  projection[3][2] = -cFar * cNear / (cFar - cNear);
+
+  for (int eye = 0; eye <= 1; ++eye)
+  {
+    const float cSign = (eye * 2) - 1;
+
+    // Translate the projection matrix by the projection offset
+    params.projection[eye] = projection * LMatrix4f::translate_mat(-cSign * params.projection_centre_offset, 0, 0);
+
+    // Move the camera by the eye separation distance
+    params.eye_offset[eye] = cSign * params.interpupillary_distance / 2.0;
+  }
+}
+
+void calculate_hud(pandrift::StereoParameters &params)
+{
+  // Get the device values
+  const float cWidthPixels = params.display_width_pixels;
+  const float cHeightPixels = params.display_height_pixels;
+  const float cHalfWidthPixels = cWidthPixels * 0.5;
+  const float cEyeDistanceToScreenInMetres = params.eye_screen_distance;
+
+  // Calculate distances
+  const float cMetresToPixels = cWidthPixels / params.display_width_metres;
+  const float cLensSeparationInPixels = params.lens_separation * cMetresToPixels;
+  const float cEyeSeparationInPixels = params.interpupillary_distance * cMetresToPixels;
+
+  // Calculate the target HUD resolution
+  const float cHalfScreenDistance = tan(cDefaultFOV2D * 0.5) * cEyeDistanceToScreenInMetres;
+  const float cFOVMetres = (2.0 * cHalfScreenDistance) / params.distortion_scale;
+  const float cFOVPixels = cFOVMetres * cMetresToPixels;
+
+  // The HUD size as orthographic film, before the window's aspect_2d scale is divided out
+  const float cCameraOffsetInPixels = (cEyeDistanceToScreenInMetres / cHUDDistance) * cEyeSeparationInPixels;
+  params.hud_film_width_scale = cWidthPixels / cFOVPixels;
+  params.hud_film_height_scale = (cHeightPixels * 2.0) / cFOVPixels;
+
+  // Calculate the orthographic camera offset from the centre
+  const float cLensOffsetInPixels = cHalfWidthPixels - cLensSeparationInPixels;
+  const float cOffsetInPixels = cLensOffsetInPixels + cCameraOffsetInPixels / params.distortion_scale;
+  const float cCameraOffset = cOffsetInPixels / cFOVPixels;
+
+  for (int eye = 0; eye <= 1; ++eye)
+  {
+    const float cSign = (eye * 2) - 1;
+    params.hud_film_offset[eye] = cCameraOffset * cSign;
+  }
+}
+
+void calculate_warp(pandrift::StereoParameters &params)
+{
+  pandrift::WarpParameters &warp = params.warp;
+
+  const float cW = 0.5, cH = 1.0;
+  const float cScaleFactor = 1.0 / params.distortion_scale;
+  const float cAspectRatio = params.display_aspect_ratio;
+  warp.scale_in = LVector2f((2.0 / cW), (2.0 / cH) / cAspectRatio);
+  warp.scale = LVector2f((cW / 2.0) * cScaleFactor, (cH / 2.0) * cScaleFactor * cAspectRatio);
+  warp.screen_half_size = LVector2f(cW / 2.0, cH / 2.0);
+  warp.distortion = params.distortion_coefficients;
+  warp.chroma = params.chromatic_aberration_coefficients;
+
+  const float cDistortionCentreOffset = params.distortion_centre_offset * 0.5;
+  for (int eye = 0; eye <= 1; ++eye)
+  {
+    const float cSign = (eye * 2) - 1;
+    const float cX = float(eye) * 0.5;
+
+    // Apply the eye offset
+    warp.screen_centre[eye] = LVector2f(cX + 0.25, 0.5);
+    warp.lens_centre[eye] = LVector2f(cX + (cW + cDistortionCentreOffset * -cSign) * 0.5, 0.5);
+  }
+
+  // With a texture per eye both the card and the texture span [0, 1] for each eye,
+  // so stretch the side-by-side values horizontally about the eye's half
+  pandrift::WarpParameters &eye_warp = params.eye_warp;
+  eye_warp = warp;
+  eye_warp.scale_in[0] = warp.scale_in[0] * cW;
+  eye_warp.scale[0] = warp.scale[0] / cW;
+  eye_warp.screen_half_size[0] = warp.screen_half_size[0] / cW;
+  for (int eye = 0; eye <= 1; ++eye)
+  {
+    const float cX = float(eye) * 0.5;
+
+    eye_warp.screen_centre[eye][0] = (warp.screen_centre[eye][0] - cX) / cW;
+    eye_warp.lens_centre[eye][0] = (warp.lens_centre[eye][0] - cX) / cW;
+  }
+}
+
+}
+
+namespace pandrift
+{
+
+bool operator==(const WarpParameters &a, const WarpParameters &b)
+{
+  return a.scale_in == b.scale_in &&
+         a.scale == b.scale &&
+         a.screen_half_size == b.screen_half_size &&
+         a.screen_centre[cEyeLeft] == b.screen_centre[cEyeLeft] &&
+         a.screen_centre[cEyeRight] == b.screen_centre[cEyeRight] &&
+         a.lens_centre[cEyeLeft] == b.lens_centre[cEyeLeft] &&
+         a.lens_centre[cEyeRight] == b.lens_centre[cEyeRight] &&
+         a.distortion == b.distortion &&
+         a.chroma == b.chroma;
+}
+
+void calculate_derived_parameters(StereoParameters &params)
+{
+  params.display_aspect_ratio = (float(params.display_width_pixels) * 0.5) / float(params.display_height_pixels);
+  params.scene_near = cSceneCameraNear;
+  params.scene_far = cSceneCameraFar;
+
+  calculate_projection(params);
+  calculate_hud(params);
+  calculate_warp(params);
+}
+
+}
@@ -0,0 +1,78 @@
+/*################################################################
+Pandrift
+Copyright (c) 2013 Warren Moore
+
+This software may be redistributed under the terms of the MIT License.
+See the file LICENSE for details.
+################################################################*/
+
+#ifndef PANDRIFT_STEREO_PARAMETERS_HEADER
+#define PANDRIFT_STEREO_PARAMETERS_HEADER
+
+#include "pandrift.hh"
+#include "lvector2.h"
+#include "lvector4.h"
+#include "lmatrix.h"
+#include "numeric_types.h"
+
+namespace pandrift
+{
+
+// The uniforms of the distortion shaders, in scene texture coordinates
+struct WarpParameters
+{
+  LVector2f scale_in;
+  LVector2f scale;
+  LVector2f screen_half_size;
+  LVector2f screen_centre[2];
+  LVector2f lens_centre[2];
+  LVector4f distortion;
+  LVector4f chroma;
+};
+
+bool operator==(const WarpParameters &a, const WarpParameters &b);
+
+// Everything the display needs from the HMD, computed once per configuration
+// change. Published as an immutable snapshot so any thread can read it
+// without locking; compare versions to skip work when nothing has changed.
+struct StereoParameters
+{
+  unsigned int version;
+
+  // Device values
+  int display_width_pixels;
+  int display_height_pixels;
+  float display_width_metres;
+  float display_height_metres;
+  float lens_separation;
+  float eye_screen_distance;
+  float y_fov_radians;
+  float interpupillary_distance;
+  float projection_centre_offset;
+  float distortion_scale;
+  float distortion_centre_offset;
+  LVector4f distortion_coefficients;
+  LVector4f chromatic_aberration_coefficients;
+  // Identifies the HMD info, IPD and distortion fit point everything else was
+  // calculated from, so data baked from them can be reused
+  PN_uint64 device_key;
+
+  // Derived by calculate_derived_parameters()
+  float display_aspect_ratio;
+  float scene_near, scene_far;
+  LMatrix4f projection[2];
+  float eye_offset[2];
+  float hud_film_width_scale;
+  float hud_film_height_scale;
+  float hud_film_offset[2];
+  // Side-by-side scene buffer, and one texture per eye
+  WarpParameters warp;
+  WarpParameters eye_warp;
+};
+
+// Fill in the derived values from the device values
+void calculate_derived_parameters(StereoParameters &params);
+
+}
+
+#endif
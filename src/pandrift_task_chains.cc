@@ -0,0 +1,257 @@
+/*################################################################
+Pandrift
+Copyright (c) 2013 Warren Moore
+
+This software may be redistributed under the terms of the MIT License.
+See the file LICENSE for details.
+################################################################*/
+
+#include "pandrift_task_chains.hh"
+#include "asyncTaskManager.h"
+#include "asyncTaskChain.h"
+#include "asyncTaskCollection.h"
+#include "clockObject.h"
+#include "conditionVarFull.h"
+#include "trueClock.h"
+#include "mutexHolder.h"
+#include <string.h>
+#include <limits.h>
+#include <algorithm>
+
+using namespace std;
+
+namespace
+{
+
+const char *cPartBundleTaskName = "pandrift part bundle update";
+const char *cAnimationWaitTaskName = "pandrift animation wait";
+// After the pose tasks, before the warp (48) and igLoop renders (50)
+const int cAnimationWaitSort = 45;
+// Long enough for any frame's animation; a task that sleeps or is paused
+// shouldn't hang the main thread
+const double cAnimationWaitSeconds = 0.1;
+
+// Records the frame it last ran in, so the default chain can wait for the
+// animation chain to finish the frame
+class AnimationTask : public GenericAsyncTask
+{
+public:
+  AnimationTask(const string &name, TaskFunc *function, void *user_data);
+
+  // Guarded by animation_lock
+  int last_frame_;
+
+protected:
+  virtual DoneStatus do_task();
+
+  virtual void upon_birth(AsyncTaskManager *manager);
+
+  virtual void upon_death(AsyncTaskManager *manager, bool clean_exit);
+};
+
+Mutex animation_lock;
+ConditionVarFull animation_done(animation_lock);
+pvector<AnimationTask*> animation_tasks;
+PT(GenericAsyncTask) animation_wait_task_ptr;
+
+AnimationTask::AnimationTask(const string &name, TaskFunc *function, void *user_data) :
+  GenericAsyncTask(name, function, user_data),
+  last_frame_(0)
+{
+}
+
+AsyncTask::DoneStatus AnimationTask::do_task()
+{
+  const DoneStatus cStatus = GenericAsyncTask::do_task();
+
+  // The main thread doesn't tick the clock until it has waited for us
+  MutexHolder holder(animation_lock);
+  last_frame_ = ClockObject::get_global_clock()->get_frame_count();
+  animation_done.notify_all();
+
+  return cStatus;
+}
+
+void AnimationTask::upon_birth(AsyncTaskManager *manager)
+{
+  GenericAsyncTask::upon_birth(manager);
+
+  // The chain may have started the frame already, so don't wait for this one
+  MutexHolder holder(animation_lock);
+  last_frame_ = ClockObject::get_global_clock()->get_frame_count();
+  animation_tasks.push_back(this);
+}
+
+void AnimationTask::upon_death(AsyncTaskManager *manager, bool clean_exit)
+{
+  {
+    MutexHolder holder(animation_lock);
+    animation_tasks.erase(find(animation_tasks.begin(), animation_tasks.end(), this));
+    animation_done.notify_all();
+  }
+
+  GenericAsyncTask::upon_death(manager, clean_exit);
+}
+
+// Assumes animation_lock is held
+bool is_animation_finished(int frame)
+{
+  for (size_t task = 0; task < animation_tasks.size(); ++task)
+    if (animation_tasks[task]->last_frame_ < frame)
+      return false;
+
+  return true;
+}
+
+AsyncTask::DoneStatus wait_for_animation(GenericAsyncTask *task_ptr, void *data_ptr)
+{
+  const int cFrame = ClockObject::get_global_clock()->get_frame_count();
+  TrueClock *true_clock_ptr = TrueClock::get_global_ptr();
+  const double cGiveUpTime = true_clock_ptr->get_short_time() + cAnimationWaitSeconds;
+
+  MutexHolder holder(animation_lock);
+  while (!is_animation_finished(cFrame))
+  {
+    const double cRemaining = cGiveUpTime - true_clock_ptr->get_short_time();
+    if (cRemaining <= 0)
+    {
+      pandrift_cat.warning() << "wait_for_animation: animation chain missed frame " << cFrame << endl;
+      break;
+    }
+
+    animation_done.wait(cRemaining);
+  }
+
+  return AsyncTask::DS_cont;
+}
+
+}
+
+namespace pandrift
+{
+
+const char *cAnimationTaskChain = "pandrift animation";
+
+const int cPoseTaskSort = 40;
+
+void configure_task_chains(int animation_threads)
+{
+  AsyncTaskManager *task_manager_ptr = AsyncTaskManager::get_global_ptr();
+
+  AsyncTaskChain *animation_chain_ptr = task_manager_ptr->make_task_chain(cAnimationTaskChain);
+  animation_chain_ptr->set_num_threads(max(1, animation_threads));
+  animation_chain_ptr->set_frame_sync(true);
+
+  // Intervals and blending write the scene graph, so finish them before the
+  // render culls it. Under a threaded pipeline, cull reads the cycled copy.
+  if (!animation_wait_task_ptr)
+    animation_wait_task_ptr = add_chain_task("default",
+                                             cAnimationWaitTaskName,
+                                             &wait_for_animation,
+                                             NULL,
+                                             cAnimationWaitSort);
+}
+
+PT(GenericAsyncTask) add_chain_task(const char *chain_name,
+                                    const string &task_name,
+                                    GenericAsyncTask::TaskFunc *function,
+                                    void *data_ptr,
+                                    int sort)
+{
+  PT(GenericAsyncTask) task_ptr;
+  if (0 == strcmp(chain_name, cAnimationTaskChain))
+    task_ptr = new AnimationTask(task_name, function, data_ptr);
+  else
+    task_ptr = new GenericAsyncTask(task_name, function, data_ptr);
+  task_ptr->set_task_chain(chain_name);
+  task_ptr->set_sort(sort);
+  AsyncTaskManager::get_global_ptr()->add(task_ptr);
+
+  return task_ptr;
+}
+
+double get_task_chain_seconds(const char *chain_name)
+{
+  return get_task_chain_seconds(chain_name, INT_MIN, INT_MAX);
+}
+
+double get_task_chain_seconds(const char *chain_name, int first_sort, int last_sort)
+{
+  AsyncTaskChain *chain_ptr = AsyncTaskManager::get_global_ptr()->find_task_chain(chain_name);
+  if (!chain_ptr)
+    return 0;
+
+  double seconds = 0;
+  AsyncTaskCollection tasks = chain_ptr->get_tasks();
+  for (int task = 0; task < tasks.get_num_tasks(); ++task)
+  {
+    const int cSort = tasks.get_task(task)->get_sort();
+    if (cSort >= first_sort && cSort <= last_sort)
+      seconds += tasks.get_task(task)->get_average_dt();
+  }
+
+  return seconds;
+}
+
+PartBundleUpdater::PartBundleUpdater()
+{
+}
+
+PartBundleUpdater::~PartBundleUpdater()
+{
+  stop();
+}
+
+void PartBundleUpdater::add_bundles(const AnimControlCollection &anim_controls)
+{
+  MutexHolder holder(lock_);
+  for (int anim = 0; anim < anim_controls.get_num_anims(); ++anim)
+  {
+    PT(PartBundle) bundle_ptr = anim_controls.get_anim(anim)->get_part();
+    if (find(bundles_.begin(), bundles_.end(), bundle_ptr) == bundles_.end())
+      bundles_.push_back(bundle_ptr);
+  }
+}
+
+void PartBundleUpdater::clear_bundles()
+{
+  MutexHolder holder(lock_);
+  bundles_.clear();
+}
+
+void PartBundleUpdater::start()
+{
+  if (task_ptr_)
+    return;
+
+  task_ptr_ = add_chain_task(cAnimationTaskChain, cPartBundleTaskName, &update_task, this);
+}
+
+void PartBundleUpdater::stop()
+{
+  if (!task_ptr_)
+    return;
+
+  task_ptr_->remove();
+  task_ptr_ = NULL;
+}
+
+AsyncTask::DoneStatus PartBundleUpdater::update_task(GenericAsyncTask *task_ptr, void *data_ptr)
+{
+  PartBundleUpdater *updater_ptr = reinterpret_cast<PartBundleUpdater*>(data_ptr);
+  assert(updater_ptr);
+
+  updater_ptr->update_bundles();
+
+  return AsyncTask::DS_cont;
+}
+
+void PartBundleUpdater::update_bundles()
+{
+  MutexHolder holder(lock_);
+  for (size_t bundle = 0; bundle < bundles_.size(); ++bundle)
+    // Only blends if the animation has moved on since the last update
+    bundles_[bundle]->update();
+}
+
+}
@@ -0,0 +1,78 @@
+/*################################################################
+Pandrift
+Copyright (c) 2013 Warren Moore
+
+This software may be redistributed under the terms of the MIT License.
+See the file LICENSE for details.
+################################################################*/
+
+#ifndef PANDRIFT_TASK_CHAINS_HEADER
+#define PANDRIFT_TASK_CHAINS_HEADER
+
+#include "pandrift.hh"
+#include "genericAsyncTask.h"
+#include "animControlCollection.h"
+#include "partBundle.h"
+#include "pmutex.h"
+#include "pvector.h"
+#include <string>
+
+namespace pandrift
+{
+
+// Threaded and frame-synced: interval stepping and animation blending. Each
+// frame the default chain waits for its tasks before the warp and igLoop, so
+// cull never sees a half-stepped interval or a half-blended pose.
+extern const char *cAnimationTaskChain;
+
+// Sort for pose-dependent updates on the default chain: after the
+// application's tasks, before the warp (48) and igLoop renders (50)
+extern const int cPoseTaskSort;
+
+// Create the chains, if they don't already exist
+void configure_task_chains(int animation_threads);
+
+// A task added to the animation chain is waited for from the frame after
+// it is added
+PT(GenericAsyncTask) add_chain_task(const char *chain_name,
+                                    const std::string &task_name,
+                                    GenericAsyncTask::TaskFunc *function,
+                                    void *data_ptr,
+                                    int sort = 0);
+
+// Mean time per frame spent in the tasks of a chain
+double get_task_chain_seconds(const char *chain_name);
+
+// As above, counting only the tasks sorted from first_sort to last_sort
+double get_task_chain_seconds(const char *chain_name, int first_sort, int last_sort);
+
+// Blends bound animations on the animation chain, finishing before igLoop
+// culls, so cull finds the characters already up to date for the frame
+class PartBundleUpdater
+{
+public:
+  PartBundleUpdater();
+
+  ~PartBundleUpdater();
+
+  void add_bundles(const AnimControlCollection &anim_controls);
+
+  void clear_bundles();
+
+  void start();
+
+  void stop();
+
+private:
+  static AsyncTask::DoneStatus update_task(GenericAsyncTask *task_ptr, void *data_ptr);
+
+  void update_bundles();
+
+  Mutex lock_;
+  pvector<PT(PartBundle)> bundles_;
+  PT(GenericAsyncTask) task_ptr_;
+};
+
+}
+
+#endif
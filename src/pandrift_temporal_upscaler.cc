@@ -0,0 +1,372 @@
+/*################################################################
+Pandrift
+Copyright (c) 2013 Warren Moore
+
+This software may be redistributed under the terms of the MIT License.
+See the file LICENSE for details.
+################################################################*/
+
+#include "pandrift_temporal_upscaler.hh"
+#include "orthographicLens.h"
+#include "cardMaker.h"
+#include "camera.h"
+#include <math.h>
+#include <algorithm>
+
+using namespace std;
+
+namespace
+{
+
+const char *cUpscalerRootName = "upscaler root";
+const char *cUpscalerCameraName = "upscaler camera";
+const char *cUpscalerCardName = "upscaler card";
+const char *cUpscalerVertexShader = "pandrift-distortion-v.glsl";
+const char *cUpscalerFragmentShader = "pandrift-upscale-f.glsl";
+// After the scene and layer buffers, before the warp
+const int cHistoryBufferSort = -80;
+const float cDefaultBlend = 0.1;
+const float cLensNear = -1000;
+const float cLensFar = 1000;
+// Halton points repeat after this many frames
+const unsigned int cJitterSequenceLength = 8;
+// Falloff of the source texels' weights with their distance in output pixels,
+// as in the shader
+const float cReconstructionSharpness = 2.29;
+
+float halton(unsigned int index, unsigned int base)
+{
+  float result = 0, fraction = 1;
+  for (; index > 0; index /= base)
+  {
+    fraction /= float(base);
+    result += fraction * float(index % base);
+  }
+
+  return result;
+}
+
+// Fetch a texel as sampling its centre does with clamped wrapping
+const float *fetch_texel(const float *image_ptr, int width, int height, int x, int y)
+{
+  x = min(max(x, 0), width - 1);
+  y = min(max(y, 0), height - 1);
+
+  return image_ptr + (size_t(y) * size_t(width) + size_t(x)) * 3;
+}
+
+}
+
+namespace pandrift
+{
+
+TemporalUpscaler::TemporalUpscaler(const string &name) :
+  name_(name),
+  blend_(cDefaultBlend),
+  source_width_(0),
+  source_height_(0),
+  root_np_(cUpscalerRootName),
+  jitter_input_(PTA_LVecBase2f::empty_array(1)),
+  source_texel_size_input_(PTA_LVecBase2f::empty_array(1)),
+  source_scale_input_(PTA_LVecBase2f::empty_array(1)),
+  projection_input_(PTA_LMatrix4f::empty_array(1)),
+  inverse_projection_input_(PTA_LMatrix4f::empty_array(1)),
+  rotation_delta_input_(PTA_LMatrix4f::empty_array(1)),
+  blend_input_(PTA_float::empty_array(1)),
+  current_(0),
+  frame_(0)
+{
+}
+
+TemporalUpscaler::~TemporalUpscaler()
+{
+  destroy();
+}
+
+void TemporalUpscaler::set_render_target_pool(boost::shared_ptr<RenderTargetPool> render_target_pool_ptr)
+{
+  assert(!is_created());
+
+  render_target_pool_ptr_ = render_target_pool_ptr;
+}
+
+void TemporalUpscaler::set_blend(float blend)
+{
+  blend_ = min(max(blend, 0.0f), 1.0f);
+}
+
+bool TemporalUpscaler::create(GraphicsOutput *host_ptr, GraphicsOutput *source_ptr, int width, int height)
+{
+  assert(!is_created());
+
+  if (!host_ptr || !source_ptr || width <= 0 || height <= 0)
+    return false;
+
+  // The texture isn't sized until the buffer first renders
+  source_ptr_ = source_ptr->get_texture();
+  source_width_ = source_ptr->get_x_size();
+  source_height_ = source_ptr->get_y_size();
+
+  for (int history = 0; history <= 1; ++history)
+  {
+    if (render_target_pool_ptr_)
+    {
+      RenderTargetPool::Format format;
+      format.alpha = false;
+      format.depth_texture = false;
+
+      RenderTargetPool::RenderTarget target;
+      if (render_target_pool_ptr_->acquire(host_ptr, name_, width, height, format, target))
+        history_buffer_ptr_[history] = target.buffer_ptr;
+    }
+    else
+    {
+      history_buffer_ptr_[history] = host_ptr->make_texture_buffer(name_, width, height);
+    }
+
+    if (!history_buffer_ptr_[history])
+    {
+      pandrift_cat.error() << "create: Unable to create history buffer";
+      destroy();
+      return false;
+    }
+
+    history_buffer_ptr_[history]->set_sort(cHistoryBufferSort);
+
+    PT(Texture) texture_ptr = history_buffer_ptr_[history]->get_texture();
+    texture_ptr->set_magfilter(Texture::FT_linear);
+    texture_ptr->set_minfilter(Texture::FT_linear);
+    texture_ptr->set_wrap_u(Texture::WM_clamp);
+    texture_ptr->set_wrap_v(Texture::WM_clamp);
+  }
+
+  resolve_shader_ = Shader::load(Shader::SL_GLSL, cUpscalerVertexShader, cUpscalerFragmentShader);
+  if (!resolve_shader_)
+  {
+    pandrift_cat.error() << "create: Unable to load shader";
+    destroy();
+    return false;
+  }
+
+  // One card filling an orthographic [-1, 1] view, seen by both buffers
+  PT(OrthographicLens) lens_ptr = new OrthographicLens();
+  lens_ptr->set_film_size(2.0, 2.0);
+  lens_ptr->set_near_far(cLensNear, cLensFar);
+
+  PT(Camera) camera_ptr = new Camera(cUpscalerCameraName);
+  camera_ptr->set_lens(lens_ptr);
+  camera_np_ = root_np_.attach_new_node(camera_ptr);
+
+  CardMaker card_maker(cUpscalerCardName);
+  card_maker.set_has_uvs(true);
+  card_maker.set_uv_range(LTexCoord(0.0, 0.0), LTexCoord(1.0, 1.0));
+  card_maker.set_frame(-1.0, 1.0, -1.0, 1.0);
+  card_np_ = root_np_.attach_new_node(card_maker.generate());
+  card_np_.set_depth_test(false);
+  card_np_.set_depth_write(false);
+  card_np_.set_shader(resolve_shader_);
+  card_np_.set_shader_input("SourceTexture", source_ptr_);
+  card_np_.set_shader_input("Jitter", jitter_input_);
+  card_np_.set_shader_input("SourceTexelSize", source_texel_size_input_);
+  card_np_.set_shader_input("SourceScale", source_scale_input_);
+  card_np_.set_shader_input("Projection", projection_input_);
+  card_np_.set_shader_input("InverseProjection", inverse_projection_input_);
+  card_np_.set_shader_input("RotationDelta", rotation_delta_input_);
+  card_np_.set_shader_input("Blend", blend_input_);
+  source_texel_size_input_[0].set(1.0 / float(source_width_), 1.0 / float(source_height_));
+  // Output pixels to a source pixel, to weight the source texels
+  source_scale_input_[0].set(float(width) / float(source_width_), float(height) / float(source_height_));
+
+  for (int history = 0; history <= 1; ++history)
+  {
+    history_region_ptr_[history] = history_buffer_ptr_[history]->make_display_region();
+    history_region_ptr_[history]->set_camera(camera_np_);
+    history_buffer_ptr_[history]->set_active(false);
+  }
+
+  // Writing one history reads the other, so the card flips between two states
+  for (int history = 0; history <= 1; ++history)
+  {
+    card_np_.set_shader_input("HistoryTexture", history_buffer_ptr_[1 - history]->get_texture());
+    card_state_[history] = card_np_.get_state();
+  }
+
+  // Nothing renders until the first update, which has no history to blend
+  current_ = 0;
+  frame_ = 0;
+  jitter_ = get_jitter_offset(frame_);
+
+  return true;
+}
+
+void TemporalUpscaler::destroy()
+{
+  for (int history = 0; history <= 1; ++history)
+  {
+    if (history_region_ptr_[history])
+    {
+      history_buffer_ptr_[history]->remove_display_region(history_region_ptr_[history]);
+      history_region_ptr_[history] = NULL;
+    }
+
+    if (history_buffer_ptr_[history])
+    {
+      if (render_target_pool_ptr_)
+        render_target_pool_ptr_->release(history_buffer_ptr_[history]);
+      else
+        history_buffer_ptr_[history]->get_engine()->remove_window(history_buffer_ptr_[history]);
+      history_buffer_ptr_[history] = NULL;
+    }
+  }
+
+  if (!camera_np_.is_empty())
+    camera_np_.remove_node();
+
+  if (!card_np_.is_empty())
+    card_np_.remove_node();
+
+  for (int history = 0; history <= 1; ++history)
+    card_state_[history] = NULL;
+
+  resolve_shader_ = NULL;
+  source_ptr_ = NULL;
+}
+
+bool TemporalUpscaler::is_created()
+{
+  return history_buffer_ptr_[0] != NULL;
+}
+
+void TemporalUpscaler::update(const LMatrix4f &projection, const LMatrix4f &rotation_delta)
+{
+  assert(is_created());
+
+  // Swap the buffers, so last frame's output is this frame's history
+  if (frame_ > 0)
+    current_ = 1 - current_;
+
+  history_buffer_ptr_[current_]->set_active(true);
+  history_buffer_ptr_[1 - current_]->set_active(false);
+
+  jitter_ = get_jitter_offset(frame_);
+
+  card_np_.set_state(card_state_[current_]);
+
+  // The jitter goes to the shader in source UVs
+  jitter_input_[0].set(jitter_[0] / float(source_width_), jitter_[1] / float(source_height_));
+  projection_input_[0] = projection;
+  inverse_projection_input_[0].invert_from(projection);
+  rotation_delta_input_[0] = rotation_delta;
+  // There's no history to blend with on the first frame
+  blend_input_[0] = frame_ > 0 ? blend_ : 1.0f;
+
+  ++frame_;
+}
+
+void TemporalUpscaler::hold()
+{
+  for (int history = 0; history <= 1; ++history)
+    if (history_buffer_ptr_[history])
+      history_buffer_ptr_[history]->set_active(false);
+}
+
+const LVecBase2f &TemporalUpscaler::get_jitter()
+{
+  return jitter_;
+}
+
+int TemporalUpscaler::get_current_history()
+{
+  return current_;
+}
+
+Texture *TemporalUpscaler::get_texture()
+{
+  if (!history_buffer_ptr_[current_])
+    return NULL;
+
+  return history_buffer_ptr_[current_]->get_texture();
+}
+
+void TemporalUpscaler::accumulate_reference(const float *source_ptr,
+                                            int source_width,
+                                            int source_height,
+                                            const LVecBase2f &jitter,
+                                            float blend,
+                                            bool first,
+                                            float *history_ptr,
+                                            int width,
+                                            int height)
+{
+  const float cScaleX = float(width) / float(source_width);
+  const float cScaleY = float(height) / float(source_height);
+
+  for (int y = 0; y < height; ++y)
+  {
+    for (int x = 0; x < width; ++x)
+    {
+      // Undo the jitter to find the point this texel sees, in source pixels
+      const float cSourceX = (float(x) + 0.5) / cScaleX + jitter[0];
+      const float cSourceY = (float(y) + 0.5) / cScaleY + jitter[1];
+      const int cBaseX = int(floor(cSourceX)), cBaseY = int(floor(cSourceY));
+
+      // Weight the 3x3 source texels by how close each sample fell, in output
+      // pixels, and bound the history by the same texels
+      float current[3] = { 0, 0, 0 };
+      float low[3] = { 1.0e6, 1.0e6, 1.0e6 };
+      float high[3] = { -1.0e6, -1.0e6, -1.0e6 };
+      float weight = 0;
+      for (int offset_y = -1; offset_y <= 1; ++offset_y)
+      {
+        for (int offset_x = -1; offset_x <= 1; ++offset_x)
+        {
+          const float cDX = (float(cBaseX + offset_x) + 0.5 - cSourceX) * cScaleX;
+          const float cDY = (float(cBaseY + offset_y) + 0.5 - cSourceY) * cScaleY;
+          const float cWeight = exp(-cReconstructionSharpness * (cDX * cDX + cDY * cDY));
+          const float *sample_ptr = fetch_texel(source_ptr,
+                                                source_width,
+                                                source_height,
+                                                cBaseX + offset_x,
+                                                cBaseY + offset_y);
+
+          for (int channel = 0; channel < 3; ++channel)
+          {
+            current[channel] += sample_ptr[channel] * cWeight;
+            low[channel] = min(low[channel], sample_ptr[channel]);
+            high[channel] = max(high[channel], sample_ptr[channel]);
+          }
+          weight += cWeight;
+        }
+      }
+
+      for (int channel = 0; channel < 3; ++channel)
+        current[channel] /= weight;
+
+      float *texel_ptr = history_ptr + (size_t(y) * size_t(width) + size_t(x)) * 3;
+      if (first)
+      {
+        for (int channel = 0; channel < 3; ++channel)
+          texel_ptr[channel] = current[channel];
+        continue;
+      }
+
+      // Where the samples fell far from this texel, trust the history more
+      const float cBlend = blend < 1.0 ? blend * min(weight, 1.0f) : 1.0f;
+      for (int channel = 0; channel < 3; ++channel)
+      {
+        const float cHistory = min(max(texel_ptr[channel], low[channel]), high[channel]);
+        texel_ptr[channel] = cHistory + (current[channel] - cHistory) * cBlend;
+      }
+    }
+  }
+}
+
+LVecBase2f TemporalUpscaler::get_jitter_offset(unsigned int frame)
+{
+  // Skip the first Halton point, which is the corner
+  const unsigned int cIndex = (frame % cJitterSequenceLength) + 1;
+
+  return LVecBase2f(halton(cIndex, 2) - 0.5, halton(cIndex, 3) - 0.5);
+}
+
+}
@@ -0,0 +1,116 @@
+/*################################################################
+Pandrift
+Copyright (c) 2013 Warren Moore
+
+This software may be redistributed under the terms of the MIT License.
+See the file LICENSE for details.
+################################################################*/
+
+#ifndef PANDRIFT_TEMPORAL_UPSCALER_HEADER
+#define PANDRIFT_TEMPORAL_UPSCALER_HEADER
+
+#include "pandrift.hh"
+#include "pandrift_render_target_pool.hh"
+#include "graphicsOutput.h"
+#include "nodePath.h"
+#include "texture.h"
+#include "shader.h"
+#include "lvecBase2.h"
+#include "lmatrix.h"
+#include "pta_LVecBase2.h"
+#include "pta_LMatrix4.h"
+#include "pta_float.h"
+#include "renderState.h"
+#include "boost/shared_ptr.hpp"
+
+namespace pandrift
+{
+
+// Rebuilds an eye at full resolution from frames rendered smaller, each with
+// a different sub-pixel jitter. Each frame the source is blended into a
+// history, moved by the head rotation since the last frame; two history
+// buffers take turns being written and read.
+class TemporalUpscaler
+{
+public:
+  TemporalUpscaler(const std::string &name);
+
+  ~TemporalUpscaler();
+
+  // Draw the history buffers from a pool, rather than making them
+  void set_render_target_pool(boost::shared_ptr<RenderTargetPool> render_target_pool_ptr);
+
+  // Weight of each new frame in the history
+  void set_blend(float blend);
+
+  // Accumulate the source buffer's texture into a history of this size
+  bool create(GraphicsOutput *host_ptr, GraphicsOutput *source_ptr, int width, int height);
+
+  void destroy();
+
+  bool is_created();
+
+  // Move on a frame. The source is drawn with projection, offset by the
+  // jitter; rotation_delta takes this frame's view space to the last one's.
+  void update(const LMatrix4f &projection, const LMatrix4f &rotation_delta);
+
+  // Stop resolving until the next update, while the source isn't drawn.
+  // The last history stays readable.
+  void hold();
+
+  // Offset to draw this frame's source with, in source pixels
+  const LVecBase2f &get_jitter();
+
+  // The history written this frame
+  Texture *get_texture();
+
+  // Which of the two history buffers get_texture() returns
+  int get_current_history();
+
+  // The resolve on the CPU, for a view that doesn't rotate. Images are RGB
+  // floats with rows bottom to top; first replaces the history outright.
+  // Matches the shader, to check the upscale without a GPU.
+  static void accumulate_reference(const float *source_ptr,
+                                   int source_width,
+                                   int source_height,
+                                   const LVecBase2f &jitter,
+                                   float blend,
+                                   bool first,
+                                   float *history_ptr,
+                                   int width,
+                                   int height);
+
+  // Sub-pixel offset for a frame, within half a pixel of the centre
+  static LVecBase2f get_jitter_offset(unsigned int frame);
+
+private:
+  std::string name_;
+  float blend_;
+  boost::shared_ptr<RenderTargetPool> render_target_pool_ptr_;
+  PT(Texture) source_ptr_;
+  int source_width_, source_height_;
+  PT(GraphicsOutput) history_buffer_ptr_[2];
+  PT(DisplayRegion) history_region_ptr_[2];
+  PT(Shader) resolve_shader_;
+  NodePath root_np_;
+  NodePath camera_np_;
+  NodePath card_np_;
+  // The card's state writing each history, reading the other
+  CPT(RenderState) card_state_[2];
+  // Bound to the shader once and updated in place, so each frame's update
+  // doesn't make new shader inputs
+  PTA_LVecBase2f jitter_input_;
+  PTA_LVecBase2f source_texel_size_input_;
+  PTA_LVecBase2f source_scale_input_;
+  PTA_LMatrix4f projection_input_;
+  PTA_LMatrix4f inverse_projection_input_;
+  PTA_LMatrix4f rotation_delta_input_;
+  PTA_float blend_input_;
+  int current_;
+  unsigned int frame_;
+  LVecBase2f jitter_;
+};
+
+}
+
+#endif